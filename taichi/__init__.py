@@ -1,17 +1,78 @@
-from taichi.core import kernel
-from taichi.core import func
+from taichi.core import kernel, atomic_add, atomic_min, atomic_max, atomic_cas, random
+from taichi.core.kernel import set_random_seed as _set_random_seed
+from taichi.lang import fast_math_value as _fast_math_value
+from taichi.core import func, remove_func
+from taichi.core import field, mmap_field
+from taichi.core import scan, prefix_sum, sort, compact
+from taichi.core import stream, stream_input, stream_output
+from taichi.core import shared_field, shard_group, ShardGroup, Transport, PipeTransport
+from taichi.core import sync, get_schedules, get_topology, get_launch_latency, start_trace, stop_trace
+from taichi.core import get_function_ir, get_function_asm, get_function_remarks, get_loop_report, get_jit_memory
 
 from taichi.tool import *
 from taichi.type import *
 
 # 不想把 llvm 暴露出去
 import taichi.llvm as _llvm
+import taichi.core.runtime as _runtime
 
 def init(
-    log_level:log_levels = log_levels.message
+    log_level:log_levels = log_levels.message,
+    thread_number: int = 0, # 0 表示使用硬件线程数
+    async_mode: bool = True, # kernel 发射之后是否立即返回
+    kernel_fusion: bool = True, # 是否融合相邻的 kernel
+    # 让 perf、GDB 可以看到编译出来的代码（符号以及 Python 源码的行号）
+    profiler_integration: profiler_integrations = profiler_integrations.none,
+    # func 先用解释器执行，调用次数和循环次数之和达到 tier_up_threshold 之后在后台编译
+    tiered_compilation: bool = False,
+    tier_up_threshold: int = 10000,
+    # kernel 发射的调度策略，auto 的话自动调优
+    # 每个「kernel 签名 + 迭代次数的量级」的每个候选测量 3 次，7 个候选共 21 次发射之后才确定选择并保存
+    # 开启 kernel_fusion 的话融合之后的一次发射算一次（签名是融合组的 kernel 名，比如 k+k+k），
+    # 连续发射同一个 kernel 的时候 8 次融合为一次，需要 21 * 8 次发射；也可以每次发射之后 ti.sync()
+    schedule: schedules = schedules.static,
+    # 块的大小：迭代次数 / 线程数 / chunks_per_thread（auto 的话由 autotuner 选择）
+    chunks_per_thread: int = 16,
+    # autotuner 保存选择的文件，None 表示默认的位置（~/.cache/taichi-mini），空字符串表示不保存
+    schedule_cache: str = None,
+    # worker 绑定 CPU、field 内存的 first-touch，双路（多 NUMA 节点）的机器上建议使用 numa
+    placement: placements = placements.none,
+    # 低延迟模式：大量很小的 kernel 的时候，空闲的 worker 先自旋这么久再休眠，发射不需要唤醒线程
+    # 0 表示关闭，自旋会占用 CPU，线程数不要超过 CPU 数
+    latency_mode: bool = False,
+    spin_microseconds: int = 200,
+    # 只通过 ti.atomic_add 累加的 field，每个 worker 累加到自己的拷贝上，kernel 结束之后再合并
+    # 直方图、粒子到网格这样的 scatter 没有原子操作和 cache line 的争用，代价是每个 worker 一份拷贝的内存
+    scatter_privatization: bool = False,
+    # ti.random() 的 seed，同样的 seed 和同样的发射顺序得到同样的随机数，和线程数无关
+    random_seed: int = 0,
+    # 没有在装饰器中指定的 kernel 和 func 的浮点数语义，见 fast_math_flags
+    fast_math: fast_math_flags = fast_math_flags.strict,
+    # main-loop 的迭代次数少于线程数、内层循环更长的 kernel，在迭代之间没有依赖的时候交换两层循环，按内层循环并行
+    loop_interchange: bool = True,
+    # 没有访问提示（见 Field.hint）的 field，gather（x[index[i]]）的读取提前这么多次迭代预取，0 表示不预取
+    prefetch_distance: int = 0,
+    # 代码生成之后是否保留 IR 的文本和生成汇编用的 module（ti.get_function_ir / get_function_asm 需要）
+    # 每个函数都要多占一份 module 的内存，默认不保留，调试的时候打开
+    retain_ir: bool = False,
+    # 编译的时候收集 LLVM 的优化报告（ti.get_function_remarks 需要），有编译时间和内存的开销，默认关闭
+    optimization_remarks: bool = False
 ):
     # 设定 log 等级
     log_set_level(log_level)
     _llvm.set_lib_log_level(log_get_level())
-    _llvm.init_lib() # 初始化 C lib
+    cfg_set(cfg.kernel_fusion, kernel_fusion)
+    cfg_set(cfg.scatter_privatization, scatter_privatization)
+    cfg_set(cfg.fast_math, _fast_math_value(fast_math) or fast_math_flags.strict)
+    cfg_set(cfg.loop_interchange, loop_interchange)
+    cfg_set(cfg.prefetch_distance, max(int(prefetch_distance), 0))
+    _set_random_seed(random_seed)
+    _llvm.init_lib( # 初始化 C lib
+        int(profiler_integration),
+        max(int(tier_up_threshold), 1) if tiered_compilation else 0,
+        retain_ir,
+        optimization_remarks
+    )
+    _runtime.init(thread_number, async_mode, schedule, chunks_per_thread, schedule_cache, placement,
+        spin_microseconds if latency_mode else 0) # 初始化 kernel 的运行时
     log_message("Taichi inited")
\ No newline at end of file
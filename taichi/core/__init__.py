@@ -1,4 +1,10 @@
 # taichi 核心 主要就是 kernel 和 func 的实现
 
-from taichi.core.kernel import kernel
-from taichi.core.func import func
\ No newline at end of file
+from taichi.core.kernel import kernel, atomic_add, atomic_min, atomic_max, atomic_cas, random
+from taichi.core.func import func, remove_func
+from taichi.core.field import field, mmap_field
+from taichi.core.primitive import scan, prefix_sum, sort, compact
+from taichi.core.stream import stream, stream_input, stream_output
+from taichi.core.shard import shared_field, shard_group, ShardGroup, Transport, PipeTransport
+from taichi.core.runtime import sync, get_schedules, get_topology, get_launch_latency, start_trace, stop_trace
+from taichi.core.codegen import get_function_ir, get_function_asm, get_function_remarks, get_loop_report, get_jit_memory
@@ -0,0 +1,128 @@
+# 查看代码生成的结果：优化前后的 IR、最终的汇编、LLVM 的优化报告、循环的依赖分析
+# 比如可以从优化报告中看到一个循环为什么没有被向量化
+
+from taichi.tool import *
+import taichi.llvm
+import taichi.core.runtime
+
+# sync with cpp（llvm_taichi::IRStage）
+_ir_stage_id = {
+    "initial": 0, # 没有优化
+    "optimized": 1, # 经过优化
+    "ssa_initial": 2, # 中间层的 IR，没有优化
+    "ssa": 3 # 中间层的 IR，经过 llvm_passes 的优化
+}
+
+# target 可以是函数名、ti.func 或者 ti.kernel
+# kernel 对应最近一次编译的 native 函数（可能和其他 kernel 融合在一起）
+def _function_name(target):
+    if isinstance(target, str):
+        return target
+    analysis = getattr(target, "_taichi_analysis", None)
+    if analysis is not None:
+        # 等待融合的 kernel 还没有编译
+        taichi.core.runtime.flush()
+        if analysis.native_name is None:
+            log_error(f"kernel {target.__name__} has not been compiled to native code")
+        return analysis.native_name
+    return target.__name__
+
+# 需要 ti.init(retain_ir=True)，否则代码生成之后 IR 和汇编就释放了，返回空的字符串
+def get_function_ir(target, stage: str = "optimized") -> str:
+    function_name = _function_name(target)
+    if function_name is None or stage not in _ir_stage_id:
+        return ""
+    function_name_b = function_name.encode(encoding="ascii")
+    return taichi.llvm.c_get_function_ir(
+        BP(function_name_b),
+        _ir_stage_id[stage]
+    ).decode(encoding="utf-8")
+
+def get_function_asm(target) -> str:
+    function_name = _function_name(target)
+    if function_name is None:
+        return ""
+    function_name_b = function_name.encode(encoding="ascii")
+    return taichi.llvm.c_get_function_asm(BP(function_name_b)).decode(encoding="utf-8")
+
+# 返回优化报告的列表，kind 可以是 passed / missed / analysis
+# 需要 ti.init(optimization_remarks=True)，否则编译的时候不收集报告，返回空的列表
+# 比如 {"kind": "missed", "pass": "loop-vectorize", "name": "MissedDetails", ...}
+def get_function_remarks(target, kind: str = None) -> list:
+    function_name = _function_name(target)
+    if function_name is None:
+        return []
+    function_name_b = function_name.encode(encoding="ascii")
+    text = taichi.llvm.c_get_function_remarks(BP(function_name_b)).decode(encoding="utf-8")
+
+    remarks = []
+    # sync with cpp（get_function_remarks 的格式）
+    for line in text.splitlines():
+        fields = line.split("\t", 5)
+        if len(fields) != 6:
+            continue
+        remark = {
+            "kind": fields[0],
+            "pass": fields[1],
+            "name": fields[2],
+            "file": fields[3],
+            "line": int(fields[4]),
+            "message": fields[5]
+        }
+        if kind is None or remark["kind"] == kind:
+            remarks.append(remark)
+    return remarks
+
+# 循环的依赖分析结果，每个循环（先序）一项
+# 比如 {"depth": 0, "file": "a.py", "line": 10, "parallel": False, "independent": False,
+#       "dependences": [("a.py", 11, "field x: accesses may touch the same element in different iterations")], "reductions": []}
+# parallel 表示 field 的访问在迭代之间没有依赖，independent 表示迭代还可以以任意顺序执行（没有局部变量传递到下一次迭代）
+def get_loop_report(target) -> list:
+    function_name = _function_name(target)
+    if function_name is None:
+        return []
+    function_name_b = function_name.encode(encoding="ascii")
+    text = taichi.llvm.c_get_loop_report(BP(function_name_b)).decode(encoding="utf-8")
+
+    loops = []
+    # sync with cpp（get_loop_report 的格式）
+    for line in text.splitlines():
+        fields = line.split("\t")
+        if fields[0] == "loop" and len(fields) == 6:
+            loops.append({
+                "depth": int(fields[1]),
+                "file": fields[2],
+                "line": int(fields[3]),
+                "parallel": fields[4] == "1",
+                "independent": fields[5] == "1",
+                "dependences": [],
+                "reductions": []
+            })
+        elif fields[0] in ("dependence", "reduction") and len(fields) >= 4 and loops:
+            note = (fields[1], int(fields[2]), "\t".join(fields[3:]))
+            loops[-1][fields[0] + "s"].append(note)
+    return loops
+
+# 所有还活着的函数占用的 JIT 内存（字节），重新定义或者删除的函数在没有调用者之后就不在列表中了
+# 比如 {"name": "f", "symbol": "f.1", "registered": True, "code": 96, "data": 0, "ir": 2048, "modules": 1}
+# registered 为 False 的函数已经被替换或者删除，只是还有已经编译的调用者在使用
+def get_jit_memory() -> list:
+    taichi.core.runtime.flush()
+    text = taichi.llvm.c_jit_memory_report().decode(encoding="utf-8")
+
+    functions = []
+    # sync with cpp（llvm_taichi::jit_memory_report 的格式）
+    for line in text.splitlines():
+        fields = line.split("\t")
+        if len(fields) != 8:
+            continue
+        functions.append({
+            "name": fields[0],
+            "symbol": fields[1],
+            "registered": fields[3] == "1",
+            "code": int(fields[4]),
+            "data": int(fields[5]),
+            "ir": int(fields[6]),
+            "modules": int(fields[7])
+        })
+    return functions
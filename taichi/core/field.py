@@ -0,0 +1,168 @@
+# field：由 C 端 runtime 管理的一维数组
+# kernel 会异步地读写 field，runtime 根据 field 追踪 kernel 之间的依赖
+# Python 端读写 field 之前，会先等待正在使用它的 kernel
+
+import taichi.llvm
+import taichi.type
+import taichi.core.runtime
+from taichi.tool import BP, log_error, map_advices
+
+# 文件映射的模式，和 numpy.memmap 一样
+# sync with cpp（llvm_taichi::MapFlag 的 MapShared、MapCreate、MapReadOnly）
+_map_modes = {
+    "r": 1 | 32, # 只读，Python 端的写入和写这个 field 的 kernel 会被拒绝
+    "r+": 1, # 读写已有的文件，kernel 的写入会写回文件
+    "w+": 1 | 2, # 文件不存在或者不够长的话创建 / 拓展
+    "c": 0 # 写时复制，写入只在内存中，不修改文件
+}
+
+# intermediate 表示这个 field 只用于在 kernel 之间传递数据
+# 生产者和消费者 kernel 被融合的时候，数据直接在寄存器中传递，不会再写入 field
+# path 不为 None 的话，field 的内存是映射到内存中的文件（从 offset 字节开始），可以比物理内存大
+# 这时 shape 为 None 表示映射到文件结尾，mode 和 advice 见 _map_modes 和 map_advices
+class Field:
+    def __init__(
+        self,
+        dtype,
+        shape: int,
+        intermediate: bool = False,
+        path: str = None,
+        offset: int = 0,
+        mode: str = "r+",
+        advice: map_advices = map_advices.none
+    ):
+        # dtype 可以是 ti.Int32 这样的类（或者结构体类型），也可以是类型名
+        # 结构体的元素读出来是 ctypes.Structure 的实例（直接引用 field 的内存），写入的时候可以是实例或者成员的 tuple / dict
+        self.dtype = dtype if isinstance(dtype, str) else dtype.__name__
+        self.intermediate = intermediate
+        self.path = path
+        self.read_only = path is not None and mode == "r" # 只读的文件映射，写入会访问违例
+
+        if path is None:
+            self.size = int(shape)
+            self.handle = taichi.llvm.c_field_create(
+                taichi.type.type_id[self.dtype],
+                self.size
+            )
+        else:
+            if mode not in _map_modes:
+                log_error(f"unknown mapping mode {mode} (r, r+, w+ or c), use c (copy-on-write)")
+                mode = "c"
+            path_b = str(path).encode(encoding="utf-8") # 调用结束之前要保持引用
+            self.handle = taichi.llvm.c_field_map(
+                taichi.type.type_id[self.dtype],
+                BP(path_b),
+                int(offset),
+                -1 if shape is None else int(shape),
+                _map_modes[mode] | int(advice)
+            )
+            if self.handle == 0:
+                log_error(f"can not map {path} as a field")
+            self.size = max(taichi.llvm.c_field_size(self.handle), 0)
+        self.ptr = taichi.llvm.c_field_ptr(self.handle) if self.handle else None
+        # 在 C 端内存上直接构造一个 ctypes 数组，读写不需要再调用 C 函数
+        self._data = (taichi.type.type_to_ctypes[self.dtype] * self.size).from_address(self.ptr) if self.ptr else []
+        self._bits = self.dtype in taichi.type.bits_types # 内存中是半精度浮点数的位，读写需要转换
+        self._dirty = False # 是否可能有 kernel 正在读写
+        # 访问提示，只影响编译出来的代码的性能，见 hint
+        self.streaming = False
+        self.prefetch = 0
+
+    # 访问提示，返回 field 本身，可以写成 ti.field(...).hint(streaming=True)
+    # streaming：kernel 只写一次、之后很久才会再读的输出（比如大的结果数组），写入不经过 cache，不会把输入挤出 cache
+    # prefetch：kernel 中以 loop index 或者另一个 field 的元素（x[index[i]]）为下标读取的时候，提前这么多次迭代预取，0 表示不预取
+    # 提示在编译使用它的 kernel 的时候生效，已经编译过的 kernel 会重新编译
+    def hint(self, streaming: bool = None, prefetch: int = None) -> "Field":
+        if streaming is not None:
+            self.streaming = bool(streaming)
+        if prefetch is not None:
+            if int(prefetch) < 0:
+                log_error(f"prefetch distance {prefetch} should not be negative, use 0 (no prefetch)")
+                prefetch = 0
+            self.prefetch = int(prefetch)
+        return self
+
+    # 作为资源时的 key
+    # sync with cpp（llvm_taichi::field_resource）
+    @property
+    def _taichi_resource(self) -> int:
+        return -self.handle
+
+    def _sync(self):
+        if self._dirty and not taichi.core.runtime.in_kernel():
+            taichi.core.runtime.flush()
+            taichi.llvm.c_runtime_wait_resource(self._taichi_resource)
+            self._dirty = False
+
+    def __len__(self):
+        return self.size
+
+    def __getitem__(self, index):
+        self._sync()
+        if self._bits:
+            if isinstance(index, slice):
+                return [taichi.type.from_storage(i, self.dtype) for i in self._data[index]]
+            return taichi.type.from_storage(self._data[index], self.dtype)
+        return self._data[index]
+
+    # 只读的 field 记录错误并返回 False
+    def _check_writable(self) -> bool:
+        if self.read_only:
+            log_error(f"field mapped from {self.path} is read-only")
+            return False
+        return True
+
+    def __setitem__(self, index, value):
+        if not self._check_writable():
+            return
+        self._sync()
+        self._data[index] = taichi.type.to_storage(value, self.dtype)
+
+    def fill(self, value):
+        if not self._check_writable():
+            return
+        self._sync()
+        value = taichi.type.to_storage(value, self.dtype)
+        for i in range(self.size):
+            self._data[i] = value
+
+    def from_list(self, values: list):
+        if not self._check_writable():
+            return
+        self._sync()
+        for i in range(min(self.size, len(values))):
+            self._data[i] = taichi.type.to_storage(values[i], self.dtype)
+
+    def to_list(self) -> list:
+        return self[:]
+
+    # 等待写这个 field 的 kernel 结束，文件映射（r+ / w+）的话再把修改写回文件
+    def flush(self):
+        taichi.core.runtime.flush()
+        if not taichi.llvm.c_field_flush(self.handle):
+            log_error(f"can not flush field {self.handle}")
+        self._dirty = False
+
+    def __del__(self):
+        # 解释器退出的时候 C lib 可能已经不可用了
+        try:
+            taichi.llvm.c_field_destroy(self.handle)
+        except Exception:
+            pass
+
+# 模仿 taichi 的 ti.field
+# streaming 和 prefetch 是访问提示，见 Field.hint
+def field(dtype, shape: int, intermediate: bool = False, streaming: bool = False, prefetch: int = 0) -> Field:
+    return Field(dtype, shape, intermediate).hint(streaming, prefetch)
+
+# 模仿 numpy.memmap：把文件 path 从 offset 字节开始映射为 field
+# kernel 像普通的 field 一样读写，只有访问到的页才会读入内存
+def mmap_field(
+    path: str,
+    dtype,
+    shape: int = None,
+    offset: int = 0,
+    mode: str = "r+",
+    advice: map_advices = map_advices.none
+) -> Field:
+    return Field(dtype, shape, False, path, offset, mode, advice)
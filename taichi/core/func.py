@@ -1,19 +1,125 @@
 import os
 import ast
+import weakref
 import inspect
-from ctypes import c_void_p, c_int32, CFUNCTYPE
+from ctypes import c_void_p, c_int32, CFUNCTYPE, POINTER
 
 from taichi.tool import *
 import taichi.lang
 import taichi.llvm
 import taichi.type
 import taichi.core.func_manager
+import taichi.core.runtime as _runtime
+from taichi.core.kernel import invalidate_func as _invalidate_kernels, remove_func as _remove_kernel_calls
+
+# 构建一个类型确定的 func，返回 C 端的 handle 和 Python 可以调用的函数（转换参数和返回值的类型）
+# 构建失败的话返回 (None, None)
+def _build_native(task: ast.FunctionDef, fast_math_mode: int):
+    args_type, return_type = taichi.lang.get_func_prototype(task)
+    handle = taichi.lang.build_llvm_func(task, fast_math_mode)
+    if not handle:
+        return None, None
+
+    # 获取这个函数在 C 端的指针（这个是原始指针）
+    function_name_b = task.name.encode(encoding="ascii")
+    function_ptr = taichi.llvm.c_get_func_ptr(BP(function_name_b))
+    # 结构体的参数按指针传递；返回结构体的话，结果写入第一个参数指向的内存（sret），函数本身没有返回值
+    # sync with cpp（llvm_taichi::Function::build_begin）
+    returns_struct = return_type in taichi.type.struct_types
+    function_prototype = [
+        POINTER(taichi.type.type_to_ctypes[i])
+        if i in taichi.type.struct_types
+        else
+        taichi.type.type_to_ctypes[i]
+        for i in args_type
+    ]
+    if returns_struct:
+        function_prototype = [None, POINTER(taichi.type.type_to_ctypes[return_type]), *function_prototype]
+    else:
+        function_prototype = [taichi.type.type_to_ctypes[return_type], *function_prototype]
+
+    # CFUNCTYPE 用于定义函数指针类型
+    # _CFUNCTYPE 是我们创建的一个「函数类型」
+    # function_ptr 是从C拿到的一个函数指针
+    # 将「函数指针」转换为正确的类型之后就可以调用了
+    _CFUNCTYPE = CFUNCTYPE(*function_prototype)
+    # 这里，终于编译完成
+    # self_func 就是编译结果，它是机器字节码，可以在 python 调用
+    self_func = _CFUNCTYPE(function_ptr)
+
+    # 说实话，CFUNCTYPE很关键，这一步转换「函数指针类型」在C端很难实现
+
+    def call(*args):
+        cast_args = []
+        for i in range(len(args_type)):
+            if args_type[i] in taichi.type.struct_types:
+                # 结构体的实例由 ctypes 取地址传入
+                cast_args.append(taichi.type.cast(args[i], args_type[i]))
+                continue
+            cast_args.append(
+                taichi.type.type_to_ctypes[args_type[i]](
+                    taichi.type.cast(args[i], args_type[i])
+                )
+            )
+        if returns_struct:
+            result = taichi.type.type_to_ctypes[return_type]()
+            self_func(result, *cast_args)
+            return result
+        result = self_func(*cast_args)
+        return taichi.type.type_to_ctypes[return_type](result).value
+    return handle, call
+
+# Python 中直接调用泛型的 func：整数是 Int64，浮点数是 Float64（和 kernel 中的常量一致）
+def _python_type(value) -> str:
+    if isinstance(value, taichi.type.StructType):
+        return type(value).__name__
+    if isinstance(value, float):
+        return taichi.type.Float64.__name__
+    return taichi.type.Int64.__name__
+
+# 泛型的 func：每种参数类型的组合第一次被调用（或者被 kernel 调用）的时候构建一个实例
+def _template(task: ast.FunctionDef, args_type: list, fast_math_mode: int):
+    instances = dict() # 所有参数的类型 -> (实例的函数名, Python 可以调用的函数)，构建失败的话是 None
+
+    def instantiate(call_types: list):
+        if len(call_types) != len(args_type):
+            return None
+        # 标注过类型的参数保持标注的类型，调用的时候转换
+        key = tuple(t if t is not None else c for t, c in zip(args_type, call_types))
+        if key not in instances:
+            instance_task = taichi.lang.specialize_func(task, list(key))
+            log_debug(f"instantiate func {instance_task.name}")
+            handle, call = _build_native(instance_task, fast_math_mode)
+            instances[key] = (instance_task.name, call) if handle else None
+            if handle:
+                weakref.finalize(wrapper, taichi.llvm.c_function_release, handle).atexit = False
+        return instances[key]
+
+    def wrapper(*args, **kwargs):
+        instance = instantiate([_python_type(i) for i in args])
+        if instance is None:
+            log_error(f"can not instantiate func {task.name} for arguments {args}")
+            return None
+        return instance[1](*args)
+
+    taichi.lang.register_template(task.name, lambda call_types: (instantiate(call_types) or (None,))[0])
+    wrapper.is_template = True
+    wrapper._taichi_instances = instances
+    return wrapper
 
 # 模仿 taichi 的 func 修饰器
-def func(f):
+# fast_math 是浮点数语义（fast_math_flags 或者它的名字），None 的话使用 ti.init 的设定
+# func 在定义的时候编译，使用的是那个时候的设定；可以带参数 @ti.func(fast_math="contract")
+# 同名的 func 重新定义（比如在 notebook 中修改之后重新执行）会替换旧的版本：
+# 之后的调用和之后编译的 kernel 使用新的代码，旧的代码在没有调用者之后释放
+# 参数不标注类型（或者标注为 ti.template）的 func 是泛型的，见 _template
+def func(f=None, *, fast_math=None):
+    if f is None:
+        return lambda f: func(f, fast_math=fast_math)
     # 获取目标函数的 AST
     source_code = inspect.getsource(f)
     tree = ast.parse(source_code)
+    taichi.lang.set_source_location(tree, f)
 
     for node in ast.walk(tree):
         # 找到函数定义
@@ -21,7 +127,8 @@ def func(f):
             # 去掉装饰器
             node.decorator_list = []
             # 检查一遍语法，不支持的语法都去掉
-            pure_calc_task = taichi.lang.convert_func_to_pure_calc_task(node)
+            # 结构体类型的名字需要在 f 所在的模块中查找
+            pure_calc_task = taichi.lang.convert_func_to_pure_calc_task(node, f.__globals__)
     # 检查完成，可以开始使用 LLVM 构建函数
     if pure_calc_task:
         log_debug(
@@ -34,42 +141,36 @@ def func(f):
         # 获取函数原型
         args_type, return_type = taichi.lang.get_func_prototype(pure_calc_task)
 
-        # 构建函数
-        taichi.lang.build_llvm_func(pure_calc_task)
-
-        function_name = f.__name__
-        function_name_b = function_name.encode(encoding="ascii")
-
-        # 获取这个函数在 C 端的指针（这个是原始指针）
-        function_ptr = taichi.llvm.c_get_func_ptr(BP(function_name_b))
-        function_prototype = [
-            taichi.type.type_to_ctypes[i]
-            for i in [return_type, *args_type]
-        ]
-
-        # CFUNCTYPE 用于定义函数指针类型
-        # _CFUNCTYPE 是我们创建的一个「函数类型」
-        # function_ptr 是从C拿到的一个函数指针
-        # 将「函数指针」转换为正确的类型之后就可以调用了
-        _CFUNCTYPE = CFUNCTYPE(*function_prototype)
-        # 这里，终于编译完成
-        # self_func 就是编译结果，它是机器字节码，可以在 python 调用
-        self_func = _CFUNCTYPE(function_ptr)
+        # 已经定义过的话先让出名字，调用旧版本的 kernel 重新编译
+        _unregister(f.__name__)
 
-        # 说实话，CFUNCTYPE很关键，这一步转换「函数指针类型」在C端很难实现
+        fast_math_mode = taichi.lang.fast_math_value(fast_math) or 0
+        handle, self_func = None, None
+        if None not in args_type:
+            # 构建函数，失败的话（比如 C 端发现缺少 return）和分析失败一样使用原函数
+            handle, self_func = _build_native(pure_calc_task, fast_math_mode)
+            if self_func is None:
+                pure_calc_task = None
 
-        # wrapper 的工作就是
-        # 转换一下 参数 和 返回值 的类型，调用 self_func
-        def wrapper(*args, **kwargs):
-            cast_args = []
-            for i in range(len(args_type)):
-                cast_args.append(
-                    taichi.type.type_to_ctypes[args_type[i]](
-                        taichi.type.cast(args[i], args_type[i])
-                    )
-                )
-            result = self_func(*cast_args)
-            return taichi.type.type_to_ctypes[return_type](result).value
+    if pure_calc_task:
+        if None in args_type:
+            wrapper = _template(pure_calc_task, args_type, fast_math_mode)
+        else:
+            # wrapper 的工作就是
+            # 转换一下 参数 和 返回值 的类型，调用 self_func
+            def wrapper(*args, **kwargs):
+                return self_func(*args)
+
+            # wrapper 被回收（被替换、删除之后没有其他引用）的时候释放 C 端的引用
+            # 退出的时候不需要释放，进程结束时一起回收
+            if handle:
+                wrapper._taichi_handle = handle
+                weakref.finalize(wrapper, taichi.llvm.c_function_release, handle).atexit = False
+
+        # 编译成功的 func 可以被 native kernel 直接调用
+        wrapper.is_compiled = True
+        wrapper.args_type = args_type
+        wrapper.return_type = return_type
 
     # 构建失败，原函数 f 就保持不变
     else:
@@ -78,6 +179,8 @@ def func(f):
         def wrapper(*args, **kwargs):
             return f(*args, **kwargs)
 
+        wrapper.is_compiled = False
+
     # 将包装后的函数的 name 设定为和原函数一致
     wrapper.__name__ = f.__name__
     # 使用 setattr 为这个函数设定一个属性 标记这个函数是 taichi 的 func
@@ -98,4 +201,31 @@ def func(f):
         wrapper
     )
 
-    return wrapper
\ No newline at end of file
+    return wrapper
+
+# 让出 C 端的函数名（泛型的 func 是它所有实例的函数名），正在执行和等待融合的 kernel 先完成
+def _unregister(function_name: str):
+    taichi.lang.unregister_template(function_name)
+    old = taichi.core.func_manager.get_func("global", function_name)
+    names = [function_name, *[i[0] for i in getattr(old, "_taichi_instances", dict()).values() if i]]
+    names_b = [i.encode(encoding="ascii") for i in names]
+    handles = [taichi.llvm.c_function_handle(BP(i)) for i in names_b]
+    handles = [i for i in handles if i]
+    if not handles:
+        return
+    _runtime.sync()
+    for handle in handles:
+        taichi.llvm.c_function_remove(handle)
+    _invalidate_kernels(function_name)
+
+# 删除一个 func：之后不能再被调用和编译到 kernel 中，没有其他引用之后代码和数据随之释放
+# 已经定义的调用它的 kernel 之后使用 Python 的入口执行
+# f 可以是 ti.func 或者函数名
+def remove_func(f):
+    function_name = f if isinstance(f, str) else f.__name__
+    if taichi.core.func_manager.get_func("global", function_name) is None:
+        log_warning(f"func {function_name} is not defined")
+        return
+    _unregister(function_name)
+    _remove_kernel_calls(function_name)
+    taichi.core.func_manager.remove_func("global", function_name)
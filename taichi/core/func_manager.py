@@ -28,4 +28,13 @@ def get_func(
         return None
     if func_name not in _taichi_func_table[file_path]:
         return None
-    return _taichi_func_table[file_path][func_name]
\ No newline at end of file
+    return _taichi_func_table[file_path][func_name]
+
+# 删除
+def remove_func(
+    file_path: str,
+    func_name: str
+):
+    global _taichi_func_table
+    if file_path in _taichi_func_table:
+        _taichi_func_table[file_path].pop(func_name, None)
@@ -1,27 +1,548 @@
 import ast # 抽象语法树 Abstract Syntax Tree
+import copy
 import inspect # 用于获取 Python 对象的信息
+import os
+import re
+import struct
+import itertools
 import threading
+from ctypes import create_string_buffer
 
 from taichi.tool import *
 import taichi.lang
+import taichi.lang.fusion
+import taichi.llvm
+import taichi.type
 import taichi.core.func_manager
+import taichi.core.runtime as _runtime
+import taichi.core.codegen
+from taichi.core.field import Field
 
-# TODO: 现在是临时做法，应该动态获取线程数量
+# 线程数量由 C 端的 runtime 决定
 def threading_number() -> int:
-    return 8
+    return _runtime.thread_number()
+
+# ===== kernel 融合 =====
+# 可以编译为 native 代码的 kernel 发射不会立即提交给 runtime，而是先放在 _fusion_group 中
+# 之后的发射如果和它们迭代空间相同、依赖关系兼容，就合并为一个循环，一次发射
+# 以下情况会提交 _fusion_group：无法融合的发射、ti.sync()、Python 端访问 field
+
+_max_fusion_stages = 8
+_fusion_group = []
+# 编译好的 kernel：key -> (入口, 函数名, 签名)（无法编译的话都是 None）
+# 签名由 kernel 名和参数类型组成，不同的运行之间保持不变，用于调度的自动调优
+_compiled_kernels = dict()
+_kernel_counter = itertools.count()
+# ti.func 的名字 -> 调用了它的编译结果（_compiled_kernels 的 key），func 重新定义的时候这些 kernel 要重新编译
+_func_kernels = dict()
+# ti.func 的名字 -> 调用了它的 kernel 的分析结果，func 被删除之后这些 kernel 不能再 native 执行
+_func_analyses = dict()
+
+# 一次可以 native 执行的 kernel 发射
+class _Stage:
+    def __init__(self, analysis, arguments, loop_range, iterations, reads, writes, python_entry):
+        self.analysis = analysis
+        self.arguments = arguments # 参数名 -> 参数值
+        self.loop_range = loop_range
+        self.iterations = iterations
+        self.reads = reads
+        self.writes = writes
+        self.python_entry = python_entry # 无法编译的时候使用
+
+# 参数在 native kernel 中的类型：(类型名, 是否是 field)，不支持的参数返回 None
+def _argument_type(value):
+    if isinstance(value, Field):
+        return value.dtype, True
+    elif isinstance(value, int):
+        return taichi.type.Int64.__name__, False
+    elif isinstance(value, float):
+        return taichi.type.Float64.__name__, False
+    return None
+
+# 能否 native 执行：参数类型都支持，并且 body 中都是支持的语法
+# 结果按照「kernel + 参数类型」缓存
+_native_checked = dict()
+
+def _native_stage(analysis, arguments: dict, *args):
+    if analysis.loop_var is None:
+        return None
+    params = []
+    for name in analysis.params:
+        arg_type = _argument_type(arguments[name])
+        if arg_type is None:
+            return None
+        params.append((name, *arg_type))
+    key = (analysis.uid, tuple(params))
+    if key not in _native_checked:
+        _native_checked[key] = taichi.lang.flatten_kernel_body(
+            params,
+            analysis.loop_var,
+            analysis.body,
+            analysis.funcs
+        ) is not None
+    if not _native_checked[key]:
+        return None
+    return _Stage(analysis, arguments, *args)
+
+def _stage_fields(stage, names) -> list:
+    return [
+        (name, stage.arguments[name])
+        for name in names
+        if isinstance(stage.arguments[name], Field)
+    ]
+
+# kernel 的浮点数语义，装饰器没有指定的话使用 ti.init 的设定
+def _fast_math(analysis) -> int:
+    if analysis.fast_math is None:
+        return int(cfg_get(cfg.fast_math))
+    return analysis.fast_math
+
+# stage 能否加入当前的融合组
+def _can_fuse(group: list, stage) -> bool:
+    if len(group) >= _max_fusion_stages or stage.loop_range != group[0].loop_range:
+        return False
+    # 浮点数语义不同的 kernel 不融合，各自保持自己的语义
+    if _fast_math(stage.analysis) != _fast_math(group[0].analysis):
+        return False
+
+    group_writes = {id(obj) for i in group for obj in i.writes}
+    group_access = group_writes | {id(obj) for i in group for obj in i.reads}
+    stage_writes = {id(obj) for obj in stage.writes}
+    for obj in (*stage.reads, *stage.writes):
+        # 融合组写过的，或者融合组读过而这次要写的，融合之后顺序会改变
+        # 只有所有相关的访问都是 field[i] 才安全（第 i 个元素只在第 i 次迭代中访问）
+        if id(obj) in group_writes or (id(obj) in stage_writes and id(obj) in group_access):
+            for i in (*group, stage):
+                for name, value in i.arguments.items():
+                    if value is obj and name not in i.analysis.elementwise:
+                        return False
+    return True
+
+# 确定融合后函数的参数：同一个 field 对应同一个参数，标量各自对应一个参数
+def _group_layout(group: list, privatize: bool = True):
+    slots = [] # [(参数名, 值, 类型名, 是否是 field)]
+    field_slots = dict() # id(field) -> 参数名
+    stages = [] # [(KernelAnalysis, 参数名 -> 融合后的参数名)]
+    for stage in group:
+        mapping = dict()
+        for name in stage.analysis.params:
+            value = stage.arguments[name]
+            value_type, is_field = _argument_type(value)
+            if is_field and id(value) in field_slots:
+                mapping[name] = field_slots[id(value)]
+                continue
+            slot_name = f"_taichi_a{len(slots)}"
+            slots.append((slot_name, value, value_type, is_field))
+            mapping[name] = slot_name
+            if is_field:
+                field_slots[id(value)] = slot_name
+        stages.append((stage.analysis, mapping))
+
+    # intermediate field 在融合组中先被写、后被读，这样的存储可以删掉
+    eliminated = set()
+    if len(group) > 1:
+        for slot_name, value, _, is_field in slots:
+            if not (is_field and value.intermediate):
+                continue
+            written = False
+            for analysis, mapping in stages:
+                names = [i for i in analysis.params if mapping[i] == slot_name]
+                if written and any(i in analysis.reads for i in names):
+                    eliminated.add(slot_name)
+                    break
+                written = written or any(i in analysis.writes for i in names)
+
+    # 开启了 scatter 私有化的话，融合组中只被 atomic_add 累加的 field 使用私有化的 scatter
+    private = dict()
+    if privatize and cfg_get(cfg.scatter_privatization):
+        for slot_name, _, value_type, is_field in slots:
+            uses = [
+                (analysis, name)
+                for analysis, mapping in stages
+                for name in analysis.params
+                if mapping[name] == slot_name
+            ]
+            # 存储类型的拷贝累加会多次舍入，不私有化
+            if (
+                is_field and uses and value_type in taichi.type.basic_types
+                and all(name in analysis.scatter for analysis, name in uses)
+            ):
+                private[slot_name] = value_type
+
+    # field 的访问提示（见 Field.hint）：参数名 -> (field_hint_flags, 预取的距离)
+    # 没有预取提示的 field 按 ti.init 的 prefetch_distance 预取 gather
+    hints = dict()
+    for slot_name, value, _, is_field in slots:
+        if not is_field or slot_name in eliminated:
+            continue
+        flags, distance = field_hint_flags.none, 0
+        if getattr(value, "streaming", False):
+            flags |= field_hint_flags.streaming
+        if getattr(value, "prefetch", 0) > 0:
+            flags, distance = flags | field_hint_flags.prefetch, value.prefetch
+        elif cfg_get(cfg.prefetch_distance) > 0:
+            flags, distance = flags | field_hint_flags.prefetch_gather, cfg_get(cfg.prefetch_distance)
+        if flags:
+            hints[slot_name] = (int(flags), distance)
+
+    key = (
+        tuple((analysis.uid, tuple(mapping[i] for i in analysis.params)) for analysis, mapping in stages),
+        tuple((i[0], i[2], i[3]) for i in slots),
+        frozenset(eliminated),
+        frozenset(private.items()),
+        _fast_math(group[0].analysis),
+        frozenset(hints.items())
+    )
+    return slots, stages, eliminated, private, hints, key
+
+# 编译融合组（可能只有一个 kernel），返回入口、参数、签名以及私有化 scatter 的 field 参数
+# privatize 为 False 的话不使用私有化的 scatter（比如流式执行，每一块的 field 指针不一样）
+def _compile_group(group: list, privatize: bool = True):
+    slots, stages, eliminated, private, hints, key = _group_layout(group, privatize)
+    if key not in _compiled_kernels:
+        body = taichi.lang.fusion.fuse_kernel_bodies(
+            stages,
+            {i[0]: i[2] for i in slots if i[3]},
+            eliminated
+        )
+        funcs = dict()
+        for analysis, _ in stages:
+            funcs.update(analysis.funcs)
+        kernel_names = "_".join([i.analysis.name for i in group])
+        name = f"_taichi_kernel_{next(_kernel_counter)}_{kernel_names}"
+        entry = taichi.lang.build_llvm_kernel(
+            name,
+            [(i[0], i[2], i[3]) for i in slots],
+            taichi.lang.fusion.fused_loop_var,
+            body,
+            funcs,
+            group[0].analysis.main_loop,
+            private,
+            _fast_math(group[0].analysis),
+            hints
+        )
+        signature = "+".join([i.analysis.name for i in group]) + "(" + ",".join([
+            i[2] + ("[]" if i[3] else "") for i in slots
+        ]) + ")"
+        _compiled_kernels[key] = (
+            (_runtime.KERNEL_ENTRY(entry), name, signature)
+            if entry
+            else
+            (None, None, None)
+        )
+        if entry and len(group) > 1:
+            log_debug(f"kernels {', '.join([i.analysis.name for i in group])} fused into {name}")
+        if entry:
+            _warn_dependences(name, stages, private)
+        for func_name in funcs:
+            _func_kernels.setdefault(func_name, set()).add(key)
+
+    entry, name, signature = _compiled_kernels[key]
+    if entry is not None:
+        for stage in group:
+            (stage.analysis.interchanged_from or stage.analysis).native_name = name
+    return entry, slots, signature, private
+
+# 融合之后的名字换回 kernel 中的名字：参数 _taichi_a{k} 换回（第一个使用它的 kernel 的）参数名，局部变量去掉前缀
+def _original_names(stages: list):
+    names = dict()
+    for analysis, mapping in stages:
+        for name in analysis.params:
+            names.setdefault(mapping[name], name)
+    def rename(message: str) -> str:
+        message = re.sub(r"\b_taichi_a\d+\b", lambda m: names.get(m.group(0), m.group(0)), message)
+        return re.sub(r"\b_taichi_s\d+_", "", message)
+    return rename
+
+# main-loop 的迭代之间有依赖的话（比如 x[i] = x[i - 1] + 1，或者不是原子操作的累加），并行执行的结果和顺序执行不同
+# 依赖分析的结果见 ti.get_loop_report
+def _warn_dependences(name: str, stages: list, private: dict):
+    # 交换之后的循环范围是运行时的参数，分析不出来的依赖已经在交换之前排除了
+    if any(analysis.interchanged_from is not None for analysis, _ in stages):
+        return
+    rename = _original_names(stages)
+    notes = []
+    for loop in taichi.core.codegen.get_loop_report(name):
+        if loop["depth"] != 0:
+            continue
+        for file, line, message in loop["dependences"]:
+            # 私有化的 scatter 已经是安全的累加
+            if any(re.search(rf"\b{i}\b", message) for i in private):
+                continue
+            location = f"{file}:{line}: " if file else ""
+            notes.append(f"    {location}{rename(message)}")
+    if notes:
+        kernel_names = ", ".join([analysis.name for analysis, _ in stages])
+        log_warning(
+            f"iterations of the main loop of kernel {kernel_names} may depend on each other, "
+            f"parallel execution may give a different result{os.linesep}" + os.linesep.join(notes)
+        )
+
+# ti.func 被重新定义或者删除：调用它的 kernel 之后重新编译，旧的编译结果释放掉
+# 调用方要先 sync，正在执行的 kernel 还在使用旧的代码
+def invalidate_func(func_name: str):
+    for key in _func_kernels.pop(func_name, ()):
+        _, name, _ = _compiled_kernels.pop(key, (None, None, None))
+        if name is None:
+            continue
+        name_b = name.encode(encoding="ascii") # BP 不持有 bytes
+        handle = taichi.llvm.c_function_handle(BP(name_b))
+        if handle:
+            taichi.llvm.c_function_release(handle)
+
+# ti.func 被删除：调用它的 kernel 不能再编译为 native 代码，之后使用 Python 的入口执行
+def remove_func(func_name: str):
+    invalidate_func(func_name)
+    uids = set()
+    for analysis in _func_analyses.pop(func_name, ()):
+        analysis.funcs.pop(func_name, None)
+        uids.add(analysis.uid)
+    for key in [i for i in _native_checked if i[0] in uids]:
+        del _native_checked[key]
+
+# ===== 循环交换 =====
+# main-loop 的迭代次数少于线程数的话，有的线程没有事做（比如 for i in range(4): for j in range(100000)）
+# 完美嵌套、两层循环的迭代之间都没有依赖的话，交换两层循环，按内层循环并行
+
+# 原来的 kernel 的编译结果（_compiled_kernels 的 key）-> 两层循环的迭代是否都没有依赖
+_interchange_checked = dict()
+
+def _interchange_legal(stage) -> bool:
+    key = _group_layout([stage])[-1]
+    # func 被重新定义之后 kernel 要重新编译，结果也要重新判断
+    if key not in _interchange_checked or key not in _compiled_kernels:
+        entry = _compile_group([stage])[0]
+        loops = taichi.core.codegen.get_loop_report(_compiled_kernels[key][1]) if entry else []
+        _interchange_checked[key] = (
+            len(loops) >= 2
+            and loops[0]["independent"]
+            and loops[1]["depth"] == 1
+            and loops[1]["independent"]
+        )
+    return _interchange_checked[key]
+
+# 交换之后的发射，不需要或者不能交换的话返回 None
+# analysis 是交换之后的 kernel，inner_range 是内层循环的范围
+def _interchange_stage(stage, analysis, inner_range: tuple):
+    if not cfg_get(cfg.loop_interchange) or stage.iterations >= threading_number():
+        return None
+    iterations = len(range(*inner_range))
+    if iterations <= stage.iterations or not _interchange_legal(stage):
+        return None
+    arguments = dict(stage.arguments)
+    arguments.update(zip(taichi.lang.interchange_params, stage.loop_range))
+    # 交换之后无法编译的话，由第一块迭代按原来的循环执行整个 kernel
+    def python_entry(begin, end, context):
+        if begin == 0:
+            stage.python_entry(0, stage.iterations, context)
+    interchanged = _native_stage(
+        analysis,
+        arguments,
+        tuple(inner_range),
+        iterations,
+        stage.reads,
+        stage.writes,
+        python_entry
+    )
+    if interchanged is not None:
+        log_debug(f"loops of kernel {stage.analysis.name} interchanged: {stage.iterations} x {iterations}")
+    return interchanged
+
+# 每个参数在 context 中占 8 字节
+# sync with cpp（llvm_taichi::Function::get_kernel_entry）
+_context_format = {
+    taichi.type.Int64.__name__: "q",
+    taichi.type.Float64.__name__: "d"
+}
+
+# native kernel 的 context：每个参数 8 字节，之后是 loop index 的起点和步长
+def _group_context(group: list, slots: list):
+    l, _, s = group[0].loop_range
+    return create_string_buffer(struct.pack(
+        cfg_get(cfg.bytes_order_c) + "".join([
+            "Q" if i[3] else _context_format[i[2]]
+            for i in slots
+        ]) + "qq",
+        *[i[1].ptr if i[3] else i[1] for i in slots],
+        l,
+        s
+    ))
+
+# 私有化 scatter 的融合组，不私有化（原子累加）的同一个 kernel，参数的布局相同，可以使用同一个 context
+# C 端不能私有化（比如拷贝的内存分配失败）的时候执行它
+def _atomic_entry(group: list, private: dict):
+    return _compile_group(group, False)[0] if private else None
+
+def _submit_group(group: list):
+    entry, slots, signature, private = _compile_group(group)
+    if entry is None:
+        # 融合之后无法编译，就分别提交
+        if len(group) > 1:
+            for stage in group:
+                _submit_group([stage])
+        else:
+            stage = group[0]
+            _runtime.submit(stage.python_entry, stage.iterations, stage.reads, stage.writes)
+        return
+
+    context = _group_context(group, slots)
+    _runtime.submit(
+        entry,
+        group[0].iterations,
+        [obj for stage in group for obj in stage.reads],
+        [obj for stage in group for obj in stage.writes],
+        context,
+        signature,
+        # 第 k 个参数在 context 中的偏移是 8 * k
+        [(8 * k, i[1]) for k, i in enumerate(slots) if i[0] in private],
+        _atomic_entry(group, private)
+    )
+
+# 提交当前的融合组
+def flush_fusion_group():
+    global _fusion_group
+    group, _fusion_group = _fusion_group, []
+    if group:
+        _submit_group(group)
+
+_runtime.add_flush_hook(flush_fusion_group)
+
+def _enqueue_stage(stage):
+    if _fusion_group and not _can_fuse(_fusion_group, stage):
+        flush_fusion_group()
+    _fusion_group.append(stage)
+    # Python 端访问这些 field 之前，需要先提交融合组
+    for obj in (*stage.reads, *stage.writes):
+        obj._dirty = True
+    if not cfg_get(cfg.kernel_fusion):
+        flush_fusion_group()
+
+# ===== 原子操作 =====
+# native kernel 中的 ti.atomic_* 编译为 LLVM 的 atomicrmw / cmpxchg
+# Python 执行的 kernel 中改写为 _taichi_atomic，多个 worker 线程之间用一个锁保证原子性
+_atomic_lock = threading.Lock()
+
+def _taichi_atomic(operation: str, target, index, value, desired=None):
+    # 操作数先转换为元素类型（存储类型的话是它的计算类型），和 native 的语义一致
+    if isinstance(target, Field):
+        value_type = taichi.type.compute_type(target.dtype)
+        value = taichi.type.cast(value, value_type)
+        if desired is not None:
+            desired = taichi.type.cast(desired, value_type)
+    with _atomic_lock:
+        old = target[index]
+        if operation == "add":
+            target[index] = old + value
+        elif operation == "min":
+            target[index] = min(old, value)
+        elif operation == "max":
+            target[index] = max(old, value)
+        elif old == value: # cas
+            target[index] = desired
+    return old
+
+# ti.atomic_* 只能在 kernel 中使用，kernel 之外调用的时候拿到的 field[index] 已经是元素的值了
+def _atomic_outside_kernel(name: str):
+    def atomic(*args):
+        log_error(f"ti.{name} can only be used in kernels")
+    atomic.__name__ = name
+    return atomic
+
+atomic_add = _atomic_outside_kernel("atomic_add")
+atomic_min = _atomic_outside_kernel("atomic_min")
+atomic_max = _atomic_outside_kernel("atomic_max")
+atomic_cas = _atomic_outside_kernel("atomic_cas")
+
+# ===== 随机数 =====
+# kernel 中的 ti.random() 使用基于计数器的 Philox4x32-10（见 llvm_random）
+# 每次发射使用一个新的 seed，迭代使用自己的 loop index 作为 counter，结果和线程数、调度无关
+# seed 的序列由 ti.init(random_seed=...) 和发射的顺序决定，同样的程序每次运行的结果一样
+
+_uint64_mask = (1 << 64) - 1
+_uint32_mask = (1 << 32) - 1
+_random_seed = 0
+_random_launches = 0
+
+def set_random_seed(seed: int):
+    global _random_seed, _random_launches
+    _random_seed = int(seed) & _uint64_mask
+    _random_launches = 0
+
+# splitmix64，相邻的发射得到不相关的 seed
+def _next_random_seed() -> int:
+    global _random_launches
+    _random_launches += 1
+    z = (_random_seed + _random_launches * 0x9E3779B97F4A7C15) & _uint64_mask
+    z = ((z ^ (z >> 30)) * 0xBF58476D1CE4E5B9) & _uint64_mask
+    z = ((z ^ (z >> 27)) * 0x94D049BB133111EB) & _uint64_mask
+    z ^= z >> 31
+    # kernel 的参数是 Int64
+    return z - (1 << 64) if z >= (1 << 63) else z
+
+# 和 llvm_taichi::random_uniform 一致
+# sync with cpp
+def _random_uniform(seed: int, counter: int, stream: int) -> float:
+    seed, counter, stream = seed & _uint64_mask, counter & _uint64_mask, stream & _uint64_mask
+    c0, c1 = counter & _uint32_mask, counter >> 32
+    c2, c3 = stream & _uint32_mask, stream >> 32
+    k0, k1 = seed & _uint32_mask, seed >> 32
+    for _ in range(10):
+        p0 = 0xD2511F53 * c0
+        p1 = 0xCD9E8D57 * c2
+        c0, c1, c2, c3 = (p1 >> 32) ^ c1 ^ k0, p1 & _uint32_mask, (p0 >> 32) ^ c3 ^ k1, p0 & _uint32_mask
+        k0 = (k0 + 0x9E3779B9) & _uint32_mask
+        k1 = (k1 + 0xBB67AE85) & _uint32_mask
+    return (((c1 << 32) | c0) >> 12) * (1.0 / 4503599627370496.0)
+
+# Python 执行的 kernel 中，一次迭代里的随机数
+class _RandomStream:
+    def __init__(self, seed: int, counter: int):
+        self.seed = seed
+        self.counter = counter
+        self.stream = 0
+
+    def next(self) -> float:
+        self.stream += 1
+        return _random_uniform(self.seed, self.counter, self.stream - 1)
+
+# kernel 之外的 ti.random()，counter 使用一个 kernel 不会用到的值
+_host_random_stream = None
+
+def random() -> float:
+    global _host_random_stream
+    if _host_random_stream is None or _host_random_stream.seed != _random_seed:
+        _host_random_stream = _RandomStream(_random_seed, -1)
+    return _host_random_stream.next()
 
 # 模仿 taichi 的 kernel
-def kernel(f):
+# fast_math 是 native 代码的浮点数语义（fast_math_flags 或者它的名字），None 的话使用 ti.init 的设定
+# 可以直接使用 @ti.kernel，也可以带参数 @ti.kernel(fast_math="fast")
+def kernel(f=None, *, fast_math=None):
+    if f is None:
+        return lambda f: kernel(f, fast_math=fast_math)
     # 获取目标函数 AST
     source_code = inspect.getsource(f)
     tree = ast.parse(source_code)
+    taichi.lang.set_source_location(tree, f)
     for node in ast.walk(tree):
         # 找到函数定义
         if isinstance(node, ast.FunctionDef) and node.name == f.__name__:
             # 需要把装饰器都去掉
             node.decorator_list = []
-            # 返回一个用于 worker 线程的函数
-            worker_func = taichi.lang.convert_kernel_main_loop_to_func(node)
+            # 融合和 native 编译需要的静态信息
+            analysis_node = copy.deepcopy(node)
+            main_loop, _ = taichi.lang.find_kernel_main_loop(analysis_node, warn=False)
+            interchanged_node, inner_range_func = (
+                taichi.lang.interchange_kernel_loops(analysis_node, main_loop)
+                if main_loop is not None
+                else
+                (None, None)
+            )
+            # 返回一个用于 worker 线程的函数，以及计算循环范围的函数
+            worker_func, range_func = taichi.lang.convert_kernel_main_loop_to_func(node)
+            if worker_func is not None:
+                worker_func = taichi.lang.AtomicRewriter().visit(worker_func)
+                taichi.lang.rewrite_random_calls(worker_func)
 
     # 解析失败了 暂时忽略这种情况
     if worker_func is None:
@@ -29,26 +550,49 @@ def kernel(f):
             ...
         wrapper.__name__ = f.__name__
         return wrapper
+
+    analysis = taichi.lang.fusion.KernelAnalysis(analysis_node, main_loop)
+    analysis.fast_math = None if fast_math is None else taichi.lang.fast_math_value(fast_math)
     
+    # 交换两层循环之后的 kernel，随机数由 loop index 决定，交换之后的结果不同
+    interchanged_analysis = None
+    if interchanged_node is not None and not analysis.uses_random:
+        interchanged_analysis = taichi.lang.fusion.KernelAnalysis(interchanged_node, interchanged_node.body[0])
+        interchanged_analysis.fast_math = analysis.fast_math
+        interchanged_analysis.interchanged_from = analysis
+        interchanged_analysis.funcs = analysis.funcs # 同一个 dict，下面找到的 func 也在其中
+        range_funcs = [range_func, inner_range_func]
+    else:
+        range_funcs = [range_func]
+
     # 将 worker_func 包装成一个模块
-    worker_module = ast.Module(body=[worker_func], type_ignores=[])
+    worker_module = ast.Module(body=[worker_func, *range_funcs], type_ignores=[])
     ast.fix_missing_locations(worker_module)
 
     # 编译这个模块
     code_obj = compile(worker_module, filename="<ast>", mode="exec")
-    blank_namespace = dict()
+    blank_namespace = {"_taichi_atomic": _taichi_atomic, "_taichi_random_stream": _RandomStream}
 
     # 找到这个 kernel 都调用了哪些 ti.func
     used_funcs = set()
     func_visitor = taichi.lang.FunctionCallVisitor(used_funcs)
     func_visitor.visit(worker_func)
 
+    # 找到这个 kernel 通过下标读写了哪些变量，用于推导 kernel 之间的依赖
+    read_names, write_names = analysis.reads, analysis.writes
+
     # 获取这些被引用的 ti.func，并将其导入新的空白的命名空间中
     # 这样才能定义新的 worker_func
     for func_name in used_funcs:
         func_obj = taichi.core.func_manager.get_func("global", func_name)
         if func_obj is not None:
             blank_namespace[func_name] = func_obj
+            # 编译成功的 ti.func 可以在 native kernel 中直接调用
+            if getattr(func_obj, "is_compiled", False):
+                analysis.funcs[func_name] = len(func_obj.args_type)
+                _func_analyses.setdefault(func_name, []).extend(
+                    i for i in (analysis, interchanged_analysis) if i is not None
+                )
 
     # 在新的命名空间中，定义 worker_func（执行它的 def 代码）
     # 注意：这里是定义，不是调用 
@@ -56,27 +600,81 @@ def kernel(f):
 
     # 大功告成，现在获取这个可执行的 worker_func
     transformed_func = blank_namespace[worker_func.name]
+    transformed_range_func = blank_namespace[range_func.name]
+    transformed_inner_range_func = blank_namespace.get("_taichi_inner_range_func")
+    signature = inspect.signature(transformed_range_func)
+
+    # 准备一次发射：native 执行的话返回 _Stage，否则返回 Python 的入口以及迭代次数和读写的对象
+    # interchange 为 False 的话不交换循环，stage 的 loop_range 和 iterations 总是 main-loop 的
+    # 写只读的 field（mode 为 r 的文件映射）的话记录错误，返回 (None, None)
+    def prepare(*args, _taichi_interchange: bool = True, **kwargs):
+        bound = signature.bind(*args, **kwargs)
+        bound.apply_defaults()
+
+        # 计算迭代次数
+        l, r, s = transformed_range_func(*args, **kwargs)
+        iterations = len(range(l, r, s))
+
+        # 只保留 kernel 能修改的对象（field 和容器），标量参数不参与依赖追踪和融合的判断
+        reads = [bound.arguments[i] for i in read_names if i in bound.arguments]
+        writes = [bound.arguments[i] for i in write_names if i in bound.arguments]
+        reads = [i for i in reads if _runtime.is_resource(i)]
+        writes = [i for i in writes if _runtime.is_resource(i)]
+        read_only = [i for i in writes if getattr(i, "read_only", False)]
+        if read_only:
+            log_error(f"kernel {f.__name__} writes the read-only field mapped from {read_only[0].path}")
+            return None, None
+
+        # 使用随机数的 kernel 每次发射有一个新的 seed
+        random_kwargs = dict()
+        if analysis.uses_random:
+            seed = _next_random_seed()
+            bound.arguments[taichi.lang.fusion.random_seed_param] = seed
+            random_kwargs[taichi.lang.fusion.random_seed_param] = seed
+
+        # runtime 的 worker 线程会调用这个入口，执行一段迭代
+        def entry(begin, end, context):
+            transformed_func(
+                *args,
+                _taichi_begin=begin,
+                _taichi_end=end,
+                **random_kwargs,
+                **kwargs
+            )
+
+        # 参数都是 field 或者数值的话，kernel 可以编译为 native 代码，并且参与融合
+        stage = _native_stage(
+            analysis,
+            bound.arguments,
+            (l, r, s),
+            iterations,
+            reads,
+            writes,
+            entry
+        )
+        # main-loop 足够长的话不需要计算内层循环的范围
+        if _taichi_interchange and stage is not None and interchanged_analysis is not None and iterations < threading_number():
+            inner_range = transformed_inner_range_func(*args, **kwargs)
+            stage = _interchange_stage(stage, interchanged_analysis, inner_range) or stage
+        return stage, (entry, iterations, reads, writes)
 
     # 真正的 wrapper 在这里
+    # 发射之后立即返回，kernel 在 runtime 的线程池中异步执行
+    # 使用 ti.sync() 等待执行完成，field 在 Python 端被访问时会自动等待
     def wrapper(*args, **kwargs):
-        threads = []
-        kwargs["_taichi_thread_cnt"] = threading_number()
-
-        # 启动线程
-        for i in range(threading_number()):
-            kwargs["_taichi_thread_id"] = i
-            local_thread = threading.Thread(
-                target=transformed_func,
-                args=args,
-                kwargs=kwargs
-            )
-            threads.append(local_thread)
-            local_thread.start()
-        # 等所有线程停止
-        for i in range(threading_number()):
-            threads[i].join()
+        stage, launch_args = prepare(*args, **kwargs)
+        if stage is not None:
+            _enqueue_stage(stage)
+        elif launch_args is not None:
+            _runtime.launch(*launch_args)
 
     wrapper.__name__ = f.__name__
+    # 按模块和名字找到 kernel（比如多进程执行的时候在 worker 进程中找到同一个 kernel）
+    wrapper.__module__ = f.__module__
+    wrapper.__qualname__ = f.__qualname__
+    wrapper._taichi_analysis = analysis # 用于查看代码生成的结果
+    # 用于流式执行和多进程执行，它们按 main-loop 的迭代分段（移动 loop_range 的起点），不能交换循环
+    wrapper._taichi_prepare = lambda *args, **kwargs: prepare(*args, _taichi_interchange=False, **kwargs)
     return wrapper
 
 # 使用 numba 进行并行化 已经弃用
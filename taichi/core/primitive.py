@@ -0,0 +1,62 @@
+# 并行原语：前缀和、排序、流压缩
+# 由 C 端（llvm_primitives）在 worker 线程池上执行，和 kernel 一样异步发射、按 field 建立依赖
+# 所以可以直接夹在 kernel 之间调用（比如粒子分桶：kernel 计算桶号，sort，kernel 按桶处理），不需要同步
+
+import taichi.llvm
+import taichi.core.runtime
+from taichi.core.field import Field
+from taichi.tool import *
+
+def _launch(name: str, launch_id: int, fields: list) -> int:
+    if launch_id < 0:
+        log_error(f"ti.{name} failed")
+        return launch_id
+    return taichi.core.runtime.track(launch_id, fields)
+
+def _check_fields(name: str, *fields) -> bool:
+    for i in fields:
+        if i is not None and not isinstance(i, Field):
+            log_error(f"ti.{name} only works on fields")
+            return False
+    return True
+
+# 前缀和，dst 为 None 的话原地计算，返回 dst
+# exclusive：dst[i] = src[0] + ... + src[i - 1]；inclusive：dst[i] = src[0] + ... + src[i]
+# 浮点数分块求和，结果和串行的顺序求和可能有舍入上的差别
+def scan(src: Field, dst: Field = None, inclusive: bool = False) -> Field:
+    dst = src if dst is None else dst
+    if not _check_fields("scan", src, dst):
+        return dst
+    taichi.core.runtime.flush() # 保证和之前的 kernel 的顺序
+    _launch("scan", taichi.llvm.c_primitive_scan(src.handle, dst.handle, 1 if inclusive else 0), [src, dst])
+    return dst
+
+def prefix_sum(src: Field, dst: Field = None, inclusive: bool = False) -> Field:
+    return scan(src, dst, inclusive)
+
+# 按 keys 升序原地排序（稳定），values 是跟着 keys 一起移动的 field（比如粒子的下标）
+# keys 可以是 Int32 / Int64 / Float32 / Float64
+def sort(keys: Field, values: Field = None):
+    if not _check_fields("sort", keys, values):
+        return
+    taichi.core.runtime.flush()
+    fields = [keys] if values is None else [keys, values]
+    _launch("sort", taichi.llvm.c_primitive_sort(keys.handle, 0 if values is None else values.handle), fields)
+
+# 流压缩：按顺序把 flags[i] 不为 0 的 src[i] 写到 dst 的前面，src 为 None 的话写的是下标 i
+# count 是一个 field 的话，选中的总数写到 count[0]；count 为 None 的话等待完成并返回总数
+def compact(src: Field, flags: Field, dst: Field, count: Field = None):
+    if not _check_fields("compact", src, flags, dst, count):
+        return None
+    taichi.core.runtime.flush()
+    result = count if count is not None else Field("Int64", 1)
+    fields = [i for i in (src, flags, dst, result) if i is not None]
+    _launch("compact", taichi.llvm.c_primitive_compact(
+        0 if src is None else src.handle,
+        flags.handle,
+        dst.handle,
+        result.handle
+    ), fields)
+    if count is None:
+        return result[0]
+    return None
@@ -0,0 +1,243 @@
+# kernel 运行时的 python 端
+# 线程池、发射队列、依赖追踪都在 C 端（llvm_runtime）
+# 这里负责：计算资源的 key、在发射完成之前保活回调对象
+
+import os
+import atexit
+import ctypes
+import threading
+from ctypes import CFUNCTYPE, c_int64, c_uint32, c_void_p
+
+from taichi.tool import *
+import taichi.llvm
+
+# kernel 入口的函数类型
+# sync with cpp（llvm_taichi::KernelEntry）
+KERNEL_ENTRY = CFUNCTYPE(None, c_int64, c_int64, c_void_p)
+
+_inited = False
+_async_mode = True
+
+# 还没有确认完成的发射：launch id -> 回调对象以及它引用的参数
+# 回调对象被回收之后 C 端再调用就会崩溃，所以发射完成之前必须留着
+# dict 保持插入顺序，也就是 launch id 的顺序
+_pending = dict()
+
+# 标记当前线程是否正在执行 kernel
+# kernel 内部访问 field 不需要（也不能）等待自己
+_local = threading.local()
+
+def in_kernel() -> bool:
+    return getattr(_local, "in_kernel", False)
+
+# 把一个 python 函数包装为 kernel 入口
+def make_entry(func) -> KERNEL_ENTRY:
+    def entry(begin, end, context):
+        _local.in_kernel = True
+        try:
+            func(begin, end, context)
+        finally:
+            _local.in_kernel = False
+    return KERNEL_ENTRY(entry)
+
+# autotuner 默认把选择保存在这里
+_default_schedule_cache = os.path.join(os.path.expanduser("~"), ".cache", "taichi-mini", "schedules.tsv")
+
+def init(
+    thread_number: int = 0,
+    async_mode: bool = True,
+    schedule: schedules = schedules.static,
+    chunks_per_thread: int = 16,
+    schedule_cache: str = None,
+    placement: placements = placements.none,
+    spin_microseconds: int = 0
+):
+    global _inited, _async_mode
+    taichi.llvm.c_runtime_init(thread_number, int(placement))
+    taichi.llvm.c_runtime_set_spin(max(int(spin_microseconds), 0) * 1000)
+    _async_mode = async_mode
+
+    # None 表示使用默认的位置，空字符串表示不保存
+    if schedule_cache is None:
+        schedule_cache = _default_schedule_cache if schedule == schedules.auto else ""
+    if schedule_cache:
+        try:
+            os.makedirs(os.path.dirname(os.path.abspath(schedule_cache)), exist_ok=True)
+        except OSError:
+            log_warning(f"can not create directory for {schedule_cache}")
+    schedule_cache_b = schedule_cache.encode(encoding="utf-8")
+    taichi.llvm.c_runtime_set_schedule(int(schedule), max(int(chunks_per_thread), 1), BP(schedule_cache_b))
+    if not _inited:
+        # 解释器退出之前要等所有 kernel 结束，否则 worker 会调用已经失效的回调
+        atexit.register(sync)
+    _inited = True
+
+def thread_number() -> int:
+    return taichi.llvm.c_runtime_thread_number()
+
+# autotuner 已经确定的调度
+def get_schedules() -> list:
+    text = taichi.llvm.c_runtime_schedule_report().decode(encoding="utf-8")
+    res = []
+    # sync with cpp（Autotuner::report_text 的格式）
+    for line in text.splitlines():
+        fields = line.split("\t")
+        if len(fields) != 5:
+            continue
+        res.append({
+            "signature": fields[0],
+            "iterations": 1 << int(fields[1]), # 迭代次数的量级
+            "policy": schedules(int(fields[2])),
+            "chunks_per_thread": int(fields[3]),
+            "time": float(fields[4])
+        })
+    return res
+
+# 最近的发射（最多 4096 次）从发射到完成的延迟，单位是微秒
+# reset 为 True 的话之后重新统计，比如跳过预热
+def get_launch_latency(reset: bool = False) -> dict:
+    text = taichi.llvm.c_runtime_latency(1 if reset else 0).decode(encoding="utf-8")
+    # sync with cpp（Runtime::latency_report 的格式）
+    fields = text.split()
+    return {
+        "count": int(fields[0]),
+        "p50": float(fields[1]),
+        "p90": float(fields[2]),
+        "p99": float(fields[3]),
+        "max": float(fields[4])
+    }
+
+# 检测到的拓扑：NUMA 节点的 CPU，以及每个 worker 绑定的 CPU 和节点（没有绑定的话是 -1）
+def get_topology() -> dict:
+    text = taichi.llvm.c_runtime_topology().decode(encoding="utf-8")
+    res = {"nodes": dict(), "workers": []}
+    # sync with cpp（Runtime::topology_report 的格式）
+    for line in text.splitlines():
+        fields = line.split("\t")
+        if len(fields) == 3 and fields[0] == "node":
+            res["nodes"][int(fields[1])] = [int(i) for i in fields[2].split(",") if i]
+        elif len(fields) == 4 and fields[0] == "worker":
+            res["workers"].append({"cpu": int(fields[2]), "node": int(fields[3])})
+    return res
+
+# 开始记录时间线：编译的各个阶段、kernel 从发射到完成、worker 执行的每一段、同步等待
+# 之前记录的事件会被丢弃
+def start_trace():
+    taichi.llvm.c_runtime_trace(1)
+
+# 等待所有 kernel 执行完成，停止记录，返回 Chrome trace 的 JSON
+# 给出 path 的话同时写到这个文件，可以在 Perfetto（ui.perfetto.dev）或者 chrome://tracing 中打开
+def stop_trace(path: str = None) -> str:
+    sync()
+    text = taichi.llvm.c_runtime_trace_export().decode(encoding="utf-8")
+    taichi.llvm.c_runtime_trace(0)
+    if path is not None:
+        with open(path, "w", encoding="utf-8") as f:
+            f.write(text)
+    return text
+
+# kernel 能修改的对象才是依赖追踪的资源：field，以及 Python 的可变容器（比如 list）
+# 数值、字符串、tuple 这样的值 kernel 改不了；小整数还是解释器共享的对象，按 id 追踪会让无关的 kernel 互相等待
+def is_resource(obj) -> bool:
+    return hasattr(obj, "_taichi_resource") or hasattr(type(obj), "__setitem__")
+
+# 资源的 key：field 使用自己的 key，其他资源（Python 的容器）使用 id
+def resource_key(obj) -> int:
+    key = getattr(obj, "_taichi_resource", None)
+    return key if key is not None else id(obj)
+
+# 清理已经完成的发射
+def _release_finished():
+    if not _pending:
+        return
+    oldest = taichi.llvm.c_runtime_oldest_pending()
+    while _pending:
+        launch_id = next(iter(_pending))
+        if launch_id >= oldest:
+            break
+        del _pending[launch_id]
+
+# 提交 runtime 之前暂存的发射（比如等待融合的 kernel）
+# 在新的发射、同步、Python 端访问 field 之前都要先提交，保证发射的顺序
+_flush_hooks = []
+
+def add_flush_hook(hook):
+    _flush_hooks.append(hook)
+
+def flush():
+    for hook in _flush_hooks:
+        hook()
+
+# 发射一个 kernel，立即返回 launch id
+# entry(begin, end, context) 处理迭代空间中的 [begin, end)
+# reads 和 writes 是 kernel 会读写的对象
+# signature 用于调度的自动调优，空字符串表示不调优
+def launch(entry, iterations: int, reads: list, writes: list, context=None, signature: str = "", private: list = (), atomic_entry=None) -> int:
+    flush()
+    return submit(entry, iterations, reads, writes, context, signature, private, atomic_entry)
+
+# 直接提交给 C 端，不处理暂存的发射
+# context 是一个 ctypes 对象，它的地址会传给 entry
+# private: [(field 的指针在 context 中的偏移, field)]，这些 field 使用私有化的 scatter，返回的是合并的发射 id
+# atomic_entry 是不私有化的同一个 kernel（原子累加），私有化的时候必须给出，C 端不能私有化的时候执行它
+def submit(entry, iterations: int, reads: list, writes: list, context=None, signature: str = "", private: list = (), atomic_entry=None) -> int:
+    _release_finished()
+
+    reads = [i for i in reads if is_resource(i)]
+    writes = [i for i in writes if is_resource(i)]
+    c_entry = entry if isinstance(entry, KERNEL_ENTRY) else make_entry(entry)
+    reads_key = (c_int64 * len(reads))(*[resource_key(i) for i in reads])
+    writes_key = (c_int64 * len(writes))(*[resource_key(i) for i in writes])
+    signature_b = signature.encode(encoding="utf-8")
+    private_offsets = (c_uint32 * len(private))(*[i[0] for i in private])
+    private_fields = (c_int64 * len(private))(*[i[1].handle for i in private])
+
+    # Python 端访问 field 之前需要等待这次发射
+    for obj in (*reads, *writes):
+        if hasattr(obj, "_taichi_resource"):
+            obj._dirty = True
+
+    launch_id = taichi.llvm.c_runtime_launch(
+        c_entry,
+        None if context is None else ctypes.addressof(context),
+        iterations,
+        len(reads),
+        reads_key,
+        len(writes),
+        writes_key,
+        BP(signature_b),
+        0 if context is None else ctypes.sizeof(context),
+        len(private),
+        private_offsets,
+        private_fields,
+        atomic_entry
+    )
+    _pending[launch_id] = (c_entry, reads, writes, context, atomic_entry)
+
+    # 同步模式：发射之后直接等待完成
+    # Python 的容器不像 field 那样在访问之前等待 kernel，读写容器的发射也要等待完成再返回
+    if not _async_mode or any(not hasattr(i, "_taichi_resource") for i in (*reads, *writes)):
+        wait(launch_id)
+    return launch_id
+
+# 登记一次由 C 端原语（scan、sort、compact）发起的发射，fields 是它读写的 field
+# 发射完成之前留着这些 field，Python 端访问它们之前要等待这次发射
+def track(launch_id: int, fields: list) -> int:
+    for obj in fields:
+        obj._dirty = True
+    _pending[launch_id] = (None, fields, (), None)
+    if not _async_mode:
+        wait(launch_id)
+    return launch_id
+
+def wait(launch_id: int):
+    taichi.llvm.c_runtime_wait(launch_id)
+    _release_finished()
+
+# 等待所有 kernel 执行完成
+def sync():
+    if not _inited:
+        return
+    flush()
+    taichi.llvm.c_runtime_sync()
+    _pending.clear()
@@ -0,0 +1,349 @@
+# 多进程执行：把 kernel 的迭代空间切分给本机的 N 个 worker 进程
+# 一个进程的线程池受限于所在节点的内存带宽布局，Python 端的调度也只有一个 GIL
+# field 放在 POSIX 共享内存（/dev/shm）中，所有进程映射同一个文件，不需要拷贝数据
+# 每个 worker 进程导入同一个脚本，按同样的源码编译同样的 kernel（没有 AOT 的产物，编译结果由源码决定）
+# 协调者（调用 ti.shard_group 的进程）负责发射、屏障，以及 reduce 的 field 的合并
+# 进程之间的消息通过 Transport 传递，本机使用 multiprocessing 的 Pipe，跨节点的话实现一个基于 socket 的 Transport
+#
+# 和 multiprocessing 一样，worker 会重新导入主模块，脚本中启动的部分需要放在 if __name__ == "__main__" 中
+#
+# if __name__ == "__main__":
+#     ti.init()
+#     x = ti.shared_field(ti.Float64, n)
+#     with ti.shard_group(4) as group:
+#         group.launch(compute, x)
+
+import os
+import sys
+import ctypes
+import atexit
+import weakref
+import itertools
+import importlib
+import traceback
+import multiprocessing
+
+import taichi.core.runtime as _runtime
+from taichi.core.field import Field
+from taichi.core.kernel import kernel, _compile_group, _group_context, _atomic_entry
+from taichi.tool import *
+import taichi.type
+
+try:
+    _page_size = os.sysconf("SC_PAGE_SIZE")
+except (AttributeError, ValueError, OSError):
+    _page_size = 4096
+
+# 每段的迭代数对齐到一页中最小的元素的个数，不同进程写的 field 不会共享页和 cache line
+# （元素更大的 field 每段就是多页）
+def _shard_align(fields) -> int:
+    sizes = [ctypes.sizeof(taichi.type.type_to_ctypes[i.dtype]) for i in fields]
+    return max(1, _page_size // min(sizes)) if sizes else _page_size // 4
+
+# ===== 共享内存中的 field =====
+
+_shared_counter = itertools.count()
+
+def _shared_dir() -> str:
+    return "/dev/shm" if os.path.isdir("/dev/shm") else os.path.join(os.path.sep, "tmp")
+
+# 在共享内存中创建一个 field，内容是 0
+# 协调者的 field 被回收的时候删除文件（已经映射的进程仍然可以访问）
+def shared_field(dtype, shape: int, name: str = None) -> Field:
+    if name is None:
+        name = f"taichi-{os.getpid()}-{next(_shared_counter)}"
+    path = os.path.join(_shared_dir(), name)
+    if os.path.exists(path):
+        os.unlink(path) # 旧的内容不应该被看到
+    field = Field(dtype, shape, path=path, mode="w+")
+    field._shared_path = path
+    weakref.finalize(field, _remove_file, path)
+    return field
+
+def _remove_file(path: str):
+    try:
+        os.unlink(path)
+    except OSError:
+        pass
+
+# 参数在消息中的描述：共享的 field 传路径，数值直接传
+def _describe(value):
+    if isinstance(value, Field):
+        path = getattr(value, "_shared_path", None)
+        if path is None:
+            log_error("only ti.shared_field can be used in sharded kernels")
+            return None
+        return ("field", path, value.dtype, value.size)
+    return ("value", value)
+
+# ===== 进程之间的消息 =====
+
+# 协调者一端的消息传递，rank 是 worker 的编号，消息是可以 pickle 的 tuple
+class Transport:
+    size = 0
+
+    def send(self, rank: int, message):
+        raise NotImplementedError
+
+    def recv(self, rank: int):
+        raise NotImplementedError
+
+    def close(self):
+        pass
+
+# 本机的 worker 进程，使用 spawn 启动（不能 fork，runtime 的线程不会被复制）
+class PipeTransport(Transport):
+    def __init__(self, workers: int, init_options: dict):
+        context = multiprocessing.get_context("spawn")
+        self.size = workers
+        self.connections = []
+        self.processes = []
+        for rank in range(workers):
+            parent, child = context.Pipe()
+            process = context.Process(
+                target=_pipe_worker,
+                args=(child, rank, workers, init_options),
+                daemon=True
+            )
+            process.start()
+            child.close()
+            self.connections.append(parent)
+            self.processes.append(process)
+
+    # worker 已经退出的话，发送的消息丢弃，接收的时候得到 error
+    def send(self, rank: int, message):
+        try:
+            self.connections[rank].send(message)
+        except OSError:
+            pass
+
+    def recv(self, rank: int):
+        try:
+            return self.connections[rank].recv()
+        except (EOFError, OSError):
+            return ("error", rank, "worker exited")
+
+    def close(self):
+        for process in self.processes:
+            process.join(timeout=10)
+            if process.is_alive():
+                process.terminate()
+        for connection in self.connections:
+            connection.close()
+        self.processes = []
+        self.connections = []
+
+# ===== worker 进程 =====
+
+# 把 reduce 的 copy 加到 dst 上，每个 worker 合并自己的那一段
+# 导入 taichi 的时候还不能编译 kernel，第一次使用的时候再编译
+def _merge_add(dst, src):
+    for i in range(len(dst)):
+        dst[i] = dst[i] + src[i]
+
+_merge_kernel = None
+
+def _get_merge_kernel():
+    global _merge_kernel
+    if _merge_kernel is None:
+        _merge_kernel = kernel(_merge_add)
+    return _merge_kernel
+
+def _pipe_worker(connection, rank: int, size: int, init_options: dict):
+    try:
+        _worker_loop(connection.recv, connection.send, rank, size, init_options)
+    except (EOFError, KeyboardInterrupt):
+        pass
+
+def _find_kernel(module: str, qualname: str):
+    target = sys.modules.get(module) or importlib.import_module(module)
+    for name in qualname.split("."):
+        target = getattr(target, name)
+    return target
+
+# 执行 kernel 的迭代 [begin, end)，等待完成
+def _run_range(target, args: list, kwargs: dict, begin: int, end: int):
+    stage, launch_args = target._taichi_prepare(*args, **kwargs)
+    if launch_args is None:
+        return
+    entry, iterations, reads, writes = launch_args
+    end = min(end, iterations)
+    if begin >= end:
+        return
+    native = None
+    if stage is not None:
+        # 迭代 k 的 loop index 是 l + k * s，把起点移到 begin 就只执行这一段
+        l, r, s = stage.loop_range
+        stage.loop_range = (l + begin * s, r, s)
+        native, slots, signature, private = _compile_group([stage])
+    if native is not None:
+        _runtime.launch(
+            native,
+            end - begin,
+            stage.reads,
+            stage.writes,
+            _group_context([stage], slots),
+            signature,
+            [(8 * k, i[1]) for k, i in enumerate(slots) if i[0] in private],
+            _atomic_entry([stage], private)
+        )
+    else:
+        _runtime.launch(lambda b, e, context: entry(begin + b, begin + e, context), end - begin, reads, writes)
+    _runtime.sync()
+
+def _worker_loop(recv, send, rank: int, size: int, init_options: dict):
+    import taichi
+    taichi.init(**init_options)
+    fields = dict() # 路径 -> 映射的 field
+
+    def resolve(description):
+        if description[0] == "value":
+            return description[1]
+        _, path, dtype, length = description
+        if path not in fields:
+            fields[path] = Field(dtype, length, path=path, mode="r+")
+        return fields[path]
+
+    send(("ready", rank))
+    while True:
+        message = recv()
+        try:
+            if message[0] == "stop":
+                break
+            elif message[0] == "launch":
+                _, module, qualname, args, kwargs, begin, end = message
+                target = _find_kernel(module, qualname)
+                _run_range(
+                    target,
+                    [resolve(i) for i in args],
+                    {k: resolve(v) for k, v in kwargs.items()},
+                    begin,
+                    end
+                )
+            elif message[0] == "merge":
+                # [(dst, copies)]：把所有 worker 的拷贝加到 dst 上，这个 worker 负责 [begin, end)
+                _, merges, begin, end = message
+                for dst, copies in merges:
+                    for copy in copies:
+                        _run_range(_get_merge_kernel(), [resolve(dst), resolve(copy)], dict(), begin, end)
+                    for copy in copies:
+                        fields.pop(copy[1], None)
+            send(("done", rank))
+        except Exception:
+            send(("error", rank, traceback.format_exc()))
+    taichi.sync()
+
+# ===== 协调者 =====
+
+# 迭代空间 [0, iterations) 切分为 parts 段，边界对齐到 align
+def _shard_ranges(iterations: int, parts: int, align: int) -> list:
+    units = (iterations + align - 1) // align
+    base, remain = units // parts, units % parts
+    res, begin = [], 0
+    for i in range(parts):
+        end = min(begin + (base + (1 if i < remain else 0)) * align, iterations)
+        res.append((begin, end))
+        begin = end
+    return res
+
+class ShardGroup:
+    def __init__(self, workers: int, transport: Transport = None, **init_options):
+        workers = max(int(workers), 1)
+        init_options.setdefault("thread_number", max((os.cpu_count() or 1) // workers, 1))
+        init_options.setdefault("log_level", log_levels.warning) # worker 只报告问题
+        self.transport = transport if transport is not None else PipeTransport(workers, init_options)
+        self.size = self.transport.size
+        self._outstanding = 0 # 已经发出、还没有回复的消息数（每个 worker）
+        self._reductions = [] # barrier 的时候合并的 [(dst, copies)]
+        self._closed = False
+        self._collect()
+        atexit.register(self.close)
+
+    # 等待每个 worker 回复一次，返回是否都成功
+    def _collect(self) -> bool:
+        ok = True
+        for rank in range(self.size):
+            reply = self.transport.recv(rank)
+            if reply[0] == "error":
+                log_error(f"shard worker {reply[1]} failed{os.linesep}{reply[2]}")
+                ok = False
+        return ok
+
+    # 发射 kernel，迭代空间切分给所有 worker，wait 为 True 的话等待完成（相当于之后调用 barrier）
+    # reduce 中的 field 只通过 ti.atomic_add 累加：每个 worker 累加到自己的一份拷贝上，barrier 的时候再合并
+    # wait 为 False 的时候，不同 worker 的发射之间没有顺序，依赖之前的结果的发射之前要先调用 barrier
+    def launch(self, target, *args, reduce: tuple = (), wait: bool = True, **kwargs) -> bool:
+        if getattr(target, "_taichi_prepare", None) is None:
+            log_error("ShardGroup.launch needs a kernel")
+            return False
+        _runtime.sync() # 协调者中读写这些 field 的 kernel 要先完成
+        _, launch_args = target._taichi_prepare(*args, **kwargs)
+        if launch_args is None:
+            return False
+        iterations = launch_args[1]
+
+        described = [_describe(i) for i in args]
+        described_kwargs = {k: _describe(v) for k, v in kwargs.items()}
+        if any(i is None for i in (*described, *described_kwargs.values())):
+            return False
+
+        # 每个 worker 的 reduce 拷贝，在参数中替换掉原来的 field
+        copies = []
+        for dst in reduce:
+            per_rank = [shared_field(dst.dtype, dst.size) for _ in range(self.size)]
+            copies.append((dst, per_rank))
+            self._reductions.append((dst, per_rank))
+
+        fields = [i for i in (*args, *kwargs.values()) if isinstance(i, Field)]
+        for rank, (begin, end) in enumerate(_shard_ranges(iterations, self.size, _shard_align(fields))):
+            def replace(value, original):
+                for dst, per_rank in copies:
+                    if original is dst:
+                        return _describe(per_rank[rank])
+                return value
+            self.transport.send(rank, (
+                "launch",
+                target.__module__,
+                target.__qualname__,
+                [replace(d, a) for d, a in zip(described, args)],
+                {k: replace(d, kwargs[k]) for k, d in described_kwargs.items()},
+                begin,
+                end
+            ))
+        self._outstanding += 1
+        return self.barrier() if wait else True
+
+    # 等待所有发出的发射完成，然后合并 reduce 的拷贝
+    def barrier(self) -> bool:
+        ok = True
+        while self._outstanding > 0:
+            ok = self._collect() and ok
+            self._outstanding -= 1
+        if self._reductions:
+            reductions, self._reductions = self._reductions, []
+            for dst in {id(d): d for d, _ in reductions}.values():
+                parts = _shard_ranges(dst.size, self.size, _shard_align([dst]))
+                merges = [(_describe(d), [_describe(i) for i in c]) for d, c in reductions if d is dst]
+                for rank, (begin, end) in enumerate(parts):
+                    self.transport.send(rank, ("merge", merges, begin, end))
+                ok = self._collect() and ok
+        return ok
+
+    def close(self):
+        if self._closed:
+            return
+        self._closed = True
+        self.barrier()
+        for rank in range(self.size):
+            self.transport.send(rank, ("stop",))
+        self.transport.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+# worker 进程的数量，以及传给每个 worker 的 ti.init 的参数（默认平分 CPU）
+def shard_group(workers: int = 2, transport: Transport = None, **init_options) -> ShardGroup:
+    return ShardGroup(workers, transport, **init_options)
@@ -0,0 +1,228 @@
+# 流式执行：输入比内存大、或者来自文件 / 回调的时候，按固定大小的块执行同一个 kernel
+# 由 C 端（llvm_stream）调度：worker 计算第 N 块的时候，调用线程写出第 N - 1 块、读入第 N + 1 块
+# kernel 的主循环需要是 range(n)（起点 0，步长 1），每一块执行 [0, 这一块的元素个数)
+#
+# @ti.kernel
+# def convert(src, dst):
+#     for i in range(len(src)):
+#         dst[i] = src[i] * 0.5
+#
+# ti.stream(convert, ti.stream_input(ti.Float32, file="in.bin"), ti.stream_output(ti.Float32, file="out.bin"))
+
+import os
+import ctypes
+from ctypes import CFUNCTYPE, c_int64, c_uint8, c_uint32, c_void_p
+
+import taichi.llvm
+import taichi.type
+import taichi.core.runtime
+from taichi.core.kernel import _compile_group, _group_context
+from taichi.core.field import Field
+from taichi.tool import *
+
+# 数据的来源 / 去处
+# sync with cpp（llvm_taichi::StreamKind）
+_stream_file = 0
+_stream_field = 1
+_stream_call = 2
+
+# sync with cpp（llvm_taichi::StreamCallback）
+STREAM_CALLBACK = CFUNCTYPE(c_int64, c_int64, c_int64, c_void_p)
+
+# kernel 的一个 field 参数，每一块对应输入 / 输出的一段
+class StreamBinding:
+    def __init__(self, output: bool, dtype, file=None, offset: int = 0, field: Field = None, callback=None):
+        self.output = output
+        self.file = file
+        self.offset = int(offset) # 第 0 个元素在文件中的偏移（字节）
+        self.field = field
+        self.callback = callback
+        if field is not None:
+            self.kind = _stream_field
+            self.dtype = field.dtype
+        else:
+            self.kind = _stream_file if file is not None else _stream_call
+            self.dtype = dtype if isinstance(dtype, str) else dtype.__name__
+        self.buffers = [] # 每个槽一个块大小的 field
+
+    # 元素在缓冲区中的大小，StreamField 不需要缓冲区
+    def buffer_bytes(self) -> int:
+        if self.kind == _stream_field:
+            return 0
+        return ctypes.sizeof(taichi.type.type_to_ctypes[self.dtype])
+
+    # 回调的 C 入口：读入的话 callback(begin, count) 返回这一段的值（序列，或者 bytes 这样的原始字节）
+    # 写出的话 callback(begin, values)，values 是这一块的结果
+    def c_callback(self):
+        ctype = taichi.type.type_to_ctypes[self.dtype]
+        bits = self.dtype in taichi.type.bits_types
+        def read(begin, count, data):
+            values = self.callback(begin, count)
+            if isinstance(values, (bytes, bytearray, memoryview)):
+                got = min(len(values) // ctypes.sizeof(ctype), count)
+                ctypes.memmove(data, bytes(values[:got * ctypes.sizeof(ctype)]), got * ctypes.sizeof(ctype))
+                return got
+            got = min(len(values), count)
+            array = (ctype * got).from_address(data)
+            for i in range(got):
+                array[i] = taichi.type.to_storage(values[i], self.dtype)
+            return got
+        def write(begin, count, data):
+            values = (ctype * count).from_address(data)[:]
+            if bits:
+                values = [taichi.type.from_storage(i, self.dtype) for i in values]
+            result = self.callback(begin, values)
+            return -1 if result is False else 0
+        # 回调中的异常没有办法传回 C 端，当作出错处理
+        def guarded(func):
+            def call(begin, count, data):
+                try:
+                    return func(begin, count, data)
+                except Exception as e:
+                    log_error(f"stream callback failed: {e}")
+                    return -1
+            return call
+        return STREAM_CALLBACK(guarded(write if self.output else read))
+
+# 从文件（路径、文件描述符或者文件对象）、field 或者回调读入
+# 文件从 offset 字节开始按顺序读，读到文件结尾的话流结束；field 通常是 ti.mmap_field 映射的文件
+def stream_input(dtype=None, file=None, offset: int = 0, field: Field = None, callback=None) -> StreamBinding:
+    return StreamBinding(False, dtype, file, offset, field, callback)
+
+# 写出到文件、field 或者回调，文件不会被截断
+def stream_output(dtype=None, file=None, offset: int = 0, field: Field = None, callback=None) -> StreamBinding:
+    return StreamBinding(True, dtype, file, offset, field, callback)
+
+# 打开绑定的文件，返回文件描述符以及需要关闭的文件描述符
+def _open_file(binding: StreamBinding):
+    if isinstance(binding.file, int):
+        return binding.file, None
+    if hasattr(binding.file, "fileno"):
+        binding.file.flush()
+        return binding.file.fileno(), None
+    flags = os.O_WRONLY | os.O_CREAT if binding.output else os.O_RDONLY
+    fd = os.open(binding.file, flags, 0o644)
+    return fd, fd
+
+# 按块执行 kernel，参数中的 StreamBinding 每一块换成对应的一段，其他参数每一块都一样
+# total 是元素总数，None 的话是 field 的长度，没有 field 的话执行到输入结束
+# chunk 是每块的元素个数，None 的话由 memory_budget（所有缓冲区的字节数上限）决定
+# depth 是缓冲的块数，2 就是双缓冲：一块在计算，另一块在读写
+# 执行完才返回，返回处理的元素个数，出错的话返回 -1
+def stream(kernel, *args, total: int = None, chunk: int = None, depth: int = 2, memory_budget: int = 64 << 20, **kwargs) -> int:
+    prepare = getattr(kernel, "_taichi_prepare", None)
+    analysis = getattr(kernel, "_taichi_analysis", None)
+    if prepare is None:
+        log_error("ti.stream needs a kernel")
+        return -1
+    if analysis.uses_random:
+        # 每一块的 loop index 都从 0 开始，随机数会重复
+        log_error(f"kernel {kernel.__name__} uses ti.random() and can not be streamed")
+        return -1
+    depth = max(int(depth), 1)
+    bindings = [i for i in (*args, *kwargs.values()) if isinstance(i, StreamBinding)]
+    if not bindings:
+        log_error("ti.stream needs at least one stream_input or stream_output")
+        return -1
+
+    if total is None:
+        sizes = [i.field.size for i in bindings if i.kind == _stream_field]
+        total = min(sizes) if sizes else -1
+    if chunk is None:
+        element_bytes = sum(i.buffer_bytes() for i in bindings)
+        chunk = max(int(memory_budget) // max(depth * element_bytes, 1), 1) if element_bytes else 1 << 20
+        if chunk >= 4096:
+            chunk = chunk // 4096 * 4096 # 整页
+    chunk = max(int(chunk), 1)
+    if total >= 0:
+        chunk = max(min(chunk, total), 1)
+
+    for binding in bindings:
+        if binding.kind != _stream_field:
+            binding.buffers = [Field(binding.dtype, chunk) for _ in range(depth)]
+
+    # 第 0 个槽的缓冲区（或者 field 本身）作为参数编译 kernel，之后由 C 端替换指针
+    def placeholder(value):
+        if not isinstance(value, StreamBinding):
+            return value
+        return value.field if value.kind == _stream_field else value.buffers[0]
+    call_args = [placeholder(i) for i in args]
+    call_kwargs = {k: placeholder(v) for k, v in kwargs.items()}
+    stage, launch_args = prepare(*call_args, **call_kwargs)
+    if launch_args is None:
+        return -1
+    if stage is None:
+        log_error(f"kernel {kernel.__name__} can not be compiled to native code and can not be streamed")
+        return -1
+    l, _, s = stage.loop_range
+    if l != 0 or s != 1:
+        log_error(f"the main loop of kernel {kernel.__name__} must be range(n) to be streamed")
+        return -1
+    entry, slots, signature, _ = _compile_group([stage], False)
+    if entry is None:
+        log_error(f"kernel {kernel.__name__} compile failed")
+        return -1
+    context = _group_context([stage], slots)
+
+    # 每个绑定的指针在 context 中的偏移，第 k 个参数的偏移是 8 * k
+    # sync with cpp（llvm_taichi::Function::get_kernel_entry）
+    holders = [placeholder(i) for i in bindings]
+    offsets = []
+    for holder in holders:
+        offsets.append(next(8 * k for k, i in enumerate(slots) if i[1] is holder))
+
+    taichi.core.runtime.flush() # 保证和之前的 kernel 的顺序
+    opened = []
+    try:
+        sources, callbacks = [], []
+        for binding in bindings:
+            callback = None
+            if binding.kind == _stream_file:
+                fd, owned = _open_file(binding)
+                if owned is not None:
+                    opened.append(owned)
+                sources.append(fd)
+            elif binding.kind == _stream_field:
+                sources.append(binding.field.handle)
+            else:
+                callback = binding.c_callback()
+                sources.append(-1)
+            callbacks.append(callback)
+
+        key = taichi.core.runtime.resource_key
+        resource = taichi.core.runtime.is_resource
+        reads = [key(i) for i in stage.reads if resource(i) and not any(i is h for h in holders)]
+        writes = [key(i) for i in stage.writes if resource(i) and not any(i is h for h in holders)]
+        n = len(bindings)
+        signature_b = signature.encode(encoding="utf-8")
+        res = taichi.llvm.c_runtime_stream(
+            entry,
+            ctypes.addressof(context),
+            ctypes.sizeof(context),
+            BP(signature_b),
+            int(total),
+            chunk,
+            depth,
+            n,
+            (c_uint32 * n)(*offsets),
+            (c_uint8 * n)(*[int(i.output) | (i.kind << 1) for i in bindings]),
+            (c_int64 * n)(*sources),
+            (c_int64 * n)(*[i.offset for i in bindings]),
+            (c_void_p * n)(*[None if i is None else ctypes.cast(i, c_void_p).value for i in callbacks]),
+            (c_int64 * (n * depth))(*[
+                i.buffers[d].handle if i.buffers else 0
+                for i in bindings for d in range(depth)
+            ]),
+            len(reads),
+            (c_int64 * len(reads))(*reads),
+            len(writes),
+            (c_int64 * len(writes))(*writes)
+        )
+    finally:
+        for fd in opened:
+            os.close(fd)
+        for binding in bindings:
+            binding.buffers = []
+    if res < 0:
+        log_error(f"ti.stream of kernel {kernel.__name__} failed")
+    return res
@@ -2,16 +2,74 @@
 
 import os
 import ast
+import copy
+import inspect
 import struct
 import taichi.type
 import taichi.llvm
 import taichi.lang.operation
-from ctypes import POINTER, c_uint8, c_int32
+from ctypes import POINTER, c_uint8, c_int32, c_uint32
 from taichi.lang.numba import ReplaceTopRangeToPrange
 from taichi.tool import *
 
 # 本模块的内容用于处理 AST
 
+# 记录 AST 在 Python 源码中的位置，用于生成调试信息（perf、GDB 可以看到 Python 源码的行号）
+# inspect.getsource 得到的源码从第 1 行开始，需要加上函数在文件中的起始行
+def set_source_location(tree: ast.AST, f):
+    try:
+        file_name = inspect.getsourcefile(f)
+        first_line = inspect.getsourcelines(f)[1]
+    except (OSError, TypeError):
+        return
+    ast.increment_lineno(tree, first_line - 1)
+    for node in ast.walk(tree):
+        if hasattr(node, "lineno"):
+            node.taichi_file = file_name
+
+# 新构造的节点使用原来节点的源码位置
+def copy_source_location(new_node, old_node):
+    ast.copy_location(new_node, old_node)
+    if hasattr(old_node, "taichi_file"):
+        new_node.taichi_file = old_node.taichi_file
+    return new_node
+
+# 之后构建的语句对应这个节点所在的行
+# 注意 bytes 要先保存在变量中，BP 不会保留它的引用
+def _debug_location(function: int, node):
+    if hasattr(node, "taichi_file"):
+        file_name_b = node.taichi_file.encode(encoding="utf-8")
+        taichi.llvm.c_debug_location(
+            c_uint32(function),
+            BP(file_name_b),
+            c_uint32(node.lineno)
+        )
+
+def _debug_begin(function: int, func: ast.FunctionDef):
+    if hasattr(func, "taichi_file"):
+        file_name_b = func.taichi_file.encode(encoding="utf-8")
+        taichi.llvm.c_debug_begin(
+            c_uint32(function),
+            BP(file_name_b),
+            c_uint32(func.lineno)
+        )
+
+# 装饰器的 fast_math 参数：fast_math_flags、它的名字（比如 "fast"、"nnan|reassoc"）或者 None（使用 ti.init 的设定）
+# 不认识的名字返回 None
+def fast_math_value(mode) -> int:
+    if mode is None:
+        return int(cfg_get(cfg.fast_math))
+    if isinstance(mode, str):
+        flags = 0
+        for name in mode.replace(",", "|").split("|"):
+            name = name.strip()
+            if name not in fast_math_flags.__members__:
+                log_error(f"unknown fast math flag {name}")
+                return None
+            flags |= fast_math_flags[name]
+        return int(flags)
+    return int(mode) & int(fast_math_flags.fast)
+
 # 遍历所有的函数调用
 # 注意这里的基类是 NodeVisitor 而不是 NodeTransformer
 # 因为我们只需要遍历获得信息 而不用修改原本的内容
@@ -32,13 +90,143 @@ class FunctionCallVisitor(ast.NodeVisitor):
         # 注意要递归调用 遍历子节点
         self.generic_visit(node)
 
-# 一个 kernel 含有一个主要的 loop
-# 传入一个 kernel
-# 将 main-loop 的 body 包装为一个函数返回 用于多线程执行
-def convert_kernel_main_loop_to_func(
-        func: ast.FunctionDef
-    ) -> ast.FunctionDef:
+# 识别原子操作 ti.atomic_<op>(field[index], value)，cas 还有第三个参数 desired（value 是 expected）
+# 返回操作的名字（见 taichi.lang.operation.atomic_operation_id），不是原子操作的话返回 None
+def atomic_call(node):
+    if not isinstance(node, ast.Call) or node.keywords:
+        return None
+    if isinstance(node.func, ast.Name):
+        name = node.func.id
+    elif isinstance(node.func, ast.Attribute):
+        name = node.func.attr
+    else:
+        return None
+    if not name.startswith("atomic_"):
+        return None
+    op = name[len("atomic_"):]
+    if op not in taichi.lang.operation.atomic_operation_id:
+        return None
+    if len(node.args) != (3 if op == "cas" else 2):
+        return None
+    target = node.args[0]
+    if not (isinstance(target, ast.Subscript) and isinstance(target.value, ast.Name)):
+        return None
+    return op
+
+# Python 执行的 kernel 中，原子操作改写为 _taichi_atomic(操作, field, index, 参数...)
+# field[index] 不能直接求值，否则拿到的只是元素的值
+# _taichi_atomic 由 ti.kernel 放进 worker_func 的命名空间
+class AtomicRewriter(ast.NodeTransformer):
+    def visit_Call(self, node):
+        self.generic_visit(node)
+        op = atomic_call(node)
+        if op is None:
+            return node
+        target = node.args[0]
+        return copy_source_location(ast.Call(
+            func=ast.Name(id="_taichi_atomic", ctx=ast.Load()),
+            args=[ast.Constant(value=op), target.value, target.slice, *node.args[1:]],
+            keywords=[]
+        ), node)
+
+# 识别 ti.random()，[0, 1) 之间均匀分布的随机数
+def random_call(node) -> bool:
+    return (
+        isinstance(node, ast.Call)
+        and not node.args
+        and not node.keywords
+        and (
+            (isinstance(node.func, ast.Name) and node.func.id == "random")
+            or (isinstance(node.func, ast.Attribute) and node.func.attr == "random")
+        )
+    )
+
+# Python 执行的 kernel 中的 ti.random()
+# 每次迭代开始的时候创建 _taichi_rs = _taichi_random_stream(_taichi_seed, loop index)，ti.random() 改写为 _taichi_rs.next()
+# 和 native 的生成器使用同样的算法、同样的 counter 和 stream，结果一致
+# func 是 convert_kernel_main_loop_to_func 返回的 worker_func，没有使用随机数的话返回 False
+def rewrite_random_calls(func: ast.FunctionDef) -> bool:
+    class _Rewriter(ast.NodeTransformer):
+        used = False
+
+        def visit_Call(self, node):
+            self.generic_visit(node)
+            if not random_call(node):
+                return node
+            self.used = True
+            return copy_source_location(ast.Call(
+                func=ast.Attribute(value=ast.Name(id="_taichi_rs", ctx=ast.Load()), attr="next", ctx=ast.Load()),
+                args=[],
+                keywords=[]
+            ), node)
+
+    loop = func.body[0]
+    rewriter = _Rewriter()
+    loop.body = [rewriter.visit(stmt) for stmt in loop.body]
+    if not rewriter.used:
+        return False
+    loop.body.insert(0, copy_source_location(_assign("_taichi_rs", ast.Call(
+        func=ast.Name(id="_taichi_random_stream", ctx=ast.Load()),
+        args=[ast.Name(id="_taichi_seed", ctx=ast.Load()), ast.Name(id=loop.target.id, ctx=ast.Load())],
+        keywords=[]
+    )), loop))
+    func.args.args.append(ast.arg(arg="_taichi_seed", annotation=None))
+    func.args.defaults.append(ast.Constant(value=0))
+    ast.fix_missing_locations(func)
+    return True
 
+# 统计 kernel 通过下标读写了哪些变量（一般是参数里的数组或 field）
+# 用于在 runtime 中推导 kernel 之间的依赖
+# 不修改参数的内置函数
+_readonly_builtins = {"range", "len", "min", "max", "abs", "int", "float"}
+
+class KernelAccessVisitor(ast.NodeVisitor):
+    def __init__(self, reads: set, writes: set):
+        super().__init__()
+        self.reads = reads
+        self.writes = writes
+
+    def visit_Subscript(self, node):
+        if isinstance(node.value, ast.Name):
+            if isinstance(node.ctx, ast.Store):
+                self.writes.add(node.value.id)
+            else:
+                self.reads.add(node.value.id)
+        self.generic_visit(node)
+
+    # a[i].x = 1 写入了 a 的元素（Subscript 本身是 Load）
+    def visit_Attribute(self, node):
+        if (
+            isinstance(node.ctx, ast.Store)
+            and isinstance(node.value, ast.Subscript)
+            and isinstance(node.value.value, ast.Name)
+        ):
+            self.writes.add(node.value.value.id)
+        self.generic_visit(node)
+
+    # a[i] += 1 既是读也是写
+    def visit_AugAssign(self, node):
+        if isinstance(node.target, ast.Subscript) and isinstance(node.target.value, ast.Name):
+            self.reads.add(node.target.value.id)
+        self.generic_visit(node)
+
+    # 作为参数传给其他函数的变量，不知道会被怎么使用，保守地认为既读又写
+    # 内置函数（比如 range(len(a))）不会修改参数；原子操作的目标既读又写
+    def visit_Call(self, node):
+        if isinstance(node.func, ast.Name) and node.func.id in _readonly_builtins:
+            self.generic_visit(node)
+            return
+        if atomic_call(node) is not None:
+            self.reads.add(node.args[0].value.id)
+            self.writes.add(node.args[0].value.id)
+        for arg in node.args:
+            if isinstance(arg, ast.Name):
+                self.reads.add(arg.id)
+                self.writes.add(arg.id)
+        self.generic_visit(node)
+
+# 找到 kernel 的 main-loop，以及它的循环范围 [l, r, s]
+def find_kernel_main_loop(func: ast.FunctionDef, warn: bool = True):
     main_loop = None
     for stmt in func.body:
         if (
@@ -49,67 +237,100 @@ def convert_kernel_main_loop_to_func(
             and stmt.iter.func.id == "range"
         ):
             main_loop = stmt
-        else:
+        elif warn:
             log_warning(
                 f"illegal code has been ignored of kernel {func.name}{os.linesep}{ast.unparse(stmt)}"
             )
     
     # 没找到 main-loop 就返回
     if main_loop is None:
-        log_warning(f"kernel {func.name} is empty")
-        return None
+        if warn:
+            log_warning(f"kernel {func.name} is empty")
+        return None, None
 
-    # 根据 range 的参数得到循环范围
-    if len(main_loop.iter.args) == 1:
-        loop_range = [
+    loop_range = _range_bounds(main_loop.iter.args)
+    if loop_range is None:
+        if warn:
+            log_error(f"the args of range loop in kernel {func.name} is illegal")
+        return None, None
+
+    return main_loop, loop_range
+
+# 根据 range 的参数得到循环范围 [l, r, s]，参数个数不对的话返回 None
+def _range_bounds(args: list):
+    if len(args) == 1:
+        return [
             ast.Constant(value=0),
-            main_loop.iter.args[0],
+            args[0],
             ast.Constant(value=1)
         ]
-    elif len(main_loop.iter.args) == 2:
-        loop_range = [
-            main_loop.iter.args[0],
-            main_loop.iter.args[1],
+    elif len(args) == 2:
+        return [
+            args[0],
+            args[1],
             ast.Constant(value=1)
         ]
-    elif len(main_loop.iter.args) == 3:
-        loop_range = main_loop.iter.args
-    else:
-        log_error(f"the args of range loop in kernel {func.name} is illegal")
-        return None
+    elif len(args) == 3:
+        return args
+    return None
+
+# 一个 kernel 含有一个主要的 loop
+# 传入一个 kernel
+# 将 main-loop 的 body 包装为一个函数返回 用于多线程执行
+# 同时返回一个计算 main-loop 循环范围的函数，runtime 需要知道迭代次数
+def convert_kernel_main_loop_to_func(
+        func: ast.FunctionDef
+    ) -> (ast.FunctionDef, ast.FunctionDef):
+
+    main_loop, loop_range = find_kernel_main_loop(func)
+    if main_loop is None:
+        return None, None
 
-    # 拓展两个参数，用于指定线程ID
+    # 计算循环范围的函数，参数和 kernel 一致
+    range_func = ast.FunctionDef(
+        name="_taichi_range_func",
+        args=copy.deepcopy(func.args),
+        body=[ast.Return(value=ast.Tuple(
+            elts=copy.deepcopy(loop_range),
+            ctx=ast.Load()
+        ))],
+        decorator_list=[]
+    )
+    ast.fix_missing_locations(range_func)
+
+    # 拓展两个参数，用于指定这个线程负责的迭代区间 [begin, end)
+    # 迭代区间是 [0, 迭代次数)，第 k 次迭代的 loop index 是 l + k * s
     args = func.args
     args.args.extend([
-        ast.arg(arg="_taichi_thread_id", annotation=None),
-        ast.arg(arg="_taichi_thread_cnt", annotation=None)
+        ast.arg(arg="_taichi_begin", annotation=None),
+        ast.arg(arg="_taichi_end", annotation=None)
     ])
     args.defaults.extend([
         ast.Constant(value=0),
-        ast.Constant(value=1)
+        ast.Constant(value=0)
     ])
 
+    # 把迭代区间换算成 loop index 的范围
+    def _iteration_to_index(name: str):
+        return ast.BinOp(
+            left=copy.deepcopy(loop_range[0]),
+            op=ast.Add(),
+            right=ast.BinOp(
+                left=ast.Name(id=name, ctx=ast.Load()),
+                op=ast.Mult(),
+                right=copy.deepcopy(loop_range[2])
+            )
+        )
+
     # 创建一个新的 FOR 循环，作为新函数的 body
     body = [ast.For(
         target=ast.Name(id=main_loop.target.id, ctx=ast.Store()),
         iter=ast.Call(
             func=ast.Name(id="range", ctx=ast.Load()),
             args=[
-                ast.BinOp(
-                    left=loop_range[0],
-                    op=ast.Add(),
-                    right=ast.BinOp(
-                        left=ast.Name(id="_taichi_thread_id", ctx=ast.Load()),
-                        op=ast.Mult(),
-                        right=loop_range[2]
-                    )
-                ),
-                loop_range[1],
-                ast.BinOp(
-                    left=loop_range[2],
-                    op=ast.Mult(),
-                    right=ast.Name(id="_taichi_thread_cnt", ctx=ast.Load())
-                )
+                _iteration_to_index("_taichi_begin"),
+                _iteration_to_index("_taichi_end"),
+                loop_range[2]
             ],
             keywords=[]
         ),
@@ -126,13 +347,146 @@ def convert_kernel_main_loop_to_func(
     )
     ast.fix_missing_locations(result_func)
 
-    return result_func
+    return result_func, range_func
+
+# 循环交换之后，原来的 main-loop 的范围作为这三个参数传入
+interchange_params = ["_taichi_ol", "_taichi_or", "_taichi_os"]
+
+# main-loop 的循环体只有一个 range 循环，并且内层循环的范围不依赖于 main-loop 的 loop index（完美嵌套）的话
+# 返回交换两层循环之后的 kernel（多出 interchange_params 三个参数）以及计算内层循环范围的函数，否则返回 None, None
+# 交换是否合法（迭代之间没有依赖）由调用者根据依赖分析的结果判断
+def interchange_kernel_loops(func: ast.FunctionDef, main_loop: ast.For):
+    if len(main_loop.body) != 1 or not isinstance(main_loop.target, ast.Name):
+        return None, None
+    inner = main_loop.body[0]
+    if not (
+        isinstance(inner, ast.For)
+        and not inner.orelse
+        and isinstance(inner.target, ast.Name)
+        and inner.target.id != main_loop.target.id
+        and isinstance(inner.iter, ast.Call)
+        and isinstance(inner.iter.func, ast.Name)
+        and inner.iter.func.id == "range"
+        and not inner.iter.keywords
+    ):
+        return None, None
+    inner_range = _range_bounds(inner.iter.args)
+    if inner_range is None:
+        return None, None
+    loop_vars = {main_loop.target.id, inner.target.id}
+    for node in ast.walk(ast.Module(body=inner.iter.args, type_ignores=[])):
+        if isinstance(node, ast.Name) and node.id == main_loop.target.id:
+            return None, None
+    # 循环体中给 loop index 赋值的话，交换之后的行为不同
+    for stmt in inner.body:
+        for node in ast.walk(stmt):
+            if isinstance(node, ast.Name) and isinstance(node.ctx, ast.Store) and node.id in loop_vars:
+                return None, None
+
+    new_inner = copy_source_location(ast.For(
+        target=ast.Name(id=main_loop.target.id, ctx=ast.Store()),
+        iter=ast.Call(
+            func=ast.Name(id="range", ctx=ast.Load()),
+            args=[ast.Name(id=i, ctx=ast.Load()) for i in interchange_params],
+            keywords=[]
+        ),
+        body=copy.deepcopy(inner.body),
+        orelse=[]
+    ), main_loop)
+    new_main = copy_source_location(ast.For(
+        target=ast.Name(id=inner.target.id, ctx=ast.Store()),
+        iter=copy.deepcopy(inner.iter),
+        body=[new_inner],
+        orelse=[]
+    ), inner)
+    args = copy.deepcopy(func.args)
+    args.args.extend([ast.arg(arg=i, annotation=None) for i in interchange_params])
+    new_func = ast.FunctionDef(
+        name=func.name,
+        args=args,
+        body=[new_main],
+        decorator_list=[]
+    )
+    ast.fix_missing_locations(new_func)
+
+    # 参数和 kernel 一致
+    range_func = ast.FunctionDef(
+        name="_taichi_inner_range_func",
+        args=copy.deepcopy(func.args),
+        body=[ast.Return(value=ast.Tuple(
+            elts=copy.deepcopy(inner_range),
+            ctx=ast.Load()
+        ))],
+        decorator_list=[]
+    )
+    ast.fix_missing_locations(range_func)
+    return new_func, range_func
+
+# namespace 中的结构体类型，不是的话返回 None
+def _struct_type(node, namespace: dict):
+    if isinstance(node, ast.Name) and namespace is not None:
+        value = namespace.get(node.id)
+        if isinstance(value, type) and issubclass(value, taichi.type.StructType):
+            return value
+    # 实例化泛型的时候，标注已经是 ti.<结构体的类型名>
+    if isinstance(node, ast.Attribute):
+        return taichi.type.struct_types.get(node.attr)
+    return None
+
+# 结构体类型的标注统一为 ti.<结构体的类型名>，之后和基础类型一样使用 .attr
+def _struct_annotation(annotation, namespace: dict):
+    struct_type = _struct_type(annotation, namespace)
+    if struct_type is None:
+        return None
+    return copy_source_location(ast.Attribute(
+        value=ast.Name(id="ti", ctx=ast.Load()),
+        attr=struct_type.__name__,
+        ctx=ast.Load()
+    ), annotation)
+
+def _is_simple_value(node) -> bool:
+    return isinstance(node, ast.Name) or isinstance(node, ast.Constant)
+
+# 结构体的构造 target = S(...) 拆分为 target = _taichi_struct("S") 以及各个成员的写入，不支持的话返回 None
+def _struct_constructor(stmt: ast.Assign, namespace: dict):
+    struct_type = _struct_type(stmt.value.func, namespace)
+    if struct_type is None:
+        return None
+    members = [i[0] for i in struct_type._taichi_members]
+    values = list(zip(members, stmt.value.args)) + [(i.arg, i.value) for i in stmt.value.keywords]
+    if (
+        len(stmt.value.args) > len(members)
+        or not all(k in members and _is_simple_value(v) for k, v in values)
+    ):
+        return None
+    target_name = stmt.targets[0].id
+    result = [_assign(target_name, ast.Call(
+        func=ast.Name(id=_struct_func, ctx=ast.Load()),
+        args=[ast.Constant(value=struct_type.__name__)],
+        keywords=[]
+    ))]
+    for k, v in values:
+        result.append(ast.Assign(
+            targets=[ast.Attribute(value=ast.Name(id=target_name, ctx=ast.Load()), attr=k, ctx=ast.Store())],
+            value=v
+        ))
+    return [copy_source_location(i, stmt) for i in result]
 
 # 对语句做筛查，只保留支持的语法
-def _body_filter(target: list, source: list, depth: int = 0):
+# namespace 是 func 所在模块的全局变量，用于找到结构体类型
+def _body_filter(target: list, source: list, depth: int = 0, namespace: dict = None):
     for stmt in source:
+        # 写入结构体变量的成员 p.member = value
+        if (
+            isinstance(stmt, ast.Assign)
+            and len(stmt.targets) == 1
+            and isinstance(stmt.targets[0], ast.Attribute)
+            and isinstance(stmt.targets[0].value, ast.Name)
+            and _is_simple_value(stmt.value)
+        ):
+            target.append(stmt)
         # 接受一部分赋值语句
-        if isinstance(stmt, ast.Assign):
+        elif isinstance(stmt, ast.Assign):
             if (
                 len(stmt.targets) != 1
                 or not isinstance(stmt.targets[0], ast.Name)
@@ -145,6 +499,12 @@ def _body_filter(target: list, source: list, depth: int = 0):
                 target.append(stmt)
             if isinstance(stmt.value, ast.Name):
                 target.append(stmt)
+            # 读取结构体变量的成员 target = p.member
+            elif isinstance(stmt.value, ast.Attribute) and isinstance(stmt.value.value, ast.Name):
+                target.append(stmt)
+            # 构造结构体 target = S(member=value, ...)
+            elif isinstance(stmt.value, ast.Call) and _struct_constructor(stmt, namespace) is not None:
+                target.extend(_struct_constructor(stmt, namespace))
             elif (
                 isinstance(stmt.value, ast.BinOp)
                 and (
@@ -179,48 +539,68 @@ def _body_filter(target: list, source: list, depth: int = 0):
             ):
                 for_body = []
                 # FOR 循环的 body 要递归处理
-                _body_filter(for_body, stmt.body, depth = depth + 1)
-                target.append(ast.For(
+                _body_filter(for_body, stmt.body, depth = depth + 1, namespace = namespace)
+                target.append(copy_source_location(ast.For(
                     target=stmt.target,
                     iter=stmt.iter,
                     body=for_body,
                     orelse=[]
-                ))
+                ), stmt))
         # 接受一部分 return 语句
         elif depth == 0 and isinstance(stmt, ast.Return):
             if isinstance(stmt.value, ast.Name):
                 target.append(stmt)
                 break
 
+# 泛型的类型标注：没有标注，或者标注为 ti.template
+def is_generic_annotation(annotation) -> bool:
+    return annotation is None or (
+        isinstance(annotation, ast.Attribute)
+        and annotation.attr == taichi.type.template.__name__
+    )
+
 # 把一个 ti.func 转换为一个「单纯」的计算任务，也就是把不支持的语法都筛掉
+# 泛型的参数和返回值保持为 None，实例化的时候再确定类型（见 specialize_func）
+# 结构体类型的参数和返回值在 namespace 中查找
 def convert_func_to_pure_calc_task(
-    func: ast.FunctionDef
+    func: ast.FunctionDef,
+    namespace: dict = None
 ) -> ast.FunctionDef:
     args = func.args
     args_list = []
     for arg in args.args:
-        if (
+        if is_generic_annotation(arg.annotation):
+            arg.annotation = None
+            args_list.append(arg)
+        elif (
             isinstance(arg.annotation, ast.Attribute)
             and arg.annotation.attr in taichi.type.basic_types # 基础类型的参数我们才要
         ):
             args_list.append(arg)
+        elif _struct_annotation(arg.annotation, namespace) is not None:
+            arg.annotation = _struct_annotation(arg.annotation, namespace)
+            args_list.append(arg)
     args.args = args_list
     args.kw_defaults = []
     args.defaults = []
 
-    # 检查返回值类型，必须是一个基础类型才行
+    # 检查返回值类型，必须是一个基础类型才行，泛型的返回值需要有泛型的参数
     if (
         isinstance(func.returns, ast.Attribute)
         and func.returns.attr in taichi.type.basic_types
     ):
         returns = func.returns
+    elif _struct_annotation(func.returns, namespace) is not None:
+        returns = _struct_annotation(func.returns, namespace)
+    elif is_generic_annotation(func.returns) and any(arg.annotation is None for arg in args_list):
+        returns = None
     else:
-        log_error(f"func {func.name} needs return taichi basic type")
+        log_error(f"func {func.name} needs return taichi basic type or struct type")
         return None
 
     # 对 body 的语句做筛查
     body = []
-    _body_filter(body, func.body)
+    _body_filter(body, func.body, namespace=namespace)
     
     # 返回新函数
     result_func = ast.FunctionDef(
@@ -230,44 +610,96 @@ def convert_func_to_pure_calc_task(
         decorator_list=[],
         returns=returns
     )
+    copy_source_location(result_func, func)
 
     # 自己创建的 AST 一般都需要调用此函数 否则会出错
     ast.fix_missing_locations(result_func)
 
     return result_func
 
-# 获取函数原型，也就是参数列表 和 返回值类型
+# 获取函数原型，也就是参数列表 和 返回值类型，泛型的是 None
 def get_func_prototype(func: ast.FunctionDef):
     args = func.args
     args_type_list = []
     for arg in args.args:
-        args_type_list.append(arg.annotation.attr)
-    return_type = func.returns.attr
+        args_type_list.append(None if arg.annotation is None else arg.annotation.attr)
+    return_type = None if func.returns is None else func.returns.attr
     return args_type_list, return_type
 
+# ===== 泛型的 ti.func =====
+# 泛型的 func 按调用处的参数类型实例化，每种参数类型的组合一个 LLVM 函数
+# 实例注册到 C 端的函数表中，名字是修饰过的签名（见 mangle_func_name），比如 lerp(Float64,Int64)
+# kernel 中调用的时候，参数的类型由 C 端给出（c_value_type），不需要转换参数，也就没有 sext / sitofp
+
+# 泛型 func 的名字 -> instantiate(args_type)，返回实例的函数名，失败的话返回 None
+# 由 ti.func 注册，构建调用语句的时候使用
+_templates = dict()
+
+def register_template(name: str, instantiate):
+    _templates[name] = instantiate
+
+def unregister_template(name: str):
+    _templates.pop(name, None)
+
+def mangle_func_name(name: str, args_type: list) -> str:
+    return f"{name}({','.join(args_type)})"
+
+# 得到泛型 func 的一个实例：args_type 是所有参数的类型（标注过类型的参数保持标注的类型）
+# 泛型的返回值是泛型参数的类型运算之后的类型
+def specialize_func(func: ast.FunctionDef, args_type: list) -> ast.FunctionDef:
+    def annotation(type_name: str, node):
+        return copy_source_location(ast.Attribute(
+            value=ast.Name(id="ti", ctx=ast.Load()),
+            attr=type_name,
+            ctx=ast.Load()
+        ), node)
+    result = copy.deepcopy(func)
+    generic = []
+    for arg, arg_type in zip(result.args.args, args_type):
+        if arg.annotation is None:
+            generic.append(arg_type)
+        arg.annotation = annotation(arg_type, arg)
+    if result.returns is None:
+        # 泛型的结构体参数的话返回这个结构体，否则是所有参数（包括标注了类型的）的计算类型
+        # 比如 lerp(a, b, t: ti.Float64) 的 a 和 b 是整数的话也返回 Float64
+        structs = [i for i in generic if i in taichi.type.struct_types]
+        if structs:
+            return_type = structs[0]
+        else:
+            return_type = args_type[0]
+            for arg_type in args_type[1:]:
+                return_type = taichi.type.calc_type(return_type, arg_type)
+        result.returns = annotation(return_type, result)
+    result.name = mangle_func_name(func.name, args_type)
+    return result
+
 # 将一个 Value 节点的信息包装为 bytes 方便传递给 C
 # Value 可能是变量，此时字节中包含此变量的 name
 # Value 可能是常量，此时字节中包含的信息是 type 和 value
 # Value 出现在「赋值语句」或者「表达式」中
 def _value_node_to_bytes(node) -> bytes:
     # 序列化一个常量
+    # 整数默认是 Int32（超出 Int32 范围的话是 Int64），浮点数默认是 Float32
+    # 带有 taichi_type 属性的常量使用指定的类型（比如 kernel 中的常量是 64 位的）
     if isinstance(node, ast.Constant):
         source_value = node.value
-        if isinstance(source_value, int):
-            buffer = [
-                int(1).to_bytes(1, byteorder=cfg_get(cfg.bytes_order), signed=False),
-                int(taichi.type.type_id[taichi.type.Int32.__name__]).to_bytes(
-                    1, byteorder=cfg_get(cfg.bytes_order), signed=False
-                ),
-                source_value.to_bytes(4, byteorder=cfg_get(cfg.bytes_order), signed=True)
-            ]
-        elif isinstance(source_value, float):
+        constant_type = getattr(node, "taichi_type", None)
+        if constant_type is None and isinstance(source_value, int):
+            constant_type = (
+                taichi.type.Int32.__name__
+                if -2**31 <= source_value < 2**31
+                else
+                taichi.type.Int64.__name__
+            )
+        elif constant_type is None and isinstance(source_value, float):
+            constant_type = taichi.type.Float32.__name__
+        if constant_type is not None:
             buffer = [
                 int(1).to_bytes(1, byteorder=cfg_get(cfg.bytes_order), signed=False),
-                int(taichi.type.type_id[taichi.type.Float32.__name__]).to_bytes(
+                int(taichi.type.type_id[constant_type]).to_bytes(
                     1, byteorder=cfg_get(cfg.bytes_order), signed=False
                 ),
-                struct.pack(f"{cfg_get(cfg.bytes_order_c)}f", source_value,)
+                taichi.type.to_bytes(source_value, constant_type)
             ]
         else:
             log_error(source_value, "is not a acceptable constant")
@@ -281,11 +713,43 @@ def _value_node_to_bytes(node) -> bytes:
     buffer_b = b"".join(buffer)
     return buffer_b
 
+# 成员访问的 base：结构体变量，或者元素为结构体的 field[index]
+# 返回 (base 的名字, 下标的 bytes)，结构体变量的下标是 None
+def _member_base(node):
+    if isinstance(node, ast.Subscript):
+        return node.value.id.encode(encoding="ascii"), _value_node_to_bytes(node.slice)
+    return node.id.encode(encoding="ascii"), None
+
 # 在 LLVM 端构建函数体的内容
-def _build_body(func_name_b: bytes, body: list):
+def _build_body(function: int, body: list):
     # 遍历 AST 的内容，调用相对应的 C 接口函数，在 C 端创建对应的语句
     for stmt in body:
-        if isinstance(stmt, ast.For):
+        _debug_location(function, stmt)
+        if isinstance(stmt, ast.For) and not all(
+            isinstance(arg, ast.Constant) for arg in stmt.iter.args
+        ):
+            # 循环范围中有变量，每个边界都序列化为 Value
+            loop_index_name_b = stmt.target.id.encode(encoding="ascii")
+            iter_args = stmt.iter.args
+            if len(iter_args) == 1:
+                loop_range = [_typed_constant(0), iter_args[0], _typed_constant(1)]
+            elif len(iter_args) == 2:
+                loop_range = [iter_args[0], iter_args[1], _typed_constant(1)]
+            elif len(iter_args) == 3:
+                loop_range = iter_args
+            loop_range_b = [_value_node_to_bytes(i) for i in loop_range]
+            taichi.llvm.c_loop_begin_value(
+                c_uint32(function),
+                BP(loop_index_name_b),
+                BP(loop_range_b[0]),
+                BP(loop_range_b[1]),
+                BP(loop_range_b[2])
+            )
+            _build_body(function, stmt.body)
+            # 更新 loop index 的指令对应 FOR 所在的行
+            _debug_location(function, stmt)
+            taichi.llvm.c_loop_finish(c_uint32(function))
+        elif isinstance(stmt, ast.For):
             loop_index_name_b = stmt.target.id.encode(encoding="ascii")
             iter_args = stmt.iter.args
             if len(iter_args) == 1:
@@ -296,16 +760,136 @@ def _build_body(func_name_b: bytes, body: list):
                 loop_range = [i.value for i in iter_args]
             # 创建一个 FOR 循环
             taichi.llvm.c_loop_begin(
-                BP(func_name_b),
+                c_uint32(function),
                 BP(loop_index_name_b),
                 c_int32(loop_range[0]),
                 c_int32(loop_range[1]),
                 c_int32(loop_range[2])
             )
             # FOR 循环的 body 要递归处理
-            _build_body(func_name_b, stmt.body)
+            _build_body(function, stmt.body)
+            _debug_location(function, stmt)
             # 循环要显式结束
-            taichi.llvm.c_loop_finish(BP(func_name_b))
+            taichi.llvm.c_loop_finish(c_uint32(function))
+        # 声明结构体变量 target = _taichi_struct("S")，所有成员为 0
+        elif (
+            isinstance(stmt, ast.Assign)
+            and isinstance(stmt.value, ast.Call)
+            and isinstance(stmt.value.func, ast.Name)
+            and stmt.value.func.id == _struct_func
+        ):
+            target_name_b = stmt.targets[0].id.encode(encoding="ascii")
+            taichi.llvm.c_struct_statement(
+                c_uint32(function),
+                BP(target_name_b),
+                c_uint8(taichi.type.type_id[stmt.value.args[0].value])
+            )
+        # 写入成员 p.member = value（或者 field[index].member = value）
+        elif isinstance(stmt, ast.Assign) and isinstance(stmt.targets[0], ast.Attribute):
+            base_name_b, index_b = _member_base(stmt.targets[0].value)
+            member_name_b = stmt.targets[0].attr.encode(encoding="ascii")
+            value_b = _value_node_to_bytes(stmt.value)
+            taichi.llvm.c_member_store_statement(
+                c_uint32(function),
+                BP(base_name_b),
+                BP(index_b) if index_b is not None else None,
+                BP(member_name_b),
+                BP(value_b)
+            )
+        # 读取成员 target = p.member（或者 target = field[index].member）
+        elif isinstance(stmt, ast.Assign) and isinstance(stmt.value, ast.Attribute):
+            target_name_b = stmt.targets[0].id.encode(encoding="ascii")
+            base_name_b, index_b = _member_base(stmt.value.value)
+            member_name_b = stmt.value.attr.encode(encoding="ascii")
+            taichi.llvm.c_member_load_statement(
+                c_uint32(function),
+                BP(target_name_b),
+                BP(base_name_b),
+                BP(index_b) if index_b is not None else None,
+                BP(member_name_b)
+            )
+        # 写入 field 的元素 field[index] = value
+        elif isinstance(stmt, ast.Assign) and isinstance(stmt.targets[0], ast.Subscript):
+            field_name_b = stmt.targets[0].value.id.encode(encoding="ascii")
+            index_b = _value_node_to_bytes(stmt.targets[0].slice)
+            value_b = _value_node_to_bytes(stmt.value)
+            taichi.llvm.c_store_statement(
+                c_uint32(function),
+                BP(field_name_b),
+                BP(index_b),
+                BP(value_b)
+            )
+        # 读取 field 的元素 target = field[index]
+        elif isinstance(stmt, ast.Assign) and isinstance(stmt.value, ast.Subscript):
+            target_name_b = stmt.targets[0].id.encode(encoding="ascii")
+            field_name_b = stmt.value.value.id.encode(encoding="ascii")
+            index_b = _value_node_to_bytes(stmt.value.slice)
+            taichi.llvm.c_load_statement(
+                c_uint32(function),
+                BP(target_name_b),
+                BP(field_name_b),
+                BP(index_b)
+            )
+        # 原子操作 target = _taichi_atomic_<op>(field, index, value[, desired])
+        elif (
+            isinstance(stmt, ast.Assign)
+            and isinstance(stmt.value, ast.Call)
+            and stmt.value.func.id.startswith(_atomic_prefix)
+        ):
+            target_name_b = stmt.targets[0].id.encode(encoding="ascii")
+            field_name_b = stmt.value.args[0].id.encode(encoding="ascii")
+            operation = taichi.lang.operation.atomic_operation_id[stmt.value.func.id[len(_atomic_prefix):]]
+            args_b = [_value_node_to_bytes(arg) for arg in stmt.value.args[1:]]
+            taichi.llvm.c_atomic_statement(
+                c_uint32(function),
+                BP(target_name_b),
+                BP(field_name_b),
+                c_uint8(operation),
+                BP(args_b[0]),
+                BP(args_b[1]),
+                BP(args_b[2]) if len(args_b) > 2 else None
+            )
+        # 随机数 target = _taichi_random(seed, counter, stream)
+        elif (
+            isinstance(stmt, ast.Assign)
+            and isinstance(stmt.value, ast.Call)
+            and stmt.value.func.id == _random_func
+        ):
+            target_name_b = stmt.targets[0].id.encode(encoding="ascii")
+            args_b = [_value_node_to_bytes(arg) for arg in stmt.value.args]
+            taichi.llvm.c_random_statement(
+                c_uint32(function),
+                BP(target_name_b),
+                BP(args_b[0]),
+                BP(args_b[1]),
+                BP(args_b[2])
+            )
+        # 调用另一个编译好的函数 target = callee(args...)
+        elif isinstance(stmt, ast.Assign) and isinstance(stmt.value, ast.Call):
+            target_name_b = stmt.targets[0].id.encode(encoding="ascii")
+            callee_name = stmt.value.func.id
+            # 保留 bytes 的引用，调用结束之前不能被回收
+            args_b = [_value_node_to_bytes(arg) for arg in stmt.value.args]
+            # 泛型的 func 按参数现在的类型实例化（可能在这里构建一个新的函数）
+            if callee_name in _templates:
+                args_type = [
+                    taichi.type.type_name.get(taichi.llvm.c_value_type(c_uint32(function), BP(i)))
+                    for i in args_b
+                ]
+                instance = None if None in args_type else _templates[callee_name](args_type)
+                if instance is None:
+                    log_error(f"can not instantiate func {callee_name} for arguments {ast.unparse(stmt.value)}")
+                    continue
+                callee_name = instance
+            callee_name_b = callee_name.encode(encoding="ascii")
+            args_buffer = (POINTER(c_uint8) * len(args_b))(*[BP(i) for i in args_b])
+            taichi.llvm.c_call_statement(
+                c_uint32(function),
+                BP(target_name_b),
+                BP(callee_name_b),
+                c_uint8(len(args_b)),
+                args_buffer
+            )
         elif isinstance(stmt, ast.Assign):
             target_name_b = stmt.targets[0].id.encode(encoding="ascii")
             if (
@@ -315,7 +899,7 @@ def _build_body(func_name_b: bytes, body: list):
                 buffer_b = _value_node_to_bytes(stmt.value)
                 # 创建一个赋值语句，右侧是单个项目（常量或变量）
                 taichi.llvm.c_assignment_statement_value(
-                    BP(func_name_b),
+                    c_uint32(function),
                     BP(target_name_b),
                     BP(buffer_b)
                 )
@@ -324,7 +908,7 @@ def _build_body(func_name_b: bytes, body: list):
                 right_b = _value_node_to_bytes(stmt.value.right)
                 # 创建一个赋值语句，右侧是表达式
                 taichi.llvm.c_assignment_statement_operation(
-                    BP(func_name_b),
+                    c_uint32(function),
                     BP(target_name_b),
                     BP(left_b),
                     c_uint8(taichi.lang.operation.ast_operation_id(stmt.value.op)),
@@ -334,12 +918,13 @@ def _build_body(func_name_b: bytes, body: list):
         elif isinstance(stmt, ast.Return):
             return_name_b = stmt.value.id.encode(encoding="ascii")
             taichi.llvm.c_return_statement(
-                BP(func_name_b),
+                c_uint32(function),
                 BP(return_name_b)
             )
 
 # 构造一个 LLVM 函数（使用 C 提供的接口，在 C 端构建）
-def build_llvm_func(func: ast.FunctionDef):
+# fast_math 是 fast_math_flags 的组合
+def build_llvm_func(func: ast.FunctionDef, fast_math: int = 0):
     function_name_b = func.name.encode(encoding="ascii")
 
     args = func.args
@@ -354,18 +939,433 @@ def build_llvm_func(func: ast.FunctionDef):
     args_type_b = b"".join(args_type)
     args_name_b = args_name.encode(encoding="ascii")
     # 函数名，参数列表，返回值，提供这些信息以开始一个函数
-    taichi.llvm.c_function_begin(
+    function = taichi.llvm.c_function_begin(
         BP(function_name_b),
         c_uint8(args_number),
         BP(args_type_b),
         BP(args_name_b),
         c_uint8(taichi.type.type_id[func.returns.attr])
     )
+    if not function: # 函数名已经注册过了
+        return None
+    _debug_begin(function, func)
+    taichi.llvm.c_function_fast_math(c_uint32(function), c_uint32(fast_math))
 
     # 构建函数体是递归进行的
-    _build_body(function_name_b, func.body)
+    _build_body(function, func.body)
 
     # 显式表明结束这个函数，交给 LLVM 编译代码
-    taichi.llvm.c_function_finish(
-        BP(function_name_b)
-    )
\ No newline at end of file
+    # 构建失败的话函数没有被编译，释放它（同时让出函数名）
+    if not taichi.llvm.c_function_finish(c_uint32(function)):
+        taichi.llvm.c_function_release(c_uint32(function))
+        return None
+    return function
+
+# ===== kernel 的 native 编译 =====
+# kernel 的 main-loop 被编译为一个 LLVM 函数，由 runtime 的 worker 线程直接调用，不需要经过 Python
+# void kernel(Int64 _taichi_begin, Int64 _taichi_end, 参数..., Int64 _taichi_l, Int64 _taichi_s)
+# 第 k 次迭代（k 属于 [begin, end)）的 loop index 是 l + k * s
+# 表达式需要先拆分为「三地址」形式的简单语句，才能使用 C 端的接口构建
+
+# void 只用作 kernel 的返回值
+# sync with cpp
+void_type_id = 0
+# field 参数的类型标记
+# sync with cpp（llvm_taichi::FieldArgumentFlag）
+field_argument_flag = 0x80
+# 拆分之后的原子操作写成对 _taichi_atomic_<op> 的调用
+_atomic_prefix = "_taichi_atomic_"
+# ti.random() 在 kernel 分析的时候改写为 _taichi_random(seed 参数)，拆分之后是 _taichi_random(seed, counter, stream)
+# counter 是 main-loop 的 loop index（build_llvm_kernel 中的 _taichi_k，不受循环体中给 loop_var 赋值的影响）
+# stream 是这次迭代中使用同一个 seed 的第几个随机数
+_random_func = "_taichi_random"
+_random_counter = "_taichi_k"
+# func 中结构体的构造拆分为 _taichi_struct("结构体的类型名") 以及各个成员的写入
+_struct_func = "_taichi_struct"
+
+# 构造一个带类型的常量，kernel 中的常量统一使用 64 位
+def _typed_constant(value, constant_type: str = None):
+    node = ast.Constant(value=value)
+    if constant_type is None:
+        constant_type = (
+            taichi.type.Int64.__name__
+            if isinstance(value, int)
+            else
+            taichi.type.Float64.__name__
+        )
+    node.taichi_type = constant_type
+    return node
+
+# 拆分表达式时使用的上下文
+class _FlattenContext:
+    def __init__(self, fields: set, funcs: dict, defined: set, private: dict):
+        self.fields = fields # field 参数的名字
+        self.funcs = funcs # 可以调用的 ti.func：名字 -> 参数个数
+        self.defined = defined # 已经定义过的变量
+        self.private = private # 私有化 scatter 的 field：名字 -> 元素类型
+        self.random_streams = set() # 随机数的 stream 变量，每次迭代开始的时候清零
+        self.temp_count = 0
+
+    # 分配一个临时变量
+    def temp(self) -> str:
+        self.temp_count += 1
+        name = f"_taichi_t{self.temp_count}"
+        self.defined.add(name)
+        return name
+
+def _assign(target: str, value) -> ast.Assign:
+    return ast.Assign(
+        targets=[ast.Name(id=target, ctx=ast.Store())],
+        value=value
+    )
+
+# 成员访问的 base 只能是变量（结构体变量）或者 field[index]，拆分之后下标是简单的值
+def _flatten_member_base(node, out: list, ctx):
+    if isinstance(node, ast.Name) and node.id in ctx.defined and node.id not in ctx.fields:
+        return ast.Name(id=node.id, ctx=ast.Load())
+    if (
+        isinstance(node, ast.Subscript)
+        and isinstance(node.value, ast.Name)
+        and node.value.id in ctx.fields
+    ):
+        index = _flatten_expr(node.slice, out, ctx)
+        if index is None:
+            return None
+        return ast.Subscript(value=ast.Name(id=node.value.id, ctx=ast.Load()), slice=index, ctx=ast.Load())
+    return None
+
+# 把一个表达式拆分为一系列简单语句（追加到 out），返回表示结果的 Name 或 Constant
+# 不支持的表达式返回 None
+def _flatten_expr(node, out: list, ctx: _FlattenContext):
+    if isinstance(node, ast.Constant):
+        if isinstance(node.value, bool) or not isinstance(node.value, (int, float)):
+            return None
+        return _typed_constant(node.value, getattr(node, "taichi_type", None))
+    elif isinstance(node, ast.Name):
+        if node.id in ctx.fields or node.id not in ctx.defined:
+            return None
+        return ast.Name(id=node.id, ctx=ast.Load())
+    elif isinstance(node, ast.UnaryOp) and isinstance(node.op, ast.USub):
+        operand = _flatten_expr(node.operand, out, ctx)
+        if operand is None:
+            return None
+        result = ctx.temp()
+        out.append(_assign(result, ast.BinOp(left=_typed_constant(0), op=ast.Sub(), right=operand)))
+        return ast.Name(id=result, ctx=ast.Load())
+    elif (
+        isinstance(node, ast.BinOp)
+        and isinstance(node.op, (ast.Add, ast.Sub, ast.Mult, ast.Div))
+    ):
+        left = _flatten_expr(node.left, out, ctx)
+        right = _flatten_expr(node.right, out, ctx)
+        if left is None or right is None:
+            return None
+        # Python 的 / 是真除法，先把左侧转换为 Float64，结果就是浮点数
+        if isinstance(node.op, ast.Div):
+            left_float = ctx.temp()
+            out.append(_assign(left_float, _typed_constant(0.0)))
+            out.append(_assign(left_float, left))
+            left = ast.Name(id=left_float, ctx=ast.Load())
+        result = ctx.temp()
+        out.append(_assign(result, ast.BinOp(left=left, op=node.op, right=right)))
+        return ast.Name(id=result, ctx=ast.Load())
+    elif (
+        isinstance(node, ast.Subscript)
+        and isinstance(node.value, ast.Name)
+        and node.value.id in ctx.fields
+    ):
+        index = _flatten_expr(node.slice, out, ctx)
+        if index is None:
+            return None
+        result = ctx.temp()
+        out.append(_assign(result, ast.Subscript(
+            value=ast.Name(id=node.value.id, ctx=ast.Load()),
+            slice=index,
+            ctx=ast.Load()
+        )))
+        return ast.Name(id=result, ctx=ast.Load())
+    elif isinstance(node, ast.Attribute):
+        base = _flatten_member_base(node.value, out, ctx)
+        if base is None:
+            return None
+        result = ctx.temp()
+        out.append(_assign(result, ast.Attribute(value=base, attr=node.attr, ctx=ast.Load())))
+        return ast.Name(id=result, ctx=ast.Load())
+    elif (
+        isinstance(node, ast.Call)
+        and isinstance(node.func, ast.Name)
+        and node.func.id == _random_func
+        and len(node.args) == 1
+        and isinstance(node.args[0], ast.Name)
+        and node.args[0].id in ctx.defined
+    ):
+        seed = node.args[0].id
+        stream = f"_taichi_rn_{seed}"
+        ctx.random_streams.add(stream)
+        result = ctx.temp()
+        out.append(_assign(result, ast.Call(
+            func=ast.Name(id=_random_func, ctx=ast.Load()),
+            args=[
+                ast.Name(id=seed, ctx=ast.Load()),
+                ast.Name(id=_random_counter, ctx=ast.Load()),
+                ast.Name(id=stream, ctx=ast.Load())
+            ],
+            keywords=[]
+        )))
+        out.append(_assign(stream, ast.BinOp(
+            left=ast.Name(id=stream, ctx=ast.Load()),
+            op=ast.Add(),
+            right=_typed_constant(1)
+        )))
+        return ast.Name(id=result, ctx=ast.Load())
+    elif atomic_call(node) is not None and node.args[0].value.id in ctx.fields:
+        target = node.args[0]
+        index = _flatten_expr(target.slice, out, ctx)
+        args = [_flatten_expr(arg, out, ctx) for arg in node.args[1:]]
+        if index is None or any(arg is None for arg in args):
+            return None
+        result = ctx.temp()
+        out.append(_assign(result, ast.Call(
+            func=ast.Name(id=_atomic_prefix + atomic_call(node), ctx=ast.Load()),
+            args=[ast.Name(id=target.value.id, ctx=ast.Load()), index, *args],
+            keywords=[]
+        )))
+        return ast.Name(id=result, ctx=ast.Load())
+    elif (
+        isinstance(node, ast.Call)
+        and isinstance(node.func, ast.Name)
+        and node.func.id in ctx.funcs
+        and not node.keywords
+        and len(node.args) == ctx.funcs[node.func.id]
+    ):
+        args = [_flatten_expr(arg, out, ctx) for arg in node.args]
+        if any(arg is None for arg in args):
+            return None
+        result = ctx.temp()
+        out.append(_assign(result, ast.Call(
+            func=ast.Name(id=node.func.id, ctx=ast.Load()),
+            args=args,
+            keywords=[]
+        )))
+        return ast.Name(id=result, ctx=ast.Load())
+    return None
+
+# 把语句拆分为简单语句，有不支持的语法就返回 None
+def _flatten_body(body: list, ctx: _FlattenContext):
+    result = []
+    for stmt in body:
+        if isinstance(stmt, ast.Pass):
+            continue
+        # 拆分出来的语句都对应原来语句的源码位置
+        start = len(result)
+        source = stmt
+        # a op= b 等价于 a = a op b
+        if isinstance(stmt, ast.AugAssign):
+            load_target = copy.deepcopy(stmt.target)
+            load_target.ctx = ast.Load()
+            stmt = ast.Assign(
+                targets=[stmt.target],
+                value=ast.BinOp(left=load_target, op=stmt.op, right=stmt.value)
+            )
+        if isinstance(stmt, ast.Assign):
+            if len(stmt.targets) != 1:
+                return None
+            target = stmt.targets[0]
+            if isinstance(target, ast.Name) and target.id not in ctx.fields:
+                value = _flatten_expr(stmt.value, result, ctx)
+                if value is None:
+                    return None
+                result.append(_assign(target.id, value))
+                ctx.defined.add(target.id)
+            elif (
+                isinstance(target, ast.Subscript)
+                and isinstance(target.value, ast.Name)
+                and target.value.id in ctx.fields
+            ):
+                value = _flatten_expr(stmt.value, result, ctx)
+                index = _flatten_expr(target.slice, result, ctx)
+                if value is None or index is None:
+                    return None
+                result.append(ast.Assign(
+                    targets=[ast.Subscript(
+                        value=ast.Name(id=target.value.id, ctx=ast.Load()),
+                        slice=index,
+                        ctx=ast.Store()
+                    )],
+                    value=value
+                ))
+            # 写入结构体的成员 p.member = value 或者 field[index].member = value
+            elif isinstance(target, ast.Attribute):
+                value = _flatten_expr(stmt.value, result, ctx)
+                base = _flatten_member_base(target.value, result, ctx)
+                if value is None or base is None:
+                    return None
+                result.append(ast.Assign(
+                    targets=[ast.Attribute(value=base, attr=target.attr, ctx=ast.Store())],
+                    value=value
+                ))
+            else:
+                return None
+        # 不使用返回值的原子操作
+        elif isinstance(stmt, ast.Expr) and atomic_call(stmt.value) is not None:
+            call = stmt.value
+            field_name = call.args[0].value.id
+            if atomic_call(call) == "add" and field_name in ctx.private:
+                # 私有化的 scatter：每个参与者写自己的拷贝，普通的读取、相加、写入就可以
+                index = _flatten_expr(call.args[0].slice, result, ctx)
+                value = _flatten_expr(call.args[1], result, ctx)
+                if index is None or value is None:
+                    return None
+                # 先转换为元素类型，和原子操作的语义一致
+                value_cast = ctx.temp()
+                result.append(_assign(value_cast, _typed_constant(0, ctx.private[field_name])))
+                result.append(_assign(value_cast, value))
+                old_value = ctx.temp()
+                result.append(_assign(old_value, ast.Subscript(
+                    value=ast.Name(id=field_name, ctx=ast.Load()),
+                    slice=index,
+                    ctx=ast.Load()
+                )))
+                new_value = ctx.temp()
+                result.append(_assign(new_value, ast.BinOp(
+                    left=ast.Name(id=old_value, ctx=ast.Load()),
+                    op=ast.Add(),
+                    right=ast.Name(id=value_cast, ctx=ast.Load())
+                )))
+                result.append(ast.Assign(
+                    targets=[ast.Subscript(
+                        value=ast.Name(id=field_name, ctx=ast.Load()),
+                        slice=copy.deepcopy(index),
+                        ctx=ast.Store()
+                    )],
+                    value=ast.Name(id=new_value, ctx=ast.Load())
+                ))
+            elif _flatten_expr(call, result, ctx) is None:
+                return None
+        elif (
+            isinstance(stmt, ast.For)
+            and isinstance(stmt.target, ast.Name)
+            and isinstance(stmt.iter, ast.Call)
+            and isinstance(stmt.iter.func, ast.Name)
+            and stmt.iter.func.id == "range"
+            and 1 <= len(stmt.iter.args) <= 3
+            and not stmt.iter.keywords
+            and not stmt.orelse
+        ):
+            args = [_flatten_expr(arg, result, ctx) for arg in stmt.iter.args]
+            if any(arg is None for arg in args):
+                return None
+            # loop index 只在循环内部可见
+            index_defined = stmt.target.id in ctx.defined
+            ctx.defined.add(stmt.target.id)
+            for_body = _flatten_body(stmt.body, ctx)
+            if for_body is None:
+                return None
+            if not index_defined:
+                ctx.defined.discard(stmt.target.id)
+            result.append(ast.For(
+                target=ast.Name(id=stmt.target.id, ctx=ast.Store()),
+                iter=ast.Call(func=ast.Name(id="range", ctx=ast.Load()), args=args, keywords=[]),
+                body=for_body,
+                orelse=[]
+            ))
+        else:
+            return None
+        for node in result[start:]:
+            copy_source_location(node, source)
+    return result
+
+# 检查并拆分 kernel 的 main-loop body
+# params: [(参数名, 类型名, 是否是 field)]
+# funcs: 可以调用的 ti.func，名字 -> 参数个数
+# private: 私有化 scatter 的 field 参数，名字 -> 元素类型，对它们的 atomic_add 不需要是原子的
+def flatten_kernel_body(params: list, loop_var: str, body: list, funcs: dict, private: dict = None):
+    ctx = _FlattenContext(
+        fields={i[0] for i in params if i[2]},
+        funcs=funcs,
+        defined={i[0] for i in params if not i[2]} | {loop_var},
+        private=private or dict()
+    )
+    result = _flatten_body(body, ctx)
+    if result is None:
+        return None
+    # 每次迭代的随机数 stream 从 0 开始，结果只由 loop index 决定
+    return [_assign(i, _typed_constant(0)) for i in sorted(ctx.random_streams)] + result
+
+# 构造 kernel 的 LLVM 函数，返回 runtime 可以调用的入口地址，失败返回 None
+# source 是 kernel 的 main-loop 节点，用于生成调试信息
+def build_llvm_kernel(name: str, params: list, loop_var: str, body: list, funcs: dict, source=None, private: dict = None, fast_math: int = 0, hints: dict = None):
+    flat_body = flatten_kernel_body(params, loop_var, body, funcs, private)
+    if flat_body is None:
+        return None
+
+    function_name_b = name.encode(encoding="ascii")
+    int64 = taichi.type.Int64.__name__
+    all_params = [
+        ("_taichi_begin", int64, False),
+        ("_taichi_end", int64, False),
+        *params,
+        ("_taichi_l", int64, False),
+        ("_taichi_s", int64, False)
+    ]
+    args_type_b = bytes([
+        taichi.type.type_id[i[1]] | (field_argument_flag if i[2] else 0)
+        for i in all_params
+    ])
+    args_name_b = "".join([i[0] + "," for i in all_params]).encode(encoding="ascii")
+    # 函数的 handle，之后的构建接口都使用它
+    function = taichi.llvm.c_function_begin(
+        BP(function_name_b),
+        c_uint8(len(all_params)),
+        BP(args_type_b),
+        BP(args_name_b),
+        c_uint8(void_type_id)
+    )
+    if not function:
+        return None
+    if source is not None:
+        _debug_begin(function, source)
+    taichi.llvm.c_function_fast_math(c_uint32(function), c_uint32(fast_math))
+    # field 参数的访问提示（参数名 -> (flags, 预取的距离)），序号要算上 _taichi_begin 和 _taichi_end
+    for k, param in enumerate(all_params):
+        if hints and param[0] in hints:
+            flags, distance = hints[param[0]]
+            taichi.llvm.c_function_field_hint(c_uint32(function), c_uint32(k), c_uint32(flags), c_uint32(distance))
+
+    # _taichi_first = _taichi_l + _taichi_begin * _taichi_s
+    # _taichi_last = _taichi_l + _taichi_end * _taichi_s
+    # for _taichi_k in range(_taichi_first, _taichi_last, _taichi_s):
+    #     loop_var = _taichi_k
+    #     body
+    # 直接按 loop index 迭代（而不是迭代次数），field 的下标就是 loop index，中间层的 IR 可以分析出迭代之间没有依赖
+    # loop_var 另外复制一份，和 Python 一样，循环体中给 loop_var 赋值不影响迭代
+    def _name(name: str):
+        return ast.Name(id=name, ctx=ast.Load())
+    def _bound(target: str, iteration: str) -> list:
+        return [
+            _assign(target + "_s", ast.BinOp(left=_name(iteration), op=ast.Mult(), right=_name("_taichi_s"))),
+            _assign(target, ast.BinOp(left=_name("_taichi_l"), op=ast.Add(), right=_name(target + "_s")))
+        ]
+    main_loop = ast.For(
+        target=ast.Name(id="_taichi_k", ctx=ast.Store()),
+        iter=ast.Call(
+            func=ast.Name(id="range", ctx=ast.Load()),
+            args=[_name("_taichi_first"), _name("_taichi_last"), _name("_taichi_s")],
+            keywords=[]
+        ),
+        body=[
+            _assign(loop_var, _name("_taichi_k")),
+            *flat_body
+        ],
+        orelse=[]
+    )
+    main_body = [*_bound("_taichi_first", "_taichi_begin"), *_bound("_taichi_last", "_taichi_end"), main_loop]
+    if source is not None:
+        for node in main_body:
+            copy_source_location(node, source)
+    _build_body(function, main_body)
+
+    if not taichi.llvm.c_function_finish(c_uint32(function)):
+        taichi.llvm.c_function_release(c_uint32(function))
+        return None
+    return taichi.llvm.c_get_kernel_entry(c_uint32(function))
@@ -0,0 +1,249 @@
+# kernel 融合
+# 相邻的、迭代空间相同的 kernel 可以合并为一个循环，数据只需要遍历一次
+# 本模块只处理 AST，发射队列的管理在 taichi.core.kernel
+
+import ast
+import copy
+import itertools
+
+import taichi.lang
+import taichi.type
+
+# 融合之后的 loop index
+fused_loop_var = "_taichi_i"
+
+_kernel_uid = itertools.count()
+
+# 找到只以 param[loop_var] 的形式被访问的参数
+# 这种参数的第 i 个元素只会被第 i 次迭代访问，融合之后依赖关系不变
+class _ElementwiseVisitor(ast.NodeVisitor):
+    def __init__(self, params: list, loop_var: str):
+        super().__init__()
+        self.params = set(params)
+        self.loop_var = loop_var
+        self.illegal = set() # 以其他形式被访问的参数
+        self.loop_var_assigned = False
+
+    def visit_Subscript(self, node):
+        if isinstance(node.value, ast.Name):
+            if not (isinstance(node.slice, ast.Name) and node.slice.id == self.loop_var):
+                self.illegal.add(node.value.id)
+            # 不遍历 node.value，下标形式的访问是合法的
+            self.visit(node.slice)
+            return
+        self.generic_visit(node)
+
+    def visit_Name(self, node):
+        # 下标之外使用了这个参数（比如传给函数、重新赋值）
+        if node.id in self.params:
+            self.illegal.add(node.id)
+        if node.id == self.loop_var and isinstance(node.ctx, ast.Store):
+            self.loop_var_assigned = True
+
+# 找到只通过语句形式的 ti.atomic_add(param[index], value) 访问的参数（只累加，不使用返回值）
+# 这种参数可以使用私有化的 scatter：每个参与者累加到自己的拷贝上，发射之后再合并
+class _ScatterVisitor(ast.NodeVisitor):
+    def __init__(self, params: list):
+        super().__init__()
+        self.params = set(params)
+        self.scattered = set()
+        self.illegal = set() # 以其他形式被访问的参数
+
+    def visit_Expr(self, node):
+        if taichi.lang.atomic_call(node.value) == "add":
+            self.scattered.add(node.value.args[0].value.id)
+            # 不遍历被累加的参数本身
+            self.visit(node.value.args[0].slice)
+            self.visit(node.value.args[1])
+            return
+        self.generic_visit(node)
+
+    def visit_Name(self, node):
+        if node.id in self.params:
+            self.illegal.add(node.id)
+
+# 使用了 ti.random() 的 kernel 有一个额外的参数，值是每次发射的 seed
+random_seed_param = "_taichi_seed"
+
+# ti.random() 改写为 _taichi_random(seed 参数)，融合的时候 seed 参数和其他参数一样被重命名
+class _RandomSeedRewriter(ast.NodeTransformer):
+    def visit_Call(self, node):
+        self.generic_visit(node)
+        if not taichi.lang.random_call(node):
+            return node
+        return taichi.lang.copy_source_location(ast.Call(
+            func=ast.Name(id=taichi.lang._random_func, ctx=ast.Load()),
+            args=[ast.Name(id=random_seed_param, ctx=ast.Load())],
+            keywords=[]
+        ), node)
+
+# 一个 kernel 的静态信息，在 ti.kernel 修饰器中计算一次
+class KernelAnalysis:
+    def __init__(self, func: ast.FunctionDef, main_loop: ast.For):
+        self.uid = next(_kernel_uid)
+        self.name = func.name
+        self.main_loop = main_loop # 用于生成调试信息
+        self.params = [arg.arg for arg in func.args.args]
+        self.loop_var = main_loop.target.id if isinstance(main_loop.target, ast.Name) else None
+        self.body = copy.deepcopy(main_loop.body)
+        self.funcs = dict() # 可以调用的 ti.func：名字 -> 参数个数
+        self.native_name = None # 最近一次编译的 native 函数名
+        self.fast_math = None # 浮点数语义（fast_math_flags 的组合），None 表示使用 ti.init 的设定
+        # 交换两层循环之后的 kernel：交换之前的 KernelAnalysis（编译结果记在它上面）
+        self.interchanged_from = None
+
+        # 使用随机数的话，seed 作为一个标量参数（每次发射由 ti.kernel 给出不同的值）
+        self.uses_random = any(
+            taichi.lang.random_call(node)
+            for stmt in self.body
+            for node in ast.walk(stmt)
+        )
+        if self.uses_random:
+            self.params.append(random_seed_param)
+            self.body = [_RandomSeedRewriter().visit(stmt) for stmt in self.body]
+
+        self.reads, self.writes = set(), set()
+        taichi.lang.KernelAccessVisitor(self.reads, self.writes).visit(main_loop)
+
+        self.elementwise = set()
+        if self.loop_var is not None:
+            visitor = _ElementwiseVisitor(self.params, self.loop_var)
+            for stmt in self.body:
+                visitor.visit(stmt)
+            if not visitor.loop_var_assigned:
+                self.elementwise = set(self.params) - visitor.illegal
+
+        visitor = _ScatterVisitor(self.params)
+        for stmt in self.body:
+            visitor.visit(stmt)
+        self.scatter = (visitor.scattered & set(self.params)) - visitor.illegal
+
+# 重命名融合前 kernel 中的变量
+# 参数改为融合后函数的参数，loop index 统一，局部变量加上前缀以免冲突
+class _Renamer(ast.NodeTransformer):
+    def __init__(self, rename: dict, prefix: str):
+        super().__init__()
+        self.rename = rename
+        self.prefix = prefix
+
+    def visit_Name(self, node):
+        if node.id in self.rename:
+            node.id = self.rename[node.id]
+        else:
+            node.id = self.prefix + node.id
+        return node
+
+    # 被调用的函数名不能改
+    def visit_Call(self, node):
+        node.args = [self.visit(arg) for arg in node.args]
+        return node
+
+# a op= b 改写为 a = a op b，方便后面做转发
+class _AugAssignRewriter(ast.NodeTransformer):
+    def visit_AugAssign(self, node):
+        load_target = copy.deepcopy(node.target)
+        load_target.ctx = ast.Load()
+        return taichi.lang.copy_source_location(ast.Assign(
+            targets=[node.target],
+            value=ast.BinOp(left=load_target, op=node.op, right=node.value)
+        ), node)
+
+def _is_element(node, ctx_type) -> bool:
+    return (
+        isinstance(node, ast.Subscript)
+        and isinstance(node.ctx, ctx_type)
+        and isinstance(node.value, ast.Name)
+        and isinstance(node.slice, ast.Name)
+        and node.slice.id == fused_loop_var
+    )
+
+# 统计哪些 field 可以做「存储到读取的转发」：
+# 所有访问都是 field[i]，并且所有写入都是 main-loop body 顶层的赋值语句（原子操作也是写入）
+def _forwardable_fields(body: list, fields: set) -> set:
+    illegal = set()
+    for stmt in body:
+        top_level_store = (
+            isinstance(stmt, ast.Assign)
+            and len(stmt.targets) == 1
+            and _is_element(stmt.targets[0], ast.Store)
+        )
+        for node in ast.walk(stmt):
+            if taichi.lang.atomic_call(node) is not None:
+                illegal.add(node.args[0].value.id)
+            elif isinstance(node, ast.Subscript) and isinstance(node.value, ast.Name):
+                if not _is_element(node, (ast.Load, ast.Store)):
+                    illegal.add(node.value.id)
+                elif isinstance(node.ctx, ast.Store) and not (
+                    top_level_store and node is stmt.targets[0]
+                ):
+                    illegal.add(node.value.id)
+            elif isinstance(node, ast.Name) and node.id in fields:
+                # 下标之外的使用，比如作为参数传给函数
+                if not any(
+                    isinstance(parent, ast.Subscript) and parent.value is node
+                    for parent in ast.walk(stmt)
+                ):
+                    illegal.add(node.id)
+    return fields - illegal
+
+# 把 field[i] 的读取替换为之前存储的值
+class _ReplaceLoads(ast.NodeTransformer):
+    def __init__(self, forwarded: dict):
+        super().__init__()
+        self.forwarded = forwarded
+
+    def visit_Subscript(self, node):
+        self.generic_visit(node)
+        if _is_element(node, ast.Load) and node.value.id in self.forwarded:
+            return ast.Name(id=self.forwarded[node.value.id], ctx=ast.Load())
+        return node
+
+# 合并多个 kernel 的 main-loop body
+# stages: [(KernelAnalysis, 参数名 -> 融合后的参数名)]
+# field_types: 融合后的 field 参数名 -> 元素类型
+# eliminated: 只在融合的 kernel 之间传递数据的 field，它们的存储会被删除
+# 返回融合后的 body，loop index 是 fused_loop_var
+def fuse_kernel_bodies(stages: list, field_types: dict, eliminated: set) -> list:
+    body = []
+    for k, (analysis, slots) in enumerate(stages):
+        rename = dict(slots)
+        rename[analysis.loop_var] = fused_loop_var
+        renamer = _Renamer(rename, f"_taichi_s{k}_")
+        for stmt in analysis.body:
+            stmt = _AugAssignRewriter().visit(copy.deepcopy(stmt))
+            body.append(renamer.visit(stmt))
+
+    # 同一次迭代中，前面写入 field[i] 的值可以直接给后面使用，不需要再读内存
+    # 存储类型写入的时候会舍入，读出来的不一定是写入的值，不转发
+    forwardable = _forwardable_fields(
+        body,
+        set(name for name, element in field_types.items() if element in taichi.type.basic_types)
+    )
+    forwarded = dict()
+    result = []
+    for stmt in body:
+        stmt = _ReplaceLoads(forwarded).visit(stmt)
+        if (
+            isinstance(stmt, ast.Assign)
+            and len(stmt.targets) == 1
+            and _is_element(stmt.targets[0], ast.Store)
+            and stmt.targets[0].value.id in forwardable
+        ):
+            field_name = stmt.targets[0].value.id
+            value_name = f"_taichi_f{len(result)}"
+            # 先用元素类型声明这个变量，转发的值和从 field 中读出的值类型一致
+            result.append(taichi.lang.copy_source_location(taichi.lang._assign(
+                value_name,
+                taichi.lang._typed_constant(0, field_types[field_name])
+            ), stmt))
+            result.append(taichi.lang.copy_source_location(
+                taichi.lang._assign(value_name, stmt.value),
+                stmt
+            ))
+            if field_name not in eliminated:
+                stmt.value = ast.Name(id=value_name, ctx=ast.Load())
+                result.append(stmt)
+            forwarded[field_name] = value_name
+        else:
+            result.append(stmt)
+    return result
@@ -25,4 +25,13 @@ def ast_operation_id(op) -> int:
     elif isinstance(op, ast.Div):
         return 4
     else:
-        return 0
\ No newline at end of file
+        return 0
+
+# 原子操作，ti.atomic_<name>
+# sync with cpp（llvm_taichi::AtomicOperation）
+atomic_operation_id = {
+    "add": 1,
+    "min": 2,
+    "max": 3,
+    "cas": 4
+}
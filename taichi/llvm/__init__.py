@@ -8,5 +8,13 @@ from taichi.llvm.llvm_importer import *
 def set_lib_log_level(level_id: int):
     c_set_log_level(ctypes.c_uint8(level_id))
 
-def init_lib():
-    c_init_lib()
\ No newline at end of file
+# tier_up_threshold 为 0 表示不使用解释器，函数直接编译
+# retain_ir 为 False 的话代码生成之后不保留 IR 和汇编
+# collect_remarks 为 False 的话不收集优化报告
+def init_lib(profiler_integration: int = 0, tier_up_threshold: int = 0, retain_ir: bool = False, collect_remarks: bool = False):
+    c_init_lib(
+        ctypes.c_uint8(profiler_integration),
+        ctypes.c_uint64(tier_up_threshold),
+        ctypes.c_uint8(1 if retain_ir else 0),
+        ctypes.c_uint8(1 if collect_remarks else 0)
+    )
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "llvm_arena.h"
+
+namespace llvm_taichi
+{
+
+void *Arena::allocate(size_t size, size_t align)
+{
+    size_t padding = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+    if(padding + size > remaining) {
+        // 大的对象单独分配一块，不浪费当前块剩下的空间
+        if(size + align > BlockSize / 4) {
+            blocks.emplace_back(new uint8_t[size + align]);
+            uint8_t *block = blocks.back().get();
+            padding = (align - reinterpret_cast<uintptr_t>(block) % align) % align;
+            used += size;
+            return block + padding;
+        }
+        blocks.emplace_back(new uint8_t[BlockSize]);
+        cursor = blocks.back().get();
+        remaining = BlockSize;
+        padding = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+    }
+    void *res = cursor + padding;
+    cursor += padding + size;
+    remaining -= padding + size;
+    used += size;
+    return res;
+}
+
+void Arena::reset()
+{
+    for(auto it = destructors.rbegin(); it != destructors.rend(); ++it) {
+        it->first(it->second);
+    }
+    destructors.clear();
+    destructors.shrink_to_fit();
+    blocks.clear();
+    cursor = nullptr;
+    remaining = 0;
+    used = 0;
+}
+
+}
@@ -0,0 +1,95 @@
+// 单调（bump）分配器
+// 构建一个函数的时候会产生大量的小对象（IR 的语句、变量的绑定、操作数列表）
+// 逐个 new / delete 的开销比构建本身还大，这些对象的生命周期又完全一致（build_finish 之后就不再需要）
+// 所以全部从 arena 中顺序分配，最后一次性释放
+
+#ifndef LLVM_ARENA_H
+#define LLVM_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace llvm_taichi
+{
+    // 对象的成员都在 arena 中分配的话（比如 ArenaVector），释放的时候不需要调用析构函数
+    // 这样的类型可以特化这个模板，省去登记析构函数的开销
+    template<typename T>
+    struct ArenaTrivial : std::is_trivially_destructible<T> {};
+
+    class Arena {
+    protected:
+        static const size_t BlockSize = 64 * 1024;
+        std::vector< std::unique_ptr<uint8_t[]> > blocks;
+        uint8_t *cursor = nullptr;
+        size_t remaining = 0;
+        size_t used = 0;
+        // 需要析构的对象，reset 的时候按创建的相反顺序析构
+        std::vector< std::pair<void (*)(void *), void *> > destructors;
+
+    public:
+        Arena() = default;
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+        ~Arena() {
+            reset();
+        }
+
+        void *allocate(size_t size, size_t align);
+
+        template<typename T, typename... Args>
+        T *create(Args &&...args) {
+            T *res = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if(!ArenaTrivial<T>::value) {
+                destructors.push_back(std::make_pair(
+                    [](void *object) { static_cast<T *>(object)->~T(); },
+                    static_cast<void *>(res)
+                ));
+            }
+            return res;
+        }
+
+        // 释放所有的内存，之前分配的指针全部失效
+        void reset();
+
+        // 已经分配的字节数（不包括块中没有用到的部分）
+        inline size_t bytes_used() const {
+            return used;
+        }
+    };
+
+    // 让标准容器从 arena 中分配，deallocate 什么也不做（容器扩容时旧的空间在 reset 的时候一起释放）
+    template<typename T>
+    class ArenaAllocator {
+    public:
+        typedef T value_type;
+        Arena *arena;
+
+        explicit ArenaAllocator(Arena &arena) : arena(&arena) {}
+        template<typename U>
+        ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+        inline T *allocate(size_t n) {
+            return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+        }
+        inline void deallocate(T *, size_t) {}
+
+        template<typename U>
+        inline bool operator==(const ArenaAllocator<U> &other) const {
+            return arena == other.arena;
+        }
+        template<typename U>
+        inline bool operator!=(const ArenaAllocator<U> &other) const {
+            return arena != other.arena;
+        }
+    };
+
+    template<typename T>
+    using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+}
+
+#endif
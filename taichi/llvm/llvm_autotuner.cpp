@@ -0,0 +1,225 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unistd.h>
+
+#include "../tool/print.h"
+#include "llvm_autotuner.h"
+
+namespace llvm_taichi
+{
+
+const std::vector<ScheduleChoice> &Autotuner::candidates()
+{
+    // 静态切分放在第一个，负载均衡的 kernel 通常它就是最快的
+    static const std::vector<ScheduleChoice> res = {
+        {SchedulePolicy::Static, 1},
+        {SchedulePolicy::Dynamic, 4},
+        {SchedulePolicy::Dynamic, 16},
+        {SchedulePolicy::Dynamic, 64},
+        {SchedulePolicy::Guided, 64},
+        {SchedulePolicy::Stealing, 8},
+        {SchedulePolicy::Stealing, 32}
+    };
+    return res;
+}
+
+uint32_t Autotuner::iteration_bucket(int64_t iterations)
+{
+    uint32_t bucket = 0;
+    while(iterations > 1) {
+        iterations >>= 1;
+        bucket += 1;
+    }
+    return bucket;
+}
+
+Autotuner::Entry &Autotuner::entry(const std::string &signature, uint32_t bucket)
+{
+    std::string key = signature + "\t" + std::to_string(bucket);
+    auto it = entries.find(key);
+    if(it != entries.end()) {
+        return it->second;
+    }
+    Entry &res = entries[key];
+    res.signature = signature;
+    res.bucket = bucket;
+    res.best.assign(candidates().size(), 0.0);
+    res.samples.assign(candidates().size(), 0);
+    return res;
+}
+
+void Autotuner::load(const std::string &path)
+{
+    cache_path = path;
+    if(cache_path.empty()) {
+        return;
+    }
+    std::ifstream file(cache_path);
+    if(!file) { // 还没有保存过
+        return;
+    }
+    // 每行：signature bucket policy chunks_per_thread time，用 tab 分割
+    // 格式不对的行直接跳过（strtoul 不会抛出异常）
+    std::string line;
+    size_t loaded = 0;
+    while(std::getline(file, line)) {
+        std::vector<std::string> parts;
+        std::stringstream stream(line);
+        std::string part;
+        while(std::getline(stream, part, '\t')) {
+            parts.push_back(part);
+        }
+        if(parts.size() != 5) {
+            continue;
+        }
+        uint32_t policy = (uint32_t)std::strtoul(parts[2].c_str(), nullptr, 10);
+        if(policy >= static_cast<uint32_t>(SchedulePolicy::Auto)) {
+            continue;
+        }
+        Entry &item = entry(parts[0], std::strtoul(parts[1].c_str(), nullptr, 10));
+        item.converged = true;
+        item.choice.policy = static_cast<SchedulePolicy>(policy);
+        item.choice.chunks_per_thread = std::max<uint32_t>((uint32_t)std::strtoul(parts[3].c_str(), nullptr, 10), 1);
+        item.time = std::strtod(parts[4].c_str(), nullptr);
+        loaded += 1;
+    }
+    std::string _m = "loaded " + std::to_string(loaded) + " schedules from " + cache_path;
+    Out::Log(pType::DEBUG, "%s", _m.c_str());
+}
+
+bool Autotuner::take_save(std::string &path, std::string &text)
+{
+    if(!save_pending || cache_path.empty()) {
+        return false;
+    }
+    save_pending = false;
+    path = cache_path;
+    text = report_text();
+    return true;
+}
+
+// 一行选择的 key：signature 和 bucket
+static std::string line_key(const std::string &line)
+{
+    size_t first = line.find('\t');
+    size_t second = first == std::string::npos ? first : line.find('\t', first + 1);
+    return second == std::string::npos ? std::string() : line.substr(0, second);
+}
+
+void Autotuner::save(const std::string &path, const std::string &text)
+{
+    // 同一个进程中的多个 worker 依次保存，后保存的总是包含先保存的选择
+    static std::mutex save_mutex;
+    static std::atomic<uint64_t> save_count{0};
+    std::lock_guard<std::mutex> lock(save_mutex);
+
+    std::unordered_map<std::string, bool> own;
+    std::stringstream own_lines(text);
+    std::string line;
+    while(std::getline(own_lines, line)) {
+        own[line_key(line)] = true;
+    }
+    // 其他进程保存的、这个进程没有的选择保留下来
+    std::string merged = text;
+    std::ifstream old_file(path);
+    while(old_file && std::getline(old_file, line)) {
+        std::string key = line_key(line);
+        if(!key.empty() && !own.count(key)) {
+            merged += line + "\n";
+        }
+    }
+    old_file.close();
+
+    std::string temp_path = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(save_count++);
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        file << merged;
+        file.close();
+        if(!file) {
+            std::remove(temp_path.c_str());
+            std::string _m = "can not write schedules to " + temp_path;
+            Out::Log(pType::WARNING, "%s", _m.c_str());
+            return;
+        }
+    }
+    if(std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        std::string _m = "can not write schedules to " + path;
+        Out::Log(pType::WARNING, "%s", _m.c_str());
+    }
+}
+
+ScheduleChoice Autotuner::choose(const std::string &signature, int64_t iterations, int32_t &candidate)
+{
+    Entry &item = entry(signature, iteration_bucket(iterations));
+    candidate = -1;
+    if(item.converged) {
+        return item.choice;
+    }
+    // 测量次数最少的候选，这样每个候选轮流测量
+    size_t res = 0;
+    for(size_t i = 1; i < item.samples.size(); i += 1) {
+        if(item.samples[i] < item.samples[res]) {
+            res = i;
+        }
+    }
+    candidate = static_cast<int32_t>(res);
+    return candidates()[res];
+}
+
+void Autotuner::report(const std::string &signature, int64_t iterations, int32_t candidate, double seconds)
+{
+    Entry &item = entry(signature, iteration_bucket(iterations));
+    if(item.converged || candidate < 0 || candidate >= static_cast<int32_t>(item.samples.size())) {
+        return;
+    }
+    if(item.samples[candidate] == 0 || seconds < item.best[candidate]) {
+        item.best[candidate] = seconds;
+    }
+    item.samples[candidate] += 1;
+
+    for(auto samples : item.samples) {
+        if(samples < SamplesPerCandidate) {
+            return;
+        }
+    }
+    // 所有候选都测量完了
+    size_t best = 0;
+    for(size_t i = 1; i < item.best.size(); i += 1) {
+        if(item.best[i] < item.best[best]) {
+            best = i;
+        }
+    }
+    item.converged = true;
+    item.choice = candidates()[best];
+    item.time = item.best[best];
+    std::string _m = "schedule of " + item.signature + " (2^" + std::to_string(item.bucket) + " iterations): " +
+        SchedulePolicyStr(item.choice.policy) + " with " + std::to_string(item.choice.chunks_per_thread) +
+        " chunks per thread, " + std::to_string(item.time * 1e3) + " ms (static " +
+        std::to_string(item.best[0] * 1e3) + " ms)";
+    Out::Log(pType::DEBUG, "%s", _m.c_str());
+    save_pending = true;
+}
+
+std::string Autotuner::report_text() const
+{
+    std::string res;
+    for(auto &item : entries) {
+        const Entry &value = item.second;
+        if(!value.converged) {
+            continue;
+        }
+        res += value.signature + "\t";
+        res += std::to_string(value.bucket) + "\t";
+        res += std::to_string(static_cast<uint32_t>(value.choice.policy)) + "\t";
+        res += std::to_string(value.choice.chunks_per_thread) + "\t";
+        res += std::to_string(value.time) + "\n";
+    }
+    return res;
+}
+
+}
@@ -0,0 +1,99 @@
+// kernel 发射的调度策略，以及调度策略的自动调优
+// 迭代的开销随 loop index 变化的 kernel（负载不均衡），静态切分会让一些线程在最后空等
+// autotuner 按「kernel 签名 + 迭代次数的量级」分别测量每个候选的调度，选出最快的，并保存到文件中
+
+#ifndef LLVM_AUTOTUNER_H
+#define LLVM_AUTOTUNER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace llvm_taichi
+{
+    // 调度策略
+    // sync with python（taichi.tool.schedules）
+    enum class SchedulePolicy {
+        Static = 0, // 静态连续切分，每个线程一段
+        Dynamic = 1, // 每次领取固定大小的一块
+        Guided = 2, // 每次领取剩余迭代的一部分，块越来越小，最小是 chunk
+        Stealing = 3, // 先静态切分，自己的做完了就从别的线程的范围末尾偷一半
+        Auto = 4 // 由 autotuner 选择
+    };
+
+    inline const char *SchedulePolicyStr(SchedulePolicy policy) {
+        switch(policy) {
+            case SchedulePolicy::Static: return "static";
+            case SchedulePolicy::Dynamic: return "dynamic";
+            case SchedulePolicy::Guided: return "guided";
+            case SchedulePolicy::Stealing: return "stealing";
+            case SchedulePolicy::Auto: return "auto";
+            default: return "unknown";
+        }
+    }
+
+    // 一次发射的调度：策略，以及块的大小
+    // 块的大小用「每个线程分到几块」表示，换了迭代次数、线程数也可以使用
+    struct ScheduleChoice {
+        SchedulePolicy policy = SchedulePolicy::Static;
+        uint32_t chunks_per_thread = 1;
+    };
+
+    // 块的大小（迭代数），至少是 1
+    inline int64_t schedule_chunk(const ScheduleChoice &choice, int64_t iterations, uint32_t thread_number) {
+        int64_t parts = static_cast<int64_t>(thread_number) * std::max<uint32_t>(choice.chunks_per_thread, 1);
+        return std::max<int64_t>(iterations / std::max<int64_t>(parts, 1), 1);
+    }
+
+    // 调用的时候需要持有 Runtime 的 mutex（选择和报告都在 Runtime 中进行）
+    class Autotuner {
+    protected:
+        // 一个「kernel 签名 + 迭代次数的量级」的调优状态
+        struct Entry {
+            std::string signature;
+            uint32_t bucket = 0;
+            std::vector<double> best; // 每个候选测量到的最短时间
+            std::vector<uint32_t> samples; // 每个候选测量的次数
+            bool converged = false;
+            ScheduleChoice choice;
+            double time = 0.0; // 选出的调度的时间（秒）
+        };
+
+        std::unordered_map<std::string, Entry> entries;
+        std::string cache_path; // 空字符串表示不保存
+        bool save_pending = false; // 有新收敛的选择还没有保存
+
+    protected:
+        // 迭代次数的量级：log2 向下取整，迭代次数相差不到一倍的发射使用同一个选择
+        static uint32_t iteration_bucket(int64_t iterations);
+        Entry &entry(const std::string &signature, uint32_t bucket);
+
+    public:
+        // 每个候选测量的次数，取最短的时间（噪声只会让时间变长）
+        // 一次发射测量一个候选，融合的 kernel 是一次发射（签名是融合组），所以收敛需要融合组的 21 次发射
+        static const uint32_t SamplesPerCandidate = 3;
+        // 所有的候选
+        static const std::vector<ScheduleChoice> &candidates();
+
+        // 读取之前保存的选择
+        void load(const std::string &path);
+
+        // 选择这次发射使用的调度
+        // candidate 是正在测量的候选的下标，已经收敛的话是 -1（不需要报告）
+        ScheduleChoice choose(const std::string &signature, int64_t iterations, int32_t &candidate);
+        // 报告一次发射的时间，所有候选都测量完了就选出最快的，等待保存
+        void report(const std::string &signature, int64_t iterations, int32_t candidate, double seconds);
+        // 有需要保存的选择的话，取出文件路径和已经收敛的选择（report_text 的格式），返回 true
+        bool take_save(std::string &path, std::string &text);
+        // 保存到文件，不需要持有 Runtime 的 mutex（写文件的时候不阻塞 worker 和发射）
+        // 和文件中已有的选择合并（多个进程可能共用一个文件），写到临时文件之后再 rename，文件总是完整的
+        static void save(const std::string &path, const std::string &text);
+
+        // 已经收敛的选择，每行一个：signature bucket policy chunks_per_thread time，用 tab 分割
+        std::string report_text() const;
+    };
+}
+
+#endif
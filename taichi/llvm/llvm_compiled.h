@@ -0,0 +1,228 @@
+// 给 C++ 宿主使用的类型化接口（只有头文件）
+// 用法：
+//     llvm_taichi::compiled<int32_t(int32_t, float)> f("name");
+//     if(f) { int32_t r = f(1, 2.0f); }
+// 函数签名只在绑定的时候和 Function 的参数列表、返回值类型比较一次
+// 之后的调用就是直接调用函数指针，和调用普通的 C 函数一样，没有打包也没有内存分配
+// field 参数对应元素的指针（比如 float *，存储类型的元素见 NativeType）
+// 结构体参数和返回值使用内存布局相同的 C++ struct（见 NativeStruct），参数按指针传递，返回值写入调用者的内存
+//
+// 句柄持有函数的引用：函数被删除（ti.remove_func）或者重新定义之后，已经绑定的代码仍然有效
+// 按名字绑定的句柄在函数表变化之后重新按名字查找，重新定义（热重载）之后调用新的版本；
+// 名字已经不存在、或者新的版本签名不一致的话，继续使用原来的函数
+// 一个句柄不要在多个线程中同时调用（重新查找的时候会修改句柄），每个线程使用自己的拷贝
+// 句柄要在 taichi_llvm_unit 释放之前析构（不要作为静态变量）
+
+#ifndef LLVM_COMPILED_H
+#define LLVM_COMPILED_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+#include "llvm_manager.h"
+
+namespace llvm_taichi
+{
+    // 半精度浮点数（Float16、BFloat16）field 元素的位，只能作为 field 参数的元素类型
+    struct float16_bits { uint16_t bits; };
+    struct bfloat16_bits { uint16_t bits; };
+
+    // 结构体：宿主定义内存布局相同的 C++ struct，特化 NativeStruct 给出注册的名字（ti.types.struct 的名字）
+    //     template<> struct llvm_taichi::NativeStruct<Particle> { static constexpr const char *name = "Particle"; };
+    // 绑定的时候检查名字和字节数
+    template<typename T> struct NativeStruct {
+        static constexpr const char *name = nullptr;
+    };
+
+    // C++ 类型和 DataType 是否对应，没有对应的类型不能出现在签名中
+    template<typename T> struct NativeType {
+        static_assert(NativeStruct<T>::name != nullptr, "no DataType for this type, specialize NativeStruct for structs");
+        static bool matches(DataType type) {
+            return is_struct_type(type)
+                && std::strcmp(struct_name(type), NativeStruct<T>::name) == 0
+                && struct_size(type) == sizeof(T);
+        }
+    };
+    template<DataType Type> struct NativeScalar {
+        static bool matches(DataType type) {
+            return type == Type;
+        }
+    };
+    template<> struct NativeType<void> : NativeScalar<DataType::Void> {};
+    template<> struct NativeType<int32_t> : NativeScalar<DataType::Int32> {};
+    template<> struct NativeType<int64_t> : NativeScalar<DataType::Int64> {};
+    template<> struct NativeType<float> : NativeScalar<DataType::Float32> {};
+    template<> struct NativeType<double> : NativeScalar<DataType::Float64> {};
+    template<> struct NativeType<int8_t> : NativeScalar<DataType::Int8> {};
+    template<> struct NativeType<int16_t> : NativeScalar<DataType::Int16> {};
+    template<> struct NativeType<uint8_t> : NativeScalar<DataType::UInt8> {};
+    template<> struct NativeType<uint16_t> : NativeScalar<DataType::UInt16> {};
+    template<> struct NativeType<uint32_t> : NativeScalar<DataType::UInt32> {};
+    template<> struct NativeType<float16_bits> : NativeScalar<DataType::Float16> {};
+    template<> struct NativeType<bfloat16_bits> : NativeScalar<DataType::BFloat16> {};
+
+    // 参数：普通的值、结构体（按指针传递），或者 field（元素的指针）
+    // Raw 是函数指针中这个参数的类型
+    template<typename T, bool = std::is_class<T>::value> struct NativeArgument {
+        typedef T Raw;
+        static bool matches(const Argument &argument) {
+            return !argument.is_field && NativeType<T>::matches(argument.type);
+        }
+        static inline Raw pass(const T &value) {
+            return value;
+        }
+    };
+    template<typename T> struct NativeArgument<T, true> {
+        typedef const T *Raw;
+        static bool matches(const Argument &argument) {
+            return !argument.is_field && NativeType<T>::matches(argument.type);
+        }
+        static inline Raw pass(const T &value) {
+            return &value;
+        }
+    };
+    template<typename T> struct NativeArgument<T *, false> {
+        typedef T *Raw;
+        static bool matches(const Argument &argument) {
+            return argument.is_field && NativeType<std::remove_cv_t<T>>::matches(argument.type);
+        }
+        static inline Raw pass(T *value) {
+            return value;
+        }
+    };
+
+    template<typename Signature> class compiled;
+
+    template<typename R, typename... Args>
+    class compiled<R(Args...)> {
+    public:
+        // 返回结构体的函数把结果写入第一个参数指向的内存（sret），函数本身没有返回值
+        static constexpr bool returns_struct = std::is_class<R>::value;
+        typedef typename std::conditional<
+            returns_struct,
+            void (*)(R *, typename NativeArgument<Args>::Raw...),
+            R (*)(typename NativeArgument<Args>::Raw...)
+        >::type Pointer;
+
+    protected:
+        mutable Pointer pointer = nullptr;
+        mutable std::shared_ptr<Function> function;
+        // 按名字绑定的话是函数名，以及绑定时函数表的 generation
+        std::string name;
+        mutable uint64_t generation = 0;
+
+        // 检查签名，需要持有 llvm_mutex
+        static bool matches(Function *target) {
+            const std::vector<Argument> &argument_list = target->get_argument_list();
+            if(!NativeType<R>::matches(target->get_return_type()) || argument_list.size() != sizeof...(Args)) {
+                return false;
+            }
+            size_t i = 0;
+            bool matched = true;
+            ((matched = matched && NativeArgument<Args>::matches(argument_list[i++])), ...);
+            return matched;
+        }
+        static Function *lookup(const std::string &function_name) {
+            return taichi_func_table.get(taichi_func_table.find(
+                taichi_symbols.lookup(reinterpret_cast<const uint8_t *>(function_name.c_str()))
+            ));
+        }
+        // 函数表变化之后按名字重新查找，找不到或者签名不一致的话保留原来的函数
+        void refresh() const {
+            if(name.empty() || generation == taichi_func_table.generation()) {
+                return;
+            }
+            std::lock_guard<std::recursive_mutex> lock(llvm_mutex);
+            generation = taichi_func_table.generation();
+            Function *target = lookup(name);
+            if(!target || target == function.get()) {
+                return;
+            }
+            void *address = matches(target) ? target->get_pointer() : nullptr;
+            if(!address) {
+                std::string _m = "function " + name + " was redefined with another signature, keep the old one";
+                Out::Log(pType::WARNING, "%s", _m.c_str());
+                return;
+            }
+            function = target->shared_from_this();
+            pointer = reinterpret_cast<Pointer>(address);
+        }
+
+    public:
+        compiled() = default;
+        explicit compiled(Function *function) {
+            bind(function);
+        }
+        explicit compiled(const char *function_name) {
+            bind(function_name);
+        }
+
+        // 绑定这个函数（之后不会重新查找），签名不一致的话记录错误并返回 false（之后是未绑定的状态）
+        // 需要在 build_finish 之后调用
+        bool bind(Function *target) {
+            std::lock_guard<std::recursive_mutex> lock(llvm_mutex);
+            pointer = nullptr;
+            function.reset();
+            name.clear();
+            if(!target) {
+                return false;
+            }
+            if(!matches(target)) {
+                std::string _m = "signature does not match function " + target->get_name();
+                Out::Log(pType::ERROR, "%s", _m.c_str());
+                return false;
+            }
+            pointer = reinterpret_cast<Pointer>(target->get_pointer());
+            if(pointer) {
+                function = target->shared_from_this();
+            }
+            return pointer != nullptr;
+        }
+        // 按名字绑定，函数重新定义之后自动使用新的版本
+        bool bind(const char *function_name) {
+            std::lock_guard<std::recursive_mutex> lock(llvm_mutex);
+            uint64_t current = taichi_func_table.generation();
+            Function *target = lookup(function_name);
+            if(!target) {
+                std::string _m = "can not find function " + std::string(function_name);
+                Out::Log(pType::ERROR, "%s", _m.c_str());
+            }
+            if(!bind(target)) {
+                return false;
+            }
+            name = function_name;
+            generation = current;
+            return true;
+        }
+
+        explicit operator bool() const {
+            return pointer != nullptr;
+        }
+        inline Pointer get() const {
+            refresh();
+            return pointer;
+        }
+        // 动态调用者使用的打包入口，格式见 PackedEntry
+        inline PackedEntry thunk() const {
+            refresh();
+            return function ? function->get_thunk() : nullptr;
+        }
+
+        inline R operator()(Args... args) const {
+            refresh();
+            if constexpr(returns_struct) {
+                R result;
+                pointer(&result, NativeArgument<Args>::pass(args)...);
+                return result;
+            } else {
+                return pointer(NativeArgument<Args>::pass(args)...);
+            }
+        }
+    };
+}
+
+#endif
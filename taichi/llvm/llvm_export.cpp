@@ -1,27 +1,73 @@
 #define TOOL_PRINT_H_DATA
 #include "llvm_export.h"
 
-void init_lib() {
-    llvm_taichi::init();
+void init_lib(uint8_t profiler_integration, uint64_t tier_up_threshold, uint8_t retain_ir, uint8_t collect_remarks) {
+    llvm_taichi::init(profiler_integration, tier_up_threshold, retain_ir != 0, collect_remarks != 0);
 }
 
 extern "C" void set_log_level(uint8_t level) {
     Out::logLevel = (pType)level;
 }
 
-void function_begin(
+// 构建接口使用 function_begin 返回的 handle 找到函数，不需要再构造字符串查表
+static llvm_taichi::Function *builder_function(uint32_t function) {
+    auto this_func = llvm_taichi::taichi_func_table.get(function);
+    if(!this_func) {
+        std::string _m = "can not find function handle " + std::to_string(function);
+        Out::Log(pType::ERROR, _m.c_str());
+    }
+    return this_func;
+}
+
+// 查询接口仍然使用函数名，没有注册过的名字返回 nullptr
+static llvm_taichi::Function *named_function(uint8_t *function_name) {
+    return llvm_taichi::taichi_func_table.get(
+        llvm_taichi::taichi_func_table.find(llvm_taichi::taichi_symbols.lookup(function_name))
+    );
+}
+
+uint32_t function_begin(
     uint8_t *function_name,
     uint8_t args_number,
     uint8_t *args_type,
     uint8_t *args_name,
     uint8_t return_type
 ) {
+    // 后台编译的线程也在使用 LLVM
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
     // 所有的函数都是注册到 llvm_taichi::taichi_func_table 里面的
     std::string function_name_s = std::string((char *)function_name);
-    if(llvm_taichi::taichi_func_table.count(function_name_s)) {
+    llvm_taichi::Symbol function_symbol = llvm_taichi::taichi_symbols.intern(function_name);
+    if(llvm_taichi::taichi_func_table.find(function_symbol) != llvm_taichi::NoFunction) {
         auto error = "function " + function_name_s + " has been registered";
         Out::Log(pType::ERROR, error.c_str());
-        return;
+        return llvm_taichi::NoFunction;
+    }
+
+    // 存储类型只能是 field 的元素类型
+    bool storage_value = llvm_taichi::is_storage_type((llvm_taichi::DataType)return_type);
+    for(uint8_t i = 0; i < args_number; i += 1) {
+        storage_value = storage_value || (
+            !(args_type[i] & llvm_taichi::FieldArgumentFlag)
+            && llvm_taichi::is_storage_type((llvm_taichi::DataType)args_type[i])
+        );
+    }
+    if(storage_value) {
+        auto error = "function " + function_name_s + " uses a storage type outside fields";
+        Out::Log(pType::ERROR, error.c_str());
+        return llvm_taichi::NoFunction;
+    }
+    // 结构体类型要先注册
+    bool unknown_struct = llvm_taichi::is_struct_type((llvm_taichi::DataType)return_type)
+        && !llvm_taichi::taichi_struct_table.get((llvm_taichi::DataType)return_type);
+    for(uint8_t i = 0; i < args_number; i += 1) {
+        llvm_taichi::DataType type = (llvm_taichi::DataType)(args_type[i] & ~llvm_taichi::FieldArgumentFlag);
+        unknown_struct = unknown_struct || (llvm_taichi::is_struct_type(type) && !llvm_taichi::taichi_struct_table.get(type));
+    }
+    if(unknown_struct) {
+        auto error = "function " + function_name_s + " uses an unregistered struct type";
+        Out::Log(pType::ERROR, error.c_str());
+        return llvm_taichi::NoFunction;
     }
 
     std::string _m = std::string("compiling function ") + function_name_s + ", ";
@@ -49,7 +95,12 @@ void function_begin(
         if(i) {
             _m += ", ";
         }
-        _m += llvm_taichi::DataTypeStr((llvm_taichi::DataType)args_type[i]);
+        _m += llvm_taichi::DataTypeStr(
+            (llvm_taichi::DataType)(args_type[i] & ~llvm_taichi::FieldArgumentFlag)
+        );
+        if(args_type[i] & llvm_taichi::FieldArgumentFlag) {
+            _m += "[]"; // field 参数
+        }
         _m += " " + args_name_v[i];
     }
     _m += std::string(") <=====");
@@ -57,13 +108,14 @@ void function_begin(
 
     // 注册新函数
     auto this_func = std::make_shared<llvm_taichi::Function>();
-    llvm_taichi::taichi_func_table[function_name_s] = this_func;
+    uint32_t handle = llvm_taichi::taichi_func_table.add(function_symbol, this_func);
 
     std::vector<llvm_taichi::Argument> args_v;
     for(uint8_t i = 0; i < args_number; i += 1) {
         args_v.push_back((llvm_taichi::Argument){
-            (llvm_taichi::DataType)args_type[i],
-            args_name_v[i]
+            (llvm_taichi::DataType)(args_type[i] & ~llvm_taichi::FieldArgumentFlag),
+            args_name_v[i],
+            (args_type[i] & llvm_taichi::FieldArgumentFlag) != 0
         });
     }
     
@@ -73,33 +125,98 @@ void function_begin(
         args_v,
         (llvm_taichi::DataType)return_type
     );
+    return handle;
 }
 
-void function_finish(
-    uint8_t *function_name
+uint8_t function_finish(
+    uint32_t function
 ) {
-    std::string function_name_s = std::string((char *)function_name);
-    std::string _m = "function " + function_name_s + " build complated";
-    Out::Log(pType::DEBUG, _m.c_str());
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
+        std::string _m = "function " + this_func->get_name() + " build complated";
+        Out::Log(pType::DEBUG, _m.c_str());
+        return this_func->build_finish() ? 1 : 0; // 结束函数定义
+    }
+    return 0;
+}
+
+void debug_begin(
+    uint32_t function,
+    uint8_t *file_name,
+    uint32_t line
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
+        this_func->debug_begin(std::string((char *)file_name), line);
+    }
+}
+
+void function_fast_math(
+    uint32_t function,
+    uint32_t flags
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
+        this_func->set_fast_math(flags);
+    }
+}
+
+void function_field_hint(
+    uint32_t function,
+    uint32_t argument,
+    uint32_t flags,
+    uint32_t prefetch_distance
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
+        this_func->set_field_hint(argument, flags, prefetch_distance);
+    }
+}
 
-    if(llvm_taichi::taichi_func_table.count(function_name_s)) {
-        auto this_func = llvm_taichi::taichi_func_table[function_name_s];
-        this_func->build_finish(); // 结束函数定义
+void debug_location(
+    uint32_t function,
+    uint8_t *file_name,
+    uint32_t line
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
+        this_func->debug_location(std::string((char *)file_name), line);
     }
 }
 
 extern "C" void loop_begin(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *loop_index_name,
     int32_t l,
     int32_t r,
     int32_t s
 ) {
-    std::string function_name_s = std::string((char *)function_name);
-    if(llvm_taichi::taichi_func_table.count(function_name_s)) {
-        auto this_func = llvm_taichi::taichi_func_table[function_name_s];
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
         this_func->loop_begin( // 开始循环定义
-            std::string((char *)loop_index_name),
+            llvm_taichi::taichi_symbols.intern(loop_index_name),
+            l,
+            r,
+            s
+        );
+    }
+}
+
+void loop_begin_value(
+    uint32_t function,
+    uint8_t *loop_index_name,
+    uint8_t *l_buffer,
+    uint8_t *r_buffer,
+    uint8_t *s_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
+        llvm_taichi::OperationValue l, r, s;
+        l.from_buffer(l_buffer);
+        r.from_buffer(r_buffer);
+        s.from_buffer(s_buffer);
+        this_func->loop_begin( // 开始循环定义
+            llvm_taichi::taichi_symbols.intern(loop_index_name),
             l,
             r,
             s
@@ -108,99 +225,363 @@ extern "C" void loop_begin(
 }
 
 extern "C" void loop_finish(
-    uint8_t *function_name
+    uint32_t function
 ) {
-    std::string function_name_s = std::string((char *)function_name);
-    if(llvm_taichi::taichi_func_table.count(function_name_s)) {
-        auto this_func = llvm_taichi::taichi_func_table[function_name_s];
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
         this_func->loop_finish(); // 结束循环
     }
 }
 
 void assignment_statement_value(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *target_variable_name,
     uint8_t *source_buffer
 ) {
-    std::string function_name_s = std::string((char *)function_name);
-    if(!llvm_taichi::taichi_func_table.count(function_name_s)) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
         return;
     }
 
-    auto this_func = llvm_taichi::taichi_func_table[function_name_s];
-
     llvm_taichi::OperationValue value;
     value.from_buffer(source_buffer); // 直接从 buffer 解析得到一个 Value
     // 定义赋值语句
     this_func->assignment_statement(
-        std::string((char *)target_variable_name),
+        llvm_taichi::taichi_symbols.intern(target_variable_name),
         value
     );
 }
 
 void assignment_statement_operation(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *target_variable_name,
     uint8_t *left_buffer,
     uint8_t operation_type,
     uint8_t *right_buffer
 ) {
-    std::string function_name_s = std::string((char *)function_name);
-    if(!llvm_taichi::taichi_func_table.count(function_name_s)) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
         return;
     }
 
-    auto this_func = llvm_taichi::taichi_func_table[function_name_s];
-
     llvm_taichi::OperationValue left, right;
     left.from_buffer(left_buffer);
     right.from_buffer(right_buffer);
     // 定义赋值语句
     this_func->assignment_statement(
-        std::string((char *)target_variable_name),
+        llvm_taichi::taichi_symbols.intern(target_variable_name),
         left,
         (llvm_taichi::OperationType)operation_type,
         right
     );
 }
 
+void load_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *field_name,
+    uint8_t *index_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return;
+    }
+
+    llvm_taichi::OperationValue index;
+    index.from_buffer(index_buffer);
+    this_func->load_statement(
+        llvm_taichi::taichi_symbols.intern(target_variable_name),
+        llvm_taichi::taichi_symbols.intern(field_name),
+        index
+    );
+}
+
+void store_statement(
+    uint32_t function,
+    uint8_t *field_name,
+    uint8_t *index_buffer,
+    uint8_t *value_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return;
+    }
+
+    llvm_taichi::OperationValue index, value;
+    index.from_buffer(index_buffer);
+    value.from_buffer(value_buffer);
+    this_func->store_statement(
+        llvm_taichi::taichi_symbols.intern(field_name),
+        index,
+        value
+    );
+}
+
+void atomic_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *field_name,
+    uint8_t operation,
+    uint8_t *index_buffer,
+    uint8_t *value_buffer,
+    uint8_t *desired_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return;
+    }
+
+    llvm_taichi::OperationValue index, value, desired;
+    index.from_buffer(index_buffer);
+    value.from_buffer(value_buffer);
+    if(desired_buffer) {
+        desired.from_buffer(desired_buffer);
+    }
+    this_func->atomic_statement(
+        llvm_taichi::taichi_symbols.intern(target_variable_name),
+        llvm_taichi::taichi_symbols.intern(field_name),
+        (llvm_taichi::AtomicOperation)operation,
+        index,
+        value,
+        desired_buffer ? &desired : nullptr
+    );
+}
+
+void random_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *seed_buffer,
+    uint8_t *counter_buffer,
+    uint8_t *stream_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return;
+    }
+
+    llvm_taichi::OperationValue seed, counter, stream;
+    seed.from_buffer(seed_buffer);
+    counter.from_buffer(counter_buffer);
+    stream.from_buffer(stream_buffer);
+    this_func->random_statement(
+        llvm_taichi::taichi_symbols.intern(target_variable_name),
+        seed,
+        counter,
+        stream
+    );
+}
+
+uint8_t value_type(
+    uint32_t function,
+    uint8_t *value_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return (uint8_t)llvm_taichi::DataType::Void;
+    }
+    llvm_taichi::OperationValue value;
+    value.from_buffer(value_buffer);
+    return (uint8_t)this_func->value_type(value);
+}
+
+uint8_t struct_register(
+    uint8_t *struct_name,
+    uint8_t members_number,
+    uint8_t *members_name,
+    uint8_t *members_type
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    // 成员名和 function_begin 的参数名一样使用逗号分割
+    std::vector<llvm_taichi::Symbol> names;
+    std::string _cache;
+    for(uint8_t *c = members_name; ; c += 1) {
+        if(*c == ',' || *c == 0) {
+            if(_cache.length()) {
+                names.push_back(llvm_taichi::taichi_symbols.intern(_cache));
+                _cache = "";
+            }
+            if(*c == 0) {
+                break;
+            }
+        } else {
+            _cache += reinterpret_cast<char&>(*c);
+        }
+    }
+    std::string name = std::string((char *)struct_name);
+    if(names.size() != members_number) {
+        std::string _m = "struct " + name + " has " + std::to_string(members_number) +
+            " member types but " + std::to_string(names.size()) + " member names";
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return (uint8_t)llvm_taichi::DataType::Void;
+    }
+    std::vector< std::pair<llvm_taichi::Symbol, llvm_taichi::DataType> > members;
+    for(uint8_t i = 0; i < members_number; i += 1) {
+        members.push_back(std::make_pair(names[i], (llvm_taichi::DataType)members_type[i]));
+    }
+    llvm_taichi::DataType type = llvm_taichi::taichi_struct_table.add(name, members);
+    if(type != llvm_taichi::DataType::Void) {
+        std::string _m = "struct " + name + " registered as type " + std::to_string((int)type) +
+            ", " + std::to_string(llvm_taichi::type_size(type)) + " bytes";
+        Out::Log(pType::DEBUG, _m.c_str());
+    }
+    return (uint8_t)type;
+}
+
+void struct_statement(
+    uint32_t function,
+    uint8_t *variable_name,
+    uint8_t type
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
+        this_func->struct_statement(llvm_taichi::taichi_symbols.intern(variable_name), (llvm_taichi::DataType)type);
+    }
+}
+
+void member_load_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *base_name,
+    uint8_t *index_buffer,
+    uint8_t *member_name
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return;
+    }
+
+    llvm_taichi::OperationValue index;
+    if(index_buffer) {
+        index.from_buffer(index_buffer);
+    }
+    this_func->member_load_statement(
+        llvm_taichi::taichi_symbols.intern(target_variable_name),
+        llvm_taichi::taichi_symbols.intern(base_name),
+        index_buffer ? &index : nullptr,
+        llvm_taichi::taichi_symbols.intern(member_name)
+    );
+}
+
+void member_store_statement(
+    uint32_t function,
+    uint8_t *base_name,
+    uint8_t *index_buffer,
+    uint8_t *member_name,
+    uint8_t *value_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return;
+    }
+
+    llvm_taichi::OperationValue index, value;
+    if(index_buffer) {
+        index.from_buffer(index_buffer);
+    }
+    value.from_buffer(value_buffer);
+    this_func->member_store_statement(
+        llvm_taichi::taichi_symbols.intern(base_name),
+        index_buffer ? &index : nullptr,
+        llvm_taichi::taichi_symbols.intern(member_name),
+        value
+    );
+}
+
+void call_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *callee_name,
+    uint8_t args_number,
+    uint8_t **args_buffer
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = builder_function(function);
+    if(!this_func) {
+        return;
+    }
+
+    std::vector<llvm_taichi::OperationValue> args(args_number);
+    for(uint8_t i = 0; i < args_number; i += 1) {
+        args[i].from_buffer(args_buffer[i]);
+    }
+    this_func->call_statement(
+        llvm_taichi::taichi_symbols.intern(target_variable_name),
+        llvm_taichi::taichi_symbols.intern(callee_name),
+        args
+    );
+}
+
 void return_statement(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *return_variable_name
 ) {
-    std::string function_name_s = std::string((char *)function_name);
-    if(llvm_taichi::taichi_func_table.count(function_name_s)) {
-        auto this_func = llvm_taichi::taichi_func_table[function_name_s];
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    if(auto this_func = builder_function(function)) {
         // 定义 return
-        this_func->return_statement(std::string((char *)return_variable_name));
+        this_func->return_statement(llvm_taichi::taichi_symbols.intern(return_variable_name));
     }
 }
 
 void run(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *argument_buffer,
     uint8_t *result_buffer
 ) {
-    std::string function_name_s = std::string((char *)function_name);
-    if(!llvm_taichi::taichi_func_table.count(function_name_s)) {
+    auto this_func = llvm_taichi::taichi_func_table.get(function);
+    if(!this_func) {
         return;
     }
-
-    auto this_func = llvm_taichi::taichi_func_table[function_name_s];
     this_func->run(argument_buffer, result_buffer); // 在 C 端调用函数，实际上这种方式并不可行
 }
 
+uint32_t function_handle(
+    uint8_t *function_name
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    return llvm_taichi::taichi_func_table.find(llvm_taichi::taichi_symbols.lookup(function_name));
+}
+
+void function_remove(
+    uint32_t function
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    llvm_taichi::taichi_func_table.remove(function);
+}
+
+void function_release(
+    uint32_t function
+) {
+    // 调用者（kernel、其他函数）持有被调用者的引用，这里只需要保证没有直接通过 handle 发射的执行
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    llvm_taichi::taichi_func_table.release(function);
+}
+
+const char *jit_memory_report() {
+    static std::string report_text;
+    report_text = llvm_taichi::jit_memory_report();
+    return report_text.c_str();
+}
+
 void *get_func_ptr(
     uint8_t *function_name
 ) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
     std::string function_name_s = std::string((char *)function_name);
 
-    if(llvm_taichi::taichi_func_table.count(function_name_s)) {
-        auto this_func = llvm_taichi::taichi_func_table[function_name_s];
-        auto llvm_func_ptr = this_func->get_raw_ptr();
-        if(llvm_func_ptr) {
-            // 注意要得到原始指针
-            return llvm_taichi::taichi_llvm_unit->engine->getPointerToFunction(llvm_func_ptr);
+    if(auto this_func = named_function(function_name)) {
+        // 注意要得到原始指针（分层执行的函数是 stub 的地址，编译前后不变）
+        void *func_ptr = this_func->get_pointer();
+        if(func_ptr) {
+            return func_ptr;
         }
     }
 
@@ -212,4 +593,345 @@ void *get_func_ptr(
     std::string _m = "can not find address of function " + function_name_s;
     Out::Log(pType::ERROR, _m.c_str());
     return nullptr;
-}
\ No newline at end of file
+}
+
+void *get_function_thunk(
+    uint8_t *function_name
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = named_function(function_name);
+    if(!this_func || !this_func->get_thunk()) {
+        std::string _m = "can not find thunk of function " + std::string((char *)function_name);
+        Out::Log(pType::ERROR, _m.c_str());
+        return nullptr;
+    }
+    return reinterpret_cast<void *>(this_func->get_thunk());
+}
+
+// 找不到函数的时候返回空字符串
+static const char *empty_string = "";
+
+const char *get_function_ir(
+    uint8_t *function_name,
+    uint8_t stage
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = named_function(function_name);
+    if(!this_func) {
+        std::string _m = "can not find function " + std::string((char *)function_name);
+        Out::Log(pType::ERROR, _m.c_str());
+        return empty_string;
+    }
+    if((llvm_taichi::IRStage)stage == llvm_taichi::IRStage::Optimized) {
+        this_func->promote(); // 还在解释执行的函数，先编译
+    }
+    return this_func->get_ir((llvm_taichi::IRStage)stage).c_str();
+}
+
+const char *get_function_asm(
+    uint8_t *function_name
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = named_function(function_name);
+    if(!this_func) {
+        std::string _m = "can not find function " + std::string((char *)function_name);
+        Out::Log(pType::ERROR, _m.c_str());
+        return empty_string;
+    }
+    this_func->promote();
+    return this_func->get_asm().c_str();
+}
+
+const char *get_function_remarks(
+    uint8_t *function_name
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    // 返回的字符串需要在调用结束之后仍然有效
+    static std::string remarks_text;
+
+    auto this_func = named_function(function_name);
+    if(!this_func) {
+        std::string _m = "can not find function " + std::string((char *)function_name);
+        Out::Log(pType::ERROR, _m.c_str());
+        return empty_string;
+    }
+    this_func->promote();
+    remarks_text.clear();
+    for(auto &remark : this_func->get_remarks()) {
+        remarks_text += remark.kind + (char)9;
+        remarks_text += remark.pass + (char)9;
+        remarks_text += remark.name + (char)9;
+        remarks_text += remark.file + (char)9;
+        remarks_text += std::to_string(remark.line) + (char)9;
+        remarks_text += remark.message + (char)10;
+    }
+    return remarks_text.c_str();
+}
+
+const char *get_loop_report(
+    uint8_t *function_name
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    static std::string report_text;
+
+    auto this_func = named_function(function_name);
+    if(!this_func) {
+        std::string _m = "can not find function " + std::string((char *)function_name);
+        Out::Log(pType::ERROR, _m.c_str());
+        return empty_string;
+    }
+    report_text.clear();
+    auto location_text = [&this_func](uint32_t location) {
+        auto &file_line = this_func->get_location(location);
+        return file_line.first + (char)9 + std::to_string(file_line.second);
+    };
+    for(auto &loop : this_func->get_loop_reports()) {
+        report_text += std::string("loop") + (char)9;
+        report_text += std::to_string(loop.depth) + (char)9;
+        report_text += location_text(loop.location) + (char)9;
+        report_text += std::to_string(loop.parallel ? 1 : 0) + (char)9;
+        report_text += std::to_string(loop.independent ? 1 : 0) + (char)10;
+        for(auto &note : loop.dependences) {
+            report_text += std::string("dependence") + (char)9 + location_text(note.second) + (char)9 + note.first + (char)10;
+        }
+        for(auto &note : loop.reductions) {
+            report_text += std::string("reduction") + (char)9 + location_text(note.second) + (char)9 + note.first + (char)10;
+        }
+    }
+    return report_text.c_str();
+}
+
+void *get_kernel_entry(
+    uint32_t function
+) {
+    std::lock_guard<std::recursive_mutex> lock(llvm_taichi::llvm_mutex);
+    auto this_func = llvm_taichi::taichi_func_table.get(function);
+    if(!this_func) {
+        std::string _m = "can not find kernel handle " + std::to_string(function);
+        Out::Log(pType::ERROR, _m.c_str());
+        return nullptr;
+    }
+    return this_func->get_kernel_entry();
+}
+
+void runtime_init(uint32_t thread_number, uint32_t placement) {
+    if(llvm_taichi::taichi_runtime) { // 已经初始化过了
+        return;
+    }
+    llvm_taichi::taichi_runtime = std::make_unique<llvm_taichi::Runtime>(thread_number, placement);
+    std::string _m = "runtime inited with " +
+        std::to_string(llvm_taichi::taichi_runtime->thread_number()) + " threads, placement " +
+        std::to_string(placement);
+    Out::Log(pType::DEBUG, _m.c_str());
+    std::string topology = llvm_taichi::taichi_runtime->topology_report();
+    Out::Log(pType::DEBUG, "topology:\n%s", topology.c_str());
+}
+
+uint32_t runtime_thread_number() {
+    return llvm_taichi::taichi_runtime->thread_number();
+}
+
+int64_t runtime_launch(
+    void *entry,
+    void *context,
+    int64_t iterations,
+    uint32_t reads_number,
+    int64_t *reads,
+    uint32_t writes_number,
+    int64_t *writes,
+    uint8_t *signature,
+    uint32_t context_size,
+    uint32_t private_number,
+    uint32_t *private_offsets,
+    int64_t *private_fields,
+    void *atomic_entry
+) {
+    llvm_taichi::Privatization privatization;
+    if(private_number && private_offsets && private_fields) {
+        privatization.context_size = context_size;
+        privatization.offsets.assign(private_offsets, private_offsets + private_number);
+        privatization.fields.assign(private_fields, private_fields + private_number);
+        privatization.atomic_entry = reinterpret_cast<llvm_taichi::KernelEntry>(atomic_entry);
+    }
+    return llvm_taichi::taichi_runtime->launch(
+        reinterpret_cast<llvm_taichi::KernelEntry>(entry),
+        context,
+        iterations,
+        std::vector<int64_t>(reads, reads + reads_number),
+        std::vector<int64_t>(writes, writes + writes_number),
+        std::string((char *)signature),
+        false,
+        privatization
+    );
+}
+
+void runtime_set_schedule(
+    uint8_t policy,
+    uint32_t chunks_per_thread,
+    uint8_t *cache_path
+) {
+    llvm_taichi::ScheduleChoice choice;
+    choice.policy = (llvm_taichi::SchedulePolicy)policy;
+    choice.chunks_per_thread = std::max<uint32_t>(chunks_per_thread, 1);
+    llvm_taichi::taichi_runtime->set_schedule(choice, std::string((char *)cache_path));
+    std::string _m = std::string("kernel schedule: ") + llvm_taichi::SchedulePolicyStr(choice.policy);
+    Out::Log(pType::DEBUG, _m.c_str());
+}
+
+const char *runtime_schedule_report() {
+    // 返回的字符串需要在调用结束之后仍然有效
+    static std::string report_text;
+    report_text = llvm_taichi::taichi_runtime->schedule_report();
+    return report_text.c_str();
+}
+
+void runtime_set_spin(int64_t spin_nanoseconds) {
+    llvm_taichi::taichi_runtime->set_spin(spin_nanoseconds);
+    std::string _m = "worker spin: " + std::to_string(spin_nanoseconds) + " ns";
+    Out::Log(pType::DEBUG, _m.c_str());
+}
+
+const char *runtime_latency(uint8_t reset) {
+    static std::string latency_text;
+    latency_text = llvm_taichi::taichi_runtime->latency_report(reset != 0);
+    return latency_text.c_str();
+}
+
+const char *runtime_topology() {
+    static std::string topology_text;
+    topology_text = llvm_taichi::taichi_runtime->topology_report();
+    return topology_text.c_str();
+}
+
+void runtime_wait(int64_t launch_id) {
+    llvm_taichi::taichi_runtime->wait(launch_id);
+}
+
+void runtime_wait_resource(int64_t resource) {
+    llvm_taichi::taichi_runtime->wait_resource(resource);
+}
+
+void runtime_sync() {
+    llvm_taichi::taichi_runtime->sync();
+}
+
+int64_t runtime_oldest_pending() {
+    return llvm_taichi::taichi_runtime->oldest_pending();
+}
+
+int64_t primitive_scan(int64_t src, int64_t dst, uint8_t inclusive) {
+    return llvm_taichi::primitive_scan(llvm_taichi::taichi_runtime.get(), src, dst, inclusive != 0);
+}
+
+int64_t primitive_sort(int64_t keys, int64_t values) {
+    return llvm_taichi::primitive_sort(llvm_taichi::taichi_runtime.get(), keys, values);
+}
+
+int64_t primitive_compact(int64_t src, int64_t flags, int64_t dst, int64_t count) {
+    return llvm_taichi::primitive_compact(llvm_taichi::taichi_runtime.get(), src, flags, dst, count);
+}
+
+int64_t runtime_stream(
+    void *entry,
+    void *context,
+    uint32_t context_size,
+    uint8_t *signature,
+    int64_t total,
+    int64_t chunk,
+    uint32_t depth,
+    uint32_t binding_number,
+    uint32_t *offsets,
+    uint8_t *flags,
+    int64_t *sources,
+    int64_t *positions,
+    void **callbacks,
+    int64_t *buffers,
+    uint32_t reads_number,
+    int64_t *reads,
+    uint32_t writes_number,
+    int64_t *writes
+) {
+    llvm_taichi::StreamJob job;
+    job.entry = reinterpret_cast<llvm_taichi::KernelEntry>(entry);
+    job.context = static_cast<const llvm_taichi::Byte *>(context);
+    job.context_size = context_size;
+    job.signature = std::string((char *)signature);
+    job.total = total;
+    job.chunk = chunk;
+    job.depth = depth;
+    for(uint32_t b = 0; b < binding_number; b += 1) {
+        llvm_taichi::StreamBinding binding;
+        binding.offset = offsets[b];
+        binding.output = flags[b] & 1;
+        binding.kind = (llvm_taichi::StreamKind)(flags[b] >> 1);
+        binding.source = sources[b];
+        binding.position = positions[b];
+        binding.callback = reinterpret_cast<llvm_taichi::StreamCallback>(callbacks[b]);
+        if(binding.kind != llvm_taichi::StreamField) {
+            binding.buffers.assign(buffers + b * depth, buffers + (b + 1) * depth);
+        }
+        job.bindings.push_back(binding);
+    }
+    job.reads.assign(reads, reads + reads_number);
+    job.writes.assign(writes, writes + writes_number);
+    return llvm_taichi::stream_run(llvm_taichi::taichi_runtime.get(), job);
+}
+
+void runtime_trace(uint8_t enabled) {
+    if(enabled) {
+        llvm_taichi::Tracer::name_thread("python");
+    }
+    llvm_taichi::Tracer::set_enabled(enabled != 0);
+    Out::Log(pType::DEBUG, enabled ? "trace enabled" : "trace disabled");
+}
+
+const char *runtime_trace_export() {
+    static std::string trace_text;
+    int64_t events = 0;
+    trace_text = llvm_taichi::Tracer::export_json(&events);
+    std::string _m = "trace exported: " + std::to_string(events) + " events";
+    Out::Log(pType::DEBUG, _m.c_str());
+    return trace_text.c_str();
+}
+
+int64_t field_create(
+    uint8_t type,
+    int64_t size
+) {
+    return llvm_taichi::taichi_runtime->field_create((llvm_taichi::DataType)type, size);
+}
+
+int64_t field_map(
+    uint8_t type,
+    uint8_t *path,
+    int64_t offset,
+    int64_t size,
+    uint32_t flags
+) {
+    return llvm_taichi::taichi_runtime->field_map(
+        (llvm_taichi::DataType)type, std::string((char *)path), offset, size, flags
+    );
+}
+
+void *field_ptr(int64_t handle) {
+    auto field = llvm_taichi::taichi_runtime->field_get(handle);
+    if(!field) {
+        std::string _m = "can not find field " + std::to_string(handle);
+        Out::Log(pType::ERROR, _m.c_str());
+        return nullptr;
+    }
+    return field->data;
+}
+
+int64_t field_size(int64_t handle) {
+    auto field = llvm_taichi::taichi_runtime->field_get(handle);
+    return field ? field->size : -1;
+}
+
+uint8_t field_flush(int64_t handle) {
+    return llvm_taichi::taichi_runtime->field_flush(handle) ? 1 : 0;
+}
+
+void field_destroy(int64_t handle) {
+    llvm_taichi::taichi_runtime->field_destroy(handle);
+}
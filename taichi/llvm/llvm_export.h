@@ -9,64 +9,335 @@
 #include <cstdint>
 
 #include "llvm_manager.h"
+#include "llvm_runtime.h"
+#include "llvm_primitives.h"
+#include "llvm_stream.h"
+#include "llvm_struct.h"
+#include "llvm_trace.h"
 
 // 本 lib 一律使用 uint8_t 类型传递 Bytes
 
-extern "C" void init_lib();　// 初始化 lib
+// 初始化 lib，profiler_integration 见 llvm_taichi::ProfilerIntegration
+// tier_up_threshold 为 0 的时候所有函数直接编译，否则函数先解释执行，热度达到阈值之后在后台编译
+// retain_ir 为 0 的话代码生成之后不保留 IR 的文本，也不能再获取汇编
+// collect_remarks 为 0 的话不收集优化报告
+extern "C" void init_lib(uint8_t profiler_integration, uint64_t tier_up_threshold, uint8_t retain_ir, uint8_t collect_remarks);
 extern "C" void set_log_level(uint8_t level); // 设定 log level
-// 开始一个函数定义
-extern "C" void function_begin(
+// 开始一个函数定义，返回函数的 handle，之后的构建接口都使用这个 handle
+// 函数名已经注册过的话返回 0
+extern "C" uint32_t function_begin(
     uint8_t *function_name,
     uint8_t args_number,
     uint8_t *args_type,
     uint8_t *args_name,
     uint8_t return_type
 );
-// 函数定义完成
-extern "C" void function_finish(
-    uint8_t *function_name
+// 函数定义完成，构建失败（比如有返回值的函数缺少 return）的话返回 0，函数没有被编译，需要 function_release
+extern "C" uint8_t function_finish(
+    uint32_t function
+);
+// 函数定义在 Python 源码中的位置（用于生成调试信息），在 function_begin 之后调用
+extern "C" void debug_begin(
+    uint32_t function,
+    uint8_t *file_name,
+    uint32_t line
+);
+// 函数的浮点数语义，flags 见 llvm_taichi::FastMathFlag，在 function_begin 之后、定义语句之前调用
+extern "C" void function_fast_math(
+    uint32_t function,
+    uint32_t flags
+);
+// 第 argument 个参数（field）的访问提示，flags 见 llvm_taichi::FieldHint，在 function_begin 之后、function_finish 之前调用
+extern "C" void function_field_hint(
+    uint32_t function,
+    uint32_t argument,
+    uint32_t flags,
+    uint32_t prefetch_distance
+);
+// 之后定义的语句对应 Python 源码中的这一行
+extern "C" void debug_location(
+    uint32_t function,
+    uint8_t *file_name,
+    uint32_t line
 );
 // 开始一个循环定义
 extern "C" void loop_begin(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *loop_index_name,
     int32_t l,
     int32_t r,
     int32_t s
 );
+// 开始一个循环定义（循环范围是变量或常量，使用 Value buffer 描述）
+extern "C" void loop_begin_value(
+    uint32_t function,
+    uint8_t *loop_index_name,
+    uint8_t *l_buffer,
+    uint8_t *r_buffer,
+    uint8_t *s_buffer
+);
 // 结束一个循环定义
 extern "C" void loop_finish(
-    uint8_t *function_name
+    uint32_t function
 );
 // 定义一个赋值语句（右侧为 Value）
 extern "C" void assignment_statement_value(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *target_variable_name,
     uint8_t *source_buffer
 );
 // 定义一个赋值语句（右侧为简单运算表达式）
 extern "C" void assignment_statement_operation(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *target_variable_name,
     uint8_t *left_buffer,
     uint8_t operation_type,
     uint8_t *right_buffer
 );
+// 定义一个读取 field 元素的语句 target = field[index]
+extern "C" void load_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *field_name,
+    uint8_t *index_buffer
+);
+// 定义一个写入 field 元素的语句 field[index] = value
+extern "C" void store_statement(
+    uint32_t function,
+    uint8_t *field_name,
+    uint8_t *index_buffer,
+    uint8_t *value_buffer
+);
+// 定义一个原子操作语句 target = atomic(field[index], value)，target 是操作之前的元素
+// operation 见 llvm_taichi::AtomicOperation，Cas 的话 value 是 expected，desired 是要写入的值
+// 其他操作的 desired_buffer 为 nullptr
+extern "C" void atomic_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *field_name,
+    uint8_t operation,
+    uint8_t *index_buffer,
+    uint8_t *value_buffer,
+    uint8_t *desired_buffer
+);
+// 定义一个随机数语句 target = random(seed, counter, stream)，target 是 [0, 1) 之间的 Float64
+// 同样的 seed、counter、stream 得到同样的结果，kernel 中 counter 一般是 loop index
+extern "C" void random_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *seed_buffer,
+    uint8_t *counter_buffer,
+    uint8_t *stream_buffer
+);
+// 值（格式和语句的参数相同）在函数当前位置的类型，没有定义的变量返回 0（Void）
+extern "C" uint8_t value_type(
+    uint32_t function,
+    uint8_t *value_buffer
+);
+// 注册一个结构体类型，成员名使用逗号分割，成员类型是标量或者存储类型
+// 返回结构体的 DataType（见 llvm_taichi::StructTypeBase），失败的话返回 0（Void）
+extern "C" uint8_t struct_register(
+    uint8_t *struct_name,
+    uint8_t members_number,
+    uint8_t *members_name,
+    uint8_t *members_type
+);
+// 声明一个结构体变量，所有成员为 0
+extern "C" void struct_statement(
+    uint32_t function,
+    uint8_t *variable_name,
+    uint8_t type
+);
+// 定义一个读取成员的语句 target = base.member
+// index_buffer 不为 nullptr 的话 base 是元素为结构体的 field：target = base[index].member
+extern "C" void member_load_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *base_name,
+    uint8_t *index_buffer,
+    uint8_t *member_name
+);
+// 定义一个写入成员的语句 base.member = value（或者 base[index].member = value）
+extern "C" void member_store_statement(
+    uint32_t function,
+    uint8_t *base_name,
+    uint8_t *index_buffer,
+    uint8_t *member_name,
+    uint8_t *value_buffer
+);
+// 定义一个调用语句 target = callee(args...)
+// 结构体的实参是结构体变量，返回结构体的话 target 是一个结构体变量
+extern "C" void call_statement(
+    uint32_t function,
+    uint8_t *target_variable_name,
+    uint8_t *callee_name,
+    uint8_t args_number,
+    uint8_t **args_buffer
+);
 // 定义一个返回语句
 extern "C" void return_statement(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *return_variable_name
 );
 // 执行函数
 // 出于学习目的保留，实际上未使用
 extern "C" void run(
-    uint8_t *function_name,
+    uint32_t function,
     uint8_t *argument_buffer,
     uint8_t *result_buffer
 );
+// 按函数名找到函数的 handle，没有这个函数的话返回 0
+extern "C" uint32_t function_handle(
+    uint8_t *function_name
+);
+// 函数名不再指向这个函数（比如重新定义之前），已经编译的调用者仍然使用旧的代码
+extern "C" void function_remove(
+    uint32_t function
+);
+// 释放 handle 对函数的引用，没有调用者的话代码和数据随之释放，之后 handle 不再有效
+// 直接发射的 kernel 入口要先 sync，释放之后不能再执行
+extern "C" void function_release(
+    uint32_t function
+);
+// 所有还活着的函数占用的 JIT 内存，每行一个函数：name symbol handle registered code data ir modules
+extern "C" const char *jit_memory_report();
 // 获取一个 LLVM 编译的 C 函数的原始指针
 extern "C" void *get_func_ptr(
     uint8_t *function_name
 );
+// 获取函数的打包入口 void thunk(void *args, void *ret)，格式见 llvm_taichi::PackedEntry
+// C++ 宿主也可以使用 llvm_compiled.h 中的类型化接口
+extern "C" void *get_function_thunk(
+    uint8_t *function_name
+);
+// 获取函数的 IR，stage 见 llvm_taichi::IRStage
+// 返回的字符串属于函数，不需要释放
+extern "C" const char *get_function_ir(
+    uint8_t *function_name,
+    uint8_t stage
+);
+// 获取函数最终的汇编代码
+extern "C" const char *get_function_asm(
+    uint8_t *function_name
+);
+// 获取函数的优化报告，每行一个，字段用 tab 分割：kind pass name file line message
+extern "C" const char *get_function_remarks(
+    uint8_t *function_name
+);
+// 获取函数中循环的依赖分析结果，每行一项，字段用 tab 分割
+// 每个循环（先序）一行 loop depth file line parallel independent，
+// 之后是这个循环的 dependence file line message 以及 reduction file line message
+extern "C" const char *get_loop_report(
+    uint8_t *function_name
+);
+// 获取一个 kernel 函数的入口 void entry(int64 begin, int64 end, void *context)
+extern "C" void *get_kernel_entry(
+    uint32_t function
+);
+// 初始化运行时（线程池），thread_number 为 0 表示使用硬件线程数
+// placement 是 worker 和内存的放置策略，见 llvm_taichi::Placement
+extern "C" void runtime_init(uint32_t thread_number, uint32_t placement);
+// 运行时的 worker 线程数量
+extern "C" uint32_t runtime_thread_number();
+// 异步发射一个 kernel，返回发射的 id
+// signature 是 kernel 的签名，autotuner 按签名分别调优，空字符串表示不调优
+// private_fields 是散射私有化的 field（只通过 atomic_add 写入），它们的指针在 context 中的偏移是 private_offsets
+// 每个参与的 worker 写入自己的副本，发射之后合并，返回的是合并的发射 id；private_number 为 0 表示不私有化
+// atomic_entry 是不私有化的同一个 kernel（原子累加），私有化的时候必须给出，副本分配失败的时候执行它
+extern "C" int64_t runtime_launch(
+    void *entry,
+    void *context,
+    int64_t iterations,
+    uint32_t reads_number,
+    int64_t *reads,
+    uint32_t writes_number,
+    int64_t *writes,
+    uint8_t *signature,
+    uint32_t context_size,
+    uint32_t private_number,
+    uint32_t *private_offsets,
+    int64_t *private_fields,
+    void *atomic_entry
+);
+// 设定 kernel 发射的调度，policy 见 llvm_taichi::SchedulePolicy
+// chunks_per_thread 决定块的大小（迭代次数 / 线程数 / chunks_per_thread）
+// policy 是 Auto 的话由 autotuner 选择，选择保存在 cache_path 中（空字符串表示不保存）
+extern "C" void runtime_set_schedule(
+    uint8_t policy,
+    uint32_t chunks_per_thread,
+    uint8_t *cache_path
+);
+// autotuner 已经确定的选择，每行一个：signature bucket policy chunks_per_thread time，用 tab 分割
+extern "C" const char *runtime_schedule_report();
+// 低延迟模式：空闲的 worker 和等待者先自旋 spin_nanoseconds 再休眠，0 表示直接休眠
+extern "C" void runtime_set_spin(int64_t spin_nanoseconds);
+// 最近的发射从发射到完成的延迟：count p50 p90 p99 max（微秒），用 tab 分割
+// reset 不为 0 的话之后重新统计
+extern "C" const char *runtime_latency(uint8_t reset);
+// 检测到的拓扑以及 worker 绑定的 CPU，格式见 llvm_taichi::Runtime::topology_report
+extern "C" const char *runtime_topology();
+// 等待某一次发射完成
+extern "C" void runtime_wait(int64_t launch_id);
+// 等待所有读写这个资源的发射完成
+extern "C" void runtime_wait_resource(int64_t resource);
+// 等待所有发射完成
+extern "C" void runtime_sync();
+// id 小于返回值的发射都已经完成
+extern "C" int64_t runtime_oldest_pending();
+// 并行原语，和 kernel 一样异步发射，返回发射的 id，参数不合法的话返回 -1
+// 前缀和，inclusive 为 0 的话是 exclusive，见 llvm_taichi::primitive_scan
+extern "C" int64_t primitive_scan(int64_t src, int64_t dst, uint8_t inclusive);
+// 稳定的基数排序，values 为 0 表示没有 payload，见 llvm_taichi::primitive_sort
+extern "C" int64_t primitive_sort(int64_t keys, int64_t values);
+// 流压缩，src 为 0 表示写下标，count 为 0 表示不需要总数，见 llvm_taichi::primitive_compact
+extern "C" int64_t primitive_compact(int64_t src, int64_t flags, int64_t dst, int64_t count);
+// 流式执行一个 kernel，见 llvm_taichi::stream_run，执行完才返回，返回处理的元素个数，出错的话返回 -1
+// 每个绑定：flags 的最低位表示输出，其余是 StreamKind；sources 是文件描述符或者 field 的 handle
+// buffers 是 binding_number * depth 个缓冲区的 handle（StreamField 的绑定对应的部分忽略）
+extern "C" int64_t runtime_stream(
+    void *entry,
+    void *context,
+    uint32_t context_size,
+    uint8_t *signature,
+    int64_t total,
+    int64_t chunk,
+    uint32_t depth,
+    uint32_t binding_number,
+    uint32_t *offsets,
+    uint8_t *flags,
+    int64_t *sources,
+    int64_t *positions,
+    void **callbacks,
+    int64_t *buffers,
+    uint32_t reads_number,
+    int64_t *reads,
+    uint32_t writes_number,
+    int64_t *writes
+);
+// 开启 / 关闭时间线追踪，开启的时候丢弃之前的事件，见 llvm_taichi::Tracer
+extern "C" void runtime_trace(uint8_t enabled);
+// 导出追踪到的事件，Chrome trace 的 JSON
+extern "C" const char *runtime_trace_export();
+// 创建一个 field，返回 handle
+extern "C" int64_t field_create(
+    uint8_t type,
+    int64_t size
+);
+// 把文件的一段映射为 field，size 小于 0 表示到文件结尾，flags 见 llvm_taichi::MapFlag，失败的话返回 0
+extern "C" int64_t field_map(
+    uint8_t type,
+    uint8_t *path,
+    int64_t offset,
+    int64_t size,
+    uint32_t flags
+);
+// 获取 field 的内存地址
+extern "C" void *field_ptr(int64_t handle);
+// field 的元素个数，找不到的话返回 -1
+extern "C" int64_t field_size(int64_t handle);
+// 等待写 field 的发射完成，文件映射的 field 再写回文件，失败的话返回 0
+extern "C" uint8_t field_flush(int64_t handle);
+// 释放一个 field
+extern "C" void field_destroy(int64_t handle);
 
 #endif
@@ -5,7 +5,7 @@
 
 import os
 import ctypes
-from ctypes import POINTER, c_uint8, c_int32, c_void_p
+from ctypes import POINTER, c_uint8, c_int32, c_uint32, c_int64, c_uint64, c_void_p, c_char_p
 
 # 从外部，可以直接安全地 import *
 __all__ = [
@@ -13,13 +13,62 @@ __all__ = [
     "c_set_log_level",
     "c_function_begin",
     "c_function_finish",
+    "c_debug_begin",
+    "c_function_fast_math",
+    "c_function_field_hint",
+    "c_debug_location",
     "c_loop_begin",
+    "c_loop_begin_value",
     "c_loop_finish",
     "c_assignment_statement_value",
     "c_assignment_statement_operation",
+    "c_load_statement",
+    "c_store_statement",
+    "c_atomic_statement",
+    "c_random_statement",
+    "c_value_type",
+    "c_struct_register",
+    "c_struct_statement",
+    "c_member_load_statement",
+    "c_member_store_statement",
+    "c_call_statement",
     "c_return_statement",
     "c_run",
-    "c_get_func_ptr"
+    "c_function_handle",
+    "c_function_remove",
+    "c_function_release",
+    "c_jit_memory_report",
+    "c_get_func_ptr",
+    "c_get_function_thunk",
+    "c_get_function_ir",
+    "c_get_function_asm",
+    "c_get_function_remarks",
+    "c_get_loop_report",
+    "c_get_kernel_entry",
+    "c_runtime_init",
+    "c_runtime_thread_number",
+    "c_runtime_launch",
+    "c_runtime_set_schedule",
+    "c_runtime_schedule_report",
+    "c_runtime_set_spin",
+    "c_runtime_latency",
+    "c_runtime_topology",
+    "c_runtime_wait",
+    "c_runtime_wait_resource",
+    "c_runtime_sync",
+    "c_runtime_oldest_pending",
+    "c_runtime_stream",
+    "c_runtime_trace",
+    "c_runtime_trace_export",
+    "c_primitive_scan",
+    "c_primitive_sort",
+    "c_primitive_compact",
+    "c_field_create",
+    "c_field_map",
+    "c_field_ptr",
+    "c_field_size",
+    "c_field_flush",
+    "c_field_destroy"
 ]
 
 current_path = os.path.dirname(os.path.abspath(__file__))
@@ -27,7 +76,12 @@ so_path = os.path.join(current_path, "llvm_taichi.so")
 lib_llvm_taichi = ctypes.cdll.LoadLibrary(so_path)
 
 c_init_lib = lib_llvm_taichi.init_lib
-c_init_lib.argtypes = ()
+c_init_lib.argtypes = (
+    c_uint8, # profiler_integration
+    c_uint64, # tier_up_threshold
+    c_uint8, # retain_ir
+    c_uint8 # collect_remarks
+)
 c_init_lib.restype = None
 
 c_set_log_level = lib_llvm_taichi.set_log_level
@@ -42,17 +96,49 @@ c_function_begin.argtypes = (
     POINTER(c_uint8), # args_name
     c_uint8 # return_type
 )
-c_function_begin.restype = None
+c_function_begin.restype = c_uint32 # function，0 表示函数名已经注册过
 
 c_function_finish = lib_llvm_taichi.function_finish
 c_function_finish.argtypes = (
-    POINTER(c_uint8), # function_name
+    c_uint32, # function
+)
+c_function_finish.restype = c_uint8 # 0 表示构建失败
+
+c_debug_begin = lib_llvm_taichi.debug_begin
+c_debug_begin.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # file_name
+    c_uint32 # line
+)
+c_debug_begin.restype = None
+
+c_function_fast_math = lib_llvm_taichi.function_fast_math
+c_function_fast_math.argtypes = (
+    c_uint32, # function
+    c_uint32 # flags
+)
+c_function_fast_math.restype = None
+
+c_function_field_hint = lib_llvm_taichi.function_field_hint
+c_function_field_hint.argtypes = (
+    c_uint32, # function
+    c_uint32, # argument
+    c_uint32, # flags
+    c_uint32 # prefetch_distance
+)
+c_function_field_hint.restype = None
+
+c_debug_location = lib_llvm_taichi.debug_location
+c_debug_location.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # file_name
+    c_uint32 # line
 )
-c_function_finish.restype = None
+c_debug_location.restype = None
 
 c_loop_begin = lib_llvm_taichi.loop_begin
 c_loop_begin.argtypes = (
-    POINTER(c_uint8), # function_name
+    c_uint32, # function
     POINTER(c_uint8), # loop_index_name
     c_int32, # l
     c_int32, # r
@@ -60,15 +146,25 @@ c_loop_begin.argtypes = (
 )
 c_loop_begin.restype = None
 
+c_loop_begin_value = lib_llvm_taichi.loop_begin_value
+c_loop_begin_value.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # loop_index_name
+    POINTER(c_uint8), # l_buffer
+    POINTER(c_uint8), # r_buffer
+    POINTER(c_uint8) # s_buffer
+)
+c_loop_begin_value.restype = None
+
 c_loop_finish = lib_llvm_taichi.loop_finish
 c_loop_finish.argtypes = (
-    POINTER(c_uint8), # function_name
+    c_uint32, # function
 )
 c_loop_finish.restype = None
 
 c_assignment_statement_value = lib_llvm_taichi.assignment_statement_value
 c_assignment_statement_value.argtypes = (
-    POINTER(c_uint8), # function_name
+    c_uint32, # function
     POINTER(c_uint8), # target_variable_name
     POINTER(c_uint8) # source_buffer
 )
@@ -76,7 +172,7 @@ c_assignment_statement_value.restype = None
 
 c_assignment_statement_operation = lib_llvm_taichi.assignment_statement_operation
 c_assignment_statement_operation.argtypes = (
-    POINTER(c_uint8), # function_name
+    c_uint32, # function
     POINTER(c_uint8), # target_variable_name
     POINTER(c_uint8), # left_buffer
     c_uint8, # operation_type
@@ -84,23 +180,352 @@ c_assignment_statement_operation.argtypes = (
 )
 c_assignment_statement_operation.restype = None
 
+c_load_statement = lib_llvm_taichi.load_statement
+c_load_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # target_variable_name
+    POINTER(c_uint8), # field_name
+    POINTER(c_uint8) # index_buffer
+)
+c_load_statement.restype = None
+
+c_store_statement = lib_llvm_taichi.store_statement
+c_store_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # field_name
+    POINTER(c_uint8), # index_buffer
+    POINTER(c_uint8) # value_buffer
+)
+c_store_statement.restype = None
+
+c_atomic_statement = lib_llvm_taichi.atomic_statement
+c_atomic_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # target_variable_name
+    POINTER(c_uint8), # field_name
+    c_uint8, # operation
+    POINTER(c_uint8), # index_buffer
+    POINTER(c_uint8), # value_buffer
+    POINTER(c_uint8) # desired_buffer，可以是 None
+)
+c_atomic_statement.restype = None
+
+c_random_statement = lib_llvm_taichi.random_statement
+c_random_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # target_variable_name
+    POINTER(c_uint8), # seed_buffer
+    POINTER(c_uint8), # counter_buffer
+    POINTER(c_uint8) # stream_buffer
+)
+c_random_statement.restype = None
+
+c_value_type = lib_llvm_taichi.value_type
+c_value_type.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8) # value_buffer
+)
+c_value_type.restype = c_uint8
+
+c_struct_register = lib_llvm_taichi.struct_register
+c_struct_register.argtypes = (
+    POINTER(c_uint8), # struct_name
+    c_uint8, # members_number
+    POINTER(c_uint8), # members_name，使用逗号分割
+    POINTER(c_uint8) # members_type
+)
+c_struct_register.restype = c_uint8 # 结构体的类型，0 表示注册失败
+
+c_struct_statement = lib_llvm_taichi.struct_statement
+c_struct_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # variable_name
+    c_uint8 # type
+)
+c_struct_statement.restype = None
+
+c_member_load_statement = lib_llvm_taichi.member_load_statement
+c_member_load_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # target_variable_name
+    POINTER(c_uint8), # base_name
+    POINTER(c_uint8), # index_buffer，base 是结构体变量的话为 None
+    POINTER(c_uint8) # member_name
+)
+c_member_load_statement.restype = None
+
+c_member_store_statement = lib_llvm_taichi.member_store_statement
+c_member_store_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # base_name
+    POINTER(c_uint8), # index_buffer，base 是结构体变量的话为 None
+    POINTER(c_uint8), # member_name
+    POINTER(c_uint8) # value_buffer
+)
+c_member_store_statement.restype = None
+
+c_call_statement = lib_llvm_taichi.call_statement
+c_call_statement.argtypes = (
+    c_uint32, # function
+    POINTER(c_uint8), # target_variable_name
+    POINTER(c_uint8), # callee_name
+    c_uint8, # args_number
+    POINTER(POINTER(c_uint8)) # args_buffer
+)
+c_call_statement.restype = None
+
 c_return_statement = lib_llvm_taichi.return_statement
 c_return_statement.argtypes = (
-    POINTER(c_uint8), # function_name
+    c_uint32, # function
     POINTER(c_uint8) # return_variable_name
 )
 c_return_statement.restype = None
 
 c_run = lib_llvm_taichi.run
 c_run.argtypes = (
-    POINTER(c_uint8), # function_name
+    c_uint32, # function
     POINTER(c_uint8), # argument_buffer
     POINTER(c_uint8) # result_buffer
 )
 c_run.restype = None
 
+c_function_handle = lib_llvm_taichi.function_handle
+c_function_handle.argtypes = (
+    POINTER(c_uint8), # function_name
+)
+c_function_handle.restype = c_uint32
+
+c_function_remove = lib_llvm_taichi.function_remove
+c_function_remove.argtypes = (
+    c_uint32, # function
+)
+c_function_remove.restype = None
+
+c_function_release = lib_llvm_taichi.function_release
+c_function_release.argtypes = (
+    c_uint32, # function
+)
+c_function_release.restype = None
+
+c_jit_memory_report = lib_llvm_taichi.jit_memory_report
+c_jit_memory_report.argtypes = ()
+c_jit_memory_report.restype = c_char_p
+
 c_get_func_ptr = lib_llvm_taichi.get_func_ptr
 c_get_func_ptr.argtypes = (
     POINTER(c_uint8), # function_name
 )
 c_get_func_ptr.restype = c_void_p
+
+# c_char_p 的返回值会被复制为 bytes
+c_get_function_thunk = lib_llvm_taichi.get_function_thunk
+c_get_function_thunk.argtypes = (
+    POINTER(c_uint8), # function_name
+)
+c_get_function_thunk.restype = c_void_p
+
+c_get_function_ir = lib_llvm_taichi.get_function_ir
+c_get_function_ir.argtypes = (
+    POINTER(c_uint8), # function_name
+    c_uint8 # stage
+)
+c_get_function_ir.restype = c_char_p
+
+c_get_function_asm = lib_llvm_taichi.get_function_asm
+c_get_function_asm.argtypes = (
+    POINTER(c_uint8), # function_name
+)
+c_get_function_asm.restype = c_char_p
+
+c_get_function_remarks = lib_llvm_taichi.get_function_remarks
+c_get_function_remarks.argtypes = (
+    POINTER(c_uint8), # function_name
+)
+c_get_function_remarks.restype = c_char_p
+
+c_get_loop_report = lib_llvm_taichi.get_loop_report
+c_get_loop_report.argtypes = (
+    POINTER(c_uint8), # function_name
+)
+c_get_loop_report.restype = c_char_p
+
+c_get_kernel_entry = lib_llvm_taichi.get_kernel_entry
+c_get_kernel_entry.argtypes = (
+    c_uint32, # function
+)
+c_get_kernel_entry.restype = c_void_p
+
+c_runtime_init = lib_llvm_taichi.runtime_init
+c_runtime_init.argtypes = (
+    c_uint32, # thread_number
+    c_uint32, # placement
+)
+c_runtime_init.restype = None
+
+c_runtime_thread_number = lib_llvm_taichi.runtime_thread_number
+c_runtime_thread_number.argtypes = ()
+c_runtime_thread_number.restype = c_uint32
+
+c_runtime_launch = lib_llvm_taichi.runtime_launch
+c_runtime_launch.argtypes = (
+    c_void_p, # entry
+    c_void_p, # context
+    c_int64, # iterations
+    c_uint32, # reads_number
+    POINTER(c_int64), # reads
+    c_uint32, # writes_number
+    POINTER(c_int64), # writes
+    POINTER(c_uint8), # signature
+    c_uint32, # context_size
+    c_uint32, # private_number
+    POINTER(c_uint32), # private_offsets
+    POINTER(c_int64), # private_fields
+    c_void_p # atomic_entry
+)
+c_runtime_launch.restype = c_int64
+
+c_runtime_set_schedule = lib_llvm_taichi.runtime_set_schedule
+c_runtime_set_schedule.argtypes = (
+    c_uint8, # policy
+    c_uint32, # chunks_per_thread
+    POINTER(c_uint8) # cache_path
+)
+c_runtime_set_schedule.restype = None
+
+c_runtime_schedule_report = lib_llvm_taichi.runtime_schedule_report
+c_runtime_schedule_report.argtypes = ()
+c_runtime_schedule_report.restype = c_char_p
+
+c_runtime_set_spin = lib_llvm_taichi.runtime_set_spin
+c_runtime_set_spin.argtypes = (
+    c_int64, # spin_nanoseconds
+)
+c_runtime_set_spin.restype = None
+
+c_runtime_latency = lib_llvm_taichi.runtime_latency
+c_runtime_latency.argtypes = (
+    c_uint8, # reset
+)
+c_runtime_latency.restype = c_char_p
+
+c_runtime_topology = lib_llvm_taichi.runtime_topology
+c_runtime_topology.argtypes = ()
+c_runtime_topology.restype = c_char_p
+
+c_runtime_wait = lib_llvm_taichi.runtime_wait
+c_runtime_wait.argtypes = (
+    c_int64, # launch_id
+)
+c_runtime_wait.restype = None
+
+c_runtime_wait_resource = lib_llvm_taichi.runtime_wait_resource
+c_runtime_wait_resource.argtypes = (
+    c_int64, # resource
+)
+c_runtime_wait_resource.restype = None
+
+c_runtime_sync = lib_llvm_taichi.runtime_sync
+c_runtime_sync.argtypes = ()
+c_runtime_sync.restype = None
+
+c_runtime_oldest_pending = lib_llvm_taichi.runtime_oldest_pending
+c_runtime_oldest_pending.argtypes = ()
+c_runtime_oldest_pending.restype = c_int64
+
+c_primitive_scan = lib_llvm_taichi.primitive_scan
+c_primitive_scan.argtypes = (
+    c_int64, # src
+    c_int64, # dst
+    c_uint8 # inclusive
+)
+c_primitive_scan.restype = c_int64
+
+c_primitive_sort = lib_llvm_taichi.primitive_sort
+c_primitive_sort.argtypes = (
+    c_int64, # keys
+    c_int64 # values
+)
+c_primitive_sort.restype = c_int64
+
+c_primitive_compact = lib_llvm_taichi.primitive_compact
+c_primitive_compact.argtypes = (
+    c_int64, # src
+    c_int64, # flags
+    c_int64, # dst
+    c_int64 # count
+)
+c_primitive_compact.restype = c_int64
+
+c_runtime_stream = lib_llvm_taichi.runtime_stream
+c_runtime_stream.argtypes = (
+    c_void_p, # entry
+    c_void_p, # context
+    c_uint32, # context_size
+    POINTER(c_uint8), # signature
+    c_int64, # total
+    c_int64, # chunk
+    c_uint32, # depth
+    c_uint32, # binding_number
+    POINTER(c_uint32), # offsets
+    POINTER(c_uint8), # flags
+    POINTER(c_int64), # sources
+    POINTER(c_int64), # positions
+    POINTER(c_void_p), # callbacks
+    POINTER(c_int64), # buffers
+    c_uint32, # reads_number
+    POINTER(c_int64), # reads
+    c_uint32, # writes_number
+    POINTER(c_int64) # writes
+)
+c_runtime_stream.restype = c_int64
+
+c_runtime_trace = lib_llvm_taichi.runtime_trace
+c_runtime_trace.argtypes = (
+    c_uint8, # enabled
+)
+c_runtime_trace.restype = None
+
+c_runtime_trace_export = lib_llvm_taichi.runtime_trace_export
+c_runtime_trace_export.argtypes = ()
+c_runtime_trace_export.restype = c_char_p
+
+c_field_create = lib_llvm_taichi.field_create
+c_field_create.argtypes = (
+    c_uint8, # type
+    c_int64 # size
+)
+c_field_create.restype = c_int64
+
+c_field_map = lib_llvm_taichi.field_map
+c_field_map.argtypes = (
+    c_uint8, # type
+    POINTER(c_uint8), # path
+    c_int64, # offset
+    c_int64, # size
+    c_uint32 # flags
+)
+c_field_map.restype = c_int64
+
+c_field_ptr = lib_llvm_taichi.field_ptr
+c_field_ptr.argtypes = (
+    c_int64, # handle
+)
+c_field_ptr.restype = c_void_p
+
+c_field_size = lib_llvm_taichi.field_size
+c_field_size.argtypes = (
+    c_int64, # handle
+)
+c_field_size.restype = c_int64
+
+c_field_flush = lib_llvm_taichi.field_flush
+c_field_flush.argtypes = (
+    c_int64, # handle
+)
+c_field_flush.restype = c_uint8
+
+c_field_destroy = lib_llvm_taichi.field_destroy
+c_field_destroy.argtypes = (
+    c_int64, # handle
+)
+c_field_destroy.restype = None
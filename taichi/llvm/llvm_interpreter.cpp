@@ -0,0 +1,675 @@
+#include "llvm_interpreter.h"
+#include "llvm_ir.h"
+#include "llvm_random.h"
+#include "llvm_storage.h"
+#include "llvm_struct.h"
+#include "llvm_trace.h"
+
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+namespace llvm_taichi
+{
+
+std::unique_ptr<TieredCompiler> taichi_tiered_compiler;
+
+// 循环的迭代次数先在本地累计，每隔这么多次才更新一次热度（热度是原子变量）
+static const uint64_t HotnessFlushInterval = 4096;
+
+// 类型转换，和 cast 生成的指令一致
+Scalar cast_scalar(DataType from, DataType to, Scalar value)
+{
+    if(from == to) return value;
+    Scalar res;
+    res.i64 = 0;
+    switch(to) {
+        case DataType::Int32:
+            if(from == DataType::Int64) {
+                res.i32 = static_cast<int32_t>(value.i64); // 截断
+            } else if(from == DataType::Float32) {
+                res.i32 = static_cast<int32_t>(value.f32);
+            } else if(from == DataType::Float64) {
+                res.i32 = static_cast<int32_t>(value.f64);
+            }
+            break;
+        case DataType::Int64:
+            if(from == DataType::Int32) {
+                res.i64 = value.i32; // 符号拓展
+            } else if(from == DataType::Float32) {
+                res.i64 = static_cast<int64_t>(value.f32);
+            } else if(from == DataType::Float64) {
+                res.i64 = static_cast<int64_t>(value.f64);
+            }
+            break;
+        case DataType::Float32:
+            if(from == DataType::Float64) {
+                res.f32 = static_cast<float>(value.f64);
+            } else if(from == DataType::Int32) {
+                res.f32 = static_cast<float>(value.i32);
+            } else if(from == DataType::Int64) {
+                res.f32 = static_cast<float>(value.i64);
+            }
+            break;
+        case DataType::Float64:
+            if(from == DataType::Float32) {
+                res.f64 = value.f32;
+            } else if(from == DataType::Int32) {
+                res.f64 = static_cast<double>(value.i32);
+            } else if(from == DataType::Int64) {
+                res.f64 = static_cast<double>(value.i64);
+            }
+            break;
+        default:
+            break;
+    }
+    return res;
+}
+
+// 整数运算
+// LLVM 的 add/sub/mul 是回绕的，这里用无符号数计算，避免有符号溢出的未定义行为
+// sdiv 除以 0 在 LLVM 中也是未定义的，解释器统一得到 0
+template<typename T>
+static T int_operation(OperationType operation, T a, T b)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    switch(operation) {
+        case OperationType::Add:
+            return static_cast<T>(static_cast<U>(a) + static_cast<U>(b));
+        case OperationType::Sub:
+            return static_cast<T>(static_cast<U>(a) - static_cast<U>(b));
+        case OperationType::Mul:
+            return static_cast<T>(static_cast<U>(a) * static_cast<U>(b));
+        case OperationType::Div:
+            if(b == 0) return 0;
+            if(b == -1) return static_cast<T>(U(0) - static_cast<U>(a)); // 避免 INT_MIN / -1
+            return a / b;
+    }
+    return 0;
+}
+
+template<typename T>
+static T float_operation(OperationType operation, T a, T b)
+{
+    switch(operation) {
+        case OperationType::Add: return a + b;
+        case OperationType::Sub: return a - b;
+        case OperationType::Mul: return a * b;
+        case OperationType::Div: return a / b;
+    }
+    return 0;
+}
+
+Scalar calc_scalar(OperationType operation, DataType type, Scalar a, Scalar b)
+{
+    Scalar res;
+    res.i64 = 0;
+    switch(type) {
+        case DataType::Int32: res.i32 = int_operation(operation, a.i32, b.i32); break;
+        case DataType::Int64: res.i64 = int_operation(operation, a.i64, b.i64); break;
+        case DataType::Float32: res.f32 = float_operation(operation, a.f32, b.f32); break;
+        case DataType::Float64: res.f64 = float_operation(operation, a.f64, b.f64); break;
+        default: break;
+    }
+    return res;
+}
+
+// 原子操作，和 llvm_atomic 生成的指令一致：返回操作之前的值，add / min / max 是 relaxed，cas 是 seq_cst
+template<typename T>
+static T atomic_int(AtomicOperation operation, T *address, T value, T desired)
+{
+    T old = __atomic_load_n(address, __ATOMIC_RELAXED);
+    switch(operation) {
+        case AtomicOperation::AtomicAdd:
+            // GCC 的原子加法按补码回绕，和 atomicrmw add 一样
+            return __atomic_fetch_add(address, value, __ATOMIC_RELAXED);
+        case AtomicOperation::AtomicMin:
+            while(value < old && !__atomic_compare_exchange_n(address, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+            return old;
+        case AtomicOperation::AtomicMax:
+            while(value > old && !__atomic_compare_exchange_n(address, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+            return old;
+        case AtomicOperation::AtomicCas:
+            // 失败的话 old 更新为元素当前的值，成功的话 old 就是 value，都是操作之前的值
+            old = value;
+            __atomic_compare_exchange_n(address, &old, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            return old;
+    }
+    return old;
+}
+
+// 浮点数按位转换为同样大小的整数，用 cmpxchg 循环实现
+template<typename F, typename I>
+static F atomic_float(AtomicOperation operation, F *address, F value, F desired)
+{
+    static_assert(sizeof(F) == sizeof(I), "size of float and bits must be equal");
+    auto to_bits = [](F v) { I bits; memcpy(&bits, &v, sizeof(I)); return bits; };
+    auto from_bits = [](I bits) { F v; memcpy(&v, &bits, sizeof(I)); return v; };
+    I *bits_address = reinterpret_cast<I *>(address);
+    if(operation == AtomicOperation::AtomicCas) {
+        return from_bits(atomic_int<I>(operation, bits_address, to_bits(value), to_bits(desired)));
+    }
+    I old = __atomic_load_n(bits_address, __ATOMIC_RELAXED);
+    while(true) {
+        F old_value = from_bits(old);
+        F new_value = old_value;
+        switch(operation) {
+            case AtomicOperation::AtomicAdd: new_value = old_value + value; break;
+            case AtomicOperation::AtomicMin: new_value = value < old_value ? value : old_value; break;
+            case AtomicOperation::AtomicMax: new_value = value > old_value ? value : old_value; break;
+            default: break;
+        }
+        if(__atomic_compare_exchange_n(bits_address, &old, to_bits(new_value), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return old_value;
+        }
+    }
+}
+
+// 存储类型的元素，和 llvm_storage_atomic 一致：cmpxchg 循环，按计算类型计算，B 是同样大小的整数
+template<typename B>
+static Scalar atomic_storage(AtomicOperation operation, DataType element, Byte *address, Scalar value, Scalar desired)
+{
+    DataType type = compute_type(element);
+    B *bits_address = reinterpret_cast<B *>(address);
+    auto to_bits = [element](Scalar v) { B bits; store_element(element, reinterpret_cast<Byte *>(&bits), v); return bits; };
+    auto from_bits = [element](B bits) { return load_element(element, reinterpret_cast<const Byte *>(&bits)); };
+    if(operation == AtomicOperation::AtomicCas) {
+        B old = to_bits(value);
+        __atomic_compare_exchange_n(bits_address, &old, to_bits(desired), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return from_bits(old);
+    }
+    B old = __atomic_load_n(bits_address, __ATOMIC_RELAXED);
+    while(true) {
+        Scalar old_value = from_bits(old);
+        Scalar new_value = old_value;
+        bool replace = false;
+        switch(operation) {
+            case AtomicOperation::AtomicAdd:
+                new_value = calc_scalar(OperationType::Add, type, old_value, value);
+                break;
+            case AtomicOperation::AtomicMin:
+                replace = type == DataType::Float32 ? value.f32 < old_value.f32
+                    : type == DataType::Int64 ? value.i64 < old_value.i64 : value.i32 < old_value.i32;
+                break;
+            case AtomicOperation::AtomicMax:
+                replace = type == DataType::Float32 ? value.f32 > old_value.f32
+                    : type == DataType::Int64 ? value.i64 > old_value.i64 : value.i32 > old_value.i32;
+                break;
+            default:
+                break;
+        }
+        if(replace) {
+            new_value = value;
+        }
+        if(__atomic_compare_exchange_n(bits_address, &old, to_bits(new_value), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return old_value;
+        }
+    }
+}
+
+Scalar atomic_scalar(AtomicOperation operation, DataType type, Byte *address, Scalar value, Scalar desired)
+{
+    Scalar res;
+    res.i64 = 0;
+    switch(type) {
+        case DataType::Int8:
+        case DataType::UInt8:
+            return atomic_storage<uint8_t>(operation, type, address, value, desired);
+        case DataType::Int16:
+        case DataType::UInt16:
+        case DataType::Float16:
+        case DataType::BFloat16:
+            return atomic_storage<uint16_t>(operation, type, address, value, desired);
+        case DataType::UInt32:
+            return atomic_storage<uint32_t>(operation, type, address, value, desired);
+        case DataType::Int32:
+            res.i32 = atomic_int(operation, reinterpret_cast<int32_t *>(address), value.i32, desired.i32);
+            break;
+        case DataType::Int64:
+            res.i64 = atomic_int(operation, reinterpret_cast<int64_t *>(address), value.i64, desired.i64);
+            break;
+        case DataType::Float32:
+            res.f32 = atomic_float<float, int32_t>(operation, reinterpret_cast<float *>(address), value.f32, desired.f32);
+            break;
+        case DataType::Float64:
+            res.f64 = atomic_float<double, int64_t>(operation, reinterpret_cast<double *>(address), value.f64, desired.f64);
+            break;
+        default:
+            break;
+    }
+    return res;
+}
+
+// 读取操作数，并转换为 type
+static inline Scalar read_operand(const Operand &operand, const std::vector<Scalar> &slots, DataType type)
+{
+    return cast_scalar(
+        operand.type,
+        type,
+        operand.is_constant ? operand.constant : slots[operand.slot]
+    );
+}
+
+uint32_t Function::new_slot(DataType type)
+{
+    slot_types.push_back(type);
+    return slot_types.size() - 1;
+}
+
+uint32_t Function::slot_of(const IRStmt *stmt)
+{
+    auto it = value_slots.find(stmt);
+    if(it != value_slots.end()) {
+        return it->second;
+    }
+    uint32_t slot = new_slot(stmt->type);
+    value_slots[stmt] = slot;
+    return slot;
+}
+
+Operand Function::to_operand(const IRStmt *stmt)
+{
+    Operand res;
+    res.is_constant = stmt->kind == IRStmtKind::Const;
+    res.type = stmt->type;
+    res.slot = NoSlot;
+    res.constant.i64 = 0;
+    if(res.is_constant) {
+        res.constant = stmt->constant;
+    } else {
+        res.slot = slot_of(stmt);
+    }
+    return res;
+}
+
+void Function::lower_statements()
+{
+    statements.clear();
+    slot_types.clear();
+    value_slots.clear();
+    argument_slots.clear();
+    frame_bytes = 0;
+    for(auto arg : ir_arguments) {
+        argument_slots.push_back(slot_of(arg));
+    }
+    lower_statements(ir_body);
+}
+
+// 每个值（以及每个 Alloca）对应一个槽位，常量直接放在操作数中
+void Function::lower_statements(IRBlock *block)
+{
+    for(const IRStmt *stmt : block->stmts) {
+        Statement statement;
+        switch(stmt->kind) {
+            case IRStmtKind::Const:
+            case IRStmtKind::Arg:
+            case IRStmtKind::Alloca:
+                continue; // 不需要语句
+            case IRStmtKind::StructAlloca: {
+                // 结构体变量放在每次执行的时候分配的 frame 中，按结构体的对齐排列
+                const StructLayout *layout = taichi_struct_table.get(stmt->type);
+                frame_bytes = (frame_bytes + layout->align - 1) / layout->align * layout->align;
+                statement.kind = StatementKind::Address;
+                statement.target = slot_of(stmt);
+                statement.target_type = stmt->type;
+                statement.offset = frame_bytes;
+                frame_bytes += layout->size;
+                break;
+            }
+            case IRStmtKind::MemberPtr: {
+                const StructLayout *layout = taichi_struct_table.get(stmt->operands[0]->type);
+                statement.kind = StatementKind::Address;
+                statement.target = slot_of(stmt);
+                statement.target_type = stmt->type;
+                statement.field = slot_of(stmt->operands[0]);
+                statement.offset = layout->members[stmt->member].offset;
+                statement.stride = layout->size;
+                statement.operands.push_back(to_operand(stmt->operands[1]));
+                break;
+            }
+            case IRStmtKind::LocalLoad:
+            case IRStmtKind::Cast:
+                statement.kind = StatementKind::Assign;
+                statement.target = slot_of(stmt);
+                statement.target_type = stmt->type;
+                statement.operands.push_back(to_operand(stmt->operands[0]));
+                break;
+            case IRStmtKind::LocalStore:
+                statement.kind = StatementKind::Assign;
+                statement.target = slot_of(stmt->operands[0]);
+                statement.target_type = stmt->operands[0]->type;
+                statement.operands.push_back(to_operand(stmt->operands[1]));
+                break;
+            case IRStmtKind::Binary:
+                statement.kind = StatementKind::Operation;
+                statement.target = slot_of(stmt);
+                statement.target_type = stmt->type;
+                statement.operation = stmt->operation;
+                statement.operands.push_back(to_operand(stmt->operands[0]));
+                statement.operands.push_back(to_operand(stmt->operands[1]));
+                break;
+            case IRStmtKind::FieldLoad:
+                statement.kind = StatementKind::Load;
+                statement.target = slot_of(stmt);
+                statement.target_type = stmt->type;
+                statement.field = slot_of(stmt->operands[0]);
+                statement.element_type = stmt->operands[0]->type;
+                statement.operands.push_back(to_operand(stmt->operands[1]));
+                break;
+            case IRStmtKind::FieldStore:
+                statement.kind = StatementKind::Store;
+                statement.field = slot_of(stmt->operands[0]);
+                statement.element_type = stmt->operands[0]->type;
+                statement.operands.push_back(to_operand(stmt->operands[1]));
+                statement.operands.push_back(to_operand(stmt->operands[2]));
+                break;
+            case IRStmtKind::FieldAtomic:
+                statement.kind = StatementKind::Atomic;
+                statement.atomic = stmt->atomic;
+                statement.target = slot_of(stmt);
+                statement.target_type = stmt->type;
+                statement.field = slot_of(stmt->operands[0]);
+                statement.element_type = stmt->operands[0]->type;
+                for(size_t i = 1; i < stmt->operands.size(); i += 1) {
+                    statement.operands.push_back(to_operand(stmt->operands[i]));
+                }
+                break;
+            case IRStmtKind::Random:
+                statement.kind = StatementKind::Random;
+                statement.target = slot_of(stmt);
+                statement.target_type = stmt->type;
+                for(auto operand : stmt->operands) {
+                    statement.operands.push_back(to_operand(operand));
+                }
+                break;
+            case IRStmtKind::Call:
+                statement.kind = StatementKind::Call;
+                statement.callee = stmt->callee;
+                for(auto operand : stmt->operands) {
+                    statement.operands.push_back(to_operand(operand)); // field 参数是 Arg 的槽位
+                }
+                if(stmt->type != DataType::Void) {
+                    statement.target = slot_of(stmt);
+                    statement.target_type = stmt->type;
+                }
+                break;
+            case IRStmtKind::Return:
+                statement.kind = StatementKind::Return;
+                if(stmt->operands.size()) {
+                    statement.operands.push_back(to_operand(stmt->operands[0]));
+                }
+                break;
+            case IRStmtKind::RangeFor: {
+                statement.kind = StatementKind::LoopBegin;
+                statement.target = slot_of(stmt->operands[0]);
+                statement.target_type = stmt->operands[0]->type;
+                for(size_t i = 1; i < 4; i += 1) {
+                    statement.operands.push_back(to_operand(stmt->operands[i]));
+                }
+                statement.bound = new_slot(statement.target_type);
+                statement.step = new_slot(statement.target_type);
+                statements.push_back(statement);
+
+                statement.kind = StatementKind::LoopCheck;
+                statement.operands.clear();
+                size_t check_position = statements.size();
+                statements.push_back(statement);
+                lower_statements(stmt->body);
+
+                statement.kind = StatementKind::LoopEnd;
+                statement.jump = check_position;
+                statements.push_back(statement);
+                statements[check_position].jump = statements.size(); // 跳出循环之后执行 LoopEnd 后面的语句
+                continue;
+            }
+        }
+        statements.push_back(statement);
+    }
+}
+
+void Function::execute(Byte *args, Byte *result)
+{
+    std::vector<Scalar> slots(slot_types.size());
+    std::vector<uint64_t> frame((frame_bytes + 7) / 8); // 结构体最多按 8 字节对齐
+    for(size_t i = 0; i < argument_slots.size(); i += 1) {
+        memcpy(&slots[argument_slots[i]], args + 8 * i, 8); // 每个参数占 8 字节
+    }
+
+    uint64_t ticks = 1; // 这次调用
+    size_t pc = 0;
+    while(pc < statements.size()) {
+        const Statement &statement = statements[pc];
+        switch(statement.kind) {
+            case StatementKind::Assign:
+                slots[statement.target] = read_operand(statement.operands[0], slots, statement.target_type);
+                break;
+            case StatementKind::Operation:
+                slots[statement.target] = calc_scalar(
+                    statement.operation,
+                    statement.target_type,
+                    read_operand(statement.operands[0], slots, statement.target_type),
+                    read_operand(statement.operands[1], slots, statement.target_type)
+                );
+                break;
+            case StatementKind::Load: {
+                Byte *address = slots[statement.field].ptr
+                    + read_operand(statement.operands[0], slots, DataType::Int64).i64 * type_size(statement.element_type);
+                slots[statement.target] = cast_scalar(
+                    compute_type(statement.element_type),
+                    statement.target_type,
+                    load_element(statement.element_type, address)
+                );
+                break;
+            }
+            case StatementKind::Store: {
+                Byte *address = slots[statement.field].ptr
+                    + read_operand(statement.operands[0], slots, DataType::Int64).i64 * type_size(statement.element_type);
+                Scalar value = read_operand(statement.operands[1], slots, compute_type(statement.element_type));
+                store_element(statement.element_type, address, value);
+                break;
+            }
+            case StatementKind::Atomic: {
+                Byte *address = slots[statement.field].ptr
+                    + read_operand(statement.operands[0], slots, DataType::Int64).i64 * type_size(statement.element_type);
+                DataType value_type = compute_type(statement.element_type);
+                Scalar value = read_operand(statement.operands[1], slots, value_type);
+                Scalar desired = value;
+                if(statement.operands.size() > 2) {
+                    desired = read_operand(statement.operands[2], slots, value_type);
+                }
+                slots[statement.target] = cast_scalar(
+                    value_type,
+                    statement.target_type,
+                    atomic_scalar(statement.atomic, statement.element_type, address, value, desired)
+                );
+                break;
+            }
+            case StatementKind::Address: {
+                Byte *base = reinterpret_cast<Byte *>(frame.data());
+                if(statement.field != NoSlot) {
+                    base = slots[statement.field].ptr
+                        + read_operand(statement.operands[0], slots, DataType::Int64).i64 * statement.stride;
+                }
+                slots[statement.target].ptr = base + statement.offset;
+                break;
+            }
+            case StatementKind::Random: {
+                Scalar value;
+                value.f64 = random_uniform(
+                    static_cast<uint64_t>(read_operand(statement.operands[0], slots, DataType::Int64).i64),
+                    static_cast<uint64_t>(read_operand(statement.operands[1], slots, DataType::Int64).i64),
+                    static_cast<uint64_t>(read_operand(statement.operands[2], slots, DataType::Int64).i64)
+                );
+                slots[statement.target] = cast_scalar(DataType::Float64, statement.target_type, value);
+                break;
+            }
+            case StatementKind::Call: {
+                Function *callee = statement.callee;
+                // 返回结构体的话第 0 个操作数是接收结果的结构体
+                size_t first = callee->returns_struct() ? 1 : 0;
+                std::vector<Byte> buffer(8 * std::max<size_t>(callee->argument_list.size(), 1), 0);
+                for(size_t i = 0; i < callee->argument_list.size(); i += 1) {
+                    const Argument &param = callee->argument_list[i];
+                    Scalar value = param.is_field || is_struct_type(param.type)
+                        ? slots[statement.operands[first + i].slot]
+                        : read_operand(statement.operands[first + i], slots, param.type);
+                    memcpy(buffer.data() + 8 * i, &value, 8);
+                }
+                Scalar value;
+                value.i64 = 0;
+                Byte *result_address = first ? slots[statement.operands[0].slot].ptr : reinterpret_cast<Byte *>(&value);
+                callee->invoke(buffer.data(), result_address);
+                if(statement.target != NoSlot) {
+                    slots[statement.target] = cast_scalar(callee->return_type, statement.target_type, value);
+                }
+                break;
+            }
+            case StatementKind::Return: {
+                if(statement.operands.size()) {
+                    Scalar value = read_operand(statement.operands[0], slots, return_type);
+                    memcpy(result, &value, type_size(return_type));
+                }
+                add_hotness(ticks);
+                return;
+            }
+            case StatementKind::LoopBegin: {
+                DataType index_type = statement.target_type;
+                slots[statement.target] = read_operand(statement.operands[0], slots, index_type);
+                slots[statement.bound] = read_operand(statement.operands[1], slots, index_type);
+                slots[statement.step] = read_operand(statement.operands[2], slots, index_type);
+                break;
+            }
+            case StatementKind::LoopCheck: {
+                int64_t index, bound, step;
+                if(statement.target_type == DataType::Int32) {
+                    index = slots[statement.target].i32;
+                    bound = slots[statement.bound].i32;
+                    step = slots[statement.step].i32;
+                } else {
+                    index = slots[statement.target].i64;
+                    bound = slots[statement.bound].i64;
+                    step = slots[statement.step].i64;
+                }
+                if(step > 0 ? index >= bound : index <= bound) {
+                    pc = statement.jump; // 跳出循环
+                    continue;
+                }
+                break;
+            }
+            case StatementKind::LoopEnd: {
+                slots[statement.target] = calc_scalar(
+                    OperationType::Add,
+                    statement.target_type,
+                    slots[statement.target],
+                    slots[statement.step]
+                );
+                ticks += 1;
+                if(ticks >= HotnessFlushInterval) {
+                    add_hotness(ticks);
+                    ticks = 0;
+                }
+                pc = statement.jump; // 回到 LoopCheck
+                continue;
+            }
+        }
+        pc += 1;
+    }
+
+    // 没有 return 语句（build_finish 不会接受这样的函数，这里只是不留下未初始化的结果）
+    if(return_type != DataType::Void) {
+        memset(result, 0, type_size(return_type));
+    }
+    add_hotness(ticks);
+}
+
+void Function::add_hotness(uint64_t ticks)
+{
+    uint64_t total = hotness.fetch_add(ticks, std::memory_order_relaxed) + ticks;
+    if(
+        total >= taichi_llvm_unit->tier_up_threshold
+        && taichi_tiered_compiler
+        && !promotion_requested.exchange(true)
+    ) {
+        taichi_tiered_compiler->request(shared_from_this());
+    }
+}
+
+void Function::invoke(Byte *args, Byte *result)
+{
+    PackedEntry entry = packed_entry.load(std::memory_order_acquire);
+    if(entry) {
+        entry(args, result);
+    } else {
+        execute(args, result);
+    }
+}
+
+void Function::promote()
+{
+    if(compiled.load()) {
+        return;
+    }
+    compile_module();
+    std::string _m = "function " + name + " promoted to JIT code after " +
+        std::to_string(hotness.load()) + " ticks";
+    Out::Log(pType::DEBUG, _m.c_str());
+}
+
+void interpreter_entry(Function *function, Byte *args, Byte *result)
+{
+    function->invoke(args, result);
+}
+
+TieredCompiler::TieredCompiler()
+{
+    worker = std::thread(&TieredCompiler::worker_loop, this);
+}
+
+TieredCompiler::~TieredCompiler()
+{
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+void TieredCompiler::request(std::shared_ptr<Function> function)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back(std::move(function));
+    }
+    queue_cv.notify_one();
+}
+
+void TieredCompiler::worker_loop()
+{
+    Tracer::name_thread("tiered compiler");
+    while(true) {
+        std::shared_ptr<Function> function;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if(stopping) {
+                return;
+            }
+            function = queue.front();
+            queue.pop_front();
+        }
+        // 和 Python 端的构建接口互斥，它们使用同一个 LLVMContext
+        std::lock_guard<std::recursive_mutex> lock(llvm_mutex);
+        function->promote();
+        function.reset(); // Python 端已经删除的话在这里释放，仍然持有 llvm_mutex
+    }
+}
+
+void stop_tiered_compiler()
+{
+    taichi_tiered_compiler.reset();
+}
+
+}
@@ -0,0 +1,54 @@
+// 分层执行
+// 冷的函数使用解释器执行 Function 记录的语句流，热的函数交给后台线程编译
+
+#ifndef LLVM_INTERPRETER_H
+#define LLVM_INTERPRETER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "llvm_manager.h"
+
+namespace llvm_taichi
+{
+    // 后台编译的线程
+    // 热度达到阈值的函数被放入队列，由这个线程优化、生成代码，然后替换 stub 的跳转目标
+    class TieredCompiler {
+    protected:
+        std::thread worker;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        std::deque< std::shared_ptr<Function> > queue; // 等待编译的函数在编译之前不会被释放
+        bool stopping = false;
+
+    protected:
+        void worker_loop();
+
+    public:
+        TieredCompiler();
+        ~TieredCompiler(); // 等待正在编译的函数完成，队列中剩下的函数不再编译
+
+        // 请求编译一个函数，立即返回
+        void request(std::shared_ptr<Function> function);
+    };
+
+    extern std::unique_ptr<TieredCompiler> taichi_tiered_compiler;
+
+    // 标量的类型转换和运算，和生成的 LLVM 指令的语义一致（常量折叠也使用这两个函数）
+    Scalar cast_scalar(DataType from, DataType to, Scalar value);
+    Scalar calc_scalar(OperationType operation, DataType type, Scalar a, Scalar b);
+    // 对 address 处的元素做原子操作，返回操作之前的值
+    // type 是元素类型，存储类型的话 value、desired 和返回值都是它的计算类型
+    Scalar atomic_scalar(AtomicOperation operation, DataType type, Byte *address, Scalar value, Scalar desired);
+
+    // 解释器的入口，由 stub 中的 adapter 调用
+    // 参数和返回值的格式见 PackedEntry
+    void interpreter_entry(Function *function, Byte *args, Byte *result);
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "llvm_ir.h"
+#include "llvm_struct.h"
+
+#include <cstdio>
+
+namespace llvm_taichi
+{
+
+void for_each_stmt(IRBlock *block, const std::function<void(IRStmt *)> &visit)
+{
+    for(IRStmt *stmt : block->stmts) {
+        visit(stmt);
+        if(stmt->body) {
+            for_each_stmt(stmt->body, visit);
+        }
+    }
+}
+
+size_t count_stmts(IRBlock *block)
+{
+    size_t res = 0;
+    for_each_stmt(block, [&res](IRStmt *) { res += 1; });
+    return res;
+}
+
+static std::string constant_str(DataType type, const Scalar &value)
+{
+    char buffer[64] = {0};
+    switch(type) {
+        case DataType::Int32: snprintf(buffer, sizeof(buffer), "%d", value.i32); break;
+        case DataType::Int64: snprintf(buffer, sizeof(buffer), "%lld", (long long)value.i64); break;
+        case DataType::Float32: snprintf(buffer, sizeof(buffer), "%g", value.f32); break;
+        case DataType::Float64: snprintf(buffer, sizeof(buffer), "%g", value.f64); break;
+        default: break;
+    }
+    return buffer;
+}
+
+static const char *operation_str(OperationType operation)
+{
+    switch(operation) {
+        case OperationType::Add: return "add";
+        case OperationType::Sub: return "sub";
+        case OperationType::Mul: return "mul";
+        case OperationType::Div: return "div";
+    }
+    return "unknown";
+}
+
+static const char *atomic_str(AtomicOperation operation)
+{
+    switch(operation) {
+        case AtomicOperation::AtomicAdd: return "atomic_add";
+        case AtomicOperation::AtomicMin: return "atomic_min";
+        case AtomicOperation::AtomicMax: return "atomic_max";
+        case AtomicOperation::AtomicCas: return "atomic_cas";
+    }
+    return "atomic_unknown";
+}
+
+static std::string value_str(const IRStmt *stmt)
+{
+    return "$" + std::to_string(stmt->id);
+}
+
+static void print_block(
+    std::string &out,
+    IRBlock *block,
+    const std::vector< std::pair<std::string, uint32_t> > &locations,
+    int depth
+)
+{
+    for(IRStmt *stmt : block->stmts) {
+        std::string line(2 * depth, ' ');
+        if(stmt->type != DataType::Void) {
+            line += value_str(stmt) + " : " + DataTypeStr(stmt->type) + " = ";
+        }
+        auto operand = [stmt](size_t i) { return value_str(stmt->operands[i]); };
+        switch(stmt->kind) {
+            case IRStmtKind::Const:
+                line += "const " + constant_str(stmt->type, stmt->constant);
+                break;
+            case IRStmtKind::Arg:
+                line += "arg " + std::to_string(stmt->arg_index) + " " + taichi_symbols.name(stmt->name);
+                line += stmt->is_field ? "[]" : "";
+                break;
+            case IRStmtKind::Alloca:
+                line += "alloca " + taichi_symbols.name(stmt->name);
+                break;
+            case IRStmtKind::StructAlloca:
+                line += "struct_alloca " + taichi_symbols.name(stmt->name);
+                break;
+            case IRStmtKind::MemberPtr: {
+                const StructLayout *layout = taichi_struct_table.get(stmt->operands[0]->type);
+                line += "member_ptr " + operand(0) + "[" + operand(1) + "].";
+                line += layout ? taichi_symbols.name(layout->members[stmt->member].name) : std::to_string(stmt->member);
+                break;
+            }
+            case IRStmtKind::LocalLoad:
+                line += "local_load " + operand(0);
+                break;
+            case IRStmtKind::LocalStore:
+                line += "local_store " + operand(0) + ", " + operand(1);
+                break;
+            case IRStmtKind::Binary:
+                line += std::string(operation_str(stmt->operation)) + " " + operand(0) + ", " + operand(1);
+                break;
+            case IRStmtKind::Cast:
+                line += "cast " + operand(0);
+                break;
+            case IRStmtKind::FieldLoad:
+                line += "field_load " + operand(0) + "[" + operand(1) + "]";
+                break;
+            case IRStmtKind::FieldStore:
+                line += "field_store " + operand(0) + "[" + operand(1) + "], " + operand(2);
+                break;
+            case IRStmtKind::FieldAtomic:
+                line += std::string(atomic_str(stmt->atomic)) + " " + operand(0) + "[" + operand(1) + "], " + operand(2);
+                line += stmt->operands.size() > 3 ? ", " + operand(3) : "";
+                break;
+            case IRStmtKind::Random:
+                line += "random " + operand(0) + ", " + operand(1) + ", " + operand(2);
+                break;
+            case IRStmtKind::Call:
+                line += "call " + stmt->callee->get_name() + "(";
+                for(size_t i = 0; i < stmt->operands.size(); i += 1) {
+                    line += (i ? ", " : "") + operand(i);
+                }
+                line += ")";
+                break;
+            case IRStmtKind::Return:
+                line += "return";
+                line += stmt->operands.size() ? " " + operand(0) : "";
+                break;
+            case IRStmtKind::RangeFor:
+                line += "range_for " + operand(0) + " in [" + operand(1) + ", " + operand(2) + ", " + operand(3) + "]";
+                line += stmt->parallel ? " parallel {" : " {";
+                break;
+        }
+        if(stmt->location && stmt->location < locations.size()) {
+            line += "  ; line " + std::to_string(locations[stmt->location].second);
+        }
+        out += line + (char)10;
+        if(stmt->body) {
+            print_block(out, stmt->body, locations, depth + 1);
+            out += std::string(2 * depth, ' ') + "}" + (char)10;
+        }
+    }
+}
+
+std::string print_ir(
+    const std::string &name,
+    IRBlock *block,
+    const std::vector< std::pair<std::string, uint32_t> > &locations
+)
+{
+    std::string out = "function " + name + " {" + (char)10;
+    print_block(out, block, locations, 1);
+    out += "}";
+    out += (char)10;
+    return out;
+}
+
+}
@@ -0,0 +1,107 @@
+// 中间层的 IR（类似 taichi 的 CHI IR）
+// 导出的构建接口先生成这一层的 IR，经过 llvm_passes 中的优化之后，再 lowering 到 LLVM IR 以及解释器的语句流
+// 每个 IRStmt 最多定义一个值（SSA），局部变量使用 Alloca + LocalLoad / LocalStore 表示
+// 控制流是结构化的：RangeFor 拥有自己的循环体 IRBlock
+
+#ifndef LLVM_IR_H
+#define LLVM_IR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "llvm_manager.h"
+
+namespace llvm_taichi
+{
+    enum class IRStmtKind {
+        Const, // 常量 constant
+        Arg, // 第 arg_index 个参数，field 参数的值是元素指针，结构体参数的值是结构体的指针
+        Alloca, // 局部变量，type 是变量的类型
+        StructAlloca, // 结构体变量，type 是结构体类型，值是结构体的指针（不能 LocalLoad）
+        MemberPtr, // operands: base, index（Int64），值是 base[index] 的第 member 个成员的指针，type 是成员的类型
+        LocalLoad, // operands: alloca
+        LocalStore, // operands: alloca, value（value 的类型和变量相同）
+        Binary, // operands: left, right（类型和结果相同）
+        Cast, // operands: value，转换为 type
+        FieldLoad, // operands: field, index（Int64），type 是元素类型（field 也可以是 MemberPtr，这时 index 是 0）
+        FieldStore, // operands: field, index, value（value 的类型是元素类型）
+        FieldAtomic, // operands: field, index, value[, desired]，type 是元素类型，值是操作之前的元素
+        Random, // operands: seed, counter, stream（都是 Int64），type 是 Float64
+        // operands: 实参（已经转换为形参的类型，field 参数是 Arg，结构体参数是结构体的指针）
+        // 返回结构体的话 type 是 Void，operands[0] 是接收结果的 StructAlloca
+        Call,
+        Return, // operands: value（Void 函数没有）
+        RangeFor // operands: alloca（loop index）, begin, end, step，循环体是 body
+    };
+
+    struct IRBlock;
+
+    // 语句和 block 都在 Function 的 arena 中分配（见 llvm_arena），成员也都在 arena 中，不需要析构
+    struct IRStmt {
+        uint32_t id = 0;
+        IRStmtKind kind = IRStmtKind::Const;
+        DataType type = DataType::Void; // 值的类型，没有值的语句是 Void
+        ArenaVector<IRStmt *> operands;
+        OperationType operation = OperationType::Add; // Binary
+        AtomicOperation atomic = AtomicOperation::AtomicAdd; // FieldAtomic
+        Scalar constant; // Const
+        uint32_t arg_index = 0; // Arg
+        bool is_field = false; // Arg
+        uint32_t member = 0; // MemberPtr
+        Function *callee = nullptr; // Call
+        IRBlock *body = nullptr; // RangeFor
+        Symbol name = NoSymbol; // Arg 和 Alloca 的变量名，只用于打印
+        uint32_t location = 0; // 源码位置（Function::locations 的下标），0 表示没有
+        // access analysis 的结果
+        bool parallel = false; // RangeFor：field 的访问在迭代之间没有依赖
+        ArenaVector<IRStmt *> parallel_loops; // FieldLoad / FieldStore：所在的 parallel 循环（结构体变量的成员不属于任何循环）
+
+        explicit IRStmt(Arena &arena) :
+            operands(ArenaAllocator<IRStmt *>(arena)),
+            parallel_loops(ArenaAllocator<IRStmt *>(arena)) {}
+    };
+
+    struct IRBlock {
+        ArenaVector<IRStmt *> stmts;
+
+        explicit IRBlock(Arena &arena) : stmts(ArenaAllocator<IRStmt *>(arena)) {}
+    };
+
+    template<> struct ArenaTrivial<IRStmt> : std::true_type {};
+    template<> struct ArenaTrivial<IRBlock> : std::true_type {};
+
+    // 有值、没有副作用的语句，没有被使用的话可以删除
+    inline bool is_pure(const IRStmt *stmt) {
+        switch(stmt->kind) {
+            case IRStmtKind::Const:
+            case IRStmtKind::Binary:
+            case IRStmtKind::Cast:
+            case IRStmtKind::LocalLoad:
+            case IRStmtKind::FieldLoad:
+            case IRStmtKind::MemberPtr: // 只计算地址
+            case IRStmtKind::Random: // 只由操作数决定
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // 先序遍历所有的语句，包括循环体中的语句
+    void for_each_stmt(IRBlock *block, const std::function<void(IRStmt *)> &visit);
+
+    // 统计语句的数量（包括循环体中的语句）
+    size_t count_stmts(IRBlock *block);
+
+    // 打印 IR，locations 用于标注源码的行号
+    std::string print_ir(
+        const std::string &name,
+        IRBlock *block,
+        const std::vector< std::pair<std::string, uint32_t> > &locations
+    );
+}
+
+#endif
@@ -0,0 +1,190 @@
+#include <algorithm>
+
+#include "llvm_jit_memory.h"
+#include "../tool/print.h"
+
+namespace llvm_taichi
+{
+
+using llvm::sys::Memory;
+
+static const unsigned CodeFlags = Memory::MF_READ | Memory::MF_EXEC;
+static const unsigned ReadonlyFlags = Memory::MF_READ;
+static const unsigned ReadwriteFlags = Memory::MF_READ | Memory::MF_WRITE;
+
+JitMemory::~JitMemory()
+{
+    for(auto &frame : eh_frames) {
+        llvm::RTDyldMemoryManager::deregisterEHFramesInProcess(frame.first, frame.second);
+    }
+    for(auto &region : regions) {
+        Memory::releaseMappedMemory(region.block);
+    }
+}
+
+JitMemoryManager::JitMemoryManager()
+{
+    permanent = std::make_shared<JitMemory>();
+}
+
+void JitMemoryManager::set_owner(std::shared_ptr<JitMemory> memory)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    current = std::move(memory);
+}
+
+std::shared_ptr<JitMemory> JitMemoryManager::owner()
+{
+    return current ? current : permanent;
+}
+
+int64_t JitMemoryManager::map_region(const std::shared_ptr<JitMemory> &memory, size_t bytes, unsigned flags)
+{
+    std::error_code error;
+    // 映射的时候可写，finalizeMemory 的时候再改为最终的权限
+    llvm::sys::MemoryBlock block = Memory::allocateMappedMemory(
+        bytes, nullptr, Memory::MF_READ | Memory::MF_WRITE, error
+    );
+    if(error || !block.base()) {
+        std::string _m = "can not map " + std::to_string(bytes) + " bytes for jit code: " + error.message();
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return -1;
+    }
+    JitRegion region;
+    region.block = block;
+    region.flags = flags;
+    memory->regions.push_back(region);
+    size_t index = memory->regions.size() - 1;
+    pending.push_back(std::make_pair(memory, index));
+    return static_cast<int64_t>(index);
+}
+
+void JitMemoryManager::reserveAllocationSpace(
+    uintptr_t code_size,
+    llvm::Align code_align,
+    uintptr_t readonly_size,
+    llvm::Align readonly_align,
+    uintptr_t readwrite_size,
+    llvm::Align readwrite_align
+)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<JitMemory> memory = owner();
+    // 大小已经包括了段之间的对齐，区域本身按页对齐
+    const std::pair<uintptr_t, unsigned> reserves[3] = {
+        {code_size, CodeFlags},
+        {readonly_size, ReadonlyFlags},
+        {readwrite_size, ReadwriteFlags}
+    };
+    for(auto &reserve : reserves) {
+        if(reserve.first > 0) {
+            map_region(memory, reserve.first, reserve.second);
+        }
+    }
+    (void)code_align;
+    (void)readonly_align;
+    (void)readwrite_align;
+}
+
+uint8_t *JitMemoryManager::allocate(size_t bytes, size_t alignment, unsigned flags)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<JitMemory> memory = owner();
+    alignment = std::max<size_t>(alignment, 16);
+    // 只在还没有设置权限的区域中分配
+    auto place = [&](JitRegion &region) -> uint8_t * {
+        uintptr_t base = reinterpret_cast<uintptr_t>(region.block.base());
+        uintptr_t start = (base + region.used + alignment - 1) / alignment * alignment;
+        if(start + bytes > base + region.block.allocatedSize()) {
+            return nullptr;
+        }
+        region.used = start + bytes - base;
+        return reinterpret_cast<uint8_t *>(start);
+    };
+    for(auto &item : pending) {
+        if(item.first != memory || memory->regions[item.second].flags != flags) {
+            continue;
+        }
+        if(uint8_t *address = place(memory->regions[item.second])) {
+            return address;
+        }
+    }
+    // 预留的空间不够（或者没有预留），单独映射一个区域
+    int64_t index = map_region(memory, bytes + alignment, flags);
+    return index < 0 ? nullptr : place(memory->regions[index]);
+}
+
+uint8_t *JitMemoryManager::allocateCodeSection(
+    uintptr_t size,
+    unsigned alignment,
+    unsigned section_id,
+    llvm::StringRef section_name
+)
+{
+    uint8_t *address = allocate(size, alignment, CodeFlags);
+    if(address) {
+        owner()->code_bytes += size;
+    }
+    return address;
+}
+
+uint8_t *JitMemoryManager::allocateDataSection(
+    uintptr_t size,
+    unsigned alignment,
+    unsigned section_id,
+    llvm::StringRef section_name,
+    bool readonly
+)
+{
+    uint8_t *address = allocate(size, alignment, readonly ? ReadonlyFlags : ReadwriteFlags);
+    if(address) {
+        owner()->data_bytes += size;
+    }
+    return address;
+}
+
+bool JitMemoryManager::finalizeMemory(std::string *error)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    bool ok = true;
+    for(auto &item : pending) {
+        JitRegion &region = item.first->regions[item.second];
+        if(region.flags == ReadwriteFlags) {
+            continue;
+        }
+        if(std::error_code code = Memory::protectMappedMemory(region.block, region.flags)) {
+            if(error) {
+                *error = code.message();
+            }
+            ok = false;
+            continue;
+        }
+        if(region.flags & Memory::MF_EXEC) {
+            Memory::InvalidateInstructionCache(region.block.base(), region.block.allocatedSize());
+        }
+    }
+    pending.clear();
+    return !ok; // 和 LLVM 的约定一致：出错的时候返回 true
+}
+
+void JitMemoryManager::registerEHFrames(uint8_t *address, uint64_t load_address, size_t size)
+{
+    // JIT 在本进程中，加载地址就是 address
+    (void)load_address;
+    llvm::RTDyldMemoryManager::registerEHFramesInProcess(address, size);
+    std::lock_guard<std::mutex> lock(mutex);
+    owner()->eh_frames.push_back(std::make_pair(address, size));
+}
+
+JitMemoryScope::JitMemoryScope(JitMemoryManager *manager, const std::shared_ptr<JitMemory> &memory)
+{
+    this->manager = manager;
+    manager->set_owner(memory);
+}
+
+JitMemoryScope::~JitMemoryScope()
+{
+    manager->set_owner(nullptr);
+}
+
+}
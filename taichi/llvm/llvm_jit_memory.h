@@ -0,0 +1,102 @@
+// JIT 生成的代码和数据的内存管理
+// MCJIT 默认的 SectionMemoryManager 把所有 module 的段放在一起，只有 engine 销毁的时候才释放
+// 这里每个函数（owner）的段单独分配，函数被删除或者替换、没有调用者之后，它的代码和数据随之释放
+// 同时按 owner 统计代码和数据的字节数
+
+#ifndef LLVM_JIT_MEMORY_H
+#define LLVM_JIT_MEMORY_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/Support/Memory.h>
+
+namespace llvm_taichi
+{
+    // 一块映射的内存，段依次分配在其中
+    struct JitRegion {
+        llvm::sys::MemoryBlock block;
+        size_t used = 0;
+        unsigned flags; // 完成之后的权限：llvm::sys::Memory::ProtectionFlags
+    };
+
+    // 一个 owner 的所有段，析构的时候注销 EH frame、释放内存
+    // 持有者（Function）要保证这时已经没有线程在执行其中的代码
+    class JitMemory {
+    public:
+        std::vector<JitRegion> regions;
+        std::vector< std::pair<uint8_t *, size_t> > eh_frames;
+        size_t code_bytes = 0;
+        size_t data_bytes = 0;
+
+    public:
+        ~JitMemory();
+    };
+
+    class JitMemoryManager : public llvm::RTDyldMemoryManager {
+    protected:
+        std::mutex mutex;
+        std::shared_ptr<JitMemory> current; // 正在生成代码的 owner
+        std::shared_ptr<JitMemory> permanent; // 没有 owner 的代码（比如初始化时的 module），不会释放
+        // 还没有设置权限的区域（owner 中的下标），finalizeMemory 的时候处理
+        std::vector< std::pair<std::shared_ptr<JitMemory>, size_t> > pending;
+
+        std::shared_ptr<JitMemory> owner();
+        // 在 owner 中映射一个新的区域，返回下标，失败的话返回 -1
+        int64_t map_region(const std::shared_ptr<JitMemory> &memory, size_t bytes, unsigned flags);
+        // 在权限为 flags 的区域中分配，空间不够的话映射一个新的区域
+        uint8_t *allocate(size_t bytes, size_t alignment, unsigned flags);
+
+    public:
+        JitMemoryManager();
+
+        // 之后生成的代码属于 memory，nullptr 表示永久的代码
+        void set_owner(std::shared_ptr<JitMemory> memory);
+
+        bool needsToReserveAllocationSpace() override {
+            return true;
+        }
+        // 一个 object 加载之前，LLVM 给出代码、只读数据、读写数据各自需要的总大小，每种一次映射
+        void reserveAllocationSpace(
+            uintptr_t code_size,
+            llvm::Align code_align,
+            uintptr_t readonly_size,
+            llvm::Align readonly_align,
+            uintptr_t readwrite_size,
+            llvm::Align readwrite_align
+        ) override;
+        uint8_t *allocateCodeSection(
+            uintptr_t size,
+            unsigned alignment,
+            unsigned section_id,
+            llvm::StringRef section_name
+        ) override;
+        uint8_t *allocateDataSection(
+            uintptr_t size,
+            unsigned alignment,
+            unsigned section_id,
+            llvm::StringRef section_name,
+            bool readonly
+        ) override;
+        bool finalizeMemory(std::string *error) override;
+        void registerEHFrames(uint8_t *address, uint64_t load_address, size_t size) override;
+        // EH frame 由各个 owner 析构的时候注销
+        void deregisterEHFrames() override {}
+    };
+
+    // 作用域中生成的代码属于 memory（一次 addModule + finalizeObject）
+    class JitMemoryScope {
+    protected:
+        JitMemoryManager *manager;
+
+    public:
+        JitMemoryScope(JitMemoryManager *manager, const std::shared_ptr<JitMemory> &memory);
+        ~JitMemoryScope();
+    };
+}
+
+#endif
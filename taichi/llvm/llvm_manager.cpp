@@ -1,13 +1,190 @@
 #include "llvm_manager.h"
+#include "llvm_interpreter.h"
+#include "llvm_ir.h"
+#include "llvm_passes.h"
+#include "llvm_random.h"
+#include "llvm_storage.h"
+#include "llvm_struct.h"
+#include "llvm_trace.h"
+
+#include <cstdio>
+#include <unistd.h>
+
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/BinaryFormat/Dwarf.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/ADT/SmallString.h>
 
 namespace llvm_taichi
 {
 
+// 把 JIT 生成的函数写入 /tmp/perf-<pid>.map
+// perf 遇到匿名的可执行内存时，会从这个文件中查找符号，格式是每行「起始地址 大小 符号名」（十六进制）
+// 和 jitdump 相比，不需要 perf inject，LLVM 编译时也不需要开启 perf 支持
+class PerfMapListener : public llvm::JITEventListener {
+protected:
+    FILE *map_file = nullptr;
+
+public:
+    PerfMapListener() {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        map_file = fopen(path.c_str(), "w");
+        if(!map_file) {
+            std::string _m = "can not open " + path;
+            Out::Log(pType::WARNING, _m.c_str());
+        }
+    }
+
+    ~PerfMapListener() override {
+        if(map_file) {
+            fclose(map_file);
+        }
+    }
+
+    void notifyObjectLoaded(
+        ObjectKey key,
+        const llvm::object::ObjectFile &object,
+        const llvm::RuntimeDyld::LoadedObjectInfo &info
+    ) override {
+        if(!map_file) {
+            return;
+        }
+        // 用于调试的 object 中，符号的地址已经是加载之后的地址
+        llvm::object::OwningBinary<llvm::object::ObjectFile> debug_object = info.getObjectForDebug(object);
+        if(!debug_object.getBinary()) {
+            return;
+        }
+        for(const auto &symbol_size : llvm::object::computeSymbolSizes(*debug_object.getBinary())) {
+            const llvm::object::SymbolRef &symbol = symbol_size.first;
+            auto type = symbol.getType();
+            if(!type) {
+                llvm::consumeError(type.takeError());
+                continue;
+            }
+            if(*type != llvm::object::SymbolRef::ST_Function) {
+                continue;
+            }
+            auto name = symbol.getName();
+            auto address = symbol.getAddress();
+            if(!name || !address) {
+                if(!name) llvm::consumeError(name.takeError());
+                if(!address) llvm::consumeError(address.takeError());
+                continue;
+            }
+            fprintf(
+                map_file,
+                "%llx %llx %s\n",
+                (unsigned long long)*address,
+                (unsigned long long)symbol_size.second,
+                name->str().c_str()
+            );
+        }
+        fflush(map_file); // perf 可能在进程结束之前读取
+    }
+};
+
 // 需要「正式」声明分配空间，只有头文件的 extern 不够
-std::unordered_map< std::string, std::shared_ptr<Function> > taichi_func_table;
+FunctionTable taichi_func_table;
 std::unique_ptr<LLVMUnit> taichi_llvm_unit;
+std::recursive_mutex llvm_mutex;
+
+// 正在编译的函数，优化报告记录到这个函数中
+static Function *remark_target = nullptr;
+
+// 函数在 LLVM 中的符号名：第一次构建使用函数名，之后同名的函数（重新加载）加上序号
+// 旧的代码可能还被其他函数调用着，新旧两份代码在 engine 中同时存在，名字不能冲突
+static std::string unique_symbol(const std::string &name)
+{
+    static std::unordered_map<std::string, uint32_t> builds;
+    uint32_t count = builds[name]++;
+    return count ? name + "." + std::to_string(count) : name;
+}
+
+// 收集 LLVM 的优化报告
+// 默认情况下报告是不生成的，需要在 handler 中开启
+class RemarkHandler : public llvm::DiagnosticHandler {
+public:
+    bool handleDiagnostics(const llvm::DiagnosticInfo &info) override {
+        auto *remark = llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&info);
+        if(!remark) {
+            return false; // 其他的诊断信息（比如错误）交给默认的处理方式
+        }
+        if(!remark_target) {
+            return true; // 不属于任何函数的报告就丢掉（返回 false 的话 LLVM 会打印出来）
+        }
+
+        Remark result;
+        result.kind = remark->isPassed() ? "passed" : (remark->isMissed() ? "missed" : "analysis");
+        result.pass = remark->getPassName();
+        result.name = remark->getRemarkName().str();
+        result.line = 0;
+        if(remark->isLocationAvailable()) {
+            llvm::StringRef file;
+            unsigned line = 0, column = 0;
+            remark->getLocation(file, line, column);
+            result.file = file.str();
+            result.line = line;
+        }
+        result.message = remark->getMsg();
+        // 每个报告占一行
+        std::replace(result.message.begin(), result.message.end(), (char)10, ' ');
+        std::replace(result.message.begin(), result.message.end(), (char)9, ' ');
+        remark_target->add_remark(std::move(result));
+        return true;
+    }
+
+    bool isAnalysisRemarkEnabled(llvm::StringRef pass_name) const override {
+        // size-info 会在每个 pass 前后统计指令数量，开销很大
+        return isAnyRemarkEnabled() && pass_name != "size-info";
+    }
+    bool isMissedOptRemarkEnabled(llvm::StringRef pass_name) const override {
+        return isAnyRemarkEnabled();
+    }
+    bool isPassedOptRemarkEnabled(llvm::StringRef pass_name) const override {
+        return isAnyRemarkEnabled();
+    }
+    // 生成和格式化报告有不小的开销，只在 init 的时候要求收集、并且正在编译某个函数的时候开启
+    bool isAnyRemarkEnabled() const override {
+        return taichi_llvm_unit->collect_remarks && remark_target;
+    }
+};
+
+// 使用 O2 的标准 pipeline 优化一个 module
+// 向量化等优化需要知道目标机器的信息，所以使用 engine 的 TargetMachine
+static void optimize_module(llvm::Module *module)
+{
+    llvm::TargetMachine *target_machine = taichi_llvm_unit->engine->getTargetMachine();
+    if(target_machine) {
+        module->setDataLayout(target_machine->createDataLayout());
+        module->setTargetTriple(target_machine->getTargetTriple().str());
+    }
+
+    // 新的 pass manager 需要四个层级的 analysis manager，并且互相注册
+    llvm::LoopAnalysisManager loop_manager;
+    llvm::FunctionAnalysisManager function_manager;
+    llvm::CGSCCAnalysisManager cgscc_manager;
+    llvm::ModuleAnalysisManager module_manager;
+    llvm::PassBuilder pass_builder(target_machine);
+    pass_builder.registerModuleAnalyses(module_manager);
+    pass_builder.registerCGSCCAnalyses(cgscc_manager);
+    pass_builder.registerFunctionAnalyses(function_manager);
+    pass_builder.registerLoopAnalyses(loop_manager);
+    pass_builder.crossRegisterProxies(loop_manager, function_manager, cgscc_manager, module_manager);
+
+    llvm::ModulePassManager pass_manager = pass_builder.buildPerModuleDefaultPipeline(
+        llvm::OptimizationLevel::O2
+    );
+    pass_manager.run(*module, module_manager);
+}
 
-void init()
+void init(uint8_t profiler_integration, uint64_t tier_up_threshold, bool retain_ir, bool collect_remarks)
 {
     Out::Log(pType::DEBUG, "initing llvm lib...");
     taichi_llvm_unit = std::make_unique<LLVMUnit>(); // 创建 LLVM 的全局状态
@@ -19,20 +196,69 @@ void init()
 
     // 创建全局上下文
     taichi_llvm_unit->context = new llvm::LLVMContext();
+    // 结构体的 LLVM 类型属于之前的 context，用到的时候在新的 context 中重新创建
+    taichi_struct_table.reset_llvm_types();
+    // 优化报告由 RemarkHandler 收集
+    taichi_llvm_unit->context->setDiagnosticHandler(std::make_unique<RemarkHandler>(), true);
     // 感觉这个 InitModule 可有可无
     auto init_module = std::make_unique<llvm::Module>("TaichiInitModule", *(taichi_llvm_unit->context));
 
+    // 生成代码的目标是当前机器的 CPU（默认是通用的 x86-64，只有 SSE2，很多循环的向量化都不划算）
+    // 指令集扩展按实际检测到的来（虚拟机中 CPU 型号支持的扩展不一定都能用）
+    std::vector<std::string> host_features;
+    llvm::StringMap<bool> host_feature_map;
+    if(llvm::sys::getHostCPUFeatures(host_feature_map)) {
+        for(auto &feature : host_feature_map) {
+            host_features.push_back((feature.second ? "+" : "-") + feature.first().str());
+        }
+    }
+
     // 构建「执行引擎」
+    // 代码和数据按函数分配，函数释放之后随之释放（默认的 SectionMemoryManager 只有 engine 销毁的时候才释放）
+    auto memory_manager = std::make_unique<JitMemoryManager>();
+    taichi_llvm_unit->memory_manager = memory_manager.get(); // 属于 engine
+    taichi_llvm_unit->retain_ir = retain_ir;
+    taichi_llvm_unit->collect_remarks = collect_remarks;
     std::string Error;
     llvm::ExecutionEngine *Engine = llvm::EngineBuilder(std::move(init_module)) // 转交所有权
         .setErrorStr(&Error)
-        .setOptLevel(llvm::CodeGenOptLevel::None)
+        .setMCJITMemoryManager(std::move(memory_manager))
+        .setMCPU(llvm::sys::getHostCPUName())
+        .setMAttrs(host_features)
+        .setOptLevel(llvm::CodeGenOptLevel::Default) // IR 已经优化过了，代码生成也使用默认的优化
         .create();
     if(!Engine || Error.length()) {
         Out::Log(pType::ERROR, Error.c_str());
     }
     
     taichi_llvm_unit->engine = Engine;
+
+    // listener 要在生成任何代码之前注册
+    if(profiler_integration & ProfilerPerf) {
+        taichi_llvm_unit->owned_listeners.push_back(std::make_unique<PerfMapListener>());
+        // jitdump 需要 LLVM 编译时开启 perf 支持，没有开启的话得到 nullptr
+        llvm::JITEventListener *jitdump = llvm::JITEventListener::createPerfJITEventListener();
+        if(jitdump) {
+            taichi_llvm_unit->owned_listeners.emplace_back(jitdump);
+        } else {
+            Out::Log(pType::WARNING, "LLVM is built without perf support, only perf map is available");
+        }
+    }
+    for(auto &listener : taichi_llvm_unit->owned_listeners) {
+        Engine->RegisterJITEventListener(listener.get());
+    }
+    if(profiler_integration & ProfilerGDB) {
+        Engine->RegisterJITEventListener(llvm::JITEventListener::createGDBRegistrationListener());
+    }
+    // 行号信息对 perf annotate 和 GDB 都有用
+    taichi_llvm_unit->debug_info = profiler_integration != ProfilerNone;
+
+    // 分层执行：有返回值的函数（ti.func）先使用解释器，热了之后在后台编译
+    taichi_llvm_unit->tier_up_threshold = tier_up_threshold;
+    if(tier_up_threshold) {
+        taichi_tiered_compiler = std::make_unique<TieredCompiler>();
+    }
+
     taichi_llvm_unit->engine->finalizeObject();
     Out::Log(pType::DEBUG, "llvm lib init complated");
 
@@ -73,6 +299,45 @@ void init()
     // DEBUG
 }
 
+std::vector< std::pair<std::shared_ptr<Function>, FunctionHandle> > FunctionTable::alive()
+{
+    std::unordered_map<const Function *, FunctionHandle> owned;
+    for(size_t i = 0; i < functions.size(); i += 1) {
+        if(functions[i]) {
+            owned[functions[i].get()] = static_cast<FunctionHandle>(i);
+        }
+    }
+    std::vector< std::pair<std::shared_ptr<Function>, FunctionHandle> > res;
+    std::vector< std::weak_ptr<Function> > remain;
+    for(auto &weak : all) {
+        if(auto function = weak.lock()) {
+            auto it = owned.find(function.get());
+            res.push_back(std::make_pair(function, it == owned.end() ? NoFunction : it->second));
+            remain.push_back(weak);
+        }
+    }
+    all.swap(remain);
+    return res;
+}
+
+std::string jit_memory_report()
+{
+    std::lock_guard<std::recursive_mutex> lock(llvm_mutex);
+    std::string res;
+    for(auto &item : taichi_func_table.alive()) {
+        const Function *function = item.first.get();
+        bool registered = item.second != NoFunction && taichi_func_table.registered(item.second);
+        res += function->get_name() + "\t" + function->get_symbol()
+            + "\t" + std::to_string(item.second)
+            + "\t" + (registered ? "1" : "0")
+            + "\t" + std::to_string(function->code_bytes())
+            + "\t" + std::to_string(function->data_bytes())
+            + "\t" + std::to_string(function->ir_bytes())
+            + "\t" + std::to_string(function->retained_modules()) + "\n";
+    }
+    return res;
+}
+
 DataType OperationValue::get_data_type(
     Function *function
 ) const
@@ -81,7 +346,7 @@ DataType OperationValue::get_data_type(
     if(operation_value_type == OperationValueType::Constant) {
         res = constant_value_type; // 常量的话就直接返回记录的类型
     } else if(operation_value_type == OperationValueType::Variable) {
-        auto find_res = function->find_variable(variable_name);
+        auto find_res = function->find_variable(variable);
         if(find_res.first) {
             res = find_res.second; // 变量的话，就找到这个变量再返回其类型
         }
@@ -89,111 +354,339 @@ DataType OperationValue::get_data_type(
     return res;
 }
 
-llvm::Value *OperationValue::construct_llvm_value(
-    Function *function,
-    llvm::IRBuilder<> *builder,
-    llvm::LLVMContext *context
+IRStmt *OperationValue::construct_value(
+    Function *function
 ) const
 {
-    llvm::Value *res = nullptr;
+    IRStmt *res = nullptr;
     // 构造常量
     if(operation_value_type == OperationValueType::Constant) {
-        uint32_t cache_32 = 0;
-        uint64_t cache_64 = 0;
-        switch(constant_value_type) {
-            case DataType::Int32:
-                memcpy(&cache_32, constant_value, 4);
-                // 构造一个 int 常量
-                // 其实还有别的方式
-                // 1 首先构造一个 llvm::APInt 然后使用 llvm::ConstantInt::get
-                // 2 Builder.getInt32
-                // 这边的数据类型转换、截断规则还要再确认（构造32位的数据，传入的却是64位的数据）
-                res = llvm::ConstantInt::get(
-                    to_llvm_type(constant_value_type, context),
-                    static_cast<uint64_t>(cache_32),
-                    true
-                );
-                break;
-            case DataType::Int64:
-                memcpy(&cache_64, constant_value, 8);
-                res = llvm::ConstantInt::get(
-                    to_llvm_type(constant_value_type, context),
-                    cache_64,
-                    true
-                );
-                break;
-            // 创建浮点数常量
-            case DataType::Float32:
-                memcpy(&cache_32, constant_value, 4);
-                res = llvm::ConstantFP::get(
-                    to_llvm_type(constant_value_type, context),
-                    static_cast<double>(
-                        reinterpret_cast<float&>(cache_32) // 这里强制转换
-                    )
-                );
-                break;
-            case DataType::Float64:
-                memcpy(&cache_64, constant_value, 8);
-                res = llvm::ConstantFP::get(
-                    to_llvm_type(constant_value_type, context),
-                    reinterpret_cast<double&>(cache_64)
-                );
-                break;
-        }
-    // 变量的话，直接找到其地址，然后创建一个 Load 指令就可以了
+        res = function->emit_constant(constant_value_type, constant_value);
+    // 变量的话，直接找到这个变量，然后读取就可以了
     } else if(operation_value_type == OperationValueType::Variable) {
-        auto find_result = function->find_variable(variable_name);
-        if(find_result.first) {
-            res = builder->CreateLoad(
-                to_llvm_type(find_result.second, context),
-                find_result.first
-            );
+        auto find_result = function->find_variable(variable);
+        // 结构体变量不是一个值，只能整体赋值、传参，或者访问成员
+        if(find_result.first && is_struct_type(find_result.second)) {
+            std::string _m = "struct variable " + taichi_symbols.name(variable) + " can not be used as a value";
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+        } else if(find_result.first) {
+            res = function->emit(IRStmtKind::LocalLoad, find_result.second, {find_result.first});
         }
     }
     return res;
 }
 
-std::pair<llvm::AllocaInst *, DataType> Function::find_variable(const std::string &variable_name)
+// IRBlock 在头文件中是不完整的类型
+Function::Function() = default;
+
+// 还没有交给 engine 的 module 属于 context，释放的时候要和其他使用 LLVM 的线程互斥
+// 生成的代码由 jit_memory 释放（没有其他函数持有的话）
+Function::~Function()
+{
+    std::lock_guard<std::recursive_mutex> lock(llvm_mutex);
+    debug_builder.reset();
+    current_builder.reset();
+    current_module.reset();
+    asm_module.reset();
+}
+
+std::vector<void *> Function::finalize_module(
+    std::unique_ptr<llvm::Module> module,
+    const std::vector<llvm::Function *> &get
+)
+{
+    llvm::ExecutionEngine *engine = taichi_llvm_unit->engine;
+    llvm::Module *raw_module = module.get();
+    {
+        // 这次生成的代码和数据都属于这个函数
+        JitMemoryScope scope(taichi_llvm_unit->memory_manager, jit_memory);
+        engine->addModule(std::move(module));
+        engine->finalizeObject();
+    }
+    std::vector<void *> res;
+    for(llvm::Function *function : get) {
+        res.push_back(engine->getPointerToFunction(function));
+    }
+    // 代码已经生成，module 不再需要了
+    // 符号仍然在 engine 的符号表中，之后的 module 可以按名字调用这里的函数
+    if(engine->removeModule(raw_module)) {
+        delete raw_module;
+    }
+    return res;
+}
+
+void Function::drop_ir()
+{
+    if(taichi_llvm_unit->retain_ir) {
+        return;
+    }
+    std::string().swap(ir_ssa_initial);
+    std::string().swap(ir_ssa);
+    std::string().swap(ir_initial);
+    std::string().swap(ir_optimized);
+}
+
+// 字符串在堆上分配的字节数（短字符串放在对象内部，不算）
+static size_t heap_bytes(const std::string &text)
+{
+    static const size_t inline_capacity = std::string().capacity();
+    return text.capacity() > inline_capacity ? text.capacity() : 0;
+}
+
+size_t Function::ir_bytes() const
+{
+    // 不保留 IR 的话文本已经释放，语句流只有分层执行的函数才有
+    // 编译之后仍然保留语句流：可能还有线程在解释执行
+    return heap_bytes(ir_ssa_initial) + heap_bytes(ir_ssa) + heap_bytes(ir_initial)
+        + heap_bytes(ir_optimized) + heap_bytes(asm_code)
+        + statements.capacity() * sizeof(Statement);
+}
+
+size_t Function::retained_modules() const
 {
-    // 从栈顶开始找，实现作用域覆盖
+    return (current_module ? 1 : 0) + (asm_module ? 1 : 0);
+}
+
+std::pair<IRStmt *, DataType> Function::find_variable(Symbol variable_name)
+{
+    // 符号表中记录的就是当前可见的（最「内部」的）绑定，实现作用域覆盖
     // 注意：实际上 Python 无法做到显示声明变量，Python 在作用域内部访问一个外部已有的变量，会被视为「访问」而不是「创建」
     // 所以这个覆盖的机制，一般只可能在 loop 的作用域内体现（loop 的 index 是强制覆盖的）
-    for(int32_t i = variable_stack.size() - 1; i >= 0; i -= 1) {
-        auto env = &(variable_stack[i]);
-        if(env->count(variable_name)) {
-            return env->at(variable_name);
-        }
+    if(variable_name < bindings.size() && bindings[variable_name]) {
+        VariableBinding *binding = bindings[variable_name];
+        return std::make_pair(binding->value, binding->type);
     }
-    
-    return std::make_pair<llvm::AllocaInst *, DataType>(nullptr, DataType::Int32); // 地址返回 nullptr 的话表示没有找到这个变量
+    return std::make_pair<IRStmt *, DataType>(nullptr, DataType::Int32); // 返回 nullptr 的话表示没有找到这个变量
+}
+
+IRStmt *Function::new_stmt(IRStmtKind kind, DataType type)
+{
+    IRStmt *stmt = arena.create<IRStmt>(arena);
+    stmt->id = ir_next_id++;
+    stmt->kind = kind;
+    stmt->type = type;
+    stmt->location = current_location;
+    return stmt;
+}
+
+IRStmt *Function::emit(IRStmtKind kind, DataType type, std::initializer_list<IRStmt *> operands)
+{
+    IRStmt *stmt = new_stmt(kind, type);
+    stmt->operands.assign(operands.begin(), operands.end());
+    ir_blocks.top()->stmts.push_back(stmt);
+    return stmt;
+}
+
+IRStmt *Function::emit_constant(DataType type, const Byte *value)
+{
+    IRStmt *res = emit(IRStmtKind::Const, type);
+    res->constant.i64 = 0;
+    memcpy(&res->constant, value, type_size(type));
+    return res;
+}
+
+IRStmt *Function::emit_cast(IRStmt *value, DataType type)
+{
+    if(value->type == type) {
+        return value;
+    }
+    return emit(IRStmtKind::Cast, type, {value});
 }
 
-// llvm::AllocaInst 是 llvm::Value 的子类
-// 想取得 AllocaInst 的数据的话需要 Load
-// AllocaInst 表示的是一个内存地址（即指针）
-llvm::AllocaInst *Function::alloc_variable(const std::string &name, DataType type, bool force_local)
+// Alloca 表示一个局部变量（内存地址）
+// 读写都通过 LocalLoad / LocalStore，lowering 之后 LLVM 的 mem2reg 会把它们提升为寄存器
+IRStmt *Function::alloc_variable(Symbol name, DataType type, bool force_local)
 {
     // 强制创建本地变量？
-    // Y: 只在栈顶找
+    // Y: 只看当前作用域中的绑定
     // N: 正常找
-    auto res = force_local ? (
-        variable_stack.back().count(name)
-        ? variable_stack.back()[name]
-        : std::make_pair<llvm::AllocaInst *, DataType>(nullptr, DataType::Int32)
-    ) : find_variable(name);
+    size_t depth = scope_marks.size() - 1;
+    if(name < bindings.size() && bindings[name]) {
+        VariableBinding *binding = bindings[name];
+        if(!force_local || binding->depth == depth) {
+            return binding->value;
+        }
+    }
 
     // 没有找到就分配新变量
-    if(!res.first) {
-        llvm::AllocaInst *ptr = current_builder->CreateAlloca(
-            to_llvm_type(type, taichi_llvm_unit->context)
-        );
-        variable_stack.back()[name] = std::make_pair(
-            ptr,
-            type
-        );
-        return ptr;
+    // Alloca 统一放在函数体的最前面（参数之后），先单独记录，build_finish 的时候再放进函数体
+    // 放在循环体里的话，每次迭代栈都会增长，而且 LLVM 只会把入口处的 alloca 提升为寄存器
+    // 结构体变量的值就是它的内存地址，成员通过 MemberPtr 读写
+    IRStmt *ptr = new_stmt(is_struct_type(type) ? IRStmtKind::StructAlloca : IRStmtKind::Alloca, type);
+    ptr->name = name;
+    ir_allocas.push_back(ptr);
+
+    if(name >= bindings.size()) {
+        bindings.resize(name + 1, nullptr);
+    }
+    // 和 Python 一样，普通变量在整个函数内可见（比如循环内赋值、循环后使用）
+    // 只有 loop index 这种强制本地的变量属于当前作用域，离开作用域的时候恢复被覆盖的绑定
+    VariableBinding *binding = arena.create<VariableBinding>();
+    binding->value = ptr;
+    binding->type = type;
+    binding->depth = force_local ? depth : 0;
+    binding->previous = force_local ? bindings[name] : nullptr;
+    bindings[name] = binding;
+    if(force_local) {
+        scope_symbols.push_back(name);
+    }
+    return ptr;
+}
+
+void Function::push_scope()
+{
+    scope_marks.push_back(scope_symbols.size());
+}
+
+void Function::pop_scope()
+{
+    size_t mark = scope_marks.back();
+    while(scope_symbols.size() > mark) {
+        Symbol symbol = scope_symbols.back();
+        bindings[symbol] = bindings[symbol]->previous;
+        scope_symbols.pop_back();
+    }
+    scope_marks.pop_back();
+}
+
+std::pair<IRStmt *, DataType> Function::find_field(Symbol field_name)
+{
+    auto iter = field_table.find(field_name);
+    if(iter != field_table.end()) {
+        return iter->second;
+    }
+    return std::make_pair<IRStmt *, DataType>(nullptr, DataType::Int32);
+}
+
+IRStmt *Function::element_index(Symbol field_name, const OperationValue &index)
+{
+    auto field = find_field(field_name);
+    if(!field.first) {
+        std::string _m = "can not find field " + taichi_symbols.name(field_name) + " in function " + name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return nullptr;
+    }
+
+    IRStmt *index_value = index.construct_value(this);
+    if(!index_value) {
+        std::string _m = "illegal index of field " + taichi_symbols.name(field_name) + " in function " + name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return nullptr;
+    }
+    // 下标统一转换为 Int64
+    return emit_cast(index_value, DataType::Int64);
+}
+
+void Function::store_variable(Symbol name, IRStmt *value)
+{
+    auto find_result = find_variable(name);
+    if(!find_result.first) {
+        alloc_variable(name, value->type); // 新变量的类型就是值的类型
+        find_result = find_variable(name);
+    }
+    if(is_struct_type(find_result.second)) {
+        std::string _m = "can not assign a " + std::string(DataTypeStr(value->type)) +
+            " value to struct variable " + taichi_symbols.name(name) + " in function " + this->name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return;
+    }
+    // 在 Store 之前，需要进行类型转换
+    emit(IRStmtKind::LocalStore, DataType::Void, {find_result.first, emit_cast(value, find_result.second)});
+}
+
+std::pair<IRStmt *, DataType> Function::find_struct(Symbol name)
+{
+    auto find_result = find_variable(name);
+    if(find_result.first && is_struct_type(find_result.second)) {
+        return find_result;
+    }
+    return std::make_pair<IRStmt *, DataType>(nullptr, DataType::Void);
+}
+
+IRStmt *Function::struct_variable(Symbol name, DataType type)
+{
+    auto find_result = find_variable(name);
+    if(!find_result.first) {
+        return alloc_variable(name, type);
+    }
+    if(find_result.second != type) {
+        std::string _m = "variable " + taichi_symbols.name(name) + " is " + DataTypeStr(find_result.second) +
+            ", not struct " + DataTypeStr(type) + " in function " + this->name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return nullptr;
+    }
+    return find_result.first;
+}
+
+IRStmt *Function::temporary_struct(DataType type)
+{
+    IRStmt *ptr = new_stmt(IRStmtKind::StructAlloca, type);
+    ir_allocas.push_back(ptr);
+    return ptr;
+}
+
+IRStmt *Function::member_pointer(IRStmt *base, IRStmt *index, Symbol member_name)
+{
+    int32_t member = taichi_struct_table.member_index(base->type, member_name);
+    if(member < 0) {
+        std::string _m = "struct " + std::string(DataTypeStr(base->type)) + " has no member " +
+            taichi_symbols.name(member_name) + " in function " + name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return nullptr;
+    }
+    IRStmt *res = emit(
+        IRStmtKind::MemberPtr,
+        taichi_struct_table.get(base->type)->members[member].type,
+        {base, index}
+    );
+    res->member = member;
+    return res;
+}
+
+IRStmt *Function::struct_index()
+{
+    Scalar zero;
+    zero.i64 = 0;
+    return emit_constant(DataType::Int64, reinterpret_cast<Byte *>(&zero));
+}
+
+void Function::copy_struct(IRStmt *dst, IRStmt *dst_index, IRStmt *src, IRStmt *src_index, DataType type)
+{
+    IRStmt *zero_index = struct_index();
+    // 成员的读写和 field 的元素一样（存储类型读出来是计算类型，写入的时候转换回来）
+    // 整个结构体都在寄存器中的话，LLVM 的 SROA 会去掉这些读写
+    for(auto &member : taichi_struct_table.get(type)->members) {
+        IRStmt *src_member = member_pointer(src, src_index, member.name);
+        IRStmt *value = emit(IRStmtKind::FieldLoad, compute_type(member.type), {src_member, zero_index});
+        IRStmt *dst_member = member_pointer(dst, dst_index, member.name);
+        emit(IRStmtKind::FieldStore, DataType::Void, {dst_member, zero_index, value});
+    }
+}
+
+std::pair<IRStmt *, IRStmt *> Function::struct_base(Symbol base_name, const OperationValue *index)
+{
+    if(index) {
+        auto field = find_field(base_name);
+        if(!field.first || !is_struct_type(field.second)) {
+            std::string _m = "field " + taichi_symbols.name(base_name) + " is not a struct field in function " + name;
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+            return std::make_pair<IRStmt *, IRStmt *>(nullptr, nullptr);
+        }
+        return std::make_pair(field.first, element_index(base_name, *index));
+    }
+    auto variable = find_struct(base_name);
+    if(!variable.first) {
+        std::string _m = "variable " + taichi_symbols.name(base_name) + " is not a struct in function " + name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return std::make_pair<IRStmt *, IRStmt *>(nullptr, nullptr);
     }
-    return res.first;
+    return std::make_pair(variable.first, struct_index());
+}
+
+// 时间线中事件的 detail，没有开启追踪的话不需要 intern
+static const char *trace_detail(const std::string &name)
+{
+    return Tracer::enabled() ? Tracer::intern(name) : nullptr;
 }
 
 void Function::build_begin(
@@ -203,14 +696,38 @@ void Function::build_begin(
 )
 {
     // 保存常规的函数信息
+    trace_begin = Tracer::now();
     this->name = function_name;
+    this->symbol = unique_symbol(function_name);
     this->return_type = return_type;
+    this->fast_math = 0;
     
     this->argument_list.clear();
-    this->variable_stack.clear();
+    this->arena.reset();
+    this->bindings.clear();
+    this->scope_symbols.clear();
+    this->scope_marks.clear();
+    this->field_table.clear();
+    this->kernel_entry = nullptr;
+    this->pointer = nullptr;
+    this->callees.clear();
+    this->jit_memory = std::make_shared<JitMemory>();
+    this->debug_builder.reset();
+    this->debug_subprogram = nullptr;
+    this->debug_scopes.clear();
+    this->ir_body = arena.create<IRBlock>(arena);
+    this->ir_blocks = std::stack<IRBlock *>();
+    this->ir_blocks.push(this->ir_body);
+    this->ir_arguments.clear();
+    this->ir_result = nullptr;
+    this->ir_allocas.clear();
+    this->ir_next_id = 0;
+    this->locations.assign(1, std::make_pair(std::string(), 0u)); // 下标 0 表示没有位置
+    this->current_location = 0;
     for(auto arg : argument_list) {
         this->argument_list.push_back(arg);　// 参数列表
     }
+    this->field_hints.assign(this->argument_list.size(), std::make_pair(0u, 0u));
 
     this->current_module = std::make_unique<llvm::Module>(
         "taichi_module_" + function_name,
@@ -219,15 +736,19 @@ void Function::build_begin(
     this->current_builder = std::make_unique< llvm::IRBuilder<> >(
         *(taichi_llvm_unit->context)
     );
-    this->current_blocks = std::stack<llvm::BasicBlock *>();
 
+    // 返回结构体的函数：结果的地址是第 0 个参数（sret），函数本身返回 void
+    // 调用者提供结果的内存，寄存器放不下的结构体 C 的 ABI 也是这样返回的
     llvm::Type *llvm_return_type = to_llvm_type(
-        this->return_type,
+        returns_struct() ? DataType::Void : this->return_type,
         taichi_llvm_unit->context
     );
     std::vector<llvm::Type *> llvm_args_type;
+    if(returns_struct()) {
+        llvm_args_type.push_back(llvm::PointerType::get(to_llvm_type(return_type, taichi_llvm_unit->context), 0));
+    }
     for(auto arg : this->argument_list) {
-        llvm_args_type.push_back(to_llvm_type(arg.type, taichi_llvm_unit->context));
+        llvm_args_type.push_back(to_llvm_type(arg, taichi_llvm_unit->context));
     }
     llvm::ArrayRef<llvm::Type *> llvm_args_type_array(llvm_args_type);
 
@@ -238,404 +759,1786 @@ void Function::build_begin(
         false
     );
 
-    // 创建函数
+    // 创建函数（函数体在 build_finish 的时候由中间层的 IR lowering 得到）
+    // 其他函数调用这个函数的时候需要它的类型，所以在这里就创建
+    this->function_type = func_type;
     this->llvm_function = llvm::Function::Create(
         func_type,
         llvm::Function::ExternalLinkage,
-        this->name,
+        this->symbol,
         *(this->current_module)
     );
-
-    // 创建起始代码块
-    llvm::BasicBlock *entry_block = llvm::BasicBlock::Create(
-        *(taichi_llvm_unit->context),
-        "function_entry",
-        this->llvm_function
-    );
-    this->current_builder->SetInsertPoint(entry_block); // 从这个位置开始构建代码
-    this->current_blocks.push(entry_block);
+    // 结果的内存不和其他指针重叠；结构体参数只读，而且不会被保存下来
+    size_t first_argument = returns_struct() ? 1 : 0;
+    if(returns_struct()) {
+        llvm::Type *struct_type = to_llvm_type(return_type, taichi_llvm_unit->context);
+        llvm_function->addParamAttr(0, llvm::Attribute::getWithStructRetType(*(taichi_llvm_unit->context), struct_type));
+        llvm_function->addParamAttr(0, llvm::Attribute::NoAlias);
+    }
+    for(size_t i = 0; i < this->argument_list.size(); i += 1) {
+        if(!this->argument_list[i].is_field && is_struct_type(this->argument_list[i].type)) {
+            llvm_function->addParamAttr(first_argument + i, llvm::Attribute::ReadOnly);
+            llvm_function->addParamAttr(first_argument + i, llvm::Attribute::NoCapture);
+        }
+    }
 
     // 第一个作用域，也就是函数最外部的作用域
-    this->variable_stack.push_back(
-        std::unordered_map<
-            std::string,
-            std::pair<llvm::AllocaInst *, DataType>
-        >()
-    );
-    llvm::Function::arg_iterator arg_begin = this->llvm_function->arg_begin(); // 获取每个参数
-    // 将每个实参都另外存储一份（这样做不是最佳做法）
-    for(auto arg : this->argument_list) {
-        auto ptr = alloc_variable(arg.name, arg.type);
-        current_builder->CreateStore(arg_begin++, ptr);
+    push_scope();
+    if(returns_struct()) {
+        ir_result = emit(IRStmtKind::Arg, return_type);
+        ir_result->arg_index = 0;
+        ir_result->name = taichi_symbols.intern("_taichi_result");
+    }
+    // 每个参数对应一个 Arg
+    for(size_t i = 0; i < this->argument_list.size(); i += 1) {
+        const Argument &arg = this->argument_list[i];
+        IRStmt *value = emit(IRStmtKind::Arg, arg.type);
+        value->arg_index = first_argument + i;
+        value->is_field = arg.is_field;
+        value->name = taichi_symbols.intern(arg.name);
+        ir_arguments.push_back(value);
+    }
+    // 将每个实参都另外存储一份，参数也可以被重新赋值（多余的读写由中间层的优化去掉）
+    // field 参数是指针，不会被重新赋值，直接记录下来
+    for(auto value : ir_arguments) {
+        if(value->is_field) {
+            field_table[value->name] = std::make_pair(value, value->type);
+            continue;
+        }
+        auto ptr = alloc_variable(value->name, value->type);
+        if(is_struct_type(value->type)) {
+            // 结构体参数复制到自己的变量中，和标量参数一样是值语义（修改成员不影响调用者）
+            IRStmt *zero_index = struct_index();
+            copy_struct(ptr, zero_index, value, zero_index, value->type);
+            continue;
+        }
+        emit(IRStmtKind::LocalStore, DataType::Void, {ptr, value});
     }
 }
 
-void Function::build_finish()
+void Function::set_fast_math(uint32_t flags)
 {
-    if (llvm::verifyFunction(*llvm_function)) {
-        Out::Log(pType::ERROR, "verify function failed");
-    }
+    fast_math = flags & FastMathFast;
+    // lowering 的时候 builder 创建的浮点数运算都带上这些 flags
+    llvm::FastMathFlags fmf;
+    fmf.setNoNaNs(fast_math & FastMathNoNaNs);
+    fmf.setNoInfs(fast_math & FastMathNoInfs);
+    fmf.setNoSignedZeros(fast_math & FastMathNoSignedZeros);
+    fmf.setAllowReciprocal(fast_math & FastMathReciprocal);
+    fmf.setAllowContract(fast_math & FastMathContract);
+    fmf.setApproxFunc(fast_math & FastMathApproxFunc);
+    fmf.setAllowReassoc(fast_math & FastMathReassoc);
+    current_builder->setFastMathFlags(fmf);
 
-    // 将构建的 IR 结果输出到一个 string
-    // 使用 llvm 提供的这个 raw_string_ostream
-    std::string func_code;
-    llvm::raw_string_ostream rso(func_code);
-    current_module->print(rso, nullptr);
-    std::string _m = std::string("code of ") + name + " is" + (char)10;
-    _m += std::string(40, '=') + (char)10; // 40 个 '=' 的写法
-    _m += func_code;
-    _m += std::string(40, '=');
+    // 函数属性：后端（比如指令选择）按函数而不是按指令判断的那部分
+    auto attribute = [this](const char *name, bool enabled) {
+        llvm_function->addFnAttr(name, enabled ? "true" : "false");
+    };
+    attribute("no-nans-fp-math", fast_math & FastMathNoNaNs);
+    attribute("no-infs-fp-math", fast_math & FastMathNoInfs);
+    attribute("no-signed-zeros-fp-math", fast_math & FastMathNoSignedZeros);
+    attribute("approx-func-fp-math", fast_math & FastMathApproxFunc);
+    attribute("unsafe-fp-math", fast_math == FastMathFast);
+
+    std::string _m = "fast math of " + name + ": " + std::to_string(fast_math);
     Out::Log(pType::DEBUG, _m.c_str());
+}
 
-    // 添加 Module 到 EE
-    taichi_llvm_unit->engine->addModule(std::move(current_module));
+void Function::set_field_hint(uint32_t argument, uint32_t flags, uint32_t prefetch_distance)
+{
+    if(argument >= argument_list.size() || !argument_list[argument].is_field) {
+        std::string _m = "field hint of " + name + ": argument " + std::to_string(argument) + " is not a field";
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return;
+    }
+    flags &= FieldHintStreaming | FieldHintPrefetch | FieldHintPrefetchGather;
+    // 距离为 0 的话没有预取
+    if(prefetch_distance == 0) {
+        flags &= ~(FieldHintPrefetch | FieldHintPrefetchGather);
+    }
+    field_hints[argument] = std::make_pair(flags, prefetch_distance);
 
-    // 完成 JIT 编译的最后阶段
-    // 确保编译完成，代码已被完全生成
-    // 因为刚才添加了一个 module 所以现在执行
-    taichi_llvm_unit->engine->finalizeObject();
+    std::string _m = "field hint of " + name + "." + argument_list[argument].name + ": " +
+        std::to_string(flags) + ", prefetch distance " + std::to_string(prefetch_distance);
+    Out::Log(pType::DEBUG, _m.c_str());
+}
 
-    Out::Log(pType::DEBUG, "function has been added to engine");
+std::pair<uint32_t, uint32_t> Function::field_hint(const IRStmt *field) const
+{
+    if(field->kind != IRStmtKind::Arg || !field->is_field) {
+        return std::make_pair(0u, 0u);
+    }
+    return field_hints[field->arg_index - (returns_struct() ? 1 : 0)];
 }
 
-// loop 的栈操作比较繁琐，要注意
-void Function::loop_begin(
-    const std::string &loop_index_name,
-    int32_t l,
-    int32_t r,
-    int32_t s
-)
+void Function::debug_begin(const std::string &file_name, uint32_t line)
 {
-    // 创建循环基本上需要「3个Block」
-    // 循环条件判断（cond）、循环体（body）、和循环后的代码（after）
-    llvm::BasicBlock *if_blcok = llvm::BasicBlock::Create(
-        *(taichi_llvm_unit->context),
-        "loop_if", // 这些名字不会影响逻辑，只是为了辅助调试（这些名字会在IR中保留）
-        this->llvm_function
-    );
-    llvm::BasicBlock *body_block = llvm::BasicBlock::Create(
-        *(taichi_llvm_unit->context),
-        "loop_body",
-        this->llvm_function
-    );
-    llvm::BasicBlock *next_block = llvm::BasicBlock::Create(
-        *(taichi_llvm_unit->context),
-        "loop_next",
-        this->llvm_function
-    );
+    // 源码位置总是记录，打印中间层的 IR 的时候也会用到
+    locations.push_back(std::make_pair(file_name, line));
+    current_location = locations.size() - 1;
 
-    // 创建一个新的变量作用域（循环体 body 的作用域）
-    variable_stack.push_back(
-        std::unordered_map<
-            std::string,
-            std::pair<llvm::AllocaInst *, DataType>
-        >()
-    );
-    // 注意对 block 的操作
-    current_blocks.pop();
-    current_blocks.push(next_block);
-    current_blocks.push(if_blcok);
-    current_blocks.push(body_block);
-
-    auto loop_index_ptr = alloc_variable(loop_index_name, DataType::Int32, true); // 强制声明一个 local 变量（不使用外部变量）
-    current_builder->CreateStore(
-        llvm::ConstantInt::get(
-            to_llvm_type(DataType::Int32, taichi_llvm_unit->context),
-            static_cast<uint64_t>(l),
-            true
-        ),
-        loop_index_ptr
-    );
-    // 保存当前 loop 的状态
-    current_loop_update.push(std::make_pair(
-        loop_index_ptr,
-        s
-    ));
-    current_builder->CreateBr(if_blcok); // 无条件跳转
-    // 跳转是一种「终结指令」
-    // 每个基本块只能有一个终结指令（如 br、ret 等）（必须在最后吗？应该是的）
-
-    // 开始构建 if 代码块
-    current_builder->SetInsertPoint(if_blcok);
-    llvm::LoadInst *load_loop_index = current_builder->CreateLoad(
-        to_llvm_type(DataType::Int32, taichi_llvm_unit->context),
-        loop_index_ptr
+    if(!taichi_llvm_unit->debug_info || debug_builder) {
+        return;
+    }
+
+    debug_builder = std::make_unique<llvm::DIBuilder>(*current_module);
+    llvm::DIFile *file = debug_builder->createFile(file_name, ".");
+    debug_builder->createCompileUnit(
+        llvm::dwarf::DW_LANG_Python,
+        file,
+        "taichi-mini",
+        false, // 没有开启优化
+        "",
+        0
     );
-    llvm::Value *compare_result = current_builder->CreateICmpSLT( // 创建比较节点
-        load_loop_index,
-        llvm::ConstantInt::get(
-            to_llvm_type(DataType::Int32, taichi_llvm_unit->context),
-            static_cast<uint64_t>(r),
-            true
-        )
+    current_module->addModuleFlag(
+        llvm::Module::Warning,
+        "Debug Info Version",
+        llvm::DEBUG_METADATA_VERSION
     );
-    // 根据条件跳转，进入循环 or 跳出循环
-    current_builder->CreateCondBr(compare_result, body_block, next_block);
-    // if 代码块 构建完成
-
-    // 开始构建 body 代码块
-    current_builder->SetInsertPoint(body_block);
-}
 
-void Function::loop_finish()
-{
-    // loop 结束的时候，loop index 要增加一个步进的长度
-    llvm::LoadInst *load = current_builder->CreateLoad(
-        to_llvm_type(DataType::Int32, taichi_llvm_unit->context),
-        current_loop_update.top().first
-    );
-    llvm::Value *add_result = current_builder->CreateAdd(
-        load,
-        llvm::ConstantInt::get(
-            to_llvm_type(DataType::Int32, taichi_llvm_unit->context),
-            static_cast<uint64_t>(current_loop_update.top().second),
-            true
-        )
+    // 只需要行号，函数类型不需要描述参数
+    llvm::DISubroutineType *type = debug_builder->createSubroutineType(
+        debug_builder->getOrCreateTypeArray({})
     );
-    current_builder->CreateStore(
-        add_result,
-        current_loop_update.top().first
+    debug_subprogram = debug_builder->createFunction(
+        file,
+        name,
+        name,
+        file,
+        line,
+        type,
+        line,
+        llvm::DINode::FlagPrototyped,
+        llvm::DISubprogram::SPFlagDefinition
     );
-    current_blocks.pop();
-    current_builder->CreateBr(current_blocks.top()); // loop 结束之后 一定是跳转到 if 块
-    current_blocks.pop();
-
-    // loop 的作用域结束了
-    variable_stack.pop_back();
-    current_loop_update.pop();
-    
-    current_builder->SetInsertPoint(current_blocks.top()); // loop 结束之后的代码块
+    llvm_function->setSubprogram(debug_subprogram);
+    debug_scopes[file_name] = debug_subprogram;
 }
 
-void Function::assignment_statement(
-    const std::string &name,
-    const OperationValue &value
-)
+void Function::debug_location(const std::string &file_name, uint32_t line)
 {
-    if(name == value.variable_name) return; // 同名赋值
-
-    auto target_find_result = find_variable(name);
-    if(!target_find_result.first) {
-        alloc_variable(name, value.get_data_type(this)); // 找不到，就说明是新变量，在这里创建这个新变量
-    }
-
-    target_find_result = find_variable(name);
-    current_builder->CreateStore(
-        cast( // 在 Store 之前，需要进行类型转换
-            value.get_data_type(this),
-            target_find_result.second,
-            value.construct_llvm_value(
-                this,
-                current_builder.get(),
-                taichi_llvm_unit->context
-            ),
-            current_builder.get(),
-            taichi_llvm_unit->context
-        ),
-        target_find_result.first
-    );
+    // 之后 emit 的语句都带着这个位置，lowering 的时候再转换为 DILocation
+    locations.push_back(std::make_pair(file_name, line));
+    current_location = locations.size() - 1;
 }
 
-void Function::assignment_statement(
-    const std::string &result_name,
-    const OperationValue &left_value,
-    OperationType operation_type,
-    const OperationValue &right_value
-)
+bool Function::build_finish()
 {
-    auto find_result = find_variable(result_name);
-    if(!find_result.first) {
-        DataType left_type = left_value.get_data_type(this);
-        DataType right_type = right_value.get_data_type(this);
-        // 如果要创建新变量存储计算结果，新变量的类型需要计算得到（自动类型提升）
-        DataType result_type = calc_type(left_type, right_type);
+    // Alloca 放到参数（以及结果的地址）之后，一次性插入
+    auto &stmts = ir_body->stmts;
+    size_t argument_count = ir_arguments.size() + (ir_result ? 1 : 0);
+    stmts.insert(stmts.begin() + argument_count, ir_allocas.begin(), ir_allocas.end());
 
-        alloc_variable(result_name, result_type);
+    // 中间层的 IR：优化之前和之后各保存一份文本
+    ir_ssa_initial = print_ir(name, ir_body, locations);
+    size_t initial_count = count_stmts(ir_body);
+    {
+        TraceScope trace("compile", "ssa passes", trace_detail(name));
+        run_ir_passes(ir_body, loop_reports);
     }
+    ir_ssa = print_ir(name, ir_body, locations);
+    std::string _m = std::string("ssa code of ") + name + " is" + (char)10;
+    _m += std::string(40, '=') + (char)10;
+    _m += ir_ssa;
+    _m += std::string(40, '=');
+    Out::Log(pType::DEBUG, "%s", _m.c_str());
+    _m = "ssa passes of " + name + ": " + std::to_string(initial_count) + " -> " +
+        std::to_string(count_stmts(ir_body)) + " statements";
+    Out::Log(pType::DEBUG, _m.c_str());
 
-    find_result = find_variable(result_name);
-    DataType result_type = find_result.second;
+    // 分层执行：有返回值的函数（ti.func）先使用解释器执行语句流
+    // 真正的函数改名为 name_taichi_jit，等到足够热了再编译；原来的名字留给 stub
+    // kernel 总是直接编译，它的入口由 runtime 的 worker 并行调用，解释执行太慢
+    // 返回结构体的函数也直接编译，stub 和解释器只按 8 字节传递返回值
+    tiered = taichi_llvm_unit->tier_up_threshold > 0 && return_type != DataType::Void && !returns_struct();
 
-    // 运算之前，必须转换为相同的类型
-    llvm::Value *llvm_left_value = cast(
-        left_value.get_data_type(this),
-        result_type,
-        left_value.construct_llvm_value(
-            this,
-            current_builder.get(),
-            taichi_llvm_unit->context
+    // 优化之后的 IR lowering 到 LLVM IR，分层执行的话还有解释器的语句流（直接编译的函数不会被解释执行）
+    bool lowered;
+    {
+        TraceScope trace("compile", "lowering", trace_detail(name));
+        lowered = lower_to_llvm();
+        if(tiered) {
+            lower_statements();
+        }
+    }
+
+    // 中间层的 IR 不再需要了，整个 arena 一次性释放
+    _m = "ir arena of " + name + ": " + std::to_string(arena.bytes_used()) + " bytes";
+    Out::Log(pType::DEBUG, "%s", _m.c_str());
+    ir_body = nullptr;
+    ir_blocks = std::stack<IRBlock *>();
+    ir_arguments.clear();
+    ir_result = nullptr;
+    ir_allocas.clear();
+    value_slots.clear();
+    bindings.clear();
+    scope_symbols.clear();
+    scope_marks.clear();
+    field_table.clear();
+    arena.reset();
+
+    if(debug_builder) {
+        debug_builder->finalize(); // 调试信息必须在 verify 之前完成
+    }
+
+    if(!lowered) {
+        return false;
+    }
+    if (llvm::verifyFunction(*llvm_function)) {
+        _m = "verify function " + name + " failed";
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return false;
+    }
+
+    // 将构建的 IR 结果输出到一个 string
+    // 使用 llvm 提供的这个 raw_string_ostream
+    ir_initial.clear();
+    llvm::raw_string_ostream rso(ir_initial);
+    current_module->print(rso, nullptr);
+    rso.flush();
+    _m = std::string("code of ") + name + " is" + (char)10;
+    _m += std::string(40, '=') + (char)10; // 40 个 '=' 的写法
+    _m += ir_initial;
+    _m += std::string(40, '=');
+    Out::Log(pType::DEBUG, "%s", _m.c_str()); // IR 中有 %，不能直接作为格式字符串
+
+    if(tiered) {
+        llvm_function->setName(symbol + "_taichi_jit");
+        build_stub();
+        std::string _m = "function " + name + " will be interpreted until it gets hot";
+        Out::Log(pType::DEBUG, _m.c_str());
+    } else {
+        compile_module();
+    }
+
+    // 从 build_begin 到这里（包括 Python 端逐条调用构建接口的时间）
+    if(Tracer::enabled()) {
+        int64_t end = Tracer::now();
+        Tracer::record(TraceEvent{
+            "compile", "build", trace_detail(name), 'X', trace_begin, end - trace_begin, -1,
+            "tiered", tiered ? 1 : 0, nullptr, 0
+        });
+    }
+    return true;
+}
+
+void Function::compile_module()
+{
+    // 打包调用的入口和函数本身放在同一个 module 中，可以被内联
+    build_packed_entry();
+
+    // 优化，优化报告和代码生成阶段的报告都记录到这个函数
+    remarks.clear();
+    remark_target = this;
+    {
+        TraceScope trace("compile", "optimize", trace_detail(name));
+        optimize_module(current_module.get());
+        mark_streaming_stores();
+    }
+
+    ir_optimized.clear();
+    llvm::raw_string_ostream optimized_rso(ir_optimized);
+    current_module->print(optimized_rso, nullptr);
+    optimized_rso.flush();
+    std::string _m = std::string("optimized code of ") + name + " is" + (char)10;
+    _m += std::string(40, '=') + (char)10;
+    _m += ir_optimized;
+    _m += std::string(40, '=');
+    Out::Log(pType::DEBUG, "%s", _m.c_str());
+
+    // 生成汇编用的拷贝，不保留 IR 的话就不能查看汇编了
+    if(taichi_llvm_unit->retain_ir) {
+        asm_module = llvm::CloneModule(*current_module);
+    }
+    asm_code.clear();
+
+    // 添加 Module 到 EE，完成 JIT 编译的最后阶段，代码生成之后 module 就释放了
+    std::vector<void *> pointers;
+    {
+        TraceScope trace("compile", "codegen", trace_detail(name));
+        pointers = finalize_module(std::move(current_module), {packed_function, llvm_function});
+    }
+    remark_target = nullptr;
+    // 调试信息引用了刚才的 module
+    debug_builder.reset();
+    debug_subprogram = nullptr;
+    debug_scopes.clear();
+    current_builder.reset();
+    llvm_function = nullptr;
+    packed_function = nullptr;
+
+    packed_entry.store(reinterpret_cast<PackedEntry>(pointers[0]), std::memory_order_release);
+    if(!tiered) {
+        thunk = packed_entry.load(std::memory_order_relaxed);
+        pointer = pointers[1];
+    }
+    if(tiered) {
+        // 之后 stub 直接跳转到编译好的函数，正在解释执行的调用不受影响
+        slot.store(pointers[1], std::memory_order_release);
+    }
+    compiled.store(true);
+    drop_ir();
+
+    Out::Log(pType::DEBUG, "function has been added to engine");
+}
+
+// 从打包的参数中依次读取，每个参数占 8 字节
+static std::vector<llvm::Value *> load_packed_arguments(
+    llvm::IRBuilder<> *builder,
+    llvm::Value *buffer,
+    const std::vector<Argument> &argument_list,
+    size_t first
+)
+{
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+    std::vector<llvm::Value *> args;
+    for(size_t i = first; i < argument_list.size(); i += 1) {
+        llvm::Type *arg_type = to_llvm_type(argument_list[i], context);
+        llvm::Value *slot = builder->CreateConstGEP1_64(
+            llvm::Type::getInt8Ty(*context),
+            buffer,
+            8 * (i - first)
+        );
+        slot = builder->CreateBitCast(slot, llvm::PointerType::get(arg_type, 0));
+        args.push_back(builder->CreateLoad(arg_type, slot));
+    }
+    return args;
+}
+
+void Function::mark_streaming_stores()
+{
+    std::vector<bool> streaming;
+    bool any = false;
+    for(auto &hint : field_hints) {
+        streaming.push_back(hint.first & FieldHintStreaming);
+        any = any || streaming.back();
+    }
+    if(!any) {
+        return;
+    }
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+    const llvm::DataLayout &data_layout = current_module->getDataLayout();
+    int64_t first_argument = returns_struct() ? 1 : 0;
+    // 一个地址来自哪个 field 参数（参数的序号），不确定的话返回 -1
+    auto argument_of = [&](llvm::Function *function, const llvm::Value *base) -> int64_t {
+        if(auto argument = llvm::dyn_cast<llvm::Argument>(base)) {
+            return function == llvm_function ? static_cast<int64_t>(argument->getArgNo()) - first_argument : -1;
+        }
+        // 函数内联到打包入口之后，field 的指针是从参数的 buffer（每个参数 8 字节）中读出来的
+        auto load = llvm::dyn_cast<llvm::LoadInst>(base);
+        if(function != packed_function || !load) {
+            return -1;
+        }
+        llvm::APInt offset(data_layout.getIndexTypeSizeInBits(load->getPointerOperandType()), 0);
+        const llvm::Value *buffer = load->getPointerOperand()->stripAndAccumulateConstantOffsets(data_layout, offset, true);
+        return buffer == packed_function->getArg(0) ? offset.getSExtValue() / 8 : -1;
+    };
+
+    // 在优化之后标记：向量化不会处理对齐不够的 non-temporal 写入，自定义的 metadata 也会在向量化的时候丢掉
+    llvm::MDNode *nontemporal = llvm::MDNode::get(*context, llvm::ConstantAsMetadata::get(
+        llvm::ConstantInt::get(llvm::Type::getInt32Ty(*context), 1)
+    ));
+    size_t marked = 0;
+    for(llvm::Function *function : {llvm_function, packed_function}) {
+        bool function_marked = false;
+        std::vector<llvm::ReturnInst *> returns;
+        for(llvm::Instruction &instruction : llvm::instructions(*function)) {
+            if(auto ret = llvm::dyn_cast<llvm::ReturnInst>(&instruction)) {
+                returns.push_back(ret);
+            }
+            auto store = llvm::dyn_cast<llvm::StoreInst>(&instruction);
+            if(!store || store->isAtomic()) {
+                continue;
+            }
+            llvm::SmallVector<const llvm::Value *, 4> bases;
+            llvm::getUnderlyingObjects(store->getPointerOperand(), bases, nullptr, 0);
+            bool hinted = !bases.empty();
+            for(const llvm::Value *base : bases) {
+                int64_t argument = argument_of(function, base);
+                hinted = hinted && argument >= 0 && argument < static_cast<int64_t>(streaming.size()) && streaming[argument];
+            }
+            if(hinted) {
+                store->setMetadata(llvm::LLVMContext::MD_nontemporal, nontemporal);
+                function_marked = true;
+                marked += 1;
+            }
+        }
+        // non-temporal 的写入和其他写入之间没有顺序（x86 上是弱序的），返回之前加一个 fence
+        // kernel 结束之后其他线程（以及 Python）才能看到结果
+        if(function_marked) {
+            for(llvm::ReturnInst *ret : returns) {
+                llvm::IRBuilder<> builder(ret);
+                builder.CreateFence(llvm::AtomicOrdering::SequentiallyConsistent);
+            }
+        }
+    }
+    std::string _m = "streaming stores of " + name + ": " + std::to_string(marked);
+    Out::Log(pType::DEBUG, _m.c_str());
+}
+
+void Function::build_packed_entry()
+{
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+    llvm::Type *byte_ptr_type = llvm::PointerType::get(llvm::Type::getInt8Ty(*context), 0);
+    packed_function = llvm::Function::Create(
+        llvm::FunctionType::get(
+            llvm::Type::getVoidTy(*context),
+            {byte_ptr_type, byte_ptr_type},
+            false
         ),
-        current_builder.get(),
-        taichi_llvm_unit->context
+        llvm::Function::ExternalLinkage,
+        symbol + "_taichi_packed",
+        *current_module
+    );
+
+    llvm::BasicBlock *block = llvm::BasicBlock::Create(*context, "entry", packed_function);
+    llvm::IRBuilder<> builder(block);
+    if(returns_struct()) {
+        // 结构体直接写入 result
+        llvm::Type *struct_type = to_llvm_type(return_type, context);
+        std::vector<llvm::Value *> args = {
+            builder.CreateBitCast(packed_function->getArg(1), llvm::PointerType::get(struct_type, 0))
+        };
+        for(llvm::Value *arg : load_packed_arguments(&builder, packed_function->getArg(0), argument_list, 0)) {
+            args.push_back(arg);
+        }
+        llvm::CallInst *call = builder.CreateCall(llvm_function, args);
+        call->addParamAttr(0, llvm::Attribute::getWithStructRetType(*context, struct_type));
+        builder.CreateRetVoid();
+        return;
+    }
+    llvm::Value *result = builder.CreateCall(
+        llvm_function,
+        load_packed_arguments(&builder, packed_function->getArg(0), argument_list, 0)
+    );
+    if(return_type != DataType::Void) {
+        builder.CreateStore(
+            result,
+            builder.CreateBitCast(
+                packed_function->getArg(1),
+                llvm::PointerType::get(to_llvm_type(return_type, context), 0)
+            )
+        );
+    }
+    builder.CreateRetVoid();
+}
+
+void Function::build_stub()
+{
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+    auto module = std::make_unique<llvm::Module>("taichi_stub_module_" + symbol, *context);
+    llvm::FunctionType *type = function_type;
+    llvm::Type *int64_type = to_llvm_type(DataType::Int64, context);
+    llvm::Type *byte_type = llvm::Type::getInt8Ty(*context);
+    llvm::Type *byte_ptr_type = llvm::PointerType::get(byte_type, 0);
+    llvm::Type *return_llvm_type = to_llvm_type(return_type, context);
+
+    // 解释器的 adapter：把参数打包之后调用 interpreter_entry(this, args, result)
+    // 地址都是常量，直接写进 IR 中
+    llvm::Function *adapter = llvm::Function::Create(
+        type,
+        llvm::Function::ExternalLinkage,
+        symbol + "_taichi_interp",
+        *module
+    );
+    {
+        llvm::IRBuilder<> builder(llvm::BasicBlock::Create(*context, "entry", adapter));
+        llvm::Value *args = builder.CreateAlloca(
+            llvm::ArrayType::get(int64_type, std::max<size_t>(argument_list.size(), 1))
+        );
+        args = builder.CreateBitCast(args, byte_ptr_type);
+        for(size_t i = 0; i < argument_list.size(); i += 1) {
+            llvm::Value *slot = builder.CreateConstGEP1_64(byte_type, args, 8 * i);
+            slot = builder.CreateBitCast(slot, llvm::PointerType::get(adapter->getArg(i)->getType(), 0));
+            builder.CreateStore(adapter->getArg(i), slot);
+        }
+        llvm::Value *result = builder.CreateBitCast(builder.CreateAlloca(int64_type), byte_ptr_type);
+
+        llvm::FunctionType *entry_type = llvm::FunctionType::get(
+            llvm::Type::getVoidTy(*context),
+            {byte_ptr_type, byte_ptr_type, byte_ptr_type},
+            false
+        );
+        llvm::Constant *entry = llvm::ConstantExpr::getIntToPtr(
+            llvm::ConstantInt::get(int64_type, reinterpret_cast<uint64_t>(&interpreter_entry)),
+            llvm::PointerType::get(entry_type, 0)
+        );
+        llvm::Constant *self = llvm::ConstantExpr::getIntToPtr(
+            llvm::ConstantInt::get(int64_type, reinterpret_cast<uint64_t>(this)),
+            byte_ptr_type
+        );
+        builder.CreateCall(entry_type, entry, {self, args, result});
+        builder.CreateRet(builder.CreateLoad(
+            return_llvm_type,
+            builder.CreateBitCast(result, llvm::PointerType::get(return_llvm_type, 0))
+        ));
+    }
+
+    // stub：从 slot 中读取跳转的目标
+    // std::atomic<void *> 和 void * 的内存布局相同，这里用 acquire 的原子读取
+    stub_function = llvm::Function::Create(
+        type,
+        llvm::Function::ExternalLinkage,
+        symbol,
+        *module
+    );
+    {
+        llvm::IRBuilder<> builder(llvm::BasicBlock::Create(*context, "entry", stub_function));
+        llvm::Type *target_type = llvm::PointerType::get(type, 0);
+        llvm::Constant *slot_address = llvm::ConstantExpr::getIntToPtr(
+            llvm::ConstantInt::get(int64_type, reinterpret_cast<uint64_t>(&slot)),
+            llvm::PointerType::get(target_type, 0)
+        );
+        llvm::LoadInst *target = builder.CreateAlignedLoad(target_type, slot_address, llvm::Align(8));
+        target->setAtomic(llvm::AtomicOrdering::Acquire);
+        std::vector<llvm::Value *> args;
+        for(auto &arg : stub_function->args()) {
+            args.push_back(&arg);
+        }
+        builder.CreateRet(builder.CreateCall(type, target, args));
+    }
+
+    // stub 的打包入口（thunk），和 packed_entry 的格式相同
+    // 调用 stub，所以编译前后都可以使用
+    llvm::Function *thunk_function = llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*context), {byte_ptr_type, byte_ptr_type}, false),
+        llvm::Function::ExternalLinkage,
+        symbol + "_taichi_thunk",
+        *module
+    );
+    {
+        llvm::IRBuilder<> builder(llvm::BasicBlock::Create(*context, "entry", thunk_function));
+        llvm::Value *result = builder.CreateCall(
+            stub_function,
+            load_packed_arguments(&builder, thunk_function->getArg(0), argument_list, 0)
+        );
+        builder.CreateStore(
+            result,
+            builder.CreateBitCast(thunk_function->getArg(1), llvm::PointerType::get(return_llvm_type, 0))
+        );
+        builder.CreateRetVoid();
+    }
+
+    std::vector<void *> pointers = finalize_module(std::move(module), {thunk_function, adapter, stub_function});
+    stub_function = nullptr;
+    thunk = reinterpret_cast<PackedEntry>(pointers[0]);
+    slot.store(pointers[1], std::memory_order_release);
+    pointer = pointers[2];
+}
+
+void *Function::get_pointer()
+{
+    return pointer;
+}
+
+// 常量范围的 loop，loop index 是 Int32
+void Function::loop_begin(
+    Symbol loop_index_name,
+    int32_t l,
+    int32_t r,
+    int32_t s
+)
+{
+    OperationValue l_value, r_value, s_value;
+    l_value.set_constant(DataType::Int32, reinterpret_cast<Byte *>(&l));
+    r_value.set_constant(DataType::Int32, reinterpret_cast<Byte *>(&r));
+    s_value.set_constant(DataType::Int32, reinterpret_cast<Byte *>(&s));
+    loop_begin(loop_index_name, l_value, r_value, s_value);
+}
+
+void Function::loop_begin(
+    Symbol loop_index_name,
+    const OperationValue &l,
+    const OperationValue &r,
+    const OperationValue &s
+)
+{
+    // 边界中有 64 位的值（或者浮点数），loop index 就使用 Int64
+    DataType index_type = DataType::Int32;
+    for(auto bound : {&l, &r, &s}) {
+        if(bound->get_data_type(this) != DataType::Int32) {
+            index_type = DataType::Int64;
+        }
+    }
+
+    // 和 Python 的 range 一样，边界在进入循环之前计算一次
+    // 边界在当前作用域中读取，要在 loop index 声明之前构造
+    IRStmt *bounds[3];
+    const OperationValue *bound_values[3] = {&l, &r, &s};
+    for(int i = 0; i < 3; i += 1) {
+        bounds[i] = bound_values[i]->construct_value(this);
+        if(!bounds[i]) {
+            std::string _m = "illegal range of loop " + taichi_symbols.name(loop_index_name) + " in function " + name;
+            Out::Log(pType::ERROR, _m.c_str());
+            Scalar zero;
+            zero.i64 = 0;
+            bounds[i] = emit_constant(index_type, reinterpret_cast<Byte *>(&zero));
+        } else {
+            bounds[i] = emit_cast(bounds[i], index_type);
+        }
+    }
+
+    // 创建一个新的变量作用域（循环体 body 的作用域）
+    push_scope();
+    auto loop_index = alloc_variable(loop_index_name, index_type, true); // 强制声明一个 local 变量（不使用外部变量）
+
+    // 之后的语句都放在循环体中，直到 loop_finish
+    IRStmt *loop = emit(IRStmtKind::RangeFor, DataType::Void, {loop_index, bounds[0], bounds[1], bounds[2]});
+    loop->body = arena.create<IRBlock>(arena);
+    ir_blocks.push(loop->body);
+}
+
+void Function::loop_finish()
+{
+    if(ir_blocks.size() <= 1) {
+        std::string _m = "loop_finish without loop_begin in function " + name;
+        Out::Log(pType::ERROR, _m.c_str());
+        return;
+    }
+    ir_blocks.pop();
+
+    // loop 的作用域结束了
+    pop_scope();
+}
+
+void Function::load_statement(
+    Symbol target_name,
+    Symbol field_name,
+    const OperationValue &index
+)
+{
+    IRStmt *index_value = element_index(field_name, index);
+    if(!index_value) {
+        return;
+    }
+    auto field = find_field(field_name);
+    // 结构体的元素整个复制到结构体变量中
+    if(is_struct_type(field.second)) {
+        if(IRStmt *target = struct_variable(target_name, field.second)) {
+            copy_struct(target, struct_index(), field.first, index_value, field.second);
+        }
+        return;
+    }
+    // 存储类型的元素读出来就是计算类型
+    IRStmt *value = emit(IRStmtKind::FieldLoad, compute_type(field.second), {field.first, index_value});
+    store_variable(target_name, value);
+}
+
+void Function::store_statement(
+    Symbol field_name,
+    const OperationValue &index,
+    const OperationValue &value
+)
+{
+    IRStmt *index_value = element_index(field_name, index);
+    if(!index_value) {
+        return;
+    }
+    auto field = find_field(field_name);
+    // 结构体的元素只能整个写入一个同类型的结构体变量
+    if(is_struct_type(field.second)) {
+        auto variable = value.operation_value_type == OperationValueType::Variable
+            ? find_struct(value.variable)
+            : std::make_pair<IRStmt *, DataType>(nullptr, DataType::Void);
+        if(variable.second != field.second) {
+            std::string _m = "element of field " + taichi_symbols.name(field_name) + " needs a " +
+                DataTypeStr(field.second) + " value in function " + name;
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+            return;
+        }
+        copy_struct(field.first, index_value, variable.first, struct_index(), field.second);
+        return;
+    }
+    IRStmt *stored_value = value.construct_value(this);
+    if(!stored_value) {
+        return;
+    }
+    // 存储之前转换为元素类型（存储类型的话是它的计算类型，lowering 的时候再舍入）
+    DataType element_type = compute_type(field.second);
+    emit(IRStmtKind::FieldStore, DataType::Void, {field.first, index_value, emit_cast(stored_value, element_type)});
+}
+
+void Function::atomic_statement(
+    Symbol target_name,
+    Symbol field_name,
+    AtomicOperation operation,
+    const OperationValue &index,
+    const OperationValue &value,
+    const OperationValue *desired
+)
+{
+    IRStmt *index_value = element_index(field_name, index);
+    IRStmt *operand_value = value.construct_value(this);
+    IRStmt *desired_value = desired ? desired->construct_value(this) : nullptr;
+    if(
+        !index_value || !operand_value || (operation == AtomicOperation::AtomicCas) != (desired_value != nullptr)
+        || is_struct_type(find_field(field_name).second)
+    ) {
+        std::string _m = "illegal atomic operation on field " + taichi_symbols.name(field_name) + " in function " + name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return;
+    }
+    auto field = find_field(field_name);
+    // 操作数都转换为元素类型（存储类型的话是它的计算类型）
+    DataType element_type = compute_type(field.second);
+    IRStmt *result = emit(
+        IRStmtKind::FieldAtomic,
+        element_type,
+        {field.first, index_value, emit_cast(operand_value, element_type)}
+    );
+    if(desired_value) {
+        result->operands.push_back(emit_cast(desired_value, element_type));
+    }
+    result->atomic = operation;
+    if(target_name != NoSymbol) {
+        store_variable(target_name, result);
+    }
+}
+
+void Function::random_statement(
+    Symbol target_name,
+    const OperationValue &seed,
+    const OperationValue &counter,
+    const OperationValue &stream
+)
+{
+    IRStmt *seed_value = seed.construct_value(this);
+    IRStmt *counter_value = counter.construct_value(this);
+    IRStmt *stream_value = stream.construct_value(this);
+    if(!seed_value || !counter_value || !stream_value || target_name == NoSymbol) {
+        std::string _m = "illegal random statement in function " + name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return;
+    }
+    IRStmt *result = emit(
+        IRStmtKind::Random,
+        DataType::Float64,
+        {
+            emit_cast(seed_value, DataType::Int64),
+            emit_cast(counter_value, DataType::Int64),
+            emit_cast(stream_value, DataType::Int64)
+        }
     );
+    store_variable(target_name, result);
+}
+
+DataType Function::value_type(const OperationValue &value)
+{
+    if(value.operation_value_type == OperationValueType::Variable && !find_variable(value.variable).first) {
+        return DataType::Void;
+    }
+    return value.get_data_type(this);
+}
+
+void Function::struct_statement(Symbol name, DataType type)
+{
+    if(!taichi_struct_table.get(type)) {
+        std::string _m = "type of " + taichi_symbols.name(name) + " is not a registered struct in function " + this->name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return;
+    }
+    IRStmt *ptr = struct_variable(name, type);
+    if(!ptr) {
+        return;
+    }
+    IRStmt *zero_index = struct_index();
+    for(auto &member : taichi_struct_table.get(type)->members) {
+        Scalar zero;
+        zero.i64 = 0;
+        IRStmt *value = emit_constant(compute_type(member.type), reinterpret_cast<Byte *>(&zero));
+        emit(IRStmtKind::FieldStore, DataType::Void, {member_pointer(ptr, zero_index, member.name), zero_index, value});
+    }
+}
+
+void Function::member_load_statement(
+    Symbol target_name,
+    Symbol base_name,
+    const OperationValue *index,
+    Symbol member_name
+)
+{
+    auto base = struct_base(base_name, index);
+    IRStmt *ptr = base.first && base.second ? member_pointer(base.first, base.second, member_name) : nullptr;
+    if(!ptr) {
+        return;
+    }
+    IRStmt *value = emit(IRStmtKind::FieldLoad, compute_type(ptr->type), {ptr, struct_index()});
+    store_variable(target_name, value);
+}
+
+void Function::member_store_statement(
+    Symbol base_name,
+    const OperationValue *index,
+    Symbol member_name,
+    const OperationValue &value
+)
+{
+    auto base = struct_base(base_name, index);
+    IRStmt *ptr = base.first && base.second ? member_pointer(base.first, base.second, member_name) : nullptr;
+    IRStmt *stored_value = ptr ? value.construct_value(this) : nullptr;
+    if(!stored_value) {
+        return;
+    }
+    emit(IRStmtKind::FieldStore, DataType::Void, {ptr, struct_index(), emit_cast(stored_value, compute_type(ptr->type))});
+}
+
+void Function::call_statement(
+    Symbol target_name,
+    Symbol callee_name,
+    const std::vector<OperationValue> &args
+)
+{
+    const std::string &callee_text = taichi_symbols.name(callee_name);
+    Function *callee = taichi_func_table.get(taichi_func_table.find(callee_name));
+    if(!callee) {
+        std::string _m = "can not find function " + callee_text + " called by " + name;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return;
+    }
+    if(!callee->function_type || callee->argument_list.size() != args.size()) {
+        std::string _m = "illegal call of function " + callee_text + " in " + name;
+        Out::Log(pType::ERROR, _m.c_str());
+        return;
+    }
 
-    llvm::Value *llvm_right_value = cast(
-        right_value.get_data_type(this),
+    std::vector<IRStmt *> call_args;
+    // 结果先写入一个临时的结构体，再复制到 target（target 也可能是实参，不能和 sret 重叠）
+    IRStmt *struct_result = nullptr;
+    if(callee->returns_struct()) {
+        struct_result = temporary_struct(callee->return_type);
+        call_args.push_back(struct_result);
+    }
+    for(size_t i = 0; i < args.size(); i += 1) {
+        const Argument &param = callee->argument_list[i];
+        // field 参数直接传递指针
+        if(param.is_field) {
+            auto field = args[i].operation_value_type == OperationValueType::Variable
+                ? find_field(args[i].variable)
+                : std::make_pair<IRStmt *, DataType>(nullptr, DataType::Int32);
+            if(!field.first || field.second != param.type) {
+                std::string _m = "argument " + param.name + " of " + callee_text + " needs a field";
+                Out::Log(pType::ERROR, _m.c_str());
+                return;
+            }
+            call_args.push_back(field.first);
+            continue;
+        }
+        // 结构体参数传递结构体变量的地址，被调用者自己复制一份
+        if(is_struct_type(param.type)) {
+            auto variable = args[i].operation_value_type == OperationValueType::Variable
+                ? find_struct(args[i].variable)
+                : std::make_pair<IRStmt *, DataType>(nullptr, DataType::Void);
+            if(variable.second != param.type) {
+                std::string _m = "argument " + param.name + " of " + callee_text + " needs a " + DataTypeStr(param.type);
+                Out::Log(pType::ERROR, "%s", _m.c_str());
+                return;
+            }
+            call_args.push_back(variable.first);
+            continue;
+        }
+        IRStmt *value = args[i].construct_value(this);
+        if(!value) {
+            std::string _m = "illegal argument " + param.name + " of " + callee_text;
+            Out::Log(pType::ERROR, _m.c_str());
+            return;
+        }
+        call_args.push_back(emit_cast(value, param.type));
+    }
+
+    IRStmt *result = emit(IRStmtKind::Call, struct_result ? DataType::Void : callee->return_type);
+    result->operands.assign(call_args.begin(), call_args.end());
+    result->callee = callee;
+    // 调用者的代码直接跳转到被调用者的代码，被调用者要一直活着（递归调用自己的话不需要）
+    if(callee != this && std::find(callees.begin(), callees.end(), callee->shared_from_this()) == callees.end()) {
+        callees.push_back(callee->shared_from_this());
+    }
+    if(struct_result && target_name != NoSymbol) {
+        if(IRStmt *target = struct_variable(target_name, callee->return_type)) {
+            IRStmt *zero_index = struct_index();
+            copy_struct(target, zero_index, struct_result, zero_index, callee->return_type);
+        }
+    } else if(callee->return_type != DataType::Void && target_name != NoSymbol) {
+        store_variable(target_name, result);
+    }
+}
+
+void Function::assignment_statement(
+    Symbol name,
+    const OperationValue &value
+)
+{
+    if(name == value.variable) return; // 同名赋值
+
+    // 结构体整体赋值：逐个成员复制（之后修改一个不影响另一个）
+    auto source = value.operation_value_type == OperationValueType::Variable
+        ? find_struct(value.variable)
+        : std::make_pair<IRStmt *, DataType>(nullptr, DataType::Void);
+    if(source.first) {
+        if(IRStmt *target = struct_variable(name, source.second)) {
+            IRStmt *zero_index = struct_index();
+            copy_struct(target, zero_index, source.first, zero_index, source.second);
+        }
+        return;
+    }
+
+    IRStmt *assigned_value = value.construct_value(this);
+    if(!assigned_value) {
+        std::string _m = "illegal value assigned to " + taichi_symbols.name(name) + " in function " + this->name;
+        Out::Log(pType::ERROR, _m.c_str());
+        return;
+    }
+    // 找不到，就说明是新变量，store_variable 会创建这个新变量
+    store_variable(name, assigned_value);
+}
+
+void Function::assignment_statement(
+    Symbol result_name,
+    const OperationValue &left_value,
+    OperationType operation_type,
+    const OperationValue &right_value
+)
+{
+    auto find_result = find_variable(result_name);
+    // 如果要创建新变量存储计算结果，新变量的类型需要计算得到（自动类型提升）
+    DataType result_type = find_result.first
+        ? find_result.second
+        : calc_type(left_value.get_data_type(this), right_value.get_data_type(this));
+
+    IRStmt *left = left_value.construct_value(this);
+    IRStmt *right = right_value.construct_value(this);
+    if(!left || !right) {
+        std::string _m = "illegal operand assigned to " + taichi_symbols.name(result_name) + " in function " + name;
+        Out::Log(pType::ERROR, _m.c_str());
+        return;
+    }
+
+    // 运算之前，必须转换为相同的类型
+    IRStmt *result = emit(
+        IRStmtKind::Binary,
         result_type,
-        right_value.construct_llvm_value(
-            this,
-            current_builder.get(),
-            taichi_llvm_unit->context
-        ),
-        current_builder.get(),
-        taichi_llvm_unit->context
+        {emit_cast(left, result_type), emit_cast(right, result_type)}
     );
+    result->operation = operation_type;
+    store_variable(result_name, result);
+}
+
+void Function::return_statement(Symbol return_variable_name)
+{
+    if(return_type == DataType::Void) {
+        emit(IRStmtKind::Return, DataType::Void);
+        return;
+    }
+    // 结构体复制到调用者给出的内存中
+    if(returns_struct()) {
+        auto variable = find_struct(return_variable_name);
+        if(variable.second != return_type) {
+            std::string _m = "function " + name + " returns " + DataTypeStr(return_type) + ", but " +
+                taichi_symbols.name(return_variable_name) + " is not";
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+            return;
+        }
+        IRStmt *zero_index = struct_index();
+        copy_struct(ir_result, zero_index, variable.first, zero_index, return_type);
+        emit(IRStmtKind::Return, DataType::Void);
+        return;
+    }
+
+    auto find_result = find_variable(return_variable_name);
+    IRStmt *value = nullptr;
+    if(find_result.first) {
+        // 找到这个变量之后 Load，再转换为返回值的类型
+        value = emit(IRStmtKind::LocalLoad, find_result.second, {find_result.first});
+        value = emit_cast(value, return_type);
+    } else {
+        // 找不到变量的话返回默认值（常量 0）
+        Scalar zero;
+        zero.i64 = 0;
+        value = emit_constant(return_type, reinterpret_cast<Byte *>(&zero));
+    }
+    emit(IRStmtKind::Return, DataType::Void, {value});
+}
+
+// ===== lowering 到 LLVM IR =====
+
+// lowering 的状态
+struct LLVMLowering {
+    // 中间层的值 to LLVM 的值
+    std::unordered_map<const IRStmt *, llvm::Value *> values;
+    // parallel 的循环 to 它的 access group
+    std::unordered_map<const IRStmt *, llvm::MDNode *> access_groups;
+    // 正在 lowering 的循环，最后一个是最内层的
+    std::vector<const IRStmt *> loops;
+};
+
+// 中间层的常量转换为 LLVM 的常量
+static llvm::Value *llvm_constant(DataType type, const Scalar &value, llvm::LLVMContext *context)
+{
+    llvm::Value *res = nullptr;
+    switch(type) {
+        case DataType::Int32:
+            // 构造一个 int 常量
+            // 其实还有别的方式
+            // 1 首先构造一个 llvm::APInt 然后使用 llvm::ConstantInt::get
+            // 2 Builder.getInt32
+            res = llvm::ConstantInt::get(
+                to_llvm_type(type, context),
+                static_cast<uint64_t>(static_cast<int64_t>(value.i32)),
+                true
+            );
+            break;
+        case DataType::Int64:
+            res = llvm::ConstantInt::get(
+                to_llvm_type(type, context),
+                static_cast<uint64_t>(value.i64),
+                true
+            );
+            break;
+        // 创建浮点数常量
+        case DataType::Float32:
+            res = llvm::ConstantFP::get(
+                to_llvm_type(type, context),
+                static_cast<double>(value.f32)
+            );
+            break;
+        case DataType::Float64:
+            res = llvm::ConstantFP::get(
+                to_llvm_type(type, context),
+                value.f64
+            );
+            break;
+        default:
+            break;
+    }
+    return res;
+}
 
-    // 数据存储的时候 类型不区分是否有符号
-    // 运算的时候才区分 比如CreateSDiv 是有符号的整数除法
-    llvm::Value *llvm_result = nullptr;
-    switch(operation_type) {
+// 二元运算
+// 数据存储的时候 类型不区分是否有符号
+// 运算的时候才区分 比如CreateSDiv 是有符号的整数除法
+static llvm::Value *llvm_binary(
+    OperationType operation,
+    DataType type,
+    llvm::Value *left,
+    llvm::Value *right,
+    llvm::IRBuilder<> *builder
+)
+{
+    llvm::Value *res = nullptr;
+    switch(operation) {
         case OperationType::Add:
-            if(is_int(result_type)) {
-                llvm_result = current_builder->CreateAdd( // 每种运算都有对应的 Create
-                    llvm_left_value,
-                    llvm_right_value
-                );
-            } else if(is_float(result_type)) {
-                llvm_result = current_builder->CreateFAdd( // 浮点数加法
-                    llvm_left_value,
-                    llvm_right_value
-                );
+            if(is_int(type)) {
+                res = builder->CreateAdd(left, right); // 每种运算都有对应的 Create
+            } else if(is_float(type)) {
+                res = builder->CreateFAdd(left, right); // 浮点数加法
             }
             break;
         case OperationType::Sub: // 减法
-            if(is_int(result_type)) {
-                llvm_result = current_builder->CreateSub(
-                    llvm_left_value,
-                    llvm_right_value
-                );
-            } else if(is_float(result_type)) {
-                llvm_result = current_builder->CreateFSub(
-                    llvm_left_value,
-                    llvm_right_value
-                );
+            if(is_int(type)) {
+                res = builder->CreateSub(left, right);
+            } else if(is_float(type)) {
+                res = builder->CreateFSub(left, right);
             }
             break;
         case OperationType::Mul: // 乘法
-            if(is_int(result_type)) {
-                llvm_result = current_builder->CreateMul(
-                    llvm_left_value,
-                    llvm_right_value
-                );
-            } else if(is_float(result_type)) {
-                llvm_result = current_builder->CreateFMul(
-                    llvm_left_value,
-                    llvm_right_value
-                );
+            if(is_int(type)) {
+                res = builder->CreateMul(left, right);
+            } else if(is_float(type)) {
+                res = builder->CreateFMul(left, right);
             }
             break;
         case OperationType::Div:
-            if(is_int(result_type)) {
-                llvm_result = current_builder->CreateSDiv( // S 表示有符号，这里是有符号的整数除法
-                    llvm_left_value,
-                    llvm_right_value
-                );
-            } else if(is_float(result_type)) {
-                llvm_result = current_builder->CreateFDiv( // 浮点数除法
-                    llvm_left_value,
-                    llvm_right_value
-                );
+            if(is_int(type)) {
+                res = builder->CreateSDiv(left, right); // S 表示有符号，这里是有符号的整数除法
+            } else if(is_float(type)) {
+                res = builder->CreateFDiv(left, right); // 浮点数除法
             }
             break;
     }
-    if(llvm_result) {
-        current_builder->CreateStore(llvm_result, find_result.first);
-    }
+    return res;
 }
 
-void Function::return_statement(const std::string &return_variable_name)
+// field 元素上的原子操作，返回操作之前的值
+// 整数的 add / min / max 和浮点数的 add 直接使用 atomicrmw
+// 浮点数的 min / max（LLVM 18 之前的 atomicrmw 不支持）和 cas 使用 cmpxchg，浮点数按位比较
+static llvm::Value *llvm_atomic(
+    AtomicOperation operation,
+    DataType type,
+    llvm::Value *address,
+    llvm::Value *value,
+    llvm::Value *desired,
+    llvm::IRBuilder<> *builder,
+    llvm::Function *function
+)
 {
-    auto find_result = find_variable(return_variable_name);
-    if(find_result.first) {
-        // 找到这个变量之后 Load
-        llvm::LoadInst *load_value = current_builder->CreateLoad(
-            to_llvm_type(
-                find_result.second,
-                taichi_llvm_unit->context
-            ),
-            find_result.first
+    llvm::LLVMContext &context = builder->getContext();
+    llvm::MaybeAlign align(type_size(type));
+    llvm::AtomicOrdering relaxed = llvm::AtomicOrdering::Monotonic;
+    llvm::AtomicOrdering seq_cst = llvm::AtomicOrdering::SequentiallyConsistent;
+
+    if(operation == AtomicOperation::AtomicAdd) {
+        return builder->CreateAtomicRMW(
+            is_int(type) ? llvm::AtomicRMWInst::Add : llvm::AtomicRMWInst::FAdd,
+            address, value, align, relaxed
+        );
+    }
+    if(is_int(type) && operation != AtomicOperation::AtomicCas) {
+        return builder->CreateAtomicRMW(
+            operation == AtomicOperation::AtomicMin ? llvm::AtomicRMWInst::Min : llvm::AtomicRMWInst::Max,
+            address, value, align, relaxed
+        );
+    }
+
+    // cmpxchg 只支持整数（和指针），浮点数先按位转换为整数
+    llvm::Type *element_type = value->getType();
+    llvm::Type *bits_type = llvm::Type::getIntNTy(context, 8 * type_size(type));
+    llvm::Value *bits_address = builder->CreateBitCast(address, llvm::PointerType::get(bits_type, 0));
+    auto to_bits = [&](llvm::Value *v) { return is_int(type) ? v : builder->CreateBitCast(v, bits_type); };
+    auto from_bits = [&](llvm::Value *v) { return is_int(type) ? v : builder->CreateBitCast(v, element_type); };
+
+    if(operation == AtomicOperation::AtomicCas) {
+        llvm::Value *pair = builder->CreateAtomicCmpXchg(
+            bits_address, to_bits(value), to_bits(desired), align, seq_cst, seq_cst
         );
-        // Load 之后 Cast 类型转换
-        llvm::Value *cast_value = cast(
-            find_result.second,
-            return_type,
-            load_value,
-            current_builder.get(),
-            taichi_llvm_unit->context
+        return from_bits(builder->CreateExtractValue(pair, 0));
+    }
+
+    // 浮点数的 min / max：读出旧值，算出新值，cmpxchg 失败的话用读到的值重试
+    llvm::BasicBlock *entry_block = builder->GetInsertBlock();
+    llvm::BasicBlock *retry_block = llvm::BasicBlock::Create(context, "atomic_retry", function);
+    llvm::BasicBlock *done_block = llvm::BasicBlock::Create(context, "atomic_done", function);
+    llvm::LoadInst *initial = builder->CreateAlignedLoad(bits_type, bits_address, align);
+    initial->setAtomic(relaxed);
+    builder->CreateBr(retry_block);
+
+    builder->SetInsertPoint(retry_block);
+    llvm::PHINode *old_bits = builder->CreatePHI(bits_type, 2);
+    old_bits->addIncoming(initial, entry_block);
+    llvm::Value *old_value = from_bits(old_bits);
+    llvm::Value *replace = operation == AtomicOperation::AtomicMin
+        ? builder->CreateFCmpOLT(value, old_value)
+        : builder->CreateFCmpOGT(value, old_value);
+    llvm::Value *new_value = builder->CreateSelect(replace, value, old_value);
+    llvm::Value *pair = builder->CreateAtomicCmpXchg(
+        bits_address, old_bits, to_bits(new_value), align, relaxed, relaxed
+    );
+    old_bits->addIncoming(builder->CreateExtractValue(pair, 0), retry_block);
+    builder->CreateCondBr(builder->CreateExtractValue(pair, 1), done_block, retry_block);
+
+    builder->SetInsertPoint(done_block);
+    return old_value;
+}
+
+// 存储类型的元素上的原子操作，value 和 desired 是计算类型，结果是操作之前的元素（计算类型）
+// 统一用 cmpxchg 循环：读出旧的元素，按计算类型算出新的值，转换回存储类型之后写入
+// 计算类型比存储类型宽，所以无符号数的 min / max 按有符号数比较也是对的，add 按存储类型回绕
+static llvm::Value *llvm_storage_atomic(
+    AtomicOperation operation,
+    DataType element,
+    llvm::Value *address,
+    llvm::Value *value,
+    llvm::Value *desired,
+    llvm::IRBuilder<> *builder,
+    llvm::Function *function
+)
+{
+    llvm::LLVMContext &context = builder->getContext();
+    llvm::MaybeAlign align(type_size(element));
+    llvm::AtomicOrdering relaxed = llvm::AtomicOrdering::Monotonic;
+    llvm::AtomicOrdering seq_cst = llvm::AtomicOrdering::SequentiallyConsistent;
+    llvm::Type *element_type = to_llvm_type(element, &context);
+    llvm::Type *bits_type = llvm::Type::getIntNTy(context, 8 * type_size(element));
+    llvm::Value *bits_address = builder->CreateBitCast(address, llvm::PointerType::get(bits_type, 0));
+    auto to_bits = [&](llvm::Value *v) {
+        return builder->CreateBitCast(llvm_store_element(element, v, builder), bits_type);
+    };
+    auto from_bits = [&](llvm::Value *v) {
+        return llvm_load_element(element, builder->CreateBitCast(v, element_type), builder);
+    };
+
+    if(operation == AtomicOperation::AtomicCas) { // 按存储的位比较
+        llvm::Value *pair = builder->CreateAtomicCmpXchg(
+            bits_address, to_bits(value), to_bits(desired), align, seq_cst, seq_cst
         );
-        // 之后返回这个 Value
-        current_builder->CreateRet(cast_value);
+        return from_bits(builder->CreateExtractValue(pair, 0));
+    }
+
+    llvm::BasicBlock *entry_block = builder->GetInsertBlock();
+    llvm::BasicBlock *retry_block = llvm::BasicBlock::Create(context, "atomic_retry", function);
+    llvm::BasicBlock *done_block = llvm::BasicBlock::Create(context, "atomic_done", function);
+    llvm::LoadInst *initial = builder->CreateAlignedLoad(bits_type, bits_address, align);
+    initial->setAtomic(relaxed);
+    builder->CreateBr(retry_block);
+
+    builder->SetInsertPoint(retry_block);
+    llvm::PHINode *old_bits = builder->CreatePHI(bits_type, 2);
+    old_bits->addIncoming(initial, entry_block);
+    llvm::Value *old_value = from_bits(old_bits);
+    bool is_float_element = is_float(compute_type(element));
+    llvm::Value *new_value = nullptr;
+    if(operation == AtomicOperation::AtomicAdd) {
+        new_value = is_float_element ? builder->CreateFAdd(old_value, value) : builder->CreateAdd(old_value, value);
     } else {
-        current_builder->CreateRet(llvm_default_value(
-            return_type,
-            taichi_llvm_unit->context
-        ));
+        bool min = operation == AtomicOperation::AtomicMin;
+        llvm::Value *replace = is_float_element
+            ? (min ? builder->CreateFCmpOLT(value, old_value) : builder->CreateFCmpOGT(value, old_value))
+            : (min ? builder->CreateICmpSLT(value, old_value) : builder->CreateICmpSGT(value, old_value));
+        new_value = builder->CreateSelect(replace, value, old_value);
     }
+    llvm::Value *pair = builder->CreateAtomicCmpXchg(
+        bits_address, old_bits, to_bits(new_value), align, relaxed, relaxed
+    );
+    old_bits->addIncoming(builder->CreateExtractValue(pair, 0), retry_block);
+    builder->CreateCondBr(builder->CreateExtractValue(pair, 1), done_block, retry_block);
+
+    builder->SetInsertPoint(done_block);
+    return old_value;
 }
 
-// 这个函数不能执行，主要是由于EE->runFunction的限制
-std::shared_ptr<Byte[]> Function::run(Byte *argument_buffer, Byte *result_buffer)
+// field 的访问属于所有外层的 parallel 循环的 access group
+static void set_access_groups(llvm::Instruction *access, const IRStmt *stmt, LLVMLowering &lowering)
 {
-    Byte *local_result_buffer = new Byte[type_size(return_type)];
+    std::vector<llvm::Metadata *> groups;
+    for(auto loop : stmt->parallel_loops) {
+        if(lowering.access_groups.count(loop)) {
+            groups.push_back(lowering.access_groups[loop]);
+        }
+    }
+    if(groups.empty()) {
+        return;
+    }
+    llvm::LLVMContext &context = access->getContext();
+    access->setMetadata(
+        llvm::LLVMContext::MD_access_group,
+        groups.size() == 1 ? llvm::cast<llvm::MDNode>(groups[0]) : llvm::MDNode::get(context, groups)
+    );
+}
 
-    uint32_t offset = 0;
-    uint32_t cache_32 = 0;
-    uint64_t cache_64 = 0;
-    std::vector<llvm::GenericValue> args;
-    // 解析传入的参数值，构建一个 LLVM 的参数列表
-    for(auto arg : this->argument_list) {
-        args.push_back(llvm::GenericValue());
-        // 创建一个 GenericValue
-        switch(arg.type) {
-            case DataType::Int32:
-                memcpy(&cache_32, argument_buffer + offset, 4);
-                args.back().IntVal = llvm::APInt(
-                    32,
-                    static_cast<uint64_t>(cache_32),
-                    true
+// 去掉 Int32 到 Int64 的转换（不改变值）
+static const IRStmt *strip_int_extend(const IRStmt *value)
+{
+    while(value->kind == IRStmtKind::Cast && value->type == DataType::Int64
+        && value->operands[0]->type == DataType::Int32) {
+        value = value->operands[0];
+    }
+    return value;
+}
+
+// value 是 loop 的 loop index 加上（或减去）一个常量的话，返回读取 loop index 的 LocalLoad，否则返回 nullptr
+// 这时 D 次迭代之后 value 就是 value + D * step
+static const IRStmt *loop_index_offset(const IRStmt *value, const IRStmt *loop)
+{
+    value = strip_int_extend(value);
+    if(value->kind == IRStmtKind::Binary
+        && (value->operation == OperationType::Add || value->operation == OperationType::Sub)) {
+        const IRStmt *left = value->operands[0];
+        const IRStmt *right = value->operands[1];
+        if(right->kind == IRStmtKind::Const) {
+            value = strip_int_extend(left);
+        } else if(value->operation == OperationType::Add && left->kind == IRStmtKind::Const) {
+            value = strip_int_extend(right);
+        } else {
+            return nullptr;
+        }
+    }
+    if(value->kind == IRStmtKind::LocalLoad && value->operands[0] == loop->operands[0]) {
+        return value;
+    }
+    return nullptr;
+}
+
+void Function::emit_prefetch(const IRStmt *stmt, llvm::Value *address, LLVMLowering &lowering)
+{
+    std::pair<uint32_t, uint32_t> hint = field_hint(stmt->operands[0]);
+    if(!(hint.first & (FieldHintPrefetch | FieldHintPrefetchGather)) || lowering.loops.empty()) {
+        return;
+    }
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+    llvm::IRBuilder<> *builder = current_builder.get();
+    auto &values = lowering.values;
+    llvm::Type *int64_type = to_llvm_type(DataType::Int64, context);
+    auto int64 = [&](const IRStmt *value) {
+        return builder->CreateSExtOrTrunc(values.at(value), int64_type);
+    };
+
+    // 只看最内层的循环，D 次迭代之后也就是下标加上 D * step
+    const IRStmt *loop = lowering.loops.back();
+    llvm::Value *step = int64(loop->operands[3]);
+    llvm::Value *ahead = builder->CreateMul(step, llvm::ConstantInt::get(int64_type, hint.second));
+    llvm::Type *element_type = to_llvm_type(stmt->operands[0]->type, context);
+    llvm::Value *future = nullptr;
+    if((hint.first & FieldHintPrefetch) && loop_index_offset(stmt->operands[1], loop)) {
+        // x[i + c]：预取不会出错，超出 field 的地址也没有关系
+        future = builder->CreateGEP(element_type, address, ahead);
+    } else {
+        // gather x[index[i + c]]：要先读出 D 次迭代之后的 index[i + c + D * step]
+        const IRStmt *source = strip_int_extend(stmt->operands[1]);
+        if(source->kind != IRStmtKind::FieldLoad) {
+            return;
+        }
+        const IRStmt *gather = source->operands[0];
+        const IRStmt *loop_index = loop_index_offset(source->operands[1], loop);
+        if(gather->kind != IRStmtKind::Arg || !gather->is_field || !loop_index
+            || (gather->type != DataType::Int32 && gather->type != DataType::Int64)) {
+            return;
+        }
+        // 没有条件分支，每次迭代都会读取 index[i + c]，只要那次迭代还在循环的范围内，读取就是合法的
+        // 循环体中有 return 的话，之后的迭代不一定执行
+        bool returns = false;
+        for_each_stmt(loop->body, [&returns](IRStmt *inner) {
+            returns = returns || inner->kind == IRStmtKind::Return;
+        });
+        if(returns) {
+            return;
+        }
+        llvm::Value *zero = llvm::ConstantInt::get(int64_type, 0);
+        llvm::Value *next = builder->CreateAdd(int64(loop_index), ahead);
+        llvm::Value *end = int64(loop->operands[2]);
+        llvm::Value *in_range = builder->CreateSelect(
+            builder->CreateICmpSGT(step, zero),
+            builder->CreateICmpSLT(next, end),
+            builder->CreateICmpSGT(next, end)
+        );
+        // 超出范围的话读取这次迭代的元素（刚刚读过，在 cache 中）
+        llvm::Value *current = int64(source->operands[1]);
+        llvm::Value *gather_index = builder->CreateSelect(in_range, builder->CreateAdd(current, ahead), current);
+        llvm::Type *gather_type = to_llvm_type(gather->type, context);
+        llvm::LoadInst *target = builder->CreateLoad(
+            gather_type,
+            builder->CreateGEP(gather_type, values.at(gather), gather_index)
+        );
+        set_access_groups(target, source, lowering);
+        future = builder->CreateGEP(
+            element_type,
+            values.at(stmt->operands[0]),
+            builder->CreateSExtOrTrunc(target, int64_type)
+        );
+    }
+    // llvm.prefetch(address, 读, 保留在所有层级的 cache 中, 数据)
+    llvm::Type *int32_type = llvm::Type::getInt32Ty(*context);
+    llvm::CallInst *prefetch = builder->CreateIntrinsic(
+        llvm::Intrinsic::prefetch,
+        {future->getType()},
+        {
+            future,
+            llvm::ConstantInt::get(int32_type, 0),
+            llvm::ConstantInt::get(int32_type, 3),
+            llvm::ConstantInt::get(int32_type, 1)
+        }
+    );
+    set_access_groups(prefetch, stmt, lowering);
+}
+
+bool Function::lower_to_llvm()
+{
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+
+    // 创建起始代码块
+    llvm::BasicBlock *entry_block = llvm::BasicBlock::Create(
+        *context,
+        "function_entry",
+        llvm_function
+    );
+    current_builder->SetInsertPoint(entry_block); // 从这个位置开始构建代码
+    if(debug_subprogram) {
+        // 没有源码位置的语句（比如参数的复制）对应到函数定义的那一行
+        current_builder->SetCurrentDebugLocation(
+            llvm::DILocation::get(*context, debug_subprogram->getLine(), 0, debug_subprogram)
+        );
+    }
+
+    LLVMLowering lowering;
+    lower_block(ir_body, lowering);
+
+    // 没有显式 return 的话，只有 kernel 的函数体（没有返回值）可以在最后补上
+    // 有返回值的函数说明前端丢掉了 return（比如不支持的表达式），构建失败，Python 端使用原来的函数
+    llvm::BasicBlock *last_block = current_builder->GetInsertBlock();
+    if(!last_block->getTerminator()) {
+        if(return_type == DataType::Void) {
+            current_builder->CreateRetVoid();
+        } else if(last_block != entry_block && llvm::pred_empty(last_block)) {
+            current_builder->CreateUnreachable(); // 所有分支都已经 return 了
+        } else {
+            std::string _m = "function " + name + " does not return a value";
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+void Function::lower_block(IRBlock *block, LLVMLowering &lowering)
+{
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+    llvm::IRBuilder<> *builder = current_builder.get();
+    auto &values = lowering.values;
+
+    for(IRStmt *stmt : block->stmts) {
+        if(debug_subprogram && stmt->location) {
+            const auto &location = locations[stmt->location];
+            // 其他文件中的语句（比如融合进来的 kernel）使用一个指向那个文件的作用域
+            if(!debug_scopes.count(location.first)) {
+                debug_scopes[location.first] = debug_builder->createLexicalBlockFile(
+                    debug_subprogram,
+                    debug_builder->createFile(location.first, ".")
                 );
+            }
+            builder->SetCurrentDebugLocation(
+                llvm::DILocation::get(*context, location.second, 0, debug_scopes[location.first])
+            );
+        }
+
+        auto operand = [&values, stmt](size_t i) { return values[stmt->operands[i]]; };
+        llvm::Value *res = nullptr;
+        switch(stmt->kind) {
+            case IRStmtKind::Const:
+                res = llvm_constant(stmt->type, stmt->constant, context);
+                break;
+            case IRStmtKind::Arg:
+                res = llvm_function->getArg(stmt->arg_index);
+                break;
+            case IRStmtKind::Alloca: {
+                // alloca 统一放在函数的入口处
+                // llvm::AllocaInst 表示的是一个内存地址（即指针），想取得数据的话需要 Load
+                llvm::BasicBlock *entry_block = &(llvm_function->getEntryBlock());
+                llvm::IRBuilder<> entry_builder(entry_block, entry_block->begin());
+                res = entry_builder.CreateAlloca(to_llvm_type(stmt->type, context));
                 break;
-            case DataType::Int64:
-                memcpy(&cache_64, argument_buffer + offset, 8);
-                args.back().IntVal = llvm::APInt(
-                    64,
-                    cache_64,
-                    true
+            }
+            case IRStmtKind::StructAlloca: {
+                llvm::BasicBlock *entry_block = &(llvm_function->getEntryBlock());
+                llvm::IRBuilder<> entry_builder(entry_block, entry_block->begin());
+                res = entry_builder.CreateAlloca(to_llvm_type(stmt->type, context));
+                break;
+            }
+            case IRStmtKind::MemberPtr:
+                // &base[index].member
+                res = builder->CreateGEP(
+                    to_llvm_type(stmt->operands[0]->type, context),
+                    operand(0),
+                    {operand(1), llvm::ConstantInt::get(llvm::Type::getInt32Ty(*context), stmt->member)}
                 );
                 break;
-            case DataType::Float32:
-                memcpy(&cache_32, argument_buffer + offset, 4);
-                args.back().FloatVal = reinterpret_cast<float&>(cache_32);
+            case IRStmtKind::LocalLoad:
+                res = builder->CreateLoad(to_llvm_type(stmt->type, context), operand(0));
+                break;
+            case IRStmtKind::LocalStore:
+                builder->CreateStore(operand(1), operand(0));
+                break;
+            case IRStmtKind::Binary:
+                res = llvm_binary(stmt->operation, stmt->type, operand(0), operand(1), builder);
+                break;
+            case IRStmtKind::Cast:
+                res = cast(stmt->operands[0]->type, stmt->type, operand(0), builder, context);
                 break;
-            case DataType::Float64:
-                memcpy(&cache_64, argument_buffer + offset, 8);
-                args.back().DoubleVal = reinterpret_cast<double&>(cache_64);
+            case IRStmtKind::FieldLoad: {
+                DataType element = stmt->operands[0]->type;
+                llvm::Type *element_type = to_llvm_type(element, context);
+                // GEP 只计算地址，不访问内存
+                llvm::Value *address = builder->CreateGEP(element_type, operand(0), operand(1));
+                emit_prefetch(stmt, address, lowering);
+                llvm::LoadInst *load = builder->CreateLoad(element_type, address);
+                set_access_groups(load, stmt, lowering);
+                res = llvm_load_element(element, load, builder); // 存储类型转换为计算类型
                 break;
+            }
+            case IRStmtKind::FieldStore: {
+                DataType element = stmt->operands[0]->type;
+                llvm::Type *element_type = to_llvm_type(element, context);
+                llvm::Value *address = builder->CreateGEP(element_type, operand(0), operand(1));
+                llvm::Value *stored = llvm_store_element(element, operand(2), builder);
+                set_access_groups(builder->CreateStore(stored, address), stmt, lowering);
+                break;
+            }
+            case IRStmtKind::FieldAtomic: {
+                DataType element = stmt->operands[0]->type;
+                llvm::Type *element_type = to_llvm_type(element, context);
+                llvm::Value *address = builder->CreateGEP(element_type, operand(0), operand(1));
+                res = (is_storage_type(element) ? llvm_storage_atomic : llvm_atomic)(
+                    stmt->atomic,
+                    element,
+                    address,
+                    operand(2),
+                    stmt->operands.size() > 3 ? operand(3) : nullptr,
+                    builder,
+                    llvm_function
+                );
+                break;
+            }
+            case IRStmtKind::Random:
+                // 生成器的指令直接内联在这里
+                res = llvm_random_uniform(builder, operand(0), operand(1), operand(2));
+                break;
+            case IRStmtKind::Call: {
+                // 在当前 module 中声明被调用的函数
+                // 函数的定义在另一个 module 中，MCJIT 在链接的时候会找到它
+                llvm::FunctionCallee callee = current_module->getOrInsertFunction(
+                    stmt->callee->get_symbol(),
+                    stmt->callee->function_type
+                );
+                std::vector<llvm::Value *> args;
+                for(size_t i = 0; i < stmt->operands.size(); i += 1) {
+                    args.push_back(operand(i));
+                }
+                llvm::CallInst *call = builder->CreateCall(callee, args);
+                if(stmt->callee->returns_struct()) {
+                    call->addParamAttr(0, llvm::Attribute::getWithStructRetType(
+                        *context,
+                        to_llvm_type(stmt->callee->get_return_type(), context)
+                    ));
+                } else {
+                    res = call;
+                }
+                break;
+            }
+            case IRStmtKind::Return:
+                if(stmt->operands.empty()) {
+                    builder->CreateRetVoid();
+                } else {
+                    builder->CreateRet(operand(0));
+                }
+                // return 是「终结指令」，之后的代码（比如循环的后半部分）放在一个不可达的 block 中，LLVM 会删掉它
+                builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "after_return", llvm_function));
+                break;
+            case IRStmtKind::RangeFor: {
+                llvm::Type *index_type = to_llvm_type(stmt->operands[0]->type, context);
+                llvm::Value *index = operand(0);
+                llvm::Value *begin = operand(1);
+                llvm::Value *end = operand(2);
+                llvm::Value *step = operand(3);
+                llvm::Value *zero = llvm::ConstantInt::get(index_type, 0, true);
+                llvm::Value *one = llvm::ConstantInt::get(index_type, 1, true);
+
+                // 创建循环基本上需要「3个Block」
+                // 循环条件判断（cond）、循环体（body）、和循环后的代码（after）
+                llvm::BasicBlock *if_blcok = llvm::BasicBlock::Create(
+                    *context,
+                    "loop_if", // 这些名字不会影响逻辑，只是为了辅助调试（这些名字会在IR中保留）
+                    llvm_function
+                );
+                llvm::BasicBlock *body_block = llvm::BasicBlock::Create(*context, "loop_body", llvm_function);
+                llvm::BasicBlock *next_block = llvm::BasicBlock::Create(*context, "loop_next", llvm_function);
+
+                // 步长是常量的话，loop index 本身就是归纳变量，条件中的 select 会被直接折叠掉
+                // 步长不是常量的话（比如 kernel 的 _taichi_s），LLVM 算不出迭代次数，循环就不能向量化
+                // 这时先算出迭代次数，用一个从 0 开始的计数器迭代，loop index = begin + counter * step
+                bool counted = stmt->operands[3]->kind != IRStmtKind::Const;
+                llvm::Value *counter = nullptr;
+                llvm::Value *trip_count = nullptr;
+                if(counted) {
+                    llvm::Value *positive = builder->CreateICmpSGT(step, zero);
+                    llvm::Value *not_empty = builder->CreateSelect(
+                        positive,
+                        builder->CreateICmpSLT(begin, end),
+                        builder->CreateICmpSGT(begin, end)
+                    );
+                    // 区间长度和步长的绝对值（按无符号数理解，不会溢出）
+                    llvm::Value *distance = builder->CreateSelect(
+                        positive,
+                        builder->CreateSub(end, begin),
+                        builder->CreateSub(begin, end)
+                    );
+                    llvm::Value *magnitude = builder->CreateSelect(positive, step, builder->CreateSub(zero, step));
+                    // 步长为 0 的时候避免除以 0（Python 的 range 不允许步长为 0）
+                    magnitude = builder->CreateSelect(builder->CreateICmpEQ(magnitude, zero), one, magnitude);
+                    trip_count = builder->CreateSelect(
+                        not_empty,
+                        builder->CreateAdd(builder->CreateUDiv(builder->CreateSub(distance, one), magnitude), one),
+                        zero
+                    );
+                    llvm::BasicBlock *entry_block = &(llvm_function->getEntryBlock());
+                    llvm::IRBuilder<> entry_builder(entry_block, entry_block->begin());
+                    counter = entry_builder.CreateAlloca(index_type);
+                    builder->CreateStore(zero, counter);
+                } else {
+                    builder->CreateStore(begin, index);
+                }
+                builder->CreateBr(if_blcok); // 无条件跳转
+                // 跳转是一种「终结指令」
+                // 每个基本块只能有一个终结指令（如 br、ret 等）（必须在最后吗？应该是的）
+
+                // 开始构建 if 代码块
+                builder->SetInsertPoint(if_blcok);
+                llvm::Value *compare_result = nullptr;
+                if(counted) {
+                    compare_result = builder->CreateICmpULT(builder->CreateLoad(index_type, counter), trip_count);
+                } else {
+                    llvm::LoadInst *load_loop_index = builder->CreateLoad(index_type, index);
+                    // 步长为正的时候 index < r 继续循环，步长为负的时候 index > r 继续循环
+                    compare_result = builder->CreateSelect(
+                        builder->CreateICmpSGT(step, zero),
+                        builder->CreateICmpSLT(load_loop_index, end), // 创建比较节点
+                        builder->CreateICmpSGT(load_loop_index, end)
+                    );
+                }
+                // 根据条件跳转，进入循环 or 跳出循环
+                builder->CreateCondBr(compare_result, body_block, next_block);
+
+                // 开始构建 body 代码块
+                builder->SetInsertPoint(body_block);
+                if(counted) {
+                    builder->CreateStore(
+                        builder->CreateAdd(begin, builder->CreateMul(builder->CreateLoad(index_type, counter), step)),
+                        index
+                    );
+                }
+                if(stmt->parallel) {
+                    lowering.access_groups[stmt] = llvm::MDNode::getDistinct(*context, {});
+                }
+                lowering.loops.push_back(stmt);
+                lower_block(stmt->body, lowering);
+                lowering.loops.pop_back();
+
+                // loop 结束的时候，loop index（或者计数器）要前进一步
+                if(counted) {
+                    builder->CreateStore(builder->CreateAdd(builder->CreateLoad(index_type, counter), one), counter);
+                } else {
+                    builder->CreateStore(builder->CreateAdd(builder->CreateLoad(index_type, index), step), index);
+                }
+                llvm::BranchInst *back_edge = builder->CreateBr(if_blcok); // loop 结束之后 一定是跳转到 if 块
+
+                // 迭代之间没有依赖：循环的 metadata 列出这个循环的 access group
+                // 向量化的时候就不需要运行时的别名检查了
+                if(stmt->parallel) {
+                    llvm::Metadata *parallel_accesses[] = {
+                        llvm::MDString::get(*context, "llvm.loop.parallel_accesses"),
+                        lowering.access_groups[stmt]
+                    };
+                    // loop id 的第一个操作数是自己
+                    llvm::TempMDTuple temp = llvm::MDTuple::getTemporary(*context, {});
+                    llvm::Metadata *loop_operands[] = {temp.get(), llvm::MDNode::get(*context, parallel_accesses)};
+                    llvm::MDNode *loop_id = llvm::MDNode::getDistinct(*context, loop_operands);
+                    loop_id->replaceOperandWith(0, loop_id);
+                    back_edge->setMetadata(llvm::LLVMContext::MD_loop, loop_id);
+                }
+
+                builder->SetInsertPoint(next_block); // loop 结束之后的代码块
+                break;
+            }
+        }
+        if(res) {
+            values[stmt] = res;
         }
-        offset += type_size(arg.type);
     }
-    llvm::ArrayRef<llvm::GenericValue> args_array(args);
+}
 
-    if(this->llvm_function) {
-        // runFunction 不是官方推荐的调用函数的方式
-        // 并且只能传递基本类型的参数
-        // 实践中，调用这个函数会报错，提示不要这样调用
-        // LLVM ERROR: MCJIT::runFunction does not support full-featured argument passing.
-        // Please use ExecutionEngine::getFunctionAddress and cast the result to the desired function pointer type.
-        llvm::GenericValue result = taichi_llvm_unit->engine->runFunction(
-            this->llvm_function,
-            args_array
-        );
+// 以前使用 EE->runFunction，MCJIT 不支持完整的参数传递，返回值也总是按整数读取
+// 现在把参数重新打包（每个参数占 8 字节）之后调用 thunk
+void Function::run(Byte *argument_buffer, Byte *result_buffer)
+{
+    if(!thunk) {
+        std::string _m = "function " + name + " is not built yet";
+        Out::Log(pType::ERROR, _m.c_str());
+        return;
+    }
 
-        // 获得返回值
-        uint64_t result_value = result.IntVal.getZExtValue();
-        Byte *src_buffer = (Byte *)&result_value;
-        memcpy(local_result_buffer, src_buffer, type_size(return_type)); // CHECK
-        memcpy(result_buffer, src_buffer, type_size(return_type));
+    // 参数数量最多是 UINT8_MAX（见 function_begin），直接使用栈上的空间
+    uint64_t packed_args[UINT8_MAX + 1];
+    uint64_t packed_result = 0;
+    uint32_t offset = 0;
+    for(size_t i = 0; i < argument_list.size(); i += 1) {
+        // field 和结构体参数都是指针
+        bool is_pointer = argument_list[i].is_field || is_struct_type(argument_list[i].type);
+        uint32_t size = is_pointer ? sizeof(void *) : type_size(argument_list[i].type);
+        packed_args[i] = 0;
+        memcpy(&packed_args[i], argument_buffer + offset, size);
+        offset += size;
+    }
+    // 结构体放不进 8 字节，直接写入 result_buffer
+    if(returns_struct()) {
+        std::vector<Byte> ignored(result_buffer ? 0 : type_size(return_type));
+        thunk(reinterpret_cast<Byte *>(packed_args), result_buffer ? result_buffer : ignored.data());
+        return;
     }
+    thunk(reinterpret_cast<Byte *>(packed_args), reinterpret_cast<Byte *>(&packed_result));
 
-    // 把返回值直接当作 Bytes 返回，这里不做类型解析（也没办法做）
-    return std::shared_ptr<Byte[]>(local_result_buffer, std::default_delete<Byte[]>());
+    // 把返回值直接当作 Bytes 写入，这里不做类型解析
+    if(return_type != DataType::Void && result_buffer) {
+        memcpy(result_buffer, &packed_result, type_size(return_type));
+    }
 }
 
-}
\ No newline at end of file
+const std::string &Function::get_asm()
+{
+    if(asm_code.empty() && asm_module) {
+        llvm::TargetMachine *target_machine = taichi_llvm_unit->engine->getTargetMachine();
+        if(!target_machine) {
+            Out::Log(pType::ERROR, "can not find target machine");
+            return asm_code;
+        }
+        // 和 engine 使用同一个 TargetMachine，得到的汇编和 JIT 生成的机器码一致
+        llvm::SmallString<0> buffer;
+        llvm::raw_svector_ostream os(buffer);
+        llvm::legacy::PassManager pass_manager;
+        if(target_machine->addPassesToEmitFile(
+            pass_manager,
+            os,
+            nullptr,
+            llvm::CodeGenFileType::AssemblyFile
+        )) {
+            Out::Log(pType::ERROR, "target machine can not emit assembly");
+            return asm_code;
+        }
+        pass_manager.run(*asm_module); // 这里不收集报告，JIT 编译的时候已经收集过了
+        asm_code = buffer.str().str();
+        asm_module.reset();
+    }
+    return asm_code;
+}
+
+void *Function::get_kernel_entry()
+{
+    llvm::LLVMContext *context = taichi_llvm_unit->context;
+    if(!kernel_entry) {
+        if(
+            argument_list.size() < 2
+            || argument_list[0].type != DataType::Int64
+            || argument_list[1].type != DataType::Int64
+            || argument_list[0].is_field
+            || argument_list[1].is_field
+        ) {
+            std::string _m = "function " + name + " is not a kernel";
+            Out::Log(pType::ERROR, _m.c_str());
+            return nullptr;
+        }
+
+        // 入口放在一个单独的 module 中，函数本身的 module 已经交给 EE 了
+        auto module = std::make_unique<llvm::Module>(
+            "taichi_entry_module_" + symbol,
+            *context
+        );
+        llvm::Type *int64_type = to_llvm_type(DataType::Int64, context);
+        llvm::Type *byte_type = llvm::Type::getInt8Ty(*context);
+        llvm::FunctionType *entry_type = llvm::FunctionType::get(
+            llvm::Type::getVoidTy(*context),
+            {int64_type, int64_type, llvm::PointerType::get(byte_type, 0)},
+            false
+        );
+        llvm::Function *entry_function = llvm::Function::Create(
+            entry_type,
+            llvm::Function::ExternalLinkage,
+            symbol + "_taichi_entry",
+            *module
+        );
+
+        llvm::BasicBlock *block = llvm::BasicBlock::Create(*context, "entry", entry_function);
+        llvm::IRBuilder<> builder(block);
+        llvm::FunctionCallee body = module->getOrInsertFunction(symbol, function_type);
+
+        // begin 和 end 直接传递，其余参数从 context 中读取
+        std::vector<llvm::Value *> args = {
+            entry_function->getArg(0),
+            entry_function->getArg(1)
+        };
+        for(auto arg : load_packed_arguments(&builder, entry_function->getArg(2), argument_list, 2)) {
+            args.push_back(arg);
+        }
+        builder.CreateCall(body, args);
+        builder.CreateRetVoid();
+
+        kernel_entry = finalize_module(std::move(module), {entry_function})[0];
+    }
+    return kernel_entry;
+}
+
+}
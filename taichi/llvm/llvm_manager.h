@@ -2,9 +2,12 @@
 #define LLVM_MANAGER_H
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
+#include <initializer_list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <stack>
@@ -14,13 +17,20 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/DiagnosticHandler.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "../tool/print.h"
+#include "llvm_arena.h"
+#include "llvm_jit_memory.h"
+#include "llvm_symbols.h"
 
 // lib 的 namespace
 namespace llvm_taichi
@@ -31,15 +41,45 @@ namespace llvm_taichi
     // Class 需要相互引用的话，可以提前声明
     class OperationValue;
     class Function;
+    enum class IRStmtKind; // 中间层的 IR，见 llvm_ir
+    struct IRStmt;
+    struct IRBlock;
+    struct LLVMLowering;
 
     // 数据类型
+    // Void 只用作返回值（比如 kernel 的函数体）
+    // Int8 之后的是存储类型，只能作为 field 的元素类型：读出来的时候转换为计算类型（见 compute_type），写入的时候再转换回来
+    // BFloat16 在 LLVM 中按 i16 存储，转换用整数运算实现，见 llvm_storage
+    // StructTypeBase 开始的是注册的结构体类型（见 llvm_struct），不在枚举中
+    // sync with python
     enum DataType {
+        Void = 0,
         Int32 = 1,
         Int64 = 2,
         Float32 = 3,
-        Float64 = 4
+        Float64 = 4,
+        Int8 = 5,
+        Int16 = 6,
+        UInt8 = 7,
+        UInt16 = 8,
+        UInt32 = 9,
+        Float16 = 10,
+        BFloat16 = 11
     };
 
+    // 结构体类型：StructTypeBase + 注册的序号，最多 64 个，不会和 FieldArgumentFlag 冲突
+    // sync with python（taichi.type.struct_type_base）
+    const uint8_t StructTypeBase = 0x40;
+
+    inline bool is_struct_type(DataType type) {
+        return type >= StructTypeBase && type < 0x80;
+    }
+
+    // 结构体的名字、字节数和 LLVM 类型，在 llvm_struct 中实现
+    const char *struct_name(DataType type);
+    uint32_t struct_size(DataType type);
+    llvm::Type *struct_llvm_type(DataType type, llvm::LLVMContext *context);
+
     // 从枚举类型转换为字符串 可以参照这种写法
     // switch 是跳表 执行很快
     // 字符串也都是常量类型
@@ -53,8 +93,24 @@ namespace llvm_taichi
                 return "Float32";
             case DataType::Float64:
                 return "Float64";
+            case DataType::Int8:
+                return "Int8";
+            case DataType::Int16:
+                return "Int16";
+            case DataType::UInt8:
+                return "UInt8";
+            case DataType::UInt16:
+                return "UInt16";
+            case DataType::UInt32:
+                return "UInt32";
+            case DataType::Float16:
+                return "Float16";
+            case DataType::BFloat16:
+                return "BFloat16";
+            case DataType::Void:
+                return "Void";
             default:
-                return "taichi_default_data_type";
+                return is_struct_type(type) ? struct_name(type) : "taichi_default_data_type";
         }
     }
 
@@ -66,35 +122,88 @@ namespace llvm_taichi
         Div = 4
     };
 
+    // field 元素上的原子操作，结果都是操作之前的值
+    // Add、Min、Max 是 relaxed 的（只保证这个元素上的操作不会丢失），Cas 是 seq_cst 的
+    // sync with python（taichi.lang.operation）
+    enum AtomicOperation {
+        AtomicAdd = 1,
+        AtomicMin = 2,
+        AtomicMax = 3,
+        AtomicCas = 4 // 元素等于 expected 的话替换为 desired，浮点数按位比较
+    };
+
     // 操作数类型：常量 or 变量
     enum OperationValueType {
         Constant = 1,
         Variable = 2
     };
 
+    // 参数类型的最高位表示这个参数是一个 field，其余位是元素类型
+    // field 参数在 LLVM 中是指向元素的指针
+    // sync with python
+    const uint8_t FieldArgumentFlag = 0x80;
+
     // 通用参数
+    // 结构体参数按指针传递（只读），被调用者在入口处复制一份，和标量参数一样是值语义
     struct Argument {
-        DataType type;
+        DataType type; // field 参数的话，这里是元素类型
         std::string name;
+        bool is_field = false;
     };
 
-    // 获取一个类型的字节数量
-    inline uint8_t type_size(DataType type) {
-        uint8_t res = 1;
+    // 获取一个类型的字节数量，结构体是按成员对齐之后的大小（和 C 的 struct 一样）
+    inline uint32_t type_size(DataType type) {
+        if(is_struct_type(type)) {
+            return struct_size(type);
+        }
+        uint32_t res = 1;
         switch(type) {
+            case DataType::Int16:
+            case DataType::UInt16:
+            case DataType::Float16:
+            case DataType::BFloat16:
+                res = 2;
+                break;
             case DataType::Int32:
             case DataType::Float32:
+            case DataType::UInt32:
                 res = 4;
                 break;
             case DataType::Int64:
             case DataType::Float64:
                 res = 8;
                 break;
+            default:
+                break;
         }
         return res;
     }
 
-    // Taichi 类型转换为 LLVM 类型
+    // 是不是只能用于 field 元素的存储类型
+    inline bool is_storage_type(DataType type) {
+        return type >= DataType::Int8 && type <= DataType::BFloat16;
+    }
+
+    // 存储类型读出来之后的计算类型：窄的整数都是 Int32（UInt32 是 Int64，这样不会溢出），半精度的浮点数是 Float32
+    // 其他类型的计算类型就是自己
+    inline DataType compute_type(DataType type) {
+        switch(type) {
+            case DataType::Int8:
+            case DataType::Int16:
+            case DataType::UInt8:
+            case DataType::UInt16:
+                return DataType::Int32;
+            case DataType::UInt32:
+                return DataType::Int64;
+            case DataType::Float16:
+            case DataType::BFloat16:
+                return DataType::Float32;
+            default:
+                return type;
+        }
+    }
+
+    // Taichi 类型转换为 LLVM 类型，存储类型是它在内存中的类型
     inline llvm::Type *to_llvm_type(DataType type, llvm::LLVMContext *context) {
         llvm::Type *res = nullptr;
         switch (type) {
@@ -110,10 +219,42 @@ namespace llvm_taichi
             case DataType::Float64:
                 res = llvm::Type::getDoubleTy(*context);
                 break;
+            case DataType::Int8:
+            case DataType::UInt8:
+                res = llvm::Type::getInt8Ty(*context);
+                break;
+            case DataType::Int16:
+            case DataType::UInt16:
+            case DataType::BFloat16:
+                res = llvm::Type::getInt16Ty(*context);
+                break;
+            case DataType::UInt32:
+                res = llvm::Type::getInt32Ty(*context);
+                break;
+            case DataType::Float16:
+                res = llvm::Type::getHalfTy(*context);
+                break;
+            case DataType::Void:
+                res = llvm::Type::getVoidTy(*context);
+                break;
+            default:
+                // 结构体是 LLVM 的 named struct，成员的顺序和注册的顺序一致
+                if(is_struct_type(type)) {
+                    res = struct_llvm_type(type, context);
+                }
+                break;
         }
         return res;
     }
 
+    // 参数对应的 LLVM 类型，field 参数是元素的指针，结构体参数是结构体的指针
+    inline llvm::Type *to_llvm_type(const Argument &arg, llvm::LLVMContext *context) {
+        if(arg.is_field || is_struct_type(arg.type)) {
+            return llvm::PointerType::get(to_llvm_type(arg.type, context), 0);
+        }
+        return to_llvm_type(arg.type, context);
+    }
+
     // 构造一个 LLVM 某类型的默认常量
     inline llvm::Value *llvm_default_value(
         DataType type,
@@ -129,6 +270,8 @@ namespace llvm_taichi
             case DataType::Float64:
                 res = llvm::ConstantFP::get(to_llvm_type(type, context), 0.0);            
                 break;
+            default:
+                break;
         }
         return res;
     }
@@ -142,7 +285,10 @@ namespace llvm_taichi
     }
 
     // 计算类型提升：a 和 b 计算的结果应该是什么类型
+    // 存储类型先提升为计算类型（比如 Float16 和 Int32 的结果是 Float32）
     inline DataType calc_type(DataType a, DataType b) {
+        a = compute_type(a);
+        b = compute_type(b);
         uint8_t res_size = std::max(type_size(a), type_size(b));
         DataType res = DataType::Int32;
         if(res_size == 4) {
@@ -218,6 +364,8 @@ namespace llvm_taichi
                     );
                 }
                 break;
+            default:
+                break;
         }
         return res;
     }
@@ -228,15 +376,15 @@ namespace llvm_taichi
 
     protected:
         OperationValueType operation_value_type; // 常量 or 变量
-        std::string variable_name; // 变量的话，存储变量名
+        Symbol variable = NoSymbol; // 变量的话，存储变量名
         DataType constant_value_type; // 常量的话，需要数据类型
         Byte constant_value[8]; // 存储常量的值
 
     public:
         // 设定变量
-        inline void set_variable(const std::string &name) {
+        inline void set_variable(Symbol name) {
             operation_value_type = OperationValueType::Variable;
-            variable_name = name;
+            variable = name;
         }
 
         // 设定常量
@@ -254,7 +402,7 @@ namespace llvm_taichi
                     buffer + 2
                 );
             } else {
-                set_variable(std::string((char *)(buffer + 2)));
+                set_variable(taichi_symbols.intern(buffer + 2));
             }
         }
     
@@ -264,54 +412,398 @@ namespace llvm_taichi
             Function *function
         ) const;
 
-        // 根据自己的数据，构造一个 LLVM Value
-        llvm::Value *construct_llvm_value(
-            Function *function,
-            llvm::IRBuilder<> *builder,
-            llvm::LLVMContext *context
+        // 根据自己的数据，在函数中构造一个值（常量，或者读取变量）
+        IRStmt *construct_value(
+            Function *function
         ) const;
     };
 
-    void init(); // 初始化 lib
+    // ===== 解释器 =====
+    // 中间层的 IR 优化之后，除了 lowering 到 LLVM IR，也会 lowering 为一份简单的语句流
+    // 冷的函数直接用解释器执行语句流，不需要等待 LLVM 优化和生成代码
+    // 热的函数在后台编译，之后的调用直接跳转到编译好的代码
+
+    // 解释器中的值，类型由语句决定
+    union Scalar {
+        int32_t i32;
+        int64_t i64;
+        float f32;
+        double f64;
+        Byte *ptr; // field 参数
+    };
+
+    // 没有槽位（比如调用的返回值没有被使用）
+    const uint32_t NoSlot = UINT32_MAX;
+
+    // 语句的操作数：常量，或者变量的槽位
+    struct Operand {
+        bool is_constant;
+        DataType type;
+        uint32_t slot;
+        Scalar constant;
+    };
+
+    enum class StatementKind {
+        Assign, // target = operands[0]
+        Operation, // target = operands[0] operation operands[1]
+        Load, // target = field[operands[0]]
+        Store, // field[operands[0]] = operands[1]
+        Atomic, // target = atomic(field[operands[0]], operands[1], operands[2])，见 AtomicOperation
+        Random, // target = random_uniform(operands[0], operands[1], operands[2])，见 llvm_random
+        Address, // target = field 的话 field + operands[0] * stride + offset，否则是 frame + offset（结构体变量）
+        Call, // target = callee(operands...)，返回结构体的话 operands[0] 是结果的地址
+        Return, // return operands[0]（Void 函数没有操作数）
+        LoopBegin, // target = l，bound = r，step = s，然后进入 LoopCheck
+        LoopCheck, // 不满足循环条件的话跳转到 jump（LoopEnd 之后）
+        LoopEnd // target += step，跳转到 jump（LoopCheck）
+    };
+
+    struct Statement {
+        StatementKind kind;
+        uint32_t target = NoSlot; // 结果存到这个槽位（loop index 也是 target）
+        DataType target_type = DataType::Int32;
+        OperationType operation = OperationType::Add;
+        AtomicOperation atomic = AtomicOperation::AtomicAdd;
+        std::vector<Operand> operands;
+        uint32_t field = NoSlot; // field 参数的槽位
+        DataType element_type = DataType::Int32; // field 的元素类型
+        uint32_t bound = NoSlot; // 循环的右边界
+        uint32_t step = NoSlot; // 循环的步长
+        size_t jump = 0;
+        Function *callee = nullptr;
+        uint32_t offset = 0; // Address
+        uint32_t stride = 0; // Address：结构体的大小
+    };
+
+    // 打包调用：参数依次存放在 args 中，每个占 8 字节，返回值写入 result
+    typedef void (*PackedEntry)(Byte *args, Byte *result);
+
+    // 性能分析工具的集成，按位组合
+    // sync with python（taichi.tool.profiler_integrations）
+    enum ProfilerIntegration {
+        ProfilerNone = 0,
+        ProfilerPerf = 1, // perf map（/tmp/perf-<pid>.map）以及 jitdump
+        ProfilerGDB = 2 // GDB 的 JIT 接口
+    };
+
+    // 浮点数的语义，按位组合，对应 LLVM 的 fast-math flags，0 就是严格的 IEEE 语义
+    // 只影响编译的代码，解释器（分层执行的冷函数）总是严格的语义
+    // sync with python（taichi.tool.fast_math_flags）
+    enum FastMathFlag {
+        FastMathNoNaNs = 1, // nnan：假设没有 NaN
+        FastMathNoInfs = 2, // ninf：假设没有无穷大
+        FastMathNoSignedZeros = 4, // nsz：不区分 +0 和 -0
+        FastMathReciprocal = 8, // arcp：除法可以换成乘倒数
+        FastMathContract = 16, // contract：a * b + c 可以合并为 FMA
+        FastMathApproxFunc = 32, // afn：数学函数可以使用近似的实现
+        FastMathReassoc = 64, // reassoc：可以重新结合，浮点数的归约才能向量化
+        FastMathFast = 127
+    };
+
+    // field 参数的访问提示，可以组合使用，只影响性能
+    // sync with python（taichi.tool.field_hint_flags）
+    enum FieldHint {
+        // 只写一次的输出：写入使用 non-temporal store，不经过 cache，不会把其他数据挤出去
+        // 在优化（向量化）之后标记，函数返回之前加一个 fence，保证 kernel 结束之后其他线程能看到
+        FieldHintStreaming = 1,
+        // 循环中以 loop index（加常数）为下标、或者以另一个 field 的元素为下标（gather，x[index[i]]）的读取，
+        // 提前 prefetch_distance 次迭代预取；连续的读取硬件也会预取，而且预取会妨碍向量化，主要用于 gather
+        FieldHintPrefetch = 2,
+        FieldHintPrefetchGather = 4 // 只预取 gather
+    };
+
+    // 初始化 lib
+    void init(
+        uint8_t profiler_integration = ProfilerNone,
+        uint64_t tier_up_threshold = 0,
+        bool retain_ir = false,
+        bool collect_remarks = false
+    );
+    // 所有还活着的函数的内存，每行一个：name symbol handle registered code data ir modules，用 tab 分割
+    std::string jit_memory_report();
+    // 停止后台编译的线程（见 llvm_interpreter）
+    void stop_tiered_compiler();
+
+    // IR 的阶段
+    // sync with python（taichi.core.codegen）
+    enum IRStage {
+        Initial = 0, // 刚刚 lowering 到 LLVM IR，没有经过 LLVM 的优化
+        Optimized = 1, // 经过优化，交给 engine 的 IR
+        SSAInitial = 2, // 中间层的 IR（见 llvm_ir），刚刚构建完成
+        SSA = 3 // 中间层的 IR，经过 llvm_passes 的优化
+    };
+
+    // LLVM 的优化报告（比如：循环是否被向量化，没有的话原因是什么）
+    struct Remark {
+        std::string kind; // passed / missed / analysis
+        std::string pass; // 产生报告的 pass，比如 loop-vectorize
+        std::string name; // 报告的名字，比如 Vectorized
+        std::string file; // 对应的 Python 源码位置（开启 profiler 集成才有）
+        uint32_t line;
+        std::string message;
+    };
+
+    // 循环的依赖分析结果（见 llvm_passes 的 analyze_dependences）
+    struct LoopReport {
+        uint32_t depth = 0; // 0 是最外层的循环
+        uint32_t location = 0; // 源码位置（Function::locations 的下标）
+        bool parallel = false; // field 的访问在迭代之间没有依赖
+        bool independent = false; // parallel，而且没有局部变量的值从上一次迭代传递过来，迭代可以以任意顺序执行
+        std::vector< std::pair<std::string, uint32_t> > dependences; // 依赖的说明和源码位置
+        std::vector< std::pair<std::string, uint32_t> > reductions; // 识别出的归约（原子的或者局部变量上的）
+    };
+
+    // 变量的绑定：变量名 to 「变量（中间层 IR 的 Alloca），变量类型」
+    // 被覆盖的绑定（比如 loop index 覆盖了同名的外部变量）通过 previous 链接，离开作用域的时候恢复
+    struct VariableBinding {
+        IRStmt *value;
+        DataType type;
+        size_t depth; // 所在作用域的深度，0 是函数最外部的作用域
+        VariableBinding *previous;
+    };
 
     // 函数
-    class Function {
+    // 由 FunctionTable（Python 端的引用）以及调用它的函数共同持有，都释放之后代码和数据随之释放
+    class Function : public std::enable_shared_from_this<Function> {
         friend class OperationValue;
 
     protected:
         std::string name; // 函数名
+        // LLVM 中的符号名：同一个函数名重新构建的话加上序号，和旧的代码不会冲突
+        std::string symbol;
         std::vector<Argument> argument_list; // 参数列表
         DataType return_type; // 返回值类型
-        llvm::Function *llvm_function; // LLVM Func 指针
-        std::vector< 
-            std::unordered_map<
-                std::string,
-                std::pair<llvm::AllocaInst *, DataType>
-            >
-        > variable_stack;
-        // 用栈（这里用 vector 模仿栈，方便遍历）存储函数内部的变量，比如进入 loop，就是进入一个新的作用域，内部的变量可以覆盖外部的变量
-        // 每一层（可以理解为一个作用域）都是一个表，存储「变量名」 to 「变量的信息」
-        // 这个「栈」记录了变量指针（非原始指针）和变量类型
+        // LLVM Func 指针，代码生成之后 module 交给 engine 再释放，这里变为 nullptr
+        llvm::Function *llvm_function = nullptr;
+        llvm::FunctionType *function_type = nullptr; // 调用者需要的类型，属于 context，一直有效
+        void *pointer = nullptr; // 编译好的函数（tiered 的话是 stub）的地址
+        // 这个函数生成的代码和数据，以及它调用的函数（被调用的代码要比调用者活得久）
+        std::shared_ptr<JitMemory> jit_memory;
+        std::vector< std::shared_ptr<Function> > callees;
+        uint32_t fast_math = 0; // FastMathFlag 的组合
+        // field 参数的访问提示：下标是参数的序号，值是 FieldHint 的组合和预取的距离（迭代次数）
+        std::vector< std::pair<uint32_t, uint32_t> > field_hints;
+        int64_t trace_begin = 0; // build_begin 的时刻（Tracer::now），整个构建在时间线中是一个事件
+        // 构建期间的数据（IR、变量的绑定）都在 arena 中分配，build_finish 之后一次性释放
+        Arena arena;
+        // 符号表：下标是变量名的 Symbol，值是当前可见的绑定（nullptr 表示没有这个变量）
+        // 进入 loop，就是进入一个新的作用域，内部的变量可以覆盖外部的变量
+        std::vector<VariableBinding *> bindings;
+        // 作用域的栈：scope_symbols 记录每个作用域中定义的变量，scope_marks 是每个作用域在 scope_symbols 中的起点
+        std::vector<Symbol> scope_symbols;
+        std::vector<size_t> scope_marks;
         std::unique_ptr<llvm::Module> current_module; // 当前的 module，一个函数对应一个 module
         std::unique_ptr< llvm::IRBuilder<> > current_builder; // 当前的 builder，也是一个函数对应一个 builder
-        // blocks，用栈存储，也是用于维护函数内部的作用域的
-        std::stack<llvm::BasicBlock *> current_blocks;
-        // 存储 loop 的状态，比如 loop index 的指针，用于更新 loop 状态
-        std::stack< std::pair<llvm::AllocaInst *, int32_t> > current_loop_update;
+        // 中间层的 IR
+        // 构建接口只生成中间层的 IR，build_finish 的时候优化，再 lowering 到 LLVM IR
+        IRBlock *ir_body = nullptr; // 函数体
+        std::stack<IRBlock *> ir_blocks; // 正在构建的 block，栈顶是当前的 block（进入 loop 就是进入循环体）
+        std::vector<IRStmt *> ir_arguments; // 每个参数的 Arg
+        IRStmt *ir_result = nullptr; // 返回结构体的函数：结果的地址（sret，第 0 个 LLVM 参数）
+        std::vector<IRStmt *> ir_allocas; // 所有的 Alloca，build_finish 的时候放到参数之后
+        uint32_t ir_next_id = 0;
+        // 源码位置：文件名和行号，下标 0 表示没有位置
+        std::vector< std::pair<std::string, uint32_t> > locations;
+        uint32_t current_location = 0;
+        // field 参数：名字 to 「元素指针（Arg），元素类型」
+        std::unordered_map<
+            Symbol,
+            std::pair<IRStmt *, DataType>
+        > field_table;
+        // kernel 的入口（由 runtime 调用），需要的时候才生成
+        void *kernel_entry = nullptr;
+        // 调试信息：把指令对应到 Python 源码的行，只在开启了 profiler 集成的时候生成
+        std::unique_ptr<llvm::DIBuilder> debug_builder;
+        llvm::DISubprogram *debug_subprogram = nullptr;
+        // 文件名 to 作用域（融合的 kernel 可能来自不同的文件）
+        std::unordered_map<std::string, llvm::DIScope *> debug_scopes;
+        // 中间层的 IR 在优化前后的文本
+        std::string ir_ssa_initial;
+        std::string ir_ssa;
+        // 优化前后的 IR，以及优化报告
+        std::string ir_initial;
+        std::string ir_optimized;
+        std::vector<Remark> remarks;
+        std::vector<LoopReport> loop_reports;
+        // 汇编需要的时候才生成，先保存一份优化后的 module
+        std::unique_ptr<llvm::Module> asm_module;
+        std::string asm_code;
+
+        // 解释器使用的语句流，以及每个值的槽位（只有分层执行的函数才有）
+        std::vector<Statement> statements;
+        std::vector<DataType> slot_types;
+        std::unordered_map<const IRStmt *, uint32_t> value_slots;
+        std::vector<uint32_t> argument_slots;
+        size_t frame_bytes = 0; // 结构体变量的内存，每次执行的时候分配
+
+        // 分层执行
+        // tiered 的函数在 build_finish 之后只生成一个 stub，stub 通过 slot 跳转
+        // slot 一开始指向解释器，编译完成之后原子地替换为编译好的函数，函数地址（stub）始终不变
+        bool tiered = false;
+        std::atomic<bool> compiled{false};
+        std::atomic<bool> promotion_requested{false};
+        std::atomic<uint64_t> hotness{0}; // 调用次数 + 循环的迭代次数
+        std::atomic<void *> slot{nullptr};
+        std::atomic<PackedEntry> packed_entry{nullptr};
+        // 给 C++ 的动态调用者使用的打包入口，build_finish 之后就可以调用
+        // 普通的函数就是 packed_entry；tiered 的函数是 stub 的打包入口，编译前后不变
+        PackedEntry thunk = nullptr;
+        llvm::Function *stub_function = nullptr;
+        llvm::Function *packed_function = nullptr;
 
     protected:
-        // 从 stack 中找到一个变量，最先找到的就是最「内部」的变量，以此做到「内部变量掩盖外部变量」
-        std::pair<llvm::AllocaInst *, DataType> find_variable(const std::string &variable_name);
-        // 分配一个变量，也是分配到栈的顶部
-        llvm::AllocaInst *alloc_variable(const std::string &name, DataType type, bool force_local = false);
+        // 找到一个变量当前可见的绑定，也就是最「内部」的变量，以此做到「内部变量掩盖外部变量」
+        std::pair<IRStmt *, DataType> find_variable(Symbol variable_name);
+        // 分配一个变量
+        // 和 Python 一样，普通变量属于整个函数；force_local 的变量（loop index）属于当前作用域
+        IRStmt *alloc_variable(Symbol name, DataType type, bool force_local = false);
+        // 进入 / 离开一个作用域，离开的时候恢复被覆盖的绑定
+        void push_scope();
+        void pop_scope();
+        // 找到一个 field 参数，找不到的话指针为 nullptr
+        std::pair<IRStmt *, DataType> find_field(Symbol field_name);
+        // 计算 field 的下标（Int64），找不到 field 或者下标不合法的话返回 nullptr
+        IRStmt *element_index(Symbol field_name, const OperationValue &index);
+        // 把一个值（转换类型之后）存储到变量中，变量不存在的话就创建，类型为 value_type
+        void store_variable(Symbol name, IRStmt *value);
+        // 结构体变量的地址（StructAlloca）和类型，不是结构体变量的话地址为 nullptr
+        std::pair<IRStmt *, DataType> find_struct(Symbol name);
+        // 结构体变量的地址，没有的话创建；已经是其他类型的变量的话返回 nullptr
+        IRStmt *struct_variable(Symbol name, DataType type);
+        // 成员的地址：base 是结构体的指针（index 为 0）或者元素是结构体的 field（第 index 个元素）
+        // 找不到成员的话返回 nullptr
+        IRStmt *member_pointer(IRStmt *base, IRStmt *index, Symbol member_name);
+        // 逐个成员复制 dst[dst_index] = src[src_index]，局部的结构体下标是 0
+        void copy_struct(IRStmt *dst, IRStmt *dst_index, IRStmt *src, IRStmt *src_index, DataType type);
+        // 临时的结构体（不绑定变量名），比如没有使用的返回值
+        IRStmt *temporary_struct(DataType type);
+        // Int64 的常量 0：结构体变量的下标，以及成员指针的读写都以 0 为下标
+        IRStmt *struct_index();
+        // 结构体变量 base，或者元素是结构体的 field base[index] 的指针和下标
+        // 找不到（或者不是结构体）的话指针为 nullptr
+        std::pair<IRStmt *, IRStmt *> struct_base(Symbol base_name, const OperationValue *index);
+
+        // 在 arena 中创建一条语句（不加入任何 block）
+        IRStmt *new_stmt(IRStmtKind kind, DataType type);
+        // 在当前的 block 中添加一条语句
+        IRStmt *emit(IRStmtKind kind, DataType type, std::initializer_list<IRStmt *> operands = {});
+        IRStmt *emit_constant(DataType type, const Byte *value);
+        // 类型相同的话直接返回 value
+        IRStmt *emit_cast(IRStmt *value, DataType type);
+
+        // lowering 到 LLVM IR（current_module 中的 llvm_function）
+        // 有返回值的函数缺少 return 的话返回 false
+        bool lower_to_llvm();
+        void lower_block(IRBlock *block, LLVMLowering &lowering);
+        // lowering 为解释器的语句流
+        void lower_statements();
+        void lower_statements(IRBlock *block);
+        // 分配一个解释器的槽位
+        uint32_t new_slot(DataType type);
+        // 一个值的槽位，第一次使用的时候分配
+        uint32_t slot_of(const IRStmt *stmt);
+        // 把一个值转换为解释器的操作数，常量直接放在操作数中
+        Operand to_operand(const IRStmt *stmt);
+        // 一个 field 参数（Arg）的访问提示，其他的语句返回 {0, 0}
+        std::pair<uint32_t, uint32_t> field_hint(const IRStmt *field) const;
+        // 在 lowering 的时候，为循环中被提示的 field 读取插入预取
+        void emit_prefetch(const IRStmt *stmt, llvm::Value *address, LLVMLowering &lowering);
+        // 优化之后，把 streaming 的 field 的写入标记为 non-temporal
+        void mark_streaming_stores();
+        // 生成打包调用的入口 void name_taichi_packed(Byte *args, Byte *result)
+        void build_packed_entry();
+        // 生成 stub 和解释器的 adapter（tiered 的函数）
+        void build_stub();
+        // 优化 module 并交给 engine
+        void compile_module();
+        // 在 jit_memory 中生成 module 的代码，然后从 engine 中取出 module 释放掉，返回 get 得到的地址
+        std::vector<void *> finalize_module(
+            std::unique_ptr<llvm::Module> module,
+            const std::vector<llvm::Function *> &get
+        );
+        // 不保留 IR 的话，代码生成之后清理 IR 的文本
+        void drop_ir();
+        // 用解释器执行一次
+        void execute(Byte *args, Byte *result);
+        // 记录热度，达到阈值就请求后台编译
+        void add_hotness(uint64_t ticks);
 
     public:
         // 获取 llvm::Function
         // 层级： taichi::Function > llvm::Function > raw_func_ptr
+        // module 交给 engine 生成代码之后就释放了，这时返回 nullptr
         inline llvm::Function *get_raw_ptr() {
             return llvm_function;
         }
 
+        inline const std::string &get_name() const {
+            return name;
+        }
+        inline const std::string &get_symbol() const {
+            return symbol;
+        }
+        // 生成的代码和数据的字节数
+        inline size_t code_bytes() const {
+            return jit_memory ? jit_memory->code_bytes : 0;
+        }
+        inline size_t data_bytes() const {
+            return jit_memory ? jit_memory->data_bytes : 0;
+        }
+        // 保留的 IR：文本、解释器的语句流，以及还没有交给 engine 的 module 的数量
+        size_t ir_bytes() const;
+        size_t retained_modules() const;
+        inline const std::vector<Argument> &get_argument_list() const {
+            return argument_list;
+        }
+        inline DataType get_return_type() const {
+            return return_type;
+        }
+        // 返回结构体的函数在 LLVM 中返回 void，结果写入第 0 个参数指向的内存（sret）
+        inline bool returns_struct() const {
+            return is_struct_type(return_type);
+        }
+
+        // 用于查看代码生成的结果
+        inline const std::string &get_ir(IRStage stage) const {
+            switch(stage) {
+                case IRStage::Initial: return ir_initial;
+                case IRStage::SSAInitial: return ir_ssa_initial;
+                case IRStage::SSA: return ir_ssa;
+                default: return ir_optimized;
+            }
+        }
+        inline const std::vector<Remark> &get_remarks() const {
+            return remarks;
+        }
+        inline void add_remark(Remark &&remark) {
+            remarks.push_back(std::move(remark));
+        }
+        inline const std::vector<LoopReport> &get_loop_reports() const {
+            return loop_reports;
+        }
+        // 源码位置的文件名和行号，没有位置的话是空的文件名和 0
+        inline const std::pair<std::string, uint32_t> &get_location(uint32_t location) const {
+            static const std::pair<std::string, uint32_t> none;
+            return location < locations.size() ? locations[location] : none;
+        }
+        // 生成（或者获取）最终的汇编代码
+        const std::string &get_asm();
+
+        // 可以直接调用的函数地址（tiered 的函数是 stub 的地址）
+        void *get_pointer();
+        // 打包调用的入口 void thunk(void *args, void *ret)，格式见 PackedEntry
+        // 还没有 build_finish 的话返回 nullptr
+        inline PackedEntry get_thunk() const {
+            return thunk;
+        }
+        // 打包调用：编译好了就调用编译好的代码，否则使用解释器
+        void invoke(Byte *args, Byte *result);
+        // 编译这个函数（已经编译过的话什么也不做），需要持有 llvm_mutex
+        void promote();
+        inline bool is_compiled() const {
+            return compiled.load();
+        }
+
     // 用于定义函数的一系列接口
     public:
         void build_begin(
@@ -319,30 +811,193 @@ namespace llvm_taichi
             const std::vector<Argument> &argument_list,
             DataType return_type
         );
-        void build_finish();
+        // 构建失败（缺少 return、verify 失败）的话返回 false，函数不会被编译，调用者应该释放它
+        bool build_finish();
+        // 函数定义在 Python 源码中的位置，在 build_begin 之后调用
+        void debug_begin(const std::string &file_name, uint32_t line);
+        // 函数的浮点数语义（FastMathFlag 的组合），在 build_begin 之后、构建语句之前调用
+        void set_fast_math(uint32_t flags);
+        // 第 argument 个参数（field）的访问提示（FieldHint 的组合），在 build_begin 之后、build_finish 之前调用
+        void set_field_hint(uint32_t argument, uint32_t flags, uint32_t prefetch_distance);
+        // 之后构建的语句对应 Python 源码中的这一行
+        void debug_location(const std::string &file_name, uint32_t line);
         void loop_begin(
-            const std::string &loop_index_name,
+            Symbol loop_index_name,
             int32_t l,
             int32_t r,
             int32_t s
         );
+        // 循环范围不是常量的 loop，三个边界都是操作数
+        void loop_begin(
+            Symbol loop_index_name,
+            const OperationValue &l,
+            const OperationValue &r,
+            const OperationValue &s
+        );
         void loop_finish();
+        // target = field[index]
+        void load_statement(
+            Symbol target_name,
+            Symbol field_name,
+            const OperationValue &index
+        );
+        // field[index] = value
+        void store_statement(
+            Symbol field_name,
+            const OperationValue &index,
+            const OperationValue &value
+        );
+        // target = atomic(field[index], value)，target 是操作之前的值
+        // Cas 的话 value 是 expected，desired 是要写入的值，其他操作 desired 为 nullptr
+        void atomic_statement(
+            Symbol target_name,
+            Symbol field_name,
+            AtomicOperation operation,
+            const OperationValue &index,
+            const OperationValue &value,
+            const OperationValue *desired
+        );
+        // target = [0, 1) 之间的随机数（Float64），结果只由 seed、counter、stream 决定（见 llvm_random）
+        // 三个操作数都转换为 Int64
+        void random_statement(
+            Symbol target_name,
+            const OperationValue &seed,
+            const OperationValue &counter,
+            const OperationValue &stream
+        );
+        // 一个值在当前位置的类型：常量的类型，或者变量现在的类型
+        // 没有定义的变量（以及 field）返回 Void，用于按调用处的参数类型实例化泛型的 ti.func
+        DataType value_type(const OperationValue &value);
+        // 声明一个结构体变量，所有成员清零（已经有这个变量的话也清零）
+        void struct_statement(Symbol name, DataType type);
+        // target = base.member，index 不为 nullptr 的话 base 是元素为结构体的 field：target = base[index].member
+        void member_load_statement(
+            Symbol target_name,
+            Symbol base_name,
+            const OperationValue *index,
+            Symbol member_name
+        );
+        // base.member = value（或者 base[index].member = value）
+        void member_store_statement(
+            Symbol base_name,
+            const OperationValue *index,
+            Symbol member_name,
+            const OperationValue &value
+        );
+        // target = callee(args...)，callee 是另一个已经编译的函数
+        // 结构体的实参是结构体变量，返回结构体的话 target 是一个结构体变量
+        void call_statement(
+            Symbol target_name,
+            Symbol callee_name,
+            const std::vector<OperationValue> &args
+        );
         void assignment_statement(
-            const std::string &name,
+            Symbol name,
             const OperationValue &value
         );
         void assignment_statement(
-            const std::string &result_name,
+            Symbol result_name,
             const OperationValue &left_value,
             OperationType operation_type,
             const OperationValue &right_value
         );
-        void return_statement(const std::string &return_variable_name);
-        std::shared_ptr<Byte[]> run(Byte *argument_buffer, Byte *result_buffer);
+        void return_statement(Symbol return_variable_name);
+        // 执行函数：参数在 argument_buffer 中紧密排列，返回值写入 result_buffer
+        // 通过 thunk 调用，不会分配内存
+        void run(Byte *argument_buffer, Byte *result_buffer);
+        // 生成（或者获取）kernel 的入口 void entry(int64 begin, int64 end, void *context)
+        // 函数本身的前两个参数必须是 Int64 的 begin 和 end
+        // 其余参数依次从 context 中读取，每个参数占 8 字节
+        void *get_kernel_entry();
 
     public:
-        Function() = default;
+        // IRBlock 在这里是不完整的类型，构造和析构函数放在 cpp 中
+        Function();
+        ~Function();
+    };
+
+    // 函数的 handle，构建接口通过 handle 找到函数，0 表示没有这个函数
+    typedef uint32_t FunctionHandle;
+    const FunctionHandle NoFunction = 0;
+
+    // 函数的注册表
+    // 函数按注册的顺序编号，handle 就是下标；函数名（Symbol）to handle 另外记录
+    // 表中的引用就是 Python 端的引用：remove 之后名字可以重新使用，release 之后 handle 不再有效
+    class FunctionTable {
+    protected:
+        std::vector< std::shared_ptr<Function> > functions;
+        std::unordered_map<Symbol, FunctionHandle> handles;
+        // 所有还活着的函数（包括已经不在表中、仍然被调用者持有的），用于统计内存
+        std::vector< std::weak_ptr<Function> > all;
+        // 名字和函数的对应每变化一次加一，按名字缓存函数的调用者（见 llvm_compiled）用它判断要不要重新查找
+        std::atomic<uint64_t> changes{0};
+
+    public:
+        inline FunctionTable() : functions(1) {}
+
+        // 已经注册过的名字返回 NoFunction
+        inline FunctionHandle add(Symbol name, std::shared_ptr<Function> function) {
+            if(handles.count(name)) {
+                return NoFunction;
+            }
+            FunctionHandle handle = static_cast<FunctionHandle>(functions.size());
+            all.push_back(function);
+            functions.push_back(std::move(function));
+            handles[name] = handle;
+            changes.fetch_add(1, std::memory_order_release);
+            return handle;
+        }
+        // 名字不再指向这个函数，之后可以用同样的名字构建新的函数
+        inline void remove(FunctionHandle handle) {
+            for(auto it = handles.begin(); it != handles.end(); ++it) {
+                if(it->second == handle) {
+                    handles.erase(it);
+                    changes.fetch_add(1, std::memory_order_release);
+                    return;
+                }
+            }
+        }
+        // 释放表中的引用，没有调用者持有的话函数立即被释放
+        inline void release(FunctionHandle handle) {
+            remove(handle);
+            if(handle != NoFunction && handle < functions.size()) {
+                functions[handle].reset();
+            }
+        }
+        inline std::shared_ptr<Function> share(FunctionHandle handle) const {
+            return handle < functions.size() ? functions[handle] : nullptr;
+        }
+        // 函数名是否还在表中
+        inline bool registered(FunctionHandle handle) const {
+            for(auto &item : handles) {
+                if(item.second == handle) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        // 还活着的函数以及它的 handle（已经 release 的话是 NoFunction），顺便清理已经释放的
+        std::vector< std::pair<std::shared_ptr<Function>, FunctionHandle> > alive();
+        inline FunctionHandle find(Symbol name) const {
+            auto it = handles.find(name);
+            return it == handles.end() ? NoFunction : it->second;
+        }
+        // 找不到的话返回 nullptr
+        inline Function *get(FunctionHandle handle) const {
+            return handle < functions.size() ? functions[handle].get() : nullptr;
+        }
+        inline void clear() {
+            functions.assign(1, nullptr);
+            handles.clear();
+            all.clear();
+            changes.fetch_add(1, std::memory_order_release);
+        }
+        // 不需要持有 llvm_mutex
+        inline uint64_t generation() const {
+            return changes.load(std::memory_order_acquire);
+        }
     };
+    extern FunctionTable taichi_func_table;
 
     // 定义 LLVM 所需要的「全局状态」，一般来说全局只需要一个 LLVMUnit
     // 为什么单独定义一个 Class 呢？
@@ -352,15 +1007,35 @@ namespace llvm_taichi
         // 目前需要这两个：执行引擎 & 上下文
         llvm::ExecutionEngine *engine;
         llvm::LLVMContext *context;
+        // 是否生成调试信息
+        bool debug_info;
+        // 热度达到这个值的函数会被编译，0 表示不使用解释器，直接编译
+        uint64_t tier_up_threshold;
+        // 注册到 engine 的 listener（GDB 的 listener 是全局单例，不能释放）
+        std::vector<std::unique_ptr<llvm::JITEventListener>> owned_listeners;
+        // engine 的内存管理，属于 engine
+        JitMemoryManager *memory_manager;
+        // 代码生成之后是否保留 IR 的文本和生成汇编用的 module（ti.get_function_ir / get_function_asm 需要）
+        bool retain_ir;
+        // 编译的时候是否收集优化报告（ti.get_function_remarks 需要）
+        bool collect_remarks;
 
     public:
         inline LLVMUnit() {
             engine = nullptr;
             context = nullptr;
+            debug_info = false;
+            tier_up_threshold = 0;
+            memory_manager = nullptr;
+            retain_ir = false;
+            collect_remarks = false;
         }
 
         inline ~LLVMUnit() {
             Out::Log(pType::DEBUG, "ready to detroy llvm unit");
+            stop_tiered_compiler(); // 后台编译的线程也在使用 engine 和 context
+            // 函数持有的 module（还没有编译的 module、生成汇编用的副本）也依赖于 context，要先释放
+            taichi_func_table.clear();
             // AI: llvm::ExecutionEngine 内部依赖于 llvm::LLVMContext，因此 LLVMContext 的生命周期必须比 ExecutionEngine 长
             if(engine) { // must destroy before context
                 // delete engine;
@@ -376,10 +1051,11 @@ namespace llvm_taichi
         }
     };
 
-    // 函数的注册表
-    extern std::unordered_map< std::string, std::shared_ptr<Function> > taichi_func_table;
     // LLVM 的全局状态
     extern std::unique_ptr<LLVMUnit> taichi_llvm_unit;
+    // LLVMContext 和 engine 不是线程安全的，所有使用它们的操作都要持有这个锁
+    // 后台编译的线程和 Python 端的构建接口可能同时运行
+    extern std::recursive_mutex llvm_mutex;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1111 @@
+#include "llvm_passes.h"
+#include "llvm_interpreter.h"
+
+#include <cstring>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace llvm_taichi
+{
+
+// 被替换的语句 to 替换之后的语句
+// 结构化的 IR 中，语句的使用总是在定义之后，按顺序遍历的时候替换就可以了
+typedef std::unordered_map<IRStmt *, IRStmt *> Replacements;
+
+static IRStmt *resolve(const Replacements &replacements, IRStmt *stmt)
+{
+    auto it = replacements.find(stmt);
+    while(it != replacements.end()) {
+        stmt = it->second;
+        it = replacements.find(stmt);
+    }
+    return stmt;
+}
+
+static void apply_replacements(IRStmt *stmt, const Replacements &replacements)
+{
+    if(replacements.empty()) {
+        return;
+    }
+    for(auto &operand : stmt->operands) {
+        operand = resolve(replacements, operand);
+    }
+}
+
+// 循环体对局部变量和 field 的影响
+struct LoopEffects {
+    std::unordered_set<IRStmt *> stored_allocas;
+    std::unordered_set<IRStmt *> loaded_allocas;
+    bool writes_fields = false; // field 写入，或者调用了有指针参数的函数
+};
+
+static bool has_field_operand(const IRStmt *stmt)
+{
+    for(auto operand : stmt->operands) {
+        if(operand->kind == IRStmtKind::Arg && operand->is_field) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// field 参数以外，结构体的指针（比如接收返回值的结构体）也可能被被调用的函数写入
+static bool has_pointer_operand(const IRStmt *stmt)
+{
+    for(auto operand : stmt->operands) {
+        if(
+            (operand->kind == IRStmtKind::Arg && (operand->is_field || is_struct_type(operand->type)))
+            || operand->kind == IRStmtKind::StructAlloca
+            || operand->kind == IRStmtKind::MemberPtr
+        ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 访问的是局部的结构体（结构体变量、结构体参数）的成员，不是 field 的元素
+static bool is_local_access(const IRStmt *access)
+{
+    const IRStmt *target = access->operands[0];
+    return target->kind == IRStmtKind::MemberPtr && !target->operands[0]->is_field;
+}
+
+// 访问的元素下标：field 元素的成员的话是 MemberPtr 的下标
+static IRStmt *access_index(const IRStmt *access)
+{
+    const IRStmt *target = access->operands[0];
+    return target->kind == IRStmtKind::MemberPtr ? target->operands[1] : access->operands[1];
+}
+
+static LoopEffects collect_effects(IRStmt *loop)
+{
+    LoopEffects effects;
+    effects.stored_allocas.insert(loop->operands[0]); // loop index 由循环更新
+    for_each_stmt(loop->body, [&effects](IRStmt *stmt) {
+        switch(stmt->kind) {
+            case IRStmtKind::LocalStore:
+            case IRStmtKind::RangeFor:
+                effects.stored_allocas.insert(stmt->operands[0]);
+                break;
+            case IRStmtKind::LocalLoad:
+                effects.loaded_allocas.insert(stmt->operands[0]);
+                break;
+            case IRStmtKind::FieldStore:
+            case IRStmtKind::FieldAtomic:
+                effects.writes_fields = true;
+                break;
+            case IRStmtKind::Call:
+                effects.writes_fields |= has_pointer_operand(stmt);
+                break;
+            default:
+                break;
+        }
+    });
+    return effects;
+}
+
+static bool constant_is(const IRStmt *stmt, int value)
+{
+    if(stmt->kind != IRStmtKind::Const) {
+        return false;
+    }
+    switch(stmt->type) {
+        case DataType::Int32: return stmt->constant.i32 == value;
+        case DataType::Int64: return stmt->constant.i64 == value;
+        case DataType::Float32: return stmt->constant.f32 == value;
+        case DataType::Float64: return stmt->constant.f64 == value;
+        default: return false;
+    }
+}
+
+static void make_constant(IRStmt *stmt, Scalar value)
+{
+    stmt->kind = IRStmtKind::Const;
+    stmt->operands.clear();
+    stmt->constant = value;
+}
+
+// ===== 常量折叠 =====
+
+static void fold_block(IRBlock *block, Replacements &replacements)
+{
+    for(IRStmt *stmt : block->stmts) {
+        apply_replacements(stmt, replacements);
+
+        if(stmt->kind == IRStmtKind::Cast) {
+            IRStmt *value = stmt->operands[0];
+            if(value->type == stmt->type) {
+                replacements[stmt] = value;
+            } else if(value->kind == IRStmtKind::Const) {
+                make_constant(stmt, cast_scalar(value->type, stmt->type, value->constant));
+            }
+        } else if(stmt->kind == IRStmtKind::Binary) {
+            IRStmt *left = stmt->operands[0];
+            IRStmt *right = stmt->operands[1];
+            bool int_type = is_int(stmt->type);
+            if(left->kind == IRStmtKind::Const && right->kind == IRStmtKind::Const) {
+                if(!(int_type && stmt->operation == OperationType::Div && constant_is(right, 0))) {
+                    make_constant(stmt, calc_scalar(stmt->operation, stmt->type, left->constant, right->constant));
+                }
+                continue;
+            }
+            // 代数化简
+            // 浮点数的 x + 0 不能化简（-0.0 + 0 = +0.0），x * 0 也不能（NaN、无穷大）
+            switch(stmt->operation) {
+                case OperationType::Add:
+                    if(int_type && constant_is(right, 0)) replacements[stmt] = left;
+                    else if(int_type && constant_is(left, 0)) replacements[stmt] = right;
+                    break;
+                case OperationType::Sub:
+                    if(constant_is(right, 0)) replacements[stmt] = left;
+                    break;
+                case OperationType::Mul:
+                    if(constant_is(right, 1)) replacements[stmt] = left;
+                    else if(constant_is(left, 1)) replacements[stmt] = right;
+                    else if(int_type && constant_is(right, 0)) make_constant(stmt, right->constant);
+                    else if(int_type && constant_is(left, 0)) make_constant(stmt, left->constant);
+                    break;
+                case OperationType::Div:
+                    if(constant_is(right, 1)) replacements[stmt] = left;
+                    break;
+            }
+        }
+
+        if(stmt->body) {
+            fold_block(stmt->body, replacements);
+        }
+    }
+}
+
+void fold_constants(IRBlock *body)
+{
+    Replacements replacements;
+    fold_block(body, replacements);
+}
+
+// ===== store to load 转发 =====
+
+static void forward_block(
+    IRBlock *block,
+    std::unordered_map<IRStmt *, IRStmt *> &known, // alloca to 当前的值
+    Replacements &replacements
+)
+{
+    for(IRStmt *stmt : block->stmts) {
+        apply_replacements(stmt, replacements);
+
+        if(stmt->kind == IRStmtKind::LocalStore) {
+            known[stmt->operands[0]] = stmt->operands[1];
+        } else if(stmt->kind == IRStmtKind::LocalLoad) {
+            auto it = known.find(stmt->operands[0]);
+            if(it != known.end() && it->second->type == stmt->type) {
+                replacements[stmt] = it->second;
+            }
+        } else if(stmt->kind == IRStmtKind::RangeFor) {
+            LoopEffects effects = collect_effects(stmt);
+            for(auto alloca : effects.stored_allocas) {
+                known.erase(alloca);
+            }
+            // 循环体中使用一份拷贝，循环体中的值在循环之后不可见
+            auto body_known = known;
+            forward_block(stmt->body, body_known, replacements);
+        }
+    }
+}
+
+void forward_local_stores(IRBlock *body)
+{
+    std::unordered_map<IRStmt *, IRStmt *> known;
+    Replacements replacements;
+    forward_block(body, known, replacements);
+}
+
+// ===== 公共子表达式消除 =====
+
+struct CSEState {
+    std::unordered_map<std::string, IRStmt *> pure; // Const / Binary / Cast / Random
+    std::unordered_map<IRStmt *, IRStmt *> local_loads; // alloca to 读取的结果
+    std::unordered_map<std::string, IRStmt *> field_loads; // field 和下标 to 读取（或者写入）的值
+};
+
+static std::string expression_key(const IRStmt *stmt)
+{
+    std::string key = std::to_string((int)stmt->kind) + ":" + std::to_string((int)stmt->type);
+    if(stmt->kind == IRStmtKind::Const) {
+        uint64_t bits = 0;
+        memcpy(&bits, &stmt->constant, type_size(stmt->type));
+        key += ":" + std::to_string(bits);
+    } else if(stmt->kind == IRStmtKind::Binary) {
+        key += ":" + std::to_string((int)stmt->operation);
+    } else if(stmt->kind == IRStmtKind::MemberPtr) {
+        key += ":" + std::to_string(stmt->member);
+    }
+    for(auto operand : stmt->operands) {
+        key += ":" + std::to_string(operand->id);
+    }
+    return key;
+}
+
+static std::string access_key(const IRStmt *field, const IRStmt *index)
+{
+    return std::to_string(field->id) + ":" + std::to_string(index->id);
+}
+
+static void cse_block(IRBlock *block, CSEState &state, Replacements &replacements)
+{
+    for(IRStmt *stmt : block->stmts) {
+        apply_replacements(stmt, replacements);
+
+        switch(stmt->kind) {
+            case IRStmtKind::Const:
+            case IRStmtKind::Binary:
+            case IRStmtKind::Cast:
+            case IRStmtKind::MemberPtr:
+            case IRStmtKind::Random: {
+                std::string key = expression_key(stmt);
+                auto it = state.pure.find(key);
+                if(it != state.pure.end()) {
+                    replacements[stmt] = it->second;
+                } else {
+                    state.pure[key] = stmt;
+                }
+                break;
+            }
+            case IRStmtKind::LocalLoad: {
+                auto it = state.local_loads.find(stmt->operands[0]);
+                if(it != state.local_loads.end()) {
+                    replacements[stmt] = it->second;
+                } else {
+                    state.local_loads[stmt->operands[0]] = stmt;
+                }
+                break;
+            }
+            case IRStmtKind::LocalStore:
+                state.local_loads.erase(stmt->operands[0]);
+                break;
+            case IRStmtKind::FieldLoad: {
+                std::string key = access_key(stmt->operands[0], stmt->operands[1]);
+                auto it = state.field_loads.find(key);
+                if(it != state.field_loads.end() && it->second->type == stmt->type) {
+                    replacements[stmt] = it->second;
+                } else {
+                    state.field_loads[key] = stmt;
+                }
+                break;
+            }
+            case IRStmtKind::FieldStore:
+                // 两个 field 参数可能是同一个 field，写入之后所有的读取都失效
+                state.field_loads.clear();
+                // 存储类型写入的时候会舍入，之后读出的值不一定是写入的值
+                if(!is_storage_type(stmt->operands[0]->type)) {
+                    state.field_loads[access_key(stmt->operands[0], stmt->operands[1])] = stmt->operands[2];
+                }
+                break;
+            case IRStmtKind::FieldAtomic:
+                // 其他线程也可能同时修改这个元素，写入之后的值是未知的
+                state.field_loads.clear();
+                break;
+            case IRStmtKind::Call:
+                if(has_pointer_operand(stmt)) {
+                    state.field_loads.clear();
+                }
+                break;
+            case IRStmtKind::RangeFor: {
+                LoopEffects effects = collect_effects(stmt);
+                for(auto alloca : effects.stored_allocas) {
+                    state.local_loads.erase(alloca);
+                }
+                if(effects.writes_fields) {
+                    state.field_loads.clear();
+                }
+                CSEState body_state = state;
+                cse_block(stmt->body, body_state, replacements);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+void eliminate_common_subexpressions(IRBlock *body)
+{
+    CSEState state;
+    Replacements replacements;
+    cse_block(body, state, replacements);
+}
+
+// ===== 死代码消除 =====
+
+static bool sweep_block(
+    IRBlock *block,
+    std::unordered_map<IRStmt *, size_t> &uses,
+    const std::unordered_set<IRStmt *> &loaded_allocas
+)
+{
+    bool changed = false;
+    auto &stmts = block->stmts;
+
+    // return 之后的语句不会被执行
+    for(size_t i = 0; i < stmts.size(); i += 1) {
+        if(stmts[i]->kind == IRStmtKind::Return && i + 1 < stmts.size()) {
+            stmts.erase(stmts.begin() + i + 1, stmts.end());
+            changed = true;
+            break;
+        }
+    }
+
+    // 同一个 block 中被覆盖、而且中间没有被读取的 store
+    std::unordered_set<IRStmt *> dead;
+    std::unordered_map<IRStmt *, IRStmt *> pending; // alloca to 最近的 store
+    for(IRStmt *stmt : stmts) {
+        if(stmt->kind == IRStmtKind::LocalStore) {
+            auto it = pending.find(stmt->operands[0]);
+            if(it != pending.end()) {
+                dead.insert(it->second);
+            }
+            pending[stmt->operands[0]] = stmt;
+        } else if(stmt->kind == IRStmtKind::LocalLoad) {
+            pending.erase(stmt->operands[0]);
+        } else if(stmt->kind == IRStmtKind::RangeFor) {
+            LoopEffects effects = collect_effects(stmt);
+            for(auto alloca : effects.loaded_allocas) pending.erase(alloca);
+            for(auto alloca : effects.stored_allocas) pending.erase(alloca);
+        }
+    }
+
+    for(IRStmt *stmt : stmts) {
+        if(stmt->body && sweep_block(stmt->body, uses, loaded_allocas)) {
+            changed = true;
+        }
+    }
+
+    size_t size = stmts.size();
+    stmts.erase(
+        std::remove_if(stmts.begin(), stmts.end(), [&](IRStmt *stmt) {
+            if(dead.count(stmt)) {
+                return true;
+            }
+            if(is_pure(stmt) || stmt->kind == IRStmtKind::Alloca || stmt->kind == IRStmtKind::StructAlloca) {
+                return uses[stmt] == 0;
+            }
+            if(stmt->kind == IRStmtKind::LocalStore) {
+                return loaded_allocas.count(stmt->operands[0]) == 0; // 从来没有被读取的变量
+            }
+            if(stmt->kind == IRStmtKind::RangeFor) {
+                return stmt->body->stmts.empty(); // 循环体是空的，loop index 在循环之后不可见
+            }
+            return false;
+        }),
+        stmts.end()
+    );
+    return changed || stmts.size() != size;
+}
+
+void eliminate_dead_code(IRBlock *body)
+{
+    bool changed = true;
+    while(changed) {
+        std::unordered_map<IRStmt *, size_t> uses;
+        std::unordered_set<IRStmt *> loaded_allocas;
+        for_each_stmt(body, [&](IRStmt *stmt) {
+            for(auto operand : stmt->operands) {
+                uses[operand] += 1;
+            }
+            if(stmt->kind == IRStmtKind::LocalLoad) {
+                loaded_allocas.insert(stmt->operands[0]);
+            }
+        });
+        changed = sweep_block(body, uses, loaded_allocas);
+    }
+}
+
+// ===== 循环不变量外提 =====
+
+static bool hoistable(const IRStmt *stmt, const LoopEffects &effects)
+{
+    switch(stmt->kind) {
+        case IRStmtKind::Const:
+        case IRStmtKind::Cast:
+        case IRStmtKind::MemberPtr:
+        case IRStmtKind::Random:
+            return true;
+        case IRStmtKind::Binary:
+            return !(is_int(stmt->type) && stmt->operation == OperationType::Div);
+        case IRStmtKind::LocalLoad:
+            return effects.stored_allocas.count(stmt->operands[0]) == 0;
+        default:
+            return false;
+    }
+}
+
+static void hoist_block(IRBlock *block)
+{
+    for(size_t i = 0; i < block->stmts.size(); i += 1) {
+        IRStmt *loop = block->stmts[i];
+        if(loop->kind != IRStmtKind::RangeFor) {
+            continue;
+        }
+        // 先处理内层的循环，不变量可以一层一层地移出去
+        hoist_block(loop->body);
+
+        LoopEffects effects = collect_effects(loop);
+        std::unordered_set<IRStmt *> defined;
+        for_each_stmt(loop->body, [&defined](IRStmt *stmt) { defined.insert(stmt); });
+
+        auto &body = loop->body->stmts;
+        for(size_t j = 0; j < body.size();) {
+            IRStmt *stmt = body[j];
+            bool invariant = hoistable(stmt, effects);
+            for(auto operand : stmt->operands) {
+                invariant = invariant && !defined.count(operand);
+            }
+            if(!invariant) {
+                j += 1;
+                continue;
+            }
+            defined.erase(stmt);
+            block->stmts.insert(block->stmts.begin() + i, body[j]);
+            body.erase(body.begin() + j);
+            i += 1; // 循环本身向后移动了一位
+        }
+    }
+}
+
+void hoist_loop_invariants(IRBlock *body)
+{
+    hoist_block(body);
+}
+
+// ===== 依赖分析 =====
+// 下标表示为 loop index 和循环不变量的多项式，最多二次（系数可以是一个不变量，比如 i * n + j）
+// 因子是 loop index 的 alloca 或者不变量的 key（见 invariant_key），常数项的两个因子都是 nullptr，一次项的第一个因子是 nullptr
+
+typedef std::pair<const IRStmt *, const IRStmt *> Monomial;
+typedef std::map<Monomial, int64_t> Polynomial;
+
+static const Monomial ConstantTerm(nullptr, nullptr);
+// 系数超过这个范围就不再分析（避免溢出）
+static const int64_t MaxCoefficient = int64_t(1) << 31;
+
+// 去掉整数的拓展（不改变值）
+static const IRStmt *strip_int_casts(const IRStmt *value)
+{
+    while(
+        value->kind == IRStmtKind::Cast
+        && is_int(value->type)
+        && is_int(value->operands[0]->type)
+        && type_size(value->type) >= type_size(value->operands[0]->type)
+    ) {
+        value = value->operands[0];
+    }
+    return value;
+}
+
+// 不变量的 key：同一个局部变量的不同读取是同一个值
+static const IRStmt *invariant_key(const IRStmt *value)
+{
+    value = strip_int_casts(value);
+    return value->kind == IRStmtKind::LocalLoad ? value->operands[0] : value;
+}
+
+static bool add_term(Polynomial &poly, Monomial term, int64_t coefficient)
+{
+    if(term.first && term.second && term.second < term.first) {
+        std::swap(term.first, term.second);
+    } else if(!term.first && term.second == nullptr) {
+        term = ConstantTerm;
+    }
+    int64_t &value = poly[term];
+    value += coefficient;
+    if(value == 0) {
+        poly.erase(term);
+    }
+    return value > -MaxCoefficient && value < MaxCoefficient;
+}
+
+// 一个循环（以及它的内层循环）的信息
+struct LoopScope {
+    IRStmt *loop = nullptr;
+    std::unordered_set<const IRStmt *> defined; // 循环体中定义的值
+    std::unordered_set<const IRStmt *> stored; // 循环体中写入的 alloca（包括 loop index）
+    std::unordered_map<const IRStmt *, IRStmt *> inner_loops; // 内层循环的 loop index -> RangeFor
+};
+
+static bool is_index_of(const IRStmt *factor, const LoopScope &scope)
+{
+    return factor && (factor == scope.loop->operands[0] || scope.inner_loops.count(factor));
+}
+
+// 下标的多项式，不能分析的话返回 false
+static bool polynomial_of(const IRStmt *value, const LoopScope &scope, Polynomial &result, int depth = 0)
+{
+    result.clear();
+    value = strip_int_casts(value);
+    if(depth > 16 || !is_int(value->type)) {
+        return false;
+    }
+    if(value->kind == IRStmtKind::Const) {
+        int64_t constant = value->type == DataType::Int32 ? value->constant.i32 : value->constant.i64;
+        return add_term(result, ConstantTerm, constant);
+    }
+    if(value->kind == IRStmtKind::LocalLoad) {
+        const IRStmt *alloca = value->operands[0];
+        // loop index 是变量；循环中没有写入的局部变量是不变量
+        if(is_index_of(alloca, scope) || !scope.stored.count(alloca)) {
+            return add_term(result, Monomial(nullptr, alloca), 1);
+        }
+        return false;
+    }
+    if(value->kind == IRStmtKind::Binary && value->operation != OperationType::Div) {
+        Polynomial left, right;
+        if(
+            !polynomial_of(value->operands[0], scope, left, depth + 1)
+            || !polynomial_of(value->operands[1], scope, right, depth + 1)
+        ) {
+            return false;
+        }
+        if(value->operation == OperationType::Add || value->operation == OperationType::Sub) {
+            result = left;
+            int64_t sign = value->operation == OperationType::Add ? 1 : -1;
+            for(auto &term : right) {
+                if(!add_term(result, term.first, sign * term.second)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        for(auto &l : left) {
+            for(auto &r : right) {
+                const IRStmt *factors[4] = {l.first.first, l.first.second, r.first.first, r.first.second};
+                std::vector<const IRStmt *> product;
+                for(auto factor : factors) {
+                    if(factor) {
+                        product.push_back(factor);
+                    }
+                }
+                if(product.size() > 2) {
+                    return false;
+                }
+                Monomial term(nullptr, nullptr);
+                if(product.size() == 1) {
+                    term.second = product[0];
+                } else if(product.size() == 2) {
+                    term = Monomial(product[0], product[1]);
+                }
+                if(
+                    l.second > MaxCoefficient || l.second < -MaxCoefficient
+                    || r.second > MaxCoefficient || r.second < -MaxCoefficient
+                    || !add_term(result, term, l.second * r.second)
+                ) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    // 循环之外定义的值是不变量
+    if(!scope.defined.count(value)) {
+        return add_term(result, Monomial(nullptr, invariant_key(value)), 1);
+    }
+    return false;
+}
+
+// 相对于循环的下标：outer 是本层 loop index 的系数（余因子 -> 系数），inner 是含有内层 loop index 的项，其他是不变的项
+struct SplitIndex {
+    bool valid = false;
+    std::map<const IRStmt *, int64_t> outer;
+    Polynomial inner;
+    Polynomial invariant;
+};
+
+static SplitIndex split_index(const IRStmt *index, const LoopScope &scope)
+{
+    SplitIndex split;
+    Polynomial poly;
+    if(!polynomial_of(index, scope, poly)) {
+        return split;
+    }
+    const IRStmt *loop_index = scope.loop->operands[0];
+    for(auto &term : poly) {
+        const IRStmt *a = term.first.first;
+        const IRStmt *b = term.first.second;
+        if(a == loop_index || b == loop_index) {
+            const IRStmt *cofactor = a == loop_index ? b : a;
+            if(is_index_of(cofactor, scope)) {
+                return split; // i * i、i * j 这样的项
+            }
+            split.outer[cofactor] += term.second;
+        } else if(is_index_of(a, scope) || is_index_of(b, scope)) {
+            if(is_index_of(a, scope) && is_index_of(b, scope)) {
+                return split;
+            }
+            split.inner[term.first] = term.second;
+        } else {
+            split.invariant[term.first] = term.second;
+        }
+    }
+    split.valid = true;
+    return split;
+}
+
+static int64_t constant_value(const IRStmt *stmt, bool &ok)
+{
+    stmt = strip_int_casts(stmt);
+    ok = stmt->kind == IRStmtKind::Const && is_int(stmt->type);
+    if(!ok) {
+        return 0;
+    }
+    return stmt->type == DataType::Int32 ? stmt->constant.i32 : stmt->constant.i64;
+}
+
+// 内层的 loop index 的取值范围 [low, high]，边界不是常量的话返回 false
+static bool index_range(const IRStmt *loop, int64_t &low, int64_t &high)
+{
+    bool ok_begin, ok_end, ok_step;
+    int64_t begin = constant_value(loop->operands[1], ok_begin);
+    int64_t end = constant_value(loop->operands[2], ok_end);
+    int64_t step = constant_value(loop->operands[3], ok_step);
+    if(!ok_begin || !ok_end || !ok_step || step <= 0) {
+        return false;
+    }
+    low = begin;
+    high = std::max(begin, end - 1);
+    return true;
+}
+
+static int64_t gcd(int64_t a, int64_t b)
+{
+    a = a < 0 ? -a : a;
+    b = b < 0 ? -b : b;
+    while(b) {
+        int64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// 两个访问（a 在第 i1 次迭代，b 在第 i2 != i1 次迭代）是否可能访问同一个元素，不能确定的话返回 true
+static bool may_depend(const SplitIndex &a, const SplitIndex &b, const LoopScope &scope)
+{
+    if(!a.valid || !b.valid) {
+        return true;
+    }
+    // 不变的项在两次迭代中的值一样，除了常数项都要相同
+    std::set<Monomial> invariant_terms;
+    for(auto &term : a.invariant) invariant_terms.insert(term.first);
+    for(auto &term : b.invariant) invariant_terms.insert(term.first);
+    int64_t delta = 0; // b 的常数项 - a 的常数项
+    for(auto &term : invariant_terms) {
+        int64_t coefficient_a = a.invariant.count(term) ? a.invariant.at(term) : 0;
+        int64_t coefficient_b = b.invariant.count(term) ? b.invariant.at(term) : 0;
+        if(term == ConstantTerm) {
+            delta = coefficient_b - coefficient_a;
+        } else if(coefficient_a != coefficient_b) {
+            return true;
+        }
+    }
+    bool numeric = true; // 系数都是常数
+    for(auto &term : a.outer) numeric = numeric && term.first == nullptr;
+    for(auto &term : b.outer) numeric = numeric && term.first == nullptr;
+    for(auto &term : a.inner) numeric = numeric && !(term.first.first && term.first.second);
+    for(auto &term : b.inner) numeric = numeric && !(term.first.first && term.first.second);
+
+    // 每次迭代都访问同样的元素
+    if(a.outer.empty() && b.outer.empty()) {
+        return !(a.inner.empty() && b.inner.empty() && delta != 0);
+    }
+    // 系数不同：GCD 测试，方程 c_a * i1 - c_b * i2 + (内层的项) = delta 没有整数解的话就没有依赖
+    if(a.outer != b.outer) {
+        if(!numeric) {
+            return true;
+        }
+        int64_t g = 0;
+        for(auto *split : {&a, &b}) {
+            for(auto &term : split->outer) g = gcd(g, term.second);
+            for(auto &term : split->inner) g = gcd(g, term.second);
+        }
+        return g == 0 ? delta == 0 : delta % g == 0;
+    }
+
+    // 系数相同：c * (i1 - i2) = R，R 是内层的项之差加上 delta
+    // |R| 小于 |c * step| 的话只能 i1 == i2
+    if(numeric) {
+        bool ok_step;
+        int64_t step = constant_value(scope.loop->operands[3], ok_step);
+        step = ok_step && step != 0 ? step : 1; // 步长不是常量的话，i1 - i2 至少是 1
+        int64_t c = a.outer.begin()->second * step;
+        c = c < 0 ? -c : c;
+        if(c >= MaxCoefficient) {
+            return true;
+        }
+        int64_t low = delta, high = delta;
+        bool bounded = true;
+        int64_t g = c;
+        for(int side = 0; side < 2; side += 1) {
+            const SplitIndex *split = side ? &b : &a; // a 和 b 可能是同一个访问
+            int64_t sign = side ? 1 : -1;
+            for(auto &term : split->inner) {
+                g = gcd(g, term.second);
+                int64_t range_low, range_high;
+                if(!bounded || !index_range(scope.inner_loops.at(term.first.second), range_low, range_high)) {
+                    bounded = false;
+                    continue;
+                }
+                int64_t k = sign * term.second;
+                if(
+                    range_low <= -MaxCoefficient || range_high >= MaxCoefficient
+                    || low <= -MaxCoefficient * MaxCoefficient || high >= MaxCoefficient * MaxCoefficient
+                ) {
+                    bounded = false;
+                    continue;
+                }
+                low += std::min(k * range_low, k * range_high);
+                high += std::max(k * range_low, k * range_high);
+            }
+        }
+        if(bounded && low > -c && high < c) {
+            return false;
+        }
+        return delta % g == 0;
+    }
+
+    // 系数是一个不变量 alpha * n：下标是 alpha * n * i + offset，两个访问的 offset 都在 [0, |alpha| * n) 中的话，
+    // 不同迭代访问的元素范围不重叠，比如 a[i * n + j] 和 a[i * n + j - 1]，j 属于 range(1, n)
+    // 内层的 index 要在 [begin, n) 中（begin 是非负的常数），offset 的下界是常数，上界是 sum * (n - 1) + constant
+    if(a.outer.size() != 1) {
+        return true;
+    }
+    const IRStmt *n = a.outer.begin()->first;
+    int64_t alpha = a.outer.begin()->second;
+    alpha = alpha < 0 ? -alpha : alpha;
+    for(int side = 0; side < 2; side += 1) {
+        const SplitIndex *split = side ? &b : &a;
+        int64_t constant = split->invariant.count(ConstantTerm) ? split->invariant.at(ConstantTerm) : 0;
+        int64_t low = constant;
+        int64_t sum = 0; // 内层 index 的系数之和
+        for(auto &term : split->inner) {
+            const IRStmt *loop = scope.inner_loops.at(term.first.second);
+            bool ok_begin, ok_step;
+            int64_t begin = constant_value(loop->operands[1], ok_begin);
+            int64_t step = constant_value(loop->operands[3], ok_step);
+            if(
+                term.first.first || term.second <= 0
+                || !ok_begin || begin < 0 || begin >= MaxCoefficient || !ok_step || step <= 0
+                || invariant_key(loop->operands[2]) != n
+            ) {
+                return true;
+            }
+            low += term.second * begin;
+            sum += term.second;
+        }
+        // 访问在以 n 为上界的内层循环中才能保证 n 至少是 1（否则内层循环不执行），n 为 1 的时候上界最接近 alpha * n - 1
+        // 没有内层 index 的话（比如 x[i * n] = x[i * n] + v）n 可以是 0，所有迭代访问同一个元素
+        if(sum == 0 || low < 0 || sum > alpha || constant > alpha - 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 访问的 field（元素的成员的话是 MemberPtr 的 field）
+static const IRStmt *access_field(const IRStmt *access)
+{
+    const IRStmt *target = access->operands[0];
+    return target->kind == IRStmtKind::MemberPtr ? target->operands[0] : target;
+}
+
+// 去掉类型转换（存储类型读出来之后转换为计算类型，写入之前再转换回来）
+static const IRStmt *strip_casts(const IRStmt *value)
+{
+    while(value->kind == IRStmtKind::Cast) {
+        value = value->operands[0];
+    }
+    return value;
+}
+
+// field 上的归约 f[k] = f[k] op value（op 是加法或者乘法），返回读取 f[k] 的语句，不是的话返回 nullptr
+static const IRStmt *reduction_load(const IRStmt *store)
+{
+    const IRStmt *value = strip_casts(store->operands[2]);
+    if(
+        value->kind != IRStmtKind::Binary
+        || (value->operation != OperationType::Add && value->operation != OperationType::Mul)
+    ) {
+        return nullptr;
+    }
+    for(auto operand : value->operands) {
+        const IRStmt *load = strip_casts(operand);
+        if(
+            load->kind == IRStmtKind::FieldLoad
+            && load->operands[0] == store->operands[0]
+            && invariant_key(access_index(load)) == invariant_key(access_index(store))
+        ) {
+            return load;
+        }
+    }
+    return nullptr;
+}
+
+struct Access {
+    const IRStmt *stmt;
+    const IRStmt *field;
+    bool write;
+    bool commutative; // 原子的加法、最小值、最大值，相互之间的顺序不影响结果
+    SplitIndex index;
+};
+
+static std::string field_name(const IRStmt *field)
+{
+    return taichi_symbols.name(field->name);
+}
+
+static void add_note(std::vector< std::pair<std::string, uint32_t> > &notes, const std::string &message, uint32_t location)
+{
+    for(auto &note : notes) {
+        if(note.first == message) {
+            return;
+        }
+    }
+    notes.push_back(std::make_pair(message, location));
+}
+
+// 两个访问是不是每次迭代访问各自的一个元素，而且不同迭代的元素不同（a[i] 和 b[i]），这样即使 a 和 b 是同一个 field 也没有依赖
+static bool same_element_per_iteration(const SplitIndex &a, const SplitIndex &b)
+{
+    return a.valid && b.valid && !a.outer.empty() && a.inner.empty() && b.inner.empty()
+        && a.outer == b.outer && a.invariant == b.invariant;
+}
+
+// 循环体中 field 的访问，返回 field 的访问在迭代之间是否没有依赖（parallel）
+// 依赖的分析假设不同的 field 参数不重叠；may_alias 表示这个假设不成立的时候可能有依赖（同一个 field 作为两个参数传入）
+static bool analyze_memory(const LoopScope &scope, LoopReport &report, bool &may_alias)
+{
+    bool parallel = true;
+    may_alias = false;
+    std::vector<Access> accesses;
+    for_each_stmt(scope.loop->body, [&](IRStmt *stmt) {
+        switch(stmt->kind) {
+            case IRStmtKind::LocalStore:
+                if(stmt->operands[0] == scope.loop->operands[0]) {
+                    add_note(report.dependences, "loop index " + taichi_symbols.name(stmt->operands[0]->name) +
+                        " is modified in the loop body", stmt->location);
+                    parallel = false;
+                }
+                break;
+            case IRStmtKind::FieldLoad:
+            case IRStmtKind::FieldStore:
+            case IRStmtKind::FieldAtomic:
+                if(!is_local_access(stmt)) {
+                    bool commutative = stmt->kind == IRStmtKind::FieldAtomic && stmt->atomic != AtomicOperation::AtomicCas;
+                    accesses.push_back(Access{
+                        stmt,
+                        access_field(stmt),
+                        stmt->kind != IRStmtKind::FieldLoad,
+                        commutative,
+                        split_index(access_index(stmt), scope)
+                    });
+                    if(commutative) {
+                        add_note(report.reductions, "field " + field_name(access_field(stmt)) + ": atomic reduction",
+                            stmt->location);
+                    }
+                }
+                break;
+            case IRStmtKind::Call:
+                if(has_field_operand(stmt)) {
+                    add_note(report.dependences, "call to " + stmt->callee->get_name() + " may access any element",
+                        stmt->location);
+                    parallel = false;
+                }
+                break;
+            default:
+                break;
+        }
+    });
+
+    for(size_t i = 0; i < accesses.size(); i += 1) {
+        for(size_t j = i; j < accesses.size(); j += 1) {
+            const Access &a = accesses[i];
+            const Access &b = accesses[j];
+            if(a.field != b.field) {
+                may_alias = may_alias || ((a.write || b.write) && !same_element_per_iteration(a.index, b.index));
+                continue;
+            }
+            if(
+                !(a.write || b.write)
+                || (a.commutative && b.commutative)
+                || !may_depend(a.index, b.index, scope)
+            ) {
+                continue;
+            }
+            parallel = false;
+            // f[k] = f[k] + value：每次迭代都累加到同一个元素上
+            const IRStmt *store = a.stmt->kind == IRStmtKind::FieldStore ? a.stmt : b.stmt;
+            const IRStmt *other = store == a.stmt ? b.stmt : a.stmt;
+            const IRStmt *load = store->kind == IRStmtKind::FieldStore ? reduction_load(store) : nullptr;
+            if(load && (other == load || other == store)) {
+                add_note(report.reductions, "field " + field_name(a.field) +
+                    ": non-atomic reduction across iterations, use ti.atomic_add", store->location);
+                add_note(report.dependences, "field " + field_name(a.field) +
+                    ": every iteration updates the same element", store->location);
+                continue;
+            }
+            add_note(report.dependences, "field " + field_name(a.field) +
+                ": accesses may touch the same element in different iterations", b.stmt->location);
+        }
+    }
+    return parallel;
+}
+
+// 局部变量：一次迭代中先读取、之后才写入的变量，读到的是上一次迭代的值
+// 返回局部变量在迭代之间是否没有依赖
+static bool analyze_locals(const LoopScope &scope, LoopReport &report)
+{
+    // written 是这次迭代中（内层循环的话是内层的这次迭代中）一定已经写入的变量
+    // 内层循环可能一次都不执行，其中的写入不带到循环之后
+    std::vector<const IRStmt *> exposed;
+    std::function<void(IRBlock *, std::unordered_set<const IRStmt *>)> walk = [&](
+        IRBlock *block,
+        std::unordered_set<const IRStmt *> written
+    ) {
+        for(IRStmt *stmt : block->stmts) {
+            if(stmt->kind == IRStmtKind::LocalLoad) {
+                const IRStmt *alloca = stmt->operands[0];
+                if(
+                    scope.stored.count(alloca) && !is_index_of(alloca, scope) && !written.count(alloca)
+                    && std::find(exposed.begin(), exposed.end(), alloca) == exposed.end()
+                ) {
+                    exposed.push_back(alloca);
+                }
+            } else if(stmt->kind == IRStmtKind::LocalStore) {
+                written.insert(stmt->operands[0]);
+            } else if(stmt->kind == IRStmtKind::RangeFor) {
+                walk(stmt->body, written);
+            }
+        }
+    };
+    walk(scope.loop->body, std::unordered_set<const IRStmt *>());
+    if(exposed.empty()) {
+        return true;
+    }
+
+    // 归约 s = s op value：变量的读取只用于这样的写入
+    std::unordered_map<const IRStmt *, std::vector<const IRStmt *> > users;
+    for_each_stmt(scope.loop->body, [&users](IRStmt *stmt) {
+        for(auto operand : stmt->operands) {
+            users[operand].push_back(stmt);
+        }
+    });
+    for(auto alloca : exposed) {
+        std::unordered_set<const IRStmt *> allowed; // 归约的运算，以及它和读取之间的类型转换
+        bool reduction = true;
+        uint32_t location = 0;
+        for_each_stmt(scope.loop->body, [&](IRStmt *stmt) {
+            if(stmt->kind != IRStmtKind::LocalStore || stmt->operands[0] != alloca) {
+                return;
+            }
+            location = location ? location : stmt->location;
+            const IRStmt *value = strip_casts(stmt->operands[1]);
+            bool found = false;
+            if(value->kind == IRStmtKind::Binary && (value->operation == OperationType::Add || value->operation == OperationType::Mul)) {
+                for(auto operand : value->operands) {
+                    const IRStmt *load = strip_casts(operand);
+                    if(load->kind == IRStmtKind::LocalLoad && load->operands[0] == alloca) {
+                        found = true;
+                        for(const IRStmt *cast = operand; cast != load; cast = cast->operands[0]) {
+                            allowed.insert(cast);
+                        }
+                    }
+                }
+                allowed.insert(value);
+            }
+            reduction = reduction && found;
+        });
+        for_each_stmt(scope.loop->body, [&](IRStmt *stmt) {
+            if(stmt->kind != IRStmtKind::LocalLoad || stmt->operands[0] != alloca) {
+                return;
+            }
+            location = location ? location : stmt->location;
+            for(auto user : users[stmt]) {
+                reduction = reduction && allowed.count(user);
+            }
+        });
+        std::string variable = "variable " + taichi_symbols.name(alloca->name);
+        if(reduction) {
+            add_note(report.reductions, variable + ": reduction across iterations", location);
+        }
+        add_note(report.dependences, variable + ": value is carried across iterations", location);
+    }
+    return false;
+}
+
+static void analyze_block(
+    IRBlock *block,
+    std::vector<IRStmt *> &parallel_loops,
+    uint32_t depth,
+    std::vector<LoopReport> &reports
+)
+{
+    for(IRStmt *stmt : block->stmts) {
+        if((stmt->kind == IRStmtKind::FieldLoad || stmt->kind == IRStmtKind::FieldStore) && !is_local_access(stmt)) {
+            stmt->parallel_loops.assign(parallel_loops.begin(), parallel_loops.end());
+        } else if(stmt->kind == IRStmtKind::RangeFor) {
+            LoopScope scope;
+            scope.loop = stmt;
+            scope.stored.insert(stmt->operands[0]);
+            for_each_stmt(stmt->body, [&scope](IRStmt *inner) {
+                scope.defined.insert(inner);
+                if(inner->kind == IRStmtKind::LocalStore) {
+                    scope.stored.insert(inner->operands[0]);
+                } else if(inner->kind == IRStmtKind::RangeFor) {
+                    scope.stored.insert(inner->operands[0]);
+                    scope.inner_loops[inner->operands[0]] = inner;
+                }
+            });
+
+            size_t index = reports.size();
+            reports.push_back(LoopReport());
+            reports[index].depth = depth;
+            reports[index].location = stmt->location;
+            bool may_alias;
+            reports[index].parallel = analyze_memory(scope, reports[index], may_alias);
+            reports[index].independent = analyze_locals(scope, reports[index]) && reports[index].parallel;
+            // 标记为 parallel 的循环，lowering 的时候加上 llvm.loop.parallel_accesses，要保证 field 重叠的时候也成立
+            stmt->parallel = reports[index].parallel && !may_alias;
+
+            if(stmt->parallel) {
+                parallel_loops.push_back(stmt);
+            }
+            analyze_block(stmt->body, parallel_loops, depth + 1, reports);
+            if(stmt->parallel) {
+                parallel_loops.pop_back();
+            }
+        }
+    }
+}
+
+void analyze_dependences(IRBlock *body, std::vector<LoopReport> &reports)
+{
+    std::vector<IRStmt *> parallel_loops;
+    reports.clear();
+    analyze_block(body, parallel_loops, 0, reports);
+}
+
+void run_ir_passes(IRBlock *body, std::vector<LoopReport> &loops)
+{
+    fold_constants(body);
+    forward_local_stores(body);
+    eliminate_common_subexpressions(body);
+    fold_constants(body); // 转发之后可能出现新的常量
+    eliminate_dead_code(body);
+    hoist_loop_invariants(body);
+    eliminate_common_subexpressions(body); // 外提之后可能出现重复的运算
+    eliminate_dead_code(body);
+    analyze_dependences(body, loops);
+}
+
+}
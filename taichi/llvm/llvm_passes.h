@@ -0,0 +1,43 @@
+// 中间层 IR（llvm_ir）的优化
+// 这些 pass 可以利用 kernel 的语义：局部变量不会被别名、loop index 只由循环更新、field 只能通过下标访问
+// 这些信息 LLVM 看不到（或者要花很大的代价才能分析出来）
+// 交给 LLVM 的 IR 变小之后，LLVM 的优化和代码生成也更快
+
+#ifndef LLVM_PASSES_H
+#define LLVM_PASSES_H
+
+#include "llvm_ir.h"
+
+namespace llvm_taichi
+{
+    // 常量折叠，以及 x + 0、x * 1 这样的代数化简
+    // 折叠的结果和解释器、LLVM 的运算结果一致；整数除以 0 不折叠
+    void fold_constants(IRBlock *body);
+
+    // 局部变量的 store to load 转发：读取的值就是之前写入的值的话，直接使用那个值
+    // 进入循环时，循环中会被写入的变量不能转发
+    void forward_local_stores(IRBlock *body);
+
+    // 公共子表达式消除
+    // 纯运算在作用域内去重；field 的读取在没有 field 写入（包括原子操作，以及可能写入 field 的调用）之间去重
+    // field 写入之后，同一个位置的读取直接使用写入的值
+    void eliminate_common_subexpressions(IRBlock *body);
+
+    // 删除没有被使用的值、不会被读取的局部变量写入（dead store）、return 之后的语句
+    void eliminate_dead_code(IRBlock *body);
+
+    // 循环不变量外提：只依赖循环外的值的运算移到循环之前
+    // 整数除法不外提（循环可能一次都不执行，而 LLVM 中除以 0 是未定义的）
+    void hoist_loop_invariants(IRBlock *body);
+
+    // 依赖分析：field 的下标表示为 loop index 的仿射函数（系数可以是循环不变量，比如 i * n + j），
+    // 用 GCD 测试以及内层循环的取值范围判断不同迭代的访问是否可能重叠；同时识别归约和迭代之间传递的局部变量
+    // 没有依赖的循环标记为 parallel，lowering 的时候加上 llvm.loop.parallel_accesses，向量化不需要运行时的别名检查
+    // 每个循环（先序）的结果（LoopReport）写入 reports
+    void analyze_dependences(IRBlock *body, std::vector<LoopReport> &reports);
+
+    // 按顺序运行所有的 pass，loops 是依赖分析的结果
+    void run_ir_passes(IRBlock *body, std::vector<LoopReport> &loops);
+}
+
+#endif
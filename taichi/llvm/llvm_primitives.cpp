@@ -0,0 +1,563 @@
+#include "llvm_primitives.h"
+
+namespace llvm_taichi
+{
+
+// 每块至少这么多元素，再小的话统计和同步的开销比计算还大
+static const int64_t MinBlockSize = 1 << 14;
+// 每个 worker 分到的块数，块的数量只影响串行阶段的工作量，多分几块可以平衡负载
+static const int64_t BlocksPerThread = 4;
+
+static int64_t block_number(Runtime *runtime, int64_t n)
+{
+    int64_t by_size = (n + MinBlockSize - 1) / MinBlockSize;
+    int64_t by_thread = static_cast<int64_t>(runtime->thread_number()) * BlocksPerThread;
+    return std::max<int64_t>(1, std::min(by_size, by_thread));
+}
+
+// 第 b 块的范围 [begin, end)
+static inline int64_t block_begin(int64_t n, int64_t blocks, int64_t b)
+{
+    return n / blocks * b + std::min(b, n % blocks);
+}
+
+static Field *find_field(Runtime *runtime, int64_t handle, const char *role)
+{
+    Field *field = runtime->field_get(handle);
+    if(!field) {
+        std::string _m = std::string("can not find ") + role + " field " + std::to_string(handle);
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+    }
+    return field;
+}
+
+static void primitive_error(const std::string &message)
+{
+    Out::Log(pType::ERROR, "%s", message.c_str());
+}
+
+/* 前缀和 */
+
+template<typename T>
+struct ScanState {
+    const T *src;
+    T *dst;
+    int64_t n;
+    int64_t blocks;
+    bool inclusive;
+    std::vector<T> sums; // 每块的和，之后变成每块的起始值
+};
+
+// 阶段 1：每块的和
+template<typename T>
+static void scan_block_sums(int64_t begin, int64_t end, void *context)
+{
+    auto state = static_cast<ScanState<T> *>(context);
+    for(int64_t b = begin; b < end; b += 1) {
+        T sum = 0;
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        for(int64_t i = block_begin(state->n, state->blocks, b); i < last; i += 1) {
+            sum += state->src[i];
+        }
+        state->sums[b] = sum;
+    }
+}
+
+// 阶段 2：块之间的 exclusive 前缀和，只有一次迭代
+template<typename T>
+static void scan_block_offsets(int64_t, int64_t, void *context)
+{
+    auto state = static_cast<ScanState<T> *>(context);
+    T acc = 0;
+    for(auto &sum : state->sums) {
+        T value = sum;
+        sum = acc;
+        acc += value;
+    }
+}
+
+// 阶段 3：从块的起始值开始，块内的前缀和
+// 先读 src[i] 再写 dst[i]，所以 dst 可以就是 src
+template<typename T>
+static void scan_block_write(int64_t begin, int64_t end, void *context)
+{
+    auto state = static_cast<ScanState<T> *>(context);
+    for(int64_t b = begin; b < end; b += 1) {
+        T acc = state->sums[b];
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        int64_t i = block_begin(state->n, state->blocks, b);
+        if(state->inclusive) {
+            for(; i < last; i += 1) {
+                acc += state->src[i];
+                state->dst[i] = acc;
+            }
+        } else {
+            for(; i < last; i += 1) {
+                T value = state->src[i];
+                state->dst[i] = acc;
+                acc += value;
+            }
+        }
+    }
+}
+
+template<typename T>
+static int64_t launch_scan(Runtime *runtime, Field *src, Field *dst, bool inclusive)
+{
+    auto state = std::make_shared< ScanState<T> >();
+    state->src = reinterpret_cast<const T *>(src->data);
+    state->dst = reinterpret_cast<T *>(dst->data);
+    state->n = src->size;
+    state->blocks = block_number(runtime, state->n);
+    state->inclusive = inclusive;
+    state->sums.assign(state->blocks, 0);
+    std::vector<LaunchStage> stages = {
+        {scan_block_sums<T>, state.get(), state->blocks},
+        {scan_block_offsets<T>, state.get(), 1},
+        {scan_block_write<T>, state.get(), state->blocks}
+    };
+    return runtime->launch_stages(
+        stages,
+        {field_resource(src->handle)},
+        {field_resource(dst->handle)},
+        state
+    );
+}
+
+int64_t primitive_scan(Runtime *runtime, int64_t src, int64_t dst, bool inclusive)
+{
+    Field *src_field = find_field(runtime, src, "scan source");
+    Field *dst_field = find_field(runtime, dst, "scan target");
+    if(!src_field || !dst_field) {
+        return -1;
+    }
+    if(src_field->type != dst_field->type || dst_field->size < src_field->size) {
+        primitive_error("scan target must have the same type as the source and be at least as long");
+        return -1;
+    }
+    switch(src_field->type) {
+        case DataType::Int32: return launch_scan<int32_t>(runtime, src_field, dst_field, inclusive);
+        case DataType::Int64: return launch_scan<int64_t>(runtime, src_field, dst_field, inclusive);
+        case DataType::Float32: return launch_scan<float>(runtime, src_field, dst_field, inclusive);
+        case DataType::Float64: return launch_scan<double>(runtime, src_field, dst_field, inclusive);
+        default: break;
+    }
+    primitive_error("unsupported scan type");
+    return -1;
+}
+
+/* 基数排序 */
+
+// key 转换为无符号整数，无符号整数的大小顺序和 key 的顺序一致
+template<typename K> struct SortKey;
+
+template<> struct SortKey<int32_t> {
+    typedef uint32_t Bits;
+    static inline Bits encode(int32_t key) {
+        return static_cast<uint32_t>(key) ^ 0x80000000u;
+    }
+    static inline int32_t decode(Bits bits) {
+        return static_cast<int32_t>(bits ^ 0x80000000u);
+    }
+};
+
+template<> struct SortKey<int64_t> {
+    typedef uint64_t Bits;
+    static inline Bits encode(int64_t key) {
+        return static_cast<uint64_t>(key) ^ 0x8000000000000000ull;
+    }
+    static inline int64_t decode(Bits bits) {
+        return static_cast<int64_t>(bits ^ 0x8000000000000000ull);
+    }
+};
+
+// 浮点数：正数翻转符号位，负数翻转所有位
+template<> struct SortKey<float> {
+    typedef uint32_t Bits;
+    static inline Bits encode(float key) {
+        Bits bits;
+        memcpy(&bits, &key, sizeof(bits));
+        return bits ^ ((bits >> 31) ? 0xFFFFFFFFu : 0x80000000u);
+    }
+    static inline float decode(Bits bits) {
+        bits ^= (bits >> 31) ? 0x80000000u : 0xFFFFFFFFu;
+        float key;
+        memcpy(&key, &bits, sizeof(key));
+        return key;
+    }
+};
+
+template<> struct SortKey<double> {
+    typedef uint64_t Bits;
+    static inline Bits encode(double key) {
+        Bits bits;
+        memcpy(&bits, &key, sizeof(bits));
+        return bits ^ ((bits >> 63) ? 0xFFFFFFFFFFFFFFFFull : 0x8000000000000000ull);
+    }
+    static inline double decode(Bits bits) {
+        bits ^= (bits >> 63) ? 0x8000000000000000ull : 0xFFFFFFFFFFFFFFFFull;
+        double key;
+        memcpy(&key, &bits, sizeof(key));
+        return key;
+    }
+};
+
+// 每一轮排序 8 位
+static const int32_t RadixBits = 8;
+static const int32_t Radix = 1 << RadixBits;
+
+// K 是 key 的类型，V 是 payload 按位搬运使用的类型（uint32_t / uint64_t），HasValues 为 false 的话没有 payload
+template<typename K, typename V, bool HasValues>
+struct SortState {
+    typedef typename SortKey<K>::Bits Bits;
+
+    // 排序的一轮，按 key 的 [shift, shift + RadixBits) 位
+    struct Pass {
+        SortState *state;
+        int32_t shift;
+        bool skip; // 所有 key 的这几位都一样，不需要移动
+        int32_t from; // 从哪个缓冲区移动到另一个
+    };
+
+    K *keys;
+    V *values;
+    int64_t n;
+    int64_t blocks;
+    // 转换之后的 key 和 payload 的两个缓冲区，每一轮从一个移动到另一个
+    std::unique_ptr<Bits[]> key_buffer[2];
+    std::unique_ptr<V[]> value_buffer[2];
+    int32_t current = 0; // 当前的数据在哪个缓冲区
+    // 第 b 块中第 d 个桶的计数，之后变成这一块的这个桶在结果中的位置，下标是 b * Radix + d
+    std::vector<int64_t> histogram;
+    std::vector<Pass> passes;
+};
+
+// 阶段：把 key 转换为无符号整数，连同 payload 复制到缓冲区
+template<typename K, typename V, bool HasValues>
+static void sort_encode(int64_t begin, int64_t end, void *context)
+{
+    auto state = static_cast<SortState<K, V, HasValues> *>(context);
+    for(int64_t b = begin; b < end; b += 1) {
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        for(int64_t i = block_begin(state->n, state->blocks, b); i < last; i += 1) {
+            state->key_buffer[0][i] = SortKey<K>::encode(state->keys[i]);
+            if(HasValues) {
+                state->value_buffer[0][i] = state->values[i];
+            }
+        }
+    }
+}
+
+// 每一轮的阶段 1：每块的直方图
+template<typename K, typename V, bool HasValues>
+static void sort_histogram(int64_t begin, int64_t end, void *context)
+{
+    auto pass = static_cast<typename SortState<K, V, HasValues>::Pass *>(context);
+    auto state = pass->state;
+    auto keys = state->key_buffer[state->current].get();
+    for(int64_t b = begin; b < end; b += 1) {
+        int64_t *count = state->histogram.data() + b * Radix;
+        std::fill(count, count + Radix, 0);
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        for(int64_t i = block_begin(state->n, state->blocks, b); i < last; i += 1) {
+            count[(keys[i] >> pass->shift) & (Radix - 1)] += 1;
+        }
+    }
+}
+
+// 每一轮的阶段 2：桶优先、块其次的前缀和，得到每块每个桶的写入位置（这样才是稳定的），只有一次迭代
+template<typename K, typename V, bool HasValues>
+static void sort_offsets(int64_t, int64_t, void *context)
+{
+    auto pass = static_cast<typename SortState<K, V, HasValues>::Pass *>(context);
+    auto state = pass->state;
+    int64_t acc = 0;
+    pass->skip = false;
+    for(int32_t d = 0; d < Radix; d += 1) {
+        int64_t total = 0;
+        for(int64_t b = 0; b < state->blocks; b += 1) {
+            int64_t &count = state->histogram[b * Radix + d];
+            total += count;
+            int64_t value = count;
+            count = acc;
+            acc += value;
+        }
+        if(total == state->n) { // 所有 key 都在这个桶里
+            pass->skip = true;
+        }
+    }
+    pass->from = state->current;
+    if(!pass->skip) {
+        state->current ^= 1;
+    }
+}
+
+// 每一轮的阶段 3：按写入位置移动 key 和 payload
+template<typename K, typename V, bool HasValues>
+static void sort_scatter(int64_t begin, int64_t end, void *context)
+{
+    auto pass = static_cast<typename SortState<K, V, HasValues>::Pass *>(context);
+    if(pass->skip) {
+        return;
+    }
+    auto state = pass->state;
+    auto src_keys = state->key_buffer[pass->from].get();
+    auto dst_keys = state->key_buffer[pass->from ^ 1].get();
+    V *src_values = HasValues ? state->value_buffer[pass->from].get() : nullptr;
+    V *dst_values = HasValues ? state->value_buffer[pass->from ^ 1].get() : nullptr;
+    for(int64_t b = begin; b < end; b += 1) {
+        int64_t *offset = state->histogram.data() + b * Radix;
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        for(int64_t i = block_begin(state->n, state->blocks, b); i < last; i += 1) {
+            int64_t position = offset[(src_keys[i] >> pass->shift) & (Radix - 1)]++;
+            dst_keys[position] = src_keys[i];
+            if(HasValues) {
+                dst_values[position] = src_values[i];
+            }
+        }
+    }
+}
+
+// 最后的阶段：转换回原来的 key，连同 payload 写回 field
+template<typename K, typename V, bool HasValues>
+static void sort_decode(int64_t begin, int64_t end, void *context)
+{
+    auto state = static_cast<SortState<K, V, HasValues> *>(context);
+    auto keys = state->key_buffer[state->current].get();
+    auto values = HasValues ? state->value_buffer[state->current].get() : nullptr;
+    for(int64_t b = begin; b < end; b += 1) {
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        for(int64_t i = block_begin(state->n, state->blocks, b); i < last; i += 1) {
+            state->keys[i] = SortKey<K>::decode(keys[i]);
+            if(HasValues) {
+                state->values[i] = values[i];
+            }
+        }
+    }
+}
+
+template<typename K, typename V, bool HasValues>
+static int64_t launch_sort(Runtime *runtime, Field *keys, Field *values)
+{
+    typedef SortState<K, V, HasValues> State;
+    auto state = std::make_shared<State>();
+    state->keys = reinterpret_cast<K *>(keys->data);
+    state->values = values ? reinterpret_cast<V *>(values->data) : nullptr;
+    state->n = keys->size;
+    state->blocks = block_number(runtime, state->n);
+    // 缓冲区不需要初始化，每个元素在使用之前都会被写入
+    for(int32_t i = 0; i < 2; i += 1) {
+        state->key_buffer[i].reset(new typename State::Bits[std::max<int64_t>(state->n, 1)]);
+        if(HasValues) {
+            state->value_buffer[i].reset(new V[std::max<int64_t>(state->n, 1)]);
+        }
+    }
+    state->histogram.assign(state->blocks * Radix, 0);
+    // passes 在发射之前就要分配好，阶段的 context 指向其中的元素
+    int32_t pass_number = static_cast<int32_t>(sizeof(typename State::Bits) * 8 / RadixBits);
+    for(int32_t p = 0; p < pass_number; p += 1) {
+        state->passes.push_back({state.get(), p * RadixBits, false, 0});
+    }
+
+    std::vector<LaunchStage> stages;
+    stages.push_back({sort_encode<K, V, HasValues>, state.get(), state->blocks});
+    for(auto &pass : state->passes) {
+        stages.push_back({sort_histogram<K, V, HasValues>, &pass, state->blocks});
+        stages.push_back({sort_offsets<K, V, HasValues>, &pass, 1});
+        stages.push_back({sort_scatter<K, V, HasValues>, &pass, state->blocks});
+    }
+    stages.push_back({sort_decode<K, V, HasValues>, state.get(), state->blocks});
+
+    std::vector<int64_t> writes = {field_resource(keys->handle)};
+    if(values) {
+        writes.push_back(field_resource(values->handle));
+    }
+    return runtime->launch_stages(stages, {}, writes, state);
+}
+
+template<typename K>
+static int64_t launch_sort_values(Runtime *runtime, Field *keys, Field *values)
+{
+    if(!values) {
+        return launch_sort<K, uint32_t, false>(runtime, keys, nullptr);
+    }
+    switch(type_size(values->type)) {
+        case 1: return launch_sort<K, uint8_t, true>(runtime, keys, values);
+        case 2: return launch_sort<K, uint16_t, true>(runtime, keys, values);
+        case 8: return launch_sort<K, uint64_t, true>(runtime, keys, values);
+        default: return launch_sort<K, uint32_t, true>(runtime, keys, values);
+    }
+}
+
+int64_t primitive_sort(Runtime *runtime, int64_t keys, int64_t values)
+{
+    Field *keys_field = find_field(runtime, keys, "sort key");
+    if(!keys_field) {
+        return -1;
+    }
+    Field *values_field = nullptr;
+    if(values) {
+        values_field = find_field(runtime, values, "sort value");
+        if(!values_field) {
+            return -1;
+        }
+        if(values_field == keys_field || values_field->size < keys_field->size) {
+            primitive_error("sort values must be another field at least as long as the keys");
+            return -1;
+        }
+    }
+    switch(keys_field->type) {
+        case DataType::Int32: return launch_sort_values<int32_t>(runtime, keys_field, values_field);
+        case DataType::Int64: return launch_sort_values<int64_t>(runtime, keys_field, values_field);
+        case DataType::Float32: return launch_sort_values<float>(runtime, keys_field, values_field);
+        case DataType::Float64: return launch_sort_values<double>(runtime, keys_field, values_field);
+        default: break;
+    }
+    primitive_error("unsupported sort key type");
+    return -1;
+}
+
+/* 流压缩 */
+
+// V 是按位搬运使用的元素类型，F 是 flag 的类型
+template<typename V, typename F>
+struct CompactState {
+    const V *src; // nullptr 表示写下标
+    const F *flags;
+    V *dst;
+    int64_t capacity; // dst 的长度
+    Field *count; // 可以是 nullptr
+    int64_t n;
+    int64_t blocks;
+    std::vector<int64_t> offsets; // 每块选中的数量，之后变成每块的写入位置
+};
+
+// 阶段 1：每块选中的数量
+template<typename V, typename F>
+static void compact_block_counts(int64_t begin, int64_t end, void *context)
+{
+    auto state = static_cast<CompactState<V, F> *>(context);
+    for(int64_t b = begin; b < end; b += 1) {
+        int64_t count = 0;
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        for(int64_t i = block_begin(state->n, state->blocks, b); i < last; i += 1) {
+            count += state->flags[i] != 0;
+        }
+        state->offsets[b] = count;
+    }
+}
+
+// 阶段 2：块之间的前缀和，以及选中的总数，只有一次迭代
+template<typename V, typename F>
+static void compact_block_offsets(int64_t, int64_t, void *context)
+{
+    auto state = static_cast<CompactState<V, F> *>(context);
+    int64_t acc = 0;
+    for(auto &offset : state->offsets) {
+        int64_t value = offset;
+        offset = acc;
+        acc += value;
+    }
+    if(state->count) {
+        if(state->count->type == DataType::Int32) {
+            reinterpret_cast<int32_t *>(state->count->data)[0] = static_cast<int32_t>(acc);
+        } else {
+            reinterpret_cast<int64_t *>(state->count->data)[0] = acc;
+        }
+    }
+}
+
+// 阶段 3：按顺序写出选中的元素
+template<typename V, typename F>
+static void compact_block_write(int64_t begin, int64_t end, void *context)
+{
+    auto state = static_cast<CompactState<V, F> *>(context);
+    for(int64_t b = begin; b < end; b += 1) {
+        int64_t position = state->offsets[b];
+        int64_t last = block_begin(state->n, state->blocks, b + 1);
+        for(int64_t i = block_begin(state->n, state->blocks, b); i < last && position < state->capacity; i += 1) {
+            if(state->flags[i] != 0) {
+                state->dst[position] = state->src ? state->src[i] : static_cast<V>(i);
+                position += 1;
+            }
+        }
+    }
+}
+
+template<typename V, typename F>
+static int64_t launch_compact(Runtime *runtime, Field *src, Field *flags, Field *dst, Field *count)
+{
+    auto state = std::make_shared< CompactState<V, F> >();
+    state->src = src ? reinterpret_cast<const V *>(src->data) : nullptr;
+    state->flags = reinterpret_cast<const F *>(flags->data);
+    state->dst = reinterpret_cast<V *>(dst->data);
+    state->capacity = dst->size;
+    state->count = count;
+    state->n = src ? std::min(src->size, flags->size) : flags->size;
+    state->blocks = block_number(runtime, state->n);
+    state->offsets.assign(state->blocks, 0);
+    std::vector<LaunchStage> stages = {
+        {compact_block_counts<V, F>, state.get(), state->blocks},
+        {compact_block_offsets<V, F>, state.get(), 1},
+        {compact_block_write<V, F>, state.get(), state->blocks}
+    };
+    std::vector<int64_t> reads = {field_resource(flags->handle)};
+    if(src) {
+        reads.push_back(field_resource(src->handle));
+    }
+    std::vector<int64_t> writes = {field_resource(dst->handle)};
+    if(count) {
+        writes.push_back(field_resource(count->handle));
+    }
+    return runtime->launch_stages(stages, reads, writes, state);
+}
+
+// 元素按位搬运，下标的话按 dst 的类型写，Int32 的 dst 也就是 uint32_t 按位写入
+template<typename F>
+static int64_t launch_compact_flags(Runtime *runtime, Field *src, Field *flags, Field *dst, Field *count)
+{
+    switch(type_size(dst->type)) {
+        case 1: return launch_compact<uint8_t, F>(runtime, src, flags, dst, count);
+        case 2: return launch_compact<uint16_t, F>(runtime, src, flags, dst, count);
+        case 8: return launch_compact<uint64_t, F>(runtime, src, flags, dst, count);
+        default: return launch_compact<uint32_t, F>(runtime, src, flags, dst, count);
+    }
+}
+
+int64_t primitive_compact(Runtime *runtime, int64_t src, int64_t flags, int64_t dst, int64_t count)
+{
+    Field *flags_field = find_field(runtime, flags, "compact flag");
+    Field *dst_field = find_field(runtime, dst, "compact target");
+    Field *src_field = src ? find_field(runtime, src, "compact source") : nullptr;
+    Field *count_field = count ? find_field(runtime, count, "compact count") : nullptr;
+    if(!flags_field || !dst_field || (src && !src_field) || (count && !count_field)) {
+        return -1;
+    }
+    if(flags_field->type != DataType::Int32 && flags_field->type != DataType::Int64) {
+        primitive_error("compact flags must be Int32 or Int64");
+        return -1;
+    }
+    if(flags_field == dst_field) {
+        primitive_error("compact target can not be the flags");
+        return -1;
+    }
+    if(src_field && (type_size(src_field->type) != type_size(dst_field->type) || src_field == dst_field)) {
+        primitive_error("compact target must be another field with the same element size as the source");
+        return -1;
+    }
+    if(!src_field && dst_field->type != DataType::Int32 && dst_field->type != DataType::Int64) {
+        primitive_error("compact target of indices must be Int32 or Int64");
+        return -1;
+    }
+    if(count_field && (count_field->size < 1 ||
+        (count_field->type != DataType::Int32 && count_field->type != DataType::Int64))) {
+        primitive_error("compact count must be an Int32 or Int64 field");
+        return -1;
+    }
+    if(flags_field->type == DataType::Int32) {
+        return launch_compact_flags<int32_t>(runtime, src_field, flags_field, dst_field, count_field);
+    }
+    return launch_compact_flags<int64_t>(runtime, src_field, flags_field, dst_field, count_field);
+}
+
+}
@@ -0,0 +1,30 @@
+// runtime 中的并行原语：前缀和、基数排序、流压缩
+// 和 kernel 一样异步发射到 worker 线程池，按 field 和其他发射建立依赖
+// 每个原语都分成几个阶段：先分块统计，再串行处理每块的统计结果（块的数量很少），最后分块写出
+
+#ifndef LLVM_PRIMITIVES_H
+#define LLVM_PRIMITIVES_H
+
+#include <cstdint>
+
+#include "llvm_runtime.h"
+
+namespace llvm_taichi
+{
+    // 前缀和，src 和 dst 的类型相同，dst 可以就是 src
+    // exclusive：dst[i] = src[0] + ... + src[i - 1]；inclusive：dst[i] = src[0] + ... + src[i]
+    // 返回最后一次发射的 id，参数不合法的话返回 -1
+    int64_t primitive_scan(Runtime *runtime, int64_t src, int64_t dst, bool inclusive);
+
+    // 按 keys 升序的稳定 LSD 基数排序，keys 是 Int32 / Int64 / Float32 / Float64
+    // values 不为 0 的话是跟着 keys 一起移动的 payload（任意类型，按位移动，长度不小于 keys）
+    // 浮点数按 IEEE 754 的全序排序，-0.0 在 0.0 前面，NaN 按符号位排在两端
+    int64_t primitive_sort(Runtime *runtime, int64_t keys, int64_t values);
+
+    // 流压缩：按顺序把 flags[i] 不为 0 的 src[i] 写到 dst 的前面，flags 是 Int32 / Int64
+    // src 为 0 的话写的是下标 i（dst 是 Int32 / Int64），否则 dst 和 src 的元素大小相同（任意类型，按位复制）
+    // 超出 dst 长度的部分丢弃；count 不为 0 的话，选中的总数写到 count[0]（Int32 / Int64）
+    int64_t primitive_compact(Runtime *runtime, int64_t src, int64_t flags, int64_t dst, int64_t count);
+}
+
+#endif
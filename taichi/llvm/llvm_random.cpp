@@ -0,0 +1,82 @@
+#include "llvm_random.h"
+
+namespace llvm_taichi
+{
+
+// Philox4x32 的常量（Salmon et al., Parallel Random Numbers: As Easy as 1, 2, 3）
+static const uint32_t PhiloxM0 = 0xD2511F53u;
+static const uint32_t PhiloxM1 = 0xCD9E8D57u;
+static const uint32_t PhiloxW0 = 0x9E3779B9u;
+static const uint32_t PhiloxW1 = 0xBB67AE85u;
+static const int PhiloxRounds = 10;
+
+double random_uniform(uint64_t seed, uint64_t counter, uint64_t stream)
+{
+    uint32_t c0 = static_cast<uint32_t>(counter);
+    uint32_t c1 = static_cast<uint32_t>(counter >> 32);
+    uint32_t c2 = static_cast<uint32_t>(stream);
+    uint32_t c3 = static_cast<uint32_t>(stream >> 32);
+    uint32_t k0 = static_cast<uint32_t>(seed);
+    uint32_t k1 = static_cast<uint32_t>(seed >> 32);
+    for(int round = 0; round < PhiloxRounds; round += 1) {
+        uint64_t p0 = static_cast<uint64_t>(PhiloxM0) * c0;
+        uint64_t p1 = static_cast<uint64_t>(PhiloxM1) * c2;
+        uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+        c1 = static_cast<uint32_t>(p1);
+        c3 = static_cast<uint32_t>(p0);
+        c0 = n0;
+        c2 = n2;
+        k0 += PhiloxW0;
+        k1 += PhiloxW1;
+    }
+    // 取高 52 位作为尾数，m / 2^52 是精确的
+    uint64_t bits = (static_cast<uint64_t>(c1) << 32) | c0;
+    return static_cast<double>(bits >> 12) * (1.0 / 4503599627370496.0);
+}
+
+llvm::Value *llvm_random_uniform(
+    llvm::IRBuilder<> *builder,
+    llvm::Value *seed,
+    llvm::Value *counter,
+    llvm::Value *stream
+)
+{
+    // 都在 i32 上计算，32 位 x 32 位的乘法扩展到 i64（x86 上是 pmuludq，可以向量化）
+    llvm::Type *i32 = builder->getInt32Ty();
+    llvm::Type *i64 = builder->getInt64Ty();
+    auto low = [&](llvm::Value *v) { return builder->CreateTrunc(v, i32); };
+    auto high = [&](llvm::Value *v) { return builder->CreateTrunc(builder->CreateLShr(v, 32), i32); };
+
+    llvm::Value *c0 = low(counter);
+    llvm::Value *c1 = high(counter);
+    llvm::Value *c2 = low(stream);
+    llvm::Value *c3 = high(stream);
+    llvm::Value *k0 = low(seed);
+    llvm::Value *k1 = high(seed);
+    llvm::Value *m0 = builder->getInt64(PhiloxM0);
+    llvm::Value *m1 = builder->getInt64(PhiloxM1);
+    for(int round = 0; round < PhiloxRounds; round += 1) {
+        llvm::Value *p0 = builder->CreateMul(builder->CreateZExt(c0, i64), m0, "", true, false);
+        llvm::Value *p1 = builder->CreateMul(builder->CreateZExt(c2, i64), m1, "", true, false);
+        llvm::Value *n0 = builder->CreateXor(builder->CreateXor(high(p1), c1), k0);
+        llvm::Value *n2 = builder->CreateXor(builder->CreateXor(high(p0), c3), k1);
+        c1 = low(p1);
+        c3 = low(p0);
+        c0 = n0;
+        c2 = n2;
+        k0 = builder->CreateAdd(k0, builder->getInt32(PhiloxW0));
+        k1 = builder->CreateAdd(k1, builder->getInt32(PhiloxW1));
+    }
+    llvm::Value *bits = builder->CreateOr(
+        builder->CreateShl(builder->CreateZExt(c1, i64), 32),
+        builder->CreateZExt(c0, i64)
+    );
+    // 不使用整数到浮点数的转换（AVX-512 之前没有 64 位整数的向量转换，循环就不向量化了）
+    // 尾数放进 [1, 2) 的 double 中再减 1，结果和 m / 2^52 相同
+    llvm::Value *one = llvm::ConstantFP::get(builder->getDoubleTy(), 1.0);
+    llvm::Value *mantissa = builder->CreateOr(builder->CreateLShr(bits, 12), builder->getInt64(0x3FF0000000000000ull));
+    return builder->CreateFSub(builder->CreateBitCast(mantissa, builder->getDoubleTy()), one);
+}
+
+}
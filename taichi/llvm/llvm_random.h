@@ -0,0 +1,28 @@
+// kernel 中的随机数：基于计数器的 Philox4x32-10
+// 结果只由 (seed, counter, stream) 决定，没有需要在迭代之间传递的状态
+// counter 是 loop index，所以结果和线程数、调度无关；生成器只有整数乘法、异或，循环仍然可以向量化
+
+#ifndef LLVM_RANDOM_H
+#define LLVM_RANDOM_H
+
+#include <cstdint>
+
+#include <llvm/IR/IRBuilder.h>
+
+namespace llvm_taichi
+{
+    // [0, 1) 之间均匀分布的 Float64（52 位精度）
+    // seed 是 64 位的 key，counter 和 stream 组成 128 位的计数器
+    // 解释器和常量折叠使用这个函数，和 llvm_random_uniform 生成的指令的结果一致
+    double random_uniform(uint64_t seed, uint64_t counter, uint64_t stream);
+
+    // 生成和 random_uniform 一样的指令，参数都是 i64，结果是 double
+    llvm::Value *llvm_random_uniform(
+        llvm::IRBuilder<> *builder,
+        llvm::Value *seed,
+        llvm::Value *counter,
+        llvm::Value *stream
+    );
+}
+
+#endif
@@ -0,0 +1,940 @@
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "llvm_runtime.h"
+
+namespace llvm_taichi
+{
+
+std::unique_ptr<Runtime> taichi_runtime;
+
+Field::Field(int64_t handle, DataType type, int64_t size, bool zero)
+{
+    this->handle = handle;
+    this->type = type;
+    this->size = size;
+
+    // 按 cache line 对齐，aligned_alloc 要求大小是对齐的整数倍
+    size_t bytes = static_cast<size_t>(size) * type_size(type);
+    bytes = (bytes + 63) / 64 * 64;
+    this->data = static_cast<Byte *>(std::aligned_alloc(64, std::max<size_t>(bytes, 64)));
+    if(this->data && zero) {
+        memset(this->data, 0, bytes);
+    }
+}
+
+Field::Field(int64_t handle, DataType type, int64_t size, Byte *mapping, size_t mapping_bytes, size_t delta, bool shared)
+{
+    this->handle = handle;
+    this->type = type;
+    this->size = size;
+    this->data = mapping + delta;
+    this->mapping = mapping;
+    this->mapping_bytes = mapping_bytes;
+    this->shared = shared;
+}
+
+Field::~Field()
+{
+    // MAP_SHARED 的脏页在 munmap 之后仍然由内核写回文件
+    if(mapping) {
+        munmap(mapping, mapping_bytes);
+    } else {
+        std::free(data);
+    }
+    data = nullptr;
+    mapping = nullptr;
+}
+
+// 向上取整到 align 的整数倍
+static inline int64_t align_up(int64_t value, int64_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+ScatterState::~ScatterState()
+{
+    for(auto copy : copies) {
+        std::free(copy);
+    }
+}
+
+// 一份拷贝的字节数，按 cache line 对齐
+static size_t copy_bytes(const Field *field)
+{
+    size_t bytes = static_cast<size_t>(field->size) * type_size(field->type);
+    return std::max<size_t>((bytes + 63) / 64 * 64, 64);
+}
+
+void *ScatterState::part_context(int32_t part)
+{
+    std::vector<Byte> &res = contexts[part];
+    if(res.empty()) {
+        res.assign(context, context + context_size);
+        for(size_t t = 0; t < targets.size(); t += 1) {
+            // 由执行这个参与者的 worker 清零，第一次写入的时候页分配在这个 worker 所在的节点上
+            Byte *copy = copies[part * targets.size() + t];
+            memset(copy, 0, copy_bytes(targets[t].field));
+            memcpy(res.data() + targets[t].offset, &copy, sizeof(Byte *));
+        }
+    }
+    return res.data();
+}
+
+// 把所有参与者的拷贝加到 field 上，迭代空间是 field 的下标
+template<typename T>
+static void merge_copies(ScatterState *state, size_t target, int64_t begin, int64_t end)
+{
+    T *data = reinterpret_cast<T *>(state->targets[target].field->data);
+    for(int32_t part = 0; part < state->parts; part += 1) {
+        T *copy = reinterpret_cast<T *>(state->copies[part * state->targets.size() + target]);
+        if(!copy) {
+            continue;
+        }
+        for(int64_t i = begin; i < end; i += 1) {
+            data[i] += copy[i];
+        }
+    }
+}
+
+static void scatter_merge_entry(int64_t begin, int64_t end, void *context)
+{
+    ScatterState *state = static_cast<ScatterState *>(context);
+    for(size_t t = 0; t < state->targets.size(); t += 1) {
+        Field *field = state->targets[t].field;
+        int64_t last = std::min(end, field->size);
+        if(begin >= last) {
+            continue;
+        }
+        switch(field->type) {
+            case DataType::Int32: merge_copies<int32_t>(state, t, begin, last); break;
+            case DataType::Int64: merge_copies<int64_t>(state, t, begin, last); break;
+            case DataType::Float32: merge_copies<float>(state, t, begin, last); break;
+            case DataType::Float64: merge_copies<double>(state, t, begin, last); break;
+            default: break;
+        }
+    }
+}
+
+// first-touch：worker 把自己负责的那一段清零，操作系统在这个 worker 所在的节点上分配这些页
+static void first_touch_entry(int64_t begin, int64_t end, void *context)
+{
+    Field *field = static_cast<Field *>(context);
+    size_t element = type_size(field->type);
+    memset(field->data + begin * element, 0, static_cast<size_t>(end - begin) * element);
+}
+
+// 自旋时让出流水线，降低功耗，也让超线程的另一个线程可以执行
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// 自旋直到 sequence 不等于 seen，或者超过 deadline（返回 false）
+// 先用 pause 自旋，一段时间之后退避为 yield，把 CPU 让给其他线程
+static bool spin_until_changed(
+    const std::atomic<uint64_t> &sequence,
+    uint64_t seen,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    for(uint32_t spins = 1; sequence.load(std::memory_order_acquire) == seen; spins += 1) {
+        if(spins < 1024) {
+            cpu_relax();
+        } else {
+            std::this_thread::yield();
+        }
+        if(spins % 64 == 0 && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Runtime::Runtime(uint32_t thread_number, uint32_t placement)
+{
+    stopping = false;
+    next_launch_id = 0;
+    next_field_handle = 1;
+    page_size = std::max<int64_t>(sysconf(_SC_PAGESIZE), 1);
+    parked_workers = 0;
+    parked_waiters = 0;
+    saving_schedules = 0;
+    latency_next = 0;
+    this->placement = placement;
+    topology = Topology::detect();
+
+    if(thread_number == 0) {
+        thread_number = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // 在启动 worker 之前准备好，worker 会读取 local_tasks
+    local_tasks.resize(thread_number);
+    worker_cpus.assign(thread_number, -1);
+    std::vector<int32_t> cpus = topology.worker_cpus(thread_number);
+    for(uint32_t i = 0; i < thread_number; i += 1) {
+        workers.emplace_back(&Runtime::worker_loop, this, i);
+        if(placement & PlacementPin) {
+            if(pin_thread(workers.back(), cpus[i])) {
+                worker_cpus[i] = cpus[i];
+            } else {
+                std::string _m = "can not pin worker " + std::to_string(i) + " to cpu " + std::to_string(cpus[i]);
+                Out::Log(pType::WARNING, "%s", _m.c_str());
+            }
+        }
+    }
+}
+
+Runtime::~Runtime()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        block_until(lock, [this] { return pending.empty(); });
+        stopping = true;
+        task_sequence.fetch_add(1, std::memory_order_release); // 让自旋的 worker 也看到
+    }
+    task_cv.notify_all();
+    for(auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void Runtime::worker_loop(uint32_t index)
+{
+    Tracer::name_thread("worker " + std::to_string(index));
+    Chunk chunk;
+    while(take_task(index, chunk)) {
+        // 执行的时候不持有锁，不同的块可以并行
+        run_chunk(chunk);
+
+        // 所有块的计数归零才算完成，最后一个到达的 worker 负责完成这次发射
+        // 其他 worker 不需要获取 mutex，直接去领取下一个任务
+        if(chunk.launch->remaining_chunks.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::string cache_path, cache_text;
+            bool save = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                complete(chunk.launch);
+                save = autotuner.take_save(cache_path, cache_text);
+                saving_schedules += save ? 1 : 0;
+            }
+            // autotuner 的选择在释放 mutex 之后写入文件，其他 worker 和发射不用等待磁盘
+            if(save) {
+                Autotuner::save(cache_path, cache_text);
+                std::lock_guard<std::mutex> lock(mutex);
+                saving_schedules -= 1;
+                done_sequence.fetch_add(1, std::memory_order_release);
+                if(parked_waiters > 0) {
+                    done_cv.notify_all();
+                }
+            }
+        }
+        chunk.launch.reset();
+    }
+}
+
+bool Runtime::take_task(uint32_t index, Chunk &chunk)
+{
+    std::deque<Chunk> &own = local_tasks[index];
+    std::unique_lock<std::mutex> lock(mutex);
+    bool spun = false;
+    while(true) {
+        std::deque<Chunk> &from = own.empty() ? tasks : own;
+        if(!from.empty()) {
+            chunk = std::move(from.front());
+            from.pop_front();
+            return true;
+        }
+        if(stopping) { // stopping 并且没有任务了
+            return false;
+        }
+        // 低延迟模式：先不持有锁自旋，有新任务（task_sequence 变了）再回来领取
+        // 每次空闲只自旋一轮，超时之后休眠
+        int64_t spin = spin_nanoseconds.load(std::memory_order_relaxed);
+        if(spin > 0 && !spun) {
+            uint64_t seen = task_sequence.load(std::memory_order_acquire);
+            lock.unlock();
+            spun = !spin_until_changed(task_sequence, seen, std::chrono::steady_clock::now() + std::chrono::nanoseconds(spin));
+            lock.lock();
+            continue;
+        }
+        parked_workers += 1;
+        task_cv.wait(lock, [this, &own] { return stopping || !own.empty() || !tasks.empty(); });
+        parked_workers -= 1;
+        spun = false;
+    }
+}
+
+template<typename Predicate>
+void Runtime::block_until(std::unique_lock<std::mutex> &lock, Predicate done)
+{
+    if(done()) {
+        return;
+    }
+    TraceScope trace("sync", "wait");
+    int64_t spin = spin_nanoseconds.load(std::memory_order_relaxed);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(spin);
+    while(!done()) {
+        // 自旋等待有发射完成（done_sequence 变了），然后重新检查
+        if(spin > 0 && std::chrono::steady_clock::now() < deadline) {
+            uint64_t seen = done_sequence.load(std::memory_order_acquire);
+            lock.unlock();
+            spin_until_changed(done_sequence, seen, deadline);
+            lock.lock();
+            continue;
+        }
+        parked_waiters += 1;
+        done_cv.wait(lock, done);
+        parked_waiters -= 1;
+    }
+}
+
+void Runtime::run_chunk(const Chunk &chunk)
+{
+    Launch *launch = chunk.launch.get();
+    int64_t iterations = launch->iterations;
+    // 私有化的 scatter：每个参与者使用自己的 context
+    void *context = launch->context;
+    if(launch->scatter && !launch->scatter_merge) {
+        context = launch->scatter->part_context(chunk.part);
+    }
+    // 执行一段迭代，开启追踪的话每一段是 worker 线程上的一个事件
+    auto run = [launch, context](int64_t begin, int64_t end) {
+        TraceScope trace("worker", "chunk", launch->trace_name, launch->id, "begin", begin, "end", end);
+        launch->entry(begin, end, context);
+    };
+    switch(launch->policy) {
+        case SchedulePolicy::Dynamic:
+            // 每次领取 chunk 个迭代，直到领完
+            while(true) {
+                int64_t begin = launch->next.fetch_add(launch->chunk, std::memory_order_relaxed);
+                if(begin >= iterations) {
+                    break;
+                }
+                run(begin, std::min(begin + launch->chunk, iterations));
+            }
+            break;
+        case SchedulePolicy::Guided: {
+            // 每次领取剩余迭代的 1 / (2 * parts)，不少于 chunk
+            int64_t begin = launch->next.load(std::memory_order_relaxed);
+            while(begin < iterations) {
+                int64_t size = std::max(launch->chunk, align_up((iterations - begin) / (2 * launch->parts), launch->align));
+                int64_t end = std::min(begin + size, iterations);
+                if(launch->next.compare_exchange_weak(begin, end, std::memory_order_relaxed)) {
+                    run(begin, end);
+                    begin = launch->next.load(std::memory_order_relaxed);
+                }
+                // 失败的话 begin 已经更新为最新的值
+            }
+            break;
+        }
+        case SchedulePolicy::Stealing: {
+            StealRange &own = launch->ranges[chunk.part];
+            while(true) {
+                int64_t begin = 0, end = 0;
+                {
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    begin = own.begin;
+                    end = std::min(own.begin + launch->chunk, own.end);
+                    own.begin = end;
+                }
+                if(begin < end) {
+                    run(begin, end);
+                    continue;
+                }
+                // 自己的做完了，从后面的参与者开始找，偷走剩余迭代的后一半
+                // 同时只持有一个锁，避免两个线程互相偷的时候死锁
+                // 范围的起点总是 align 的整数倍，偷的位置也对齐，剩余的不到一个 align 的话整个偷走
+                for(int32_t i = 1; i < launch->parts && begin >= end; i += 1) {
+                    StealRange &victim = launch->ranges[(chunk.part + i) % launch->parts];
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    int64_t remain = victim.end - victim.begin;
+                    if(remain > 0) {
+                        begin = victim.begin + align_up(remain / 2, launch->align);
+                        if(begin >= victim.end) {
+                            begin = victim.begin;
+                        }
+                        end = victim.end;
+                        victim.end = begin;
+                    }
+                }
+                if(begin >= end) { // 所有的范围都空了
+                    break;
+                }
+                std::lock_guard<std::mutex> lock(own.mutex);
+                own.begin = begin;
+                own.end = end;
+            }
+            break;
+        }
+        default:
+            run(chunk.begin, chunk.end);
+            break;
+    }
+}
+
+// 参与者的数量确定之后，为每个参与者分配拷贝（只分配，还没有访问，不占用物理内存）
+// 分配失败的话不私有化，改为执行原子累加的 kernel，合并的发射也就没有拷贝可以合并
+static void prepare_scatter(Launch *launch)
+{
+    if(!launch->scatter || launch->scatter_merge) {
+        return;
+    }
+    ScatterState *state = launch->scatter.get();
+    state->contexts.assign(launch->parts, std::vector<Byte>());
+    state->copies.assign(launch->parts * state->targets.size(), nullptr);
+    for(int32_t part = 0; part < launch->parts; part += 1) {
+        for(size_t t = 0; t < state->targets.size(); t += 1) {
+            Byte *copy = static_cast<Byte *>(std::aligned_alloc(64, copy_bytes(state->targets[t].field)));
+            if(!copy) {
+                Out::Log(pType::WARNING, "can not allocate memory for scatter copies, use atomic updates");
+                for(auto &allocated : state->copies) {
+                    std::free(allocated);
+                    allocated = nullptr;
+                }
+                launch->entry = state->atomic_entry;
+                launch->scatter.reset();
+                return;
+            }
+            state->copies[part * state->targets.size() + t] = copy;
+        }
+    }
+    state->parts = launch->parts;
+}
+
+// 所有前驱都完成了，确定调度，然后把任务放进任务队列
+void Runtime::schedule(const std::shared_ptr<Launch> &launch)
+{
+    int64_t thread_number = static_cast<int64_t>(workers.size());
+    if(launch->iterations <= 0) {
+        complete(launch); // 空的发射直接完成
+        return;
+    }
+
+    ScheduleChoice choice = launch->fixed_schedule ? ScheduleChoice() : default_schedule;
+    if(choice.policy == SchedulePolicy::Auto) {
+        choice = launch->signature.empty()
+            ? ScheduleChoice()
+            : autotuner.choose(launch->signature, launch->iterations, launch->candidate);
+    }
+    launch->policy = choice.policy;
+    launch->chunk = align_up(schedule_chunk(choice, launch->iterations, workers.size()), launch->align);
+    launch->start = std::chrono::steady_clock::now();
+
+    if(launch->policy == SchedulePolicy::Static) {
+        // 静态连续切分，前 remain 块多分一个
+        // 设定了放置策略的话第 i 块固定交给 worker i，这样每次发射中同一段迭代都在同一个 CPU（节点）上执行
+        // 和 first-touch 初始化的切分一致，访问的就是本节点的内存
+        // 按 align 个迭代为单位切分，最后一块到 iterations 为止
+        bool bound = placement != PlacementNone;
+        int64_t units = (launch->iterations + launch->align - 1) / launch->align;
+        int64_t chunk_number = std::min<int64_t>(units, thread_number);
+        int64_t base = units / chunk_number;
+        int64_t remain = units % chunk_number;
+        int64_t begin = 0;
+        launch->parts = static_cast<int32_t>(chunk_number);
+        launch->remaining_chunks = launch->parts;
+        prepare_scatter(launch.get());
+        for(int64_t i = 0; i < chunk_number; i += 1) {
+            int64_t end = std::min(begin + (base + (i < remain ? 1 : 0)) * launch->align, launch->iterations);
+            (bound ? local_tasks[i] : tasks).push_back(Chunk{launch, begin, end, static_cast<int32_t>(i)});
+            begin = end;
+        }
+        notify_workers();
+        return;
+    }
+
+    // 其他调度：每个参与者一个任务，执行的时候再领取迭代
+    // 块的数量比线程少的话，多余的参与者没有意义
+    int64_t chunk_number = (launch->iterations + launch->chunk - 1) / launch->chunk;
+    launch->parts = static_cast<int32_t>(std::min(chunk_number, thread_number));
+    launch->remaining_chunks = launch->parts;
+    prepare_scatter(launch.get());
+    launch->next.store(0, std::memory_order_relaxed);
+    if(launch->policy == SchedulePolicy::Stealing) {
+        // 一开始和静态调度一样连续切分
+        launch->ranges.reset(new StealRange[launch->parts]);
+        int64_t units = (launch->iterations + launch->align - 1) / launch->align;
+        int64_t base = units / launch->parts;
+        int64_t remain = units % launch->parts;
+        int64_t begin = 0;
+        for(int32_t i = 0; i < launch->parts; i += 1) {
+            launch->ranges[i].begin = begin;
+            begin = std::min(begin + (base + (i < remain ? 1 : 0)) * launch->align, launch->iterations);
+            launch->ranges[i].end = begin;
+        }
+    }
+    for(int32_t i = 0; i < launch->parts; i += 1) {
+        tasks.push_back(Chunk{launch, 0, 0, i});
+    }
+    notify_workers();
+}
+
+void Runtime::notify_workers()
+{
+    task_sequence.fetch_add(1, std::memory_order_release);
+    // 休眠的 worker 在持有 mutex 的时候登记，所以这里看到 0 的话就不会有 worker 错过这些任务
+    if(parked_workers > 0) {
+        task_cv.notify_all();
+    }
+}
+
+void Runtime::complete(const std::shared_ptr<Launch> &launch)
+{
+    if(launch->candidate >= 0) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - launch->start;
+        autotuner.report(launch->signature, launch->iterations, launch->candidate, elapsed.count());
+    }
+    launch->ranges.reset();
+
+    std::chrono::duration<double> latency = std::chrono::steady_clock::now() - launch->submitted;
+    if(latency_samples.size() < LatencySamples) {
+        latency_samples.push_back(latency.count());
+    } else {
+        latency_samples[latency_next] = latency.count();
+    }
+    latency_next = (latency_next + 1) % LatencySamples;
+
+    pending.erase(launch->id);
+    for(auto &dependent : launch->dependents) {
+        dependent->waiting -= 1;
+        if(dependent->waiting == 0) {
+            schedule(dependent);
+        }
+    }
+    launch->dependents.clear();
+    if(launch->trace_name) {
+        trace_mark("launch", "launch", 'e', launch->trace_name, launch->id);
+    }
+    done_sequence.fetch_add(1, std::memory_order_release);
+    if(parked_waiters > 0) {
+        done_cv.notify_all();
+    }
+}
+
+void Runtime::add_dependency(const std::shared_ptr<Launch> &launch, int64_t dependency_id)
+{
+    if(dependency_id < 0 || dependency_id == launch->id) {
+        return;
+    }
+    auto it = pending.find(dependency_id);
+    if(it == pending.end()) { // 已经完成了
+        return;
+    }
+    // 同一个前驱只记录一次
+    auto &dependents = it->second->dependents;
+    if(!dependents.empty() && dependents.back() == launch) {
+        return;
+    }
+    dependents.push_back(launch);
+    launch->waiting += 1;
+}
+
+bool Runtime::resource_busy(int64_t resource)
+{
+    auto it = resources.find(resource);
+    if(it == resources.end()) {
+        return false;
+    }
+    if(pending.count(it->second.last_writer)) {
+        return true;
+    }
+    for(auto reader : it->second.readers) {
+        if(pending.count(reader)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<Launch> Runtime::submit(
+    KernelEntry entry,
+    void *context,
+    int64_t iterations,
+    const std::vector<int64_t> &reads,
+    const std::vector<int64_t> &writes,
+    const std::string &signature,
+    bool fixed_schedule
+)
+{
+    auto this_launch = std::make_shared<Launch>();
+    this_launch->id = next_launch_id++;
+    this_launch->entry = entry;
+    this_launch->context = context;
+    this_launch->iterations = iterations;
+    this_launch->waiting = 0;
+    this_launch->signature = signature;
+    this_launch->submitted = std::chrono::steady_clock::now();
+    this_launch->fixed_schedule = fixed_schedule;
+    pending[this_launch->id] = this_launch;
+    // 发射到完成是时间线上的一个异步区间，以 kernel 签名命名
+    if(Tracer::enabled()) {
+        this_launch->trace_name = Tracer::intern(signature.empty() ? std::string("kernel") : signature);
+        trace_mark("launch", "launch", 'b', this_launch->trace_name, this_launch->id);
+    }
+
+    // 读写文件映射的 field 的话，切分对齐到页（元素大小都是 2 的幂，取最大的就是公倍数）
+    for(auto *list : {&reads, &writes}) {
+        for(auto resource : *list) {
+            auto it = resource < 0 ? fields.find(-resource) : fields.end();
+            if(it != fields.end() && it->second->mapping) {
+                int64_t elements = page_size / static_cast<int64_t>(type_size(it->second->type));
+                this_launch->align = std::max(this_launch->align, elements);
+            }
+        }
+    }
+
+    // 读之前要等上一次写（RAW）
+    for(auto resource : reads) {
+        auto &state = resources[resource];
+        add_dependency(this_launch, state.last_writer);
+    }
+    // 写之前要等上一次写（WAW），以及上一次写之后的所有读（WAR）
+    for(auto resource : writes) {
+        auto &state = resources[resource];
+        add_dependency(this_launch, state.last_writer);
+        for(auto reader : state.readers) {
+            add_dependency(this_launch, reader);
+        }
+    }
+
+    // 更新资源的读写记录，顺便清理已经完成的读者
+    for(auto resource : reads) {
+        auto &readers = resources[resource].readers;
+        readers.erase(
+            std::remove_if(readers.begin(), readers.end(), [this](int64_t id) {
+                return !pending.count(id);
+            }),
+            readers.end()
+        );
+        readers.push_back(this_launch->id);
+    }
+    for(auto resource : writes) {
+        auto &state = resources[resource];
+        state.last_writer = this_launch->id;
+        state.readers.clear();
+    }
+    return this_launch;
+}
+
+int64_t Runtime::launch(
+    KernelEntry entry,
+    void *context,
+    int64_t iterations,
+    const std::vector<int64_t> &reads,
+    const std::vector<int64_t> &writes,
+    const std::string &signature,
+    bool fixed_schedule,
+    const Privatization &privatization
+)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // 私有化的 kernel 中累加不是原子的，必须有原子累加的版本，不能私有化的时候使用
+    if(!privatization.fields.empty() && !privatization.atomic_entry) {
+        Out::Log(pType::ERROR, "privatized scatter launch without an atomic kernel");
+        return -1;
+    }
+    // 私有化的 field，找不到 field 或者偏移不合法的话，退化为原子累加的 kernel
+    std::shared_ptr<ScatterState> scatter;
+    if(!privatization.fields.empty()) {
+        scatter = std::make_shared<ScatterState>();
+        scatter->context = static_cast<const Byte *>(context);
+        scatter->context_size = privatization.context_size;
+        scatter->atomic_entry = privatization.atomic_entry;
+        for(size_t i = 0; i < privatization.fields.size() && i < privatization.offsets.size(); i += 1) {
+            auto it = fields.find(privatization.fields[i]);
+            // 存储类型的拷贝没有办法无损地累加，也退化为原子操作
+            if(it == fields.end() || privatization.offsets[i] + sizeof(Byte *) > privatization.context_size
+                || is_storage_type(it->second->type)) {
+                std::string _m = "illegal scatter field " + std::to_string(privatization.fields[i]);
+                Out::Log(pType::WARNING, "%s", _m.c_str());
+                scatter.reset();
+                break;
+            }
+            scatter->targets.push_back({privatization.offsets[i], it->second.get()});
+        }
+        if(!scatter || !context) {
+            scatter.reset();
+            entry = privatization.atomic_entry;
+        }
+    }
+
+    auto this_launch = submit(entry, context, iterations, reads, writes, signature, fixed_schedule);
+    this_launch->scatter = scatter;
+    if(this_launch->waiting == 0) {
+        schedule(this_launch);
+    }
+    if(!scatter) {
+        return this_launch->id;
+    }
+
+    // 合并拷贝：写这些 field，在 scatter 的发射之后执行
+    std::vector<int64_t> merged;
+    int64_t size = 0;
+    for(auto &target : scatter->targets) {
+        merged.push_back(field_resource(target.field->handle));
+        size = std::max(size, target.field->size);
+    }
+    auto merge = submit(scatter_merge_entry, scatter.get(), size, {}, merged, std::string(), true);
+    merge->scatter = scatter;
+    merge->scatter_merge = true;
+    add_dependency(merge, this_launch->id);
+    if(merge->waiting == 0) {
+        schedule(merge);
+    }
+    return merge->id;
+}
+
+int64_t Runtime::launch_stages(
+    const std::vector<LaunchStage> &stages,
+    const std::vector<int64_t> &reads,
+    const std::vector<int64_t> &writes,
+    std::shared_ptr<void> owner
+)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int64_t previous = -1;
+    for(auto &stage : stages) {
+        // 每个阶段都按 reads / writes 登记，之后的发射依赖的是最后一个阶段
+        auto this_launch = submit(stage.entry, stage.context, stage.iterations, reads, writes, std::string(), true);
+        this_launch->owner = owner;
+        add_dependency(this_launch, previous);
+        if(this_launch->waiting == 0) {
+            schedule(this_launch);
+        }
+        previous = this_launch->id;
+    }
+    return previous;
+}
+
+void Runtime::wait(int64_t launch_id)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    block_until(lock, [this, launch_id] { return !pending.count(launch_id); });
+}
+
+void Runtime::wait_resource(int64_t resource)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    block_until(lock, [this, resource] { return !resource_busy(resource); });
+    resources.erase(resource);
+}
+
+void Runtime::sync()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    block_until(lock, [this] { return pending.empty() && saving_schedules == 0; });
+    resources.clear();
+}
+
+int64_t Runtime::oldest_pending()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int64_t res = next_launch_id;
+    for(auto &item : pending) {
+        res = std::min(res, item.first);
+    }
+    return res;
+}
+
+void Runtime::set_schedule(ScheduleChoice choice, const std::string &cache_path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    default_schedule = choice;
+    if(choice.policy == SchedulePolicy::Auto) {
+        autotuner.load(cache_path);
+    }
+}
+
+std::string Runtime::schedule_report()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return autotuner.report_text();
+}
+
+void Runtime::set_spin(int64_t spin_nanoseconds)
+{
+    this->spin_nanoseconds.store(std::max<int64_t>(spin_nanoseconds, 0), std::memory_order_relaxed);
+}
+
+std::string Runtime::latency_report(bool reset)
+{
+    std::vector<double> samples;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples = latency_samples;
+        if(reset) {
+            latency_samples.clear();
+            latency_next = 0;
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    // 最近秩的百分位数，单位换算为微秒（to_string 只保留 6 位小数）
+    auto percentile = [&samples](double p) -> double {
+        if(samples.empty()) {
+            return 0.0;
+        }
+        size_t rank = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+        return samples[std::min(rank, samples.size() - 1)] * 1e6;
+    };
+    std::string res = std::to_string(samples.size()) + (char)9;
+    res += std::to_string(percentile(0.5)) + (char)9;
+    res += std::to_string(percentile(0.9)) + (char)9;
+    res += std::to_string(percentile(0.99)) + (char)9;
+    res += std::to_string(samples.empty() ? 0.0 : samples.back() * 1e6) + (char)10;
+    return res;
+}
+
+std::string Runtime::topology_report()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string res = topology.report_text();
+    for(size_t i = 0; i < worker_cpus.size(); i += 1) {
+        int32_t cpu = worker_cpus[i];
+        res += "worker" + std::string(1, (char)9) + std::to_string(i) + (char)9;
+        res += std::to_string(cpu) + (char)9;
+        res += std::to_string(cpu < 0 ? -1 : topology.node_of(cpu)) + (char)10;
+    }
+    return res;
+}
+
+int64_t Runtime::field_create(DataType type, int64_t size)
+{
+    bool first_touch = (placement & PlacementFirstTouch) && size > 0;
+    int64_t handle = 0;
+    Field *created = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        handle = next_field_handle++;
+        auto field = std::make_unique<Field>(handle, type, size, !first_touch);
+        if(!field->data) {
+            Out::Log(pType::ERROR, "can not allocate memory for field");
+            return 0;
+        }
+        created = field.get();
+        fields[handle] = std::move(field);
+    }
+    if(first_touch) { // launch 需要获取 mutex
+        wait(launch(first_touch_entry, created, size, {}, {field_resource(handle)}, std::string(), true));
+    }
+    return handle;
+}
+
+int64_t Runtime::field_map(DataType type, const std::string &path, int64_t offset, int64_t size, uint32_t flags)
+{
+    int64_t element = static_cast<int64_t>(type_size(type));
+    if(offset < 0 || offset % element != 0) {
+        std::string _m = "illegal offset " + std::to_string(offset) + " for mapping " + path;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return 0;
+    }
+    bool shared = flags & MapShared;
+    bool create = flags & MapCreate;
+    bool read_only = flags & MapReadOnly;
+    if(read_only && create) {
+        std::string _m = "can not create " + path + " for a read-only mapping";
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return 0;
+    }
+    // MAP_PRIVATE 的写入不会到达文件，只读打开就够了
+    bool writable = (shared || create) && !read_only;
+    int fd = open(path.c_str(), writable ? (O_RDWR | (create ? O_CREAT : 0)) : O_RDONLY, 0644);
+    if(fd < 0) {
+        std::string _m = "can not open " + path + ": " + strerror(errno);
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return 0;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0) {
+        std::string _m = "can not stat " + path + ": " + strerror(errno);
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        close(fd);
+        return 0;
+    }
+    int64_t file_bytes = static_cast<int64_t>(info.st_size);
+    if(size < 0) {
+        size = std::max<int64_t>(file_bytes - offset, 0) / element;
+    }
+    int64_t end = offset + size * element;
+    if(end > file_bytes) {
+        if(!create || ftruncate(fd, end) != 0) {
+            std::string _m = path + " is shorter than " + std::to_string(end) + " bytes";
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+            close(fd);
+            return 0;
+        }
+    }
+    if(size == 0) {
+        std::string _m = "can not map an empty field from " + path;
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        close(fd);
+        return 0;
+    }
+
+    // mmap 的偏移需要是页大小的整数倍，从 offset 所在的页开始映射
+    int64_t delta = offset % page_size;
+    size_t bytes = static_cast<size_t>(delta + size * element);
+    int protection = read_only ? PROT_READ : (PROT_READ | PROT_WRITE);
+    void *mapping = mmap(nullptr, bytes, protection, shared ? MAP_SHARED : MAP_PRIVATE, fd, offset - delta);
+    close(fd); // 映射会保留对文件的引用
+    if(mapping == MAP_FAILED) {
+        std::string _m = "can not map " + path + ": " + strerror(errno);
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return 0;
+    }
+    // 建议只影响预读和回收，失败了也不影响正确性
+    int advices[] = {MapSequential, MADV_SEQUENTIAL, MapRandom, MADV_RANDOM, MapWillNeed, MADV_WILLNEED};
+    for(size_t i = 0; i < sizeof(advices) / sizeof(int); i += 2) {
+        if((flags & advices[i]) && madvise(mapping, bytes, advices[i + 1]) != 0) {
+            std::string _m = std::string("madvise failed: ") + strerror(errno);
+            Out::Log(pType::WARNING, "%s", _m.c_str());
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    int64_t handle = next_field_handle++;
+    fields[handle] = std::make_unique<Field>(
+        handle, type, size, static_cast<Byte *>(mapping), bytes, static_cast<size_t>(delta), shared
+    );
+    return handle;
+}
+
+Field *Runtime::field_get(int64_t handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = fields.find(handle);
+    return it == fields.end() ? nullptr : it->second.get();
+}
+
+bool Runtime::field_flush(int64_t handle)
+{
+    wait_resource(field_resource(handle));
+    Field *field = field_get(handle);
+    if(!field || !field->mapping || !field->shared) {
+        return field != nullptr;
+    }
+    if(msync(field->mapping, field->mapping_bytes, MS_SYNC) != 0) {
+        std::string _m = std::string("msync failed: ") + strerror(errno);
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return false;
+    }
+    return true;
+}
+
+void Runtime::field_destroy(int64_t handle)
+{
+    // 还有发射在使用这个 field 的话，要等它们结束
+    wait_resource(field_resource(handle));
+    std::lock_guard<std::mutex> lock(mutex);
+    fields.erase(handle);
+}
+
+}
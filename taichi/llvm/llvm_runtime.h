@@ -0,0 +1,305 @@
+// kernel 的运行时
+// 负责 field 的内存、worker 线程池、以及 kernel 的异步发射队列
+
+#ifndef LLVM_RUNTIME_H
+#define LLVM_RUNTIME_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "llvm_manager.h"
+#include "llvm_autotuner.h"
+#include "llvm_topology.h"
+#include "llvm_trace.h"
+
+namespace llvm_taichi
+{
+    // kernel 的入口：处理迭代空间中 [begin, end) 这一段
+    // 迭代空间是 [0, iterations)，由 kernel 自己换算成真实的 loop index
+    // context 由发射者提供，runtime 原样传回
+    typedef void (*KernelEntry)(int64_t begin, int64_t end, void *context);
+
+    // 文件映射的 field 的选项，按位组合
+    // sync with python（taichi.core.field 中 mode 的含义、taichi.tool.map_advices）
+    enum MapFlag {
+        MapShared = 1, // MAP_SHARED：kernel 的写入会写回文件；否则是 MAP_PRIVATE，写时复制，不修改文件
+        MapCreate = 2, // 文件不存在的话创建，长度不够的话用 ftruncate 拓展（新的部分是 0）
+        MapSequential = 4, // madvise(MADV_SEQUENTIAL)：顺序访问，内核会加大预读，读过的页可以尽早回收
+        MapWillNeed = 8, // madvise(MADV_WILLNEED)：马上要用，现在就开始异步预读
+        MapRandom = 16, // madvise(MADV_RANDOM)：随机访问，不需要预读
+        MapReadOnly = 32 // 只读打开，PROT_READ 映射，不能和 MapCreate 一起使用（写入由 Python 端拒绝）
+    };
+
+    // 一块由 runtime 管理的连续内存，元素类型是 DataType
+    // 也可以是映射到内存中的一段文件（mmap），kernel 像普通的 field 一样按下标访问，缺页的时候由内核读入
+    // 这样 field 可以比内存大，没有访问的部分不占用内存
+    class Field {
+    public:
+        int64_t handle;
+        DataType type;
+        int64_t size; // 元素个数
+        Byte *data;
+        // 文件映射：mmap 返回的地址和长度（data 可能不在页的开头），不是映射的话 mapping 是 nullptr
+        Byte *mapping = nullptr;
+        size_t mapping_bytes = 0;
+        bool shared = false; // MAP_SHARED
+
+    public:
+        // zero 为 false 的话不初始化内存（由 first-touch 的发射初始化）
+        Field(int64_t handle, DataType type, int64_t size, bool zero = true);
+        // 文件映射，mapping 由 Field 负责 munmap
+        Field(int64_t handle, DataType type, int64_t size, Byte *mapping, size_t mapping_bytes, size_t delta, bool shared);
+        ~Field();
+    };
+
+    // work stealing 中一个参与者的迭代范围 [begin, end)
+    // 自己从前面领取，别人从后面偷
+    struct StealRange {
+        std::mutex mutex;
+        int64_t begin = 0;
+        int64_t end = 0;
+    };
+
+    // 私有化的 scatter：kernel 对这些 field 只做累加（atomic_add）
+    // 每个参与者在自己的一份拷贝上累加，不需要原子操作，也没有 cache line 的争用
+    // 发射完成之后，再由一次合并的发射把所有拷贝加到 field 上
+    struct Privatization {
+        size_t context_size = 0;
+        std::vector<uint32_t> offsets; // field 的指针在 context 中的偏移
+        std::vector<int64_t> fields; // field 的 handle，和 offsets 一一对应
+        // 不私有化的同一个 kernel（累加是原子操作），不能私有化（比如拷贝的内存分配失败）的时候使用
+        KernelEntry atomic_entry = nullptr;
+    };
+
+    // 私有化的 scatter 在执行期间的状态，由 scatter 的发射和合并的发射共享
+    struct ScatterState {
+        struct Target {
+            uint32_t offset;
+            Field *field;
+        };
+        const Byte *context = nullptr; // 原来的 context
+        size_t context_size = 0;
+        KernelEntry atomic_entry = nullptr; // 见 Privatization::atomic_entry
+        std::vector<Target> targets;
+        int32_t parts = 0;
+        // 每个参与者的 context（field 的指针替换为拷贝），第一次执行的时候才创建
+        std::vector< std::vector<Byte> > contexts;
+        // 第 part 个参与者的第 t 个 field 的拷贝是 copies[part * targets.size() + t]
+        // 确定调度的时候就全部分配好，由参与者第一次执行的时候清零
+        std::vector<Byte *> copies;
+
+        ~ScatterState();
+        // 参与者 part 使用的 context，每个参与者只会被一个任务使用，所以不需要加锁
+        void *part_context(int32_t part);
+    };
+
+    // 一次 kernel 发射
+    struct Launch {
+        int64_t id;
+        KernelEntry entry;
+        void *context;
+        int64_t iterations;
+        int32_t waiting; // 还没有完成的前驱发射的数量，为 0 才可以开始执行
+        // 还没有执行完的块，worker 不持有 mutex 直接减一，减到 0 的那个 worker 负责完成这次发射
+        std::atomic<int32_t> remaining_chunks{0};
+        std::chrono::steady_clock::time_point submitted; // 发射的时间，用于统计发射的延迟
+        std::vector< std::shared_ptr<Launch> > dependents; // 依赖于本次发射的后继
+
+        // 调度，在开始执行的时候确定
+        SchedulePolicy policy = SchedulePolicy::Static;
+        int64_t chunk = 1; // 每次领取的迭代数，Guided 的最小块
+        int32_t parts = 0; // 参与执行的任务数
+        std::atomic<int64_t> next{0}; // Dynamic / Guided：下一次领取的起点
+        std::unique_ptr<StealRange[]> ranges; // Stealing：每个参与者的范围
+        // autotuner：kernel 签名（空字符串表示不调优），正在测量的候选，开始执行的时间
+        std::string signature;
+        int32_t candidate = -1;
+        std::chrono::steady_clock::time_point start;
+        // 固定使用静态调度，不受默认调度和 autotuner 影响（比如 first-touch 的切分要和 kernel 一致）
+        bool fixed_schedule = false;
+        // 私有化的 scatter，scatter_merge 表示这是合并拷贝的发射
+        std::shared_ptr<ScatterState> scatter;
+        bool scatter_merge = false;
+        // 切分的边界对齐到 align 个迭代的整数倍，读写文件映射的 field 的话是一页的元素个数
+        // 这样每一页只由一个 worker 访问，缺页和写回不会在 worker 之间争用
+        int64_t align = 1;
+        // 发射者的状态（比如 scan、sort 的临时内存），发射结束之后随 Launch 一起释放
+        std::shared_ptr<void> owner;
+        // 时间线中这次发射的名字（Tracer::intern 的 kernel 签名），没有开启追踪的话是 nullptr
+        const char *trace_name = nullptr;
+    };
+
+    // 分阶段发射中的一个阶段：entry 处理 [0, iterations) 中的一段
+    struct LaunchStage {
+        KernelEntry entry;
+        void *context;
+        int64_t iterations;
+    };
+
+    // 线程池中的一个任务
+    // 静态调度的话就是某次发射的一段迭代 [begin, end)，其他调度的话 part 是参与者的下标
+    struct Chunk {
+        std::shared_ptr<Launch> launch;
+        int64_t begin;
+        int64_t end;
+        int32_t part;
+    };
+
+    // 每个资源（field 或者其他数组）的读写记录，用于推导依赖
+    struct ResourceState {
+        int64_t last_writer = -1;
+        std::vector<int64_t> readers; // 上一次写之后的所有读者
+    };
+
+    class Runtime {
+    protected:
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable task_cv; // 有新任务了
+        std::condition_variable done_cv; // 有发射完成了
+        std::deque<Chunk> tasks;
+        // 每次放入任务 / 完成发射的时候加一，自旋等待的线程只读这两个数，不需要获取 mutex
+        std::atomic<uint64_t> task_sequence{0};
+        std::atomic<uint64_t> done_sequence{0};
+        // 自旋的时间（纳秒），超过之后再休眠，0 表示直接休眠
+        std::atomic<int64_t> spin_nanoseconds{0};
+        // 正在休眠的 worker 和等待者，没有休眠的线程的话不需要唤醒（省掉 futex 的系统调用）
+        int32_t parked_workers;
+        int32_t parked_waiters;
+        // 每个 worker 自己的任务，只能由这个 worker 执行，优先于公共的任务
+        std::vector< std::deque<Chunk> > local_tasks;
+        bool stopping;
+
+        uint32_t placement; // 见 Placement
+        Topology topology;
+        std::vector<int32_t> worker_cpus; // 每个 worker 绑定的 CPU，没有绑定的话是 -1
+
+        int64_t next_launch_id;
+        // 所有没有完成的发射
+        std::unordered_map< int64_t, std::shared_ptr<Launch> > pending;
+        std::unordered_map<int64_t, ResourceState> resources;
+
+        int64_t next_field_handle;
+        std::unordered_map< int64_t, std::unique_ptr<Field> > fields;
+        int64_t page_size; // 文件映射的对齐单位
+
+        // 默认的调度，policy 是 Auto 的话由 autotuner 选择（没有签名的发射使用静态调度）
+        ScheduleChoice default_schedule;
+        Autotuner autotuner;
+        // 正在写入文件的 autotuner 选择，sync 要等它们写完（sync 之后文件中有已经收敛的选择）
+        uint32_t saving_schedules;
+
+        // 最近 LatencySamples 次发射的延迟（秒），从发射到完成，循环覆盖
+        static const size_t LatencySamples = 4096;
+        std::vector<double> latency_samples;
+        size_t latency_next;
+
+    protected:
+        void worker_loop(uint32_t index);
+        // 领取一个任务，先自旋再休眠，返回 false 表示运行时要结束了
+        bool take_task(uint32_t index, Chunk &chunk);
+        // 有新任务了，调用时需要持有 mutex
+        void notify_workers();
+        // 等待 done 成立，先自旋再休眠，调用时需要持有 lock
+        template<typename Predicate>
+        void block_until(std::unique_lock<std::mutex> &lock, Predicate done);
+        // 执行一个任务，不持有 mutex
+        void run_chunk(const Chunk &chunk);
+        // 以下函数调用时需要持有 mutex
+        void schedule(const std::shared_ptr<Launch> &launch);
+        void complete(const std::shared_ptr<Launch> &launch);
+        void add_dependency(const std::shared_ptr<Launch> &launch, int64_t dependency_id);
+        bool resource_busy(int64_t resource);
+        // 创建一次发射并建立依赖，调用时需要持有 mutex
+        std::shared_ptr<Launch> submit(
+            KernelEntry entry,
+            void *context,
+            int64_t iterations,
+            const std::vector<int64_t> &reads,
+            const std::vector<int64_t> &writes,
+            const std::string &signature,
+            bool fixed_schedule
+        );
+
+    public:
+        Runtime(uint32_t thread_number, uint32_t placement = PlacementNone);
+        ~Runtime();
+
+        inline uint32_t thread_number() const {
+            return static_cast<uint32_t>(workers.size());
+        }
+
+        // 发射一个 kernel，立即返回发射的 id
+        // reads 和 writes 是 kernel 会读写的资源，用于和之前的发射建立依赖
+        // signature 用于 autotuner 区分不同的 kernel（比如 kernel 名和参数类型）
+        // fixed_schedule 为 true 的话总是使用静态调度
+        // privatization 不为空的话，这些 field 使用私有化的 scatter，返回的是合并拷贝的那次发射的 id
+        int64_t launch(
+            KernelEntry entry,
+            void *context,
+            int64_t iterations,
+            const std::vector<int64_t> &reads,
+            const std::vector<int64_t> &writes,
+            const std::string &signature = std::string(),
+            bool fixed_schedule = false,
+            const Privatization &privatization = Privatization()
+        );
+        // 按顺序发射多个阶段，每个阶段等前一个阶段完成之后才开始，返回最后一个阶段的 id
+        // reads 和 writes 是所有阶段合起来读写的资源，每个阶段都按它们建立依赖
+        // 阶段总是使用静态调度；owner 是阶段之间共享的状态，所有阶段结束之后释放
+        int64_t launch_stages(
+            const std::vector<LaunchStage> &stages,
+            const std::vector<int64_t> &reads,
+            const std::vector<int64_t> &writes,
+            std::shared_ptr<void> owner
+        );
+        // 设定默认的调度，cache_path 是 autotuner 保存选择的文件（空字符串表示不保存）
+        void set_schedule(ScheduleChoice choice, const std::string &cache_path);
+        // autotuner 已经确定的选择，格式见 Autotuner::report_text
+        std::string schedule_report();
+        // 低延迟模式：空闲的 worker 和等待者先自旋 spin_nanoseconds 再休眠，0 表示关闭
+        void set_spin(int64_t spin_nanoseconds);
+        // 最近的发射从发射到完成的延迟：count p50 p90 p99 max（微秒），用 tab 分割
+        // reset 为 true 的话之后重新统计
+        std::string latency_report(bool reset);
+        // 检测到的拓扑以及 worker 的放置，格式见 Topology::report_text
+        // 之后每个 worker 一行：worker index cpu node，用 tab 分割，没有绑定的话 cpu 和 node 是 -1
+        std::string topology_report();
+        void wait(int64_t launch_id); // 等待某一次发射完成
+        void wait_resource(int64_t resource); // 等待所有读写这个资源的发射完成
+        void sync(); // 等待所有发射完成
+        int64_t oldest_pending(); // id 小于返回值的发射都已经完成了
+
+        // 开启 first-touch 的话，field 的内存由 worker 按静态调度的切分初始化，返回之前会等待初始化完成
+        int64_t field_create(DataType type, int64_t size);
+        // 把文件 path 从 offset 字节开始的 size 个元素映射为 field，flags 见 MapFlag
+        // size 小于 0 的话映射到文件结尾，offset 需要是元素大小的整数倍；失败的话返回 0
+        // offset 是页大小的整数倍的话，切分的边界正好是页的边界
+        int64_t field_map(DataType type, const std::string &path, int64_t offset, int64_t size, uint32_t flags);
+        Field *field_get(int64_t handle);
+        // 等待写这个 field 的发射完成，MAP_SHARED 的映射再用 msync 写回文件，失败的话返回 false
+        bool field_flush(int64_t handle);
+        void field_destroy(int64_t handle);
+    };
+
+    // field 作为资源时的 key，取负数以便和 Python 对象的 id 区分开
+    inline int64_t field_resource(int64_t handle) {
+        return -handle;
+    }
+
+    // 运行时的全局状态
+    extern std::unique_ptr<Runtime> taichi_runtime;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include "llvm_storage.h"
+
+#include <cstring>
+
+namespace llvm_taichi
+{
+
+static inline uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline float bits_float(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+float half_to_float(uint16_t bits)
+{
+    uint32_t sign = static_cast<uint32_t>(bits & 0x8000) << 16;
+    uint32_t exponent = (bits >> 10) & 0x1F;
+    uint32_t mantissa = bits & 0x3FF;
+    if(exponent == 0) { // 0 和非规格化数：mantissa * 2^-24，Float32 可以精确表示
+        return bits_float(sign | float_bits(static_cast<float>(mantissa) * 5.9604644775390625e-8f));
+    }
+    if(exponent == 0x1F) { // inf 和 NaN
+        return bits_float(sign | 0x7F800000 | (mantissa << 13));
+    }
+    return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+uint16_t float_to_half(float value)
+{
+    uint32_t bits = float_bits(value);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7FFFFFFF;
+    if(magnitude >= 0x7F800000) { // inf 和 NaN，NaN 变成 quiet NaN，和 vcvtps2ph 一样
+        uint32_t nan = magnitude > 0x7F800000 ? 0x200 | ((magnitude >> 13) & 0x3FF) : 0;
+        return static_cast<uint16_t>(sign | 0x7C00 | nan);
+    }
+    if(magnitude >= 0x477FF000) { // 舍入之后超过 65504
+        return static_cast<uint16_t>(sign | 0x7C00);
+    }
+    if(magnitude >= 0x38800000) { // 规格化数：指数减去 112，加上舍入的偏移，尾数的进位会进到指数上
+        uint32_t odd = (magnitude >> 13) & 1;
+        magnitude += 0xC8000FFF + odd;
+        return static_cast<uint16_t>(sign | (magnitude >> 13));
+    }
+    // 非规格化数：加上 0.5 之后，Float32 加法的舍入就是我们要的舍入，尾数的低位就是结果
+    const uint32_t magic = 126u << 23;
+    uint32_t rounded = float_bits(bits_float(magnitude) + bits_float(magic)) - magic;
+    return static_cast<uint16_t>(sign | rounded);
+}
+
+float bfloat16_to_float(uint16_t bits)
+{
+    return bits_float(static_cast<uint32_t>(bits) << 16);
+}
+
+uint16_t float_to_bfloat16(float value)
+{
+    uint32_t bits = float_bits(value);
+    if(value != value) { // NaN 保持为 quiet NaN
+        return static_cast<uint16_t>((bits >> 16) | 0x40);
+    }
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+Scalar load_element(DataType element, const Byte *address)
+{
+    Scalar res;
+    res.i64 = 0;
+    switch(element) {
+        case DataType::Int8: res.i32 = *reinterpret_cast<const int8_t *>(address); break;
+        case DataType::Int16: { int16_t v; memcpy(&v, address, 2); res.i32 = v; break; }
+        case DataType::UInt8: res.i32 = *address; break;
+        case DataType::UInt16: { uint16_t v; memcpy(&v, address, 2); res.i32 = v; break; }
+        case DataType::UInt32: { uint32_t v; memcpy(&v, address, 4); res.i64 = v; break; }
+        case DataType::Float16: { uint16_t v; memcpy(&v, address, 2); res.f32 = half_to_float(v); break; }
+        case DataType::BFloat16: { uint16_t v; memcpy(&v, address, 2); res.f32 = bfloat16_to_float(v); break; }
+        default: memcpy(&res, address, type_size(element)); break;
+    }
+    return res;
+}
+
+void store_element(DataType element, Byte *address, Scalar value)
+{
+    switch(element) {
+        case DataType::Int8:
+        case DataType::UInt8:
+            *address = static_cast<Byte>(value.i32);
+            break;
+        case DataType::Int16:
+        case DataType::UInt16: {
+            uint16_t v = static_cast<uint16_t>(value.i32);
+            memcpy(address, &v, 2);
+            break;
+        }
+        case DataType::UInt32: {
+            uint32_t v = static_cast<uint32_t>(value.i64);
+            memcpy(address, &v, 4);
+            break;
+        }
+        case DataType::Float16: {
+            uint16_t v = float_to_half(value.f32);
+            memcpy(address, &v, 2);
+            break;
+        }
+        case DataType::BFloat16: {
+            uint16_t v = float_to_bfloat16(value.f32);
+            memcpy(address, &v, 2);
+            break;
+        }
+        default:
+            memcpy(address, &value, type_size(element));
+            break;
+    }
+}
+
+llvm::Value *llvm_load_element(DataType element, llvm::Value *stored, llvm::IRBuilder<> *builder)
+{
+    llvm::LLVMContext &context = builder->getContext();
+    llvm::Type *target = to_llvm_type(compute_type(element), &context);
+    switch(element) {
+        case DataType::Int8:
+        case DataType::Int16:
+            return builder->CreateSExt(stored, target);
+        case DataType::UInt8:
+        case DataType::UInt16:
+        case DataType::UInt32:
+            return builder->CreateZExt(stored, target);
+        case DataType::Float16:
+            return builder->CreateFPExt(stored, target);
+        case DataType::BFloat16: {
+            llvm::Value *bits = builder->CreateZExt(stored, builder->getInt32Ty());
+            return builder->CreateBitCast(builder->CreateShl(bits, 16), target);
+        }
+        default:
+            return stored;
+    }
+}
+
+llvm::Value *llvm_store_element(DataType element, llvm::Value *value, llvm::IRBuilder<> *builder)
+{
+    llvm::LLVMContext &context = builder->getContext();
+    llvm::Type *target = to_llvm_type(element, &context);
+    switch(element) {
+        case DataType::Int8:
+        case DataType::Int16:
+        case DataType::UInt8:
+        case DataType::UInt16:
+        case DataType::UInt32:
+            return builder->CreateTrunc(value, target);
+        case DataType::Float16:
+            return builder->CreateFPTrunc(value, target);
+        case DataType::BFloat16: {
+            // 和 float_to_bfloat16 一样：加上舍入的偏移之后取高 16 位，NaN 保持为 quiet NaN
+            llvm::Value *bits = builder->CreateBitCast(value, builder->getInt32Ty());
+            llvm::Value *odd = builder->CreateAnd(builder->CreateLShr(bits, 16), 1);
+            llvm::Value *rounded = builder->CreateAdd(bits, builder->CreateAdd(odd, builder->getInt32(0x7FFF)));
+            llvm::Value *nan = builder->CreateOr(bits, builder->getInt32(0x400000));
+            llvm::Value *is_nan = builder->CreateFCmpUNO(value, value);
+            llvm::Value *result = builder->CreateSelect(is_nan, nan, rounded);
+            return builder->CreateTrunc(builder->CreateLShr(result, 16), target);
+        }
+        default:
+            return value;
+    }
+}
+
+}
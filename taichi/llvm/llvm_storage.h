@@ -0,0 +1,37 @@
+// 存储类型（Int8、Int16、UInt8、UInt16、UInt32、Float16、BFloat16）和计算类型之间的转换
+// 存储类型只出现在 field 的内存中：FieldLoad 读出之后立即转换为计算类型，FieldStore 写入之前再转换回来
+// 整数是截断 / 拓展；浮点数按 IEEE 754 就近舍入（ties to even），溢出得到 inf
+// Float16 使用 LLVM 的 half，有 F16C 的 CPU 上就是 vcvtph2ps / vcvtps2ph
+// BFloat16 就是 Float32 的高 16 位，用整数运算实现，循环仍然可以向量化
+// 解释器使用这里的标量版本，和生成的指令的结果一致
+
+#ifndef LLVM_STORAGE_H
+#define LLVM_STORAGE_H
+
+#include <cstdint>
+
+#include <llvm/IR/IRBuilder.h>
+
+#include "llvm_manager.h"
+
+namespace llvm_taichi
+{
+    // 半精度浮点数的标量转换
+    float half_to_float(uint16_t bits);
+    uint16_t float_to_half(float value);
+    float bfloat16_to_float(uint16_t bits);
+    uint16_t float_to_bfloat16(float value);
+
+    // 从 address 读一个 element 类型的元素，结果是 compute_type(element)
+    Scalar load_element(DataType element, const Byte *address);
+    // 把 compute_type(element) 类型的 value 写为一个 element 类型的元素
+    void store_element(DataType element, Byte *address, Scalar value);
+
+    // 生成上面两个转换的指令
+    // stored 是从内存中读出的值（to_llvm_type(element)），结果是计算类型
+    llvm::Value *llvm_load_element(DataType element, llvm::Value *stored, llvm::IRBuilder<> *builder);
+    // value 是计算类型，结果是要写入内存的值
+    llvm::Value *llvm_store_element(DataType element, llvm::Value *value, llvm::IRBuilder<> *builder);
+}
+
+#endif
@@ -0,0 +1,250 @@
+#include <cerrno>
+#include <deque>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "llvm_stream.h"
+
+namespace llvm_taichi
+{
+
+static void stream_error(const std::string &message)
+{
+    Out::Log(pType::ERROR, "%s", message.c_str());
+}
+
+// pread / pwrite 直到完成，被信号打断的话重试，返回完成的字节数，出错的话返回 -1
+static int64_t read_all(int fd, Byte *data, int64_t bytes, int64_t position)
+{
+    int64_t done = 0;
+    while(done < bytes) {
+        ssize_t n = pread(fd, data + done, static_cast<size_t>(bytes - done), position + done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        if(n == 0) { // 文件结束
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int64_t write_all(int fd, const Byte *data, int64_t bytes, int64_t position)
+{
+    int64_t done = 0;
+    while(done < bytes) {
+        ssize_t n = pwrite(fd, data + done, static_cast<size_t>(bytes - done), position + done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// 绑定对应的 field：StreamField 是 field 本身，其他是 depth 个缓冲区
+struct StreamTarget {
+    Field *field = nullptr;
+    std::vector<Field *> buffers;
+    int64_t element = 0;
+};
+
+// 已经发射、还没有写出的一块
+struct StreamChunk {
+    uint32_t slot;
+    int64_t begin;
+    int64_t count;
+    int64_t launch_id;
+};
+
+static bool resolve_targets(Runtime *runtime, const StreamJob &job, std::vector<StreamTarget> &targets)
+{
+    targets.resize(job.bindings.size());
+    for(size_t b = 0; b < job.bindings.size(); b += 1) {
+        const StreamBinding &binding = job.bindings[b];
+        StreamTarget &target = targets[b];
+        if(binding.offset + sizeof(Byte *) > job.context_size) {
+            stream_error("illegal stream binding offset " + std::to_string(binding.offset));
+            return false;
+        }
+        if(binding.kind == StreamField) {
+            target.field = runtime->field_get(binding.source);
+            if(!target.field) {
+                stream_error("can not find stream field " + std::to_string(binding.source));
+                return false;
+            }
+            target.element = static_cast<int64_t>(type_size(target.field->type));
+            continue;
+        }
+        if(binding.buffers.size() != job.depth) {
+            stream_error("stream binding needs " + std::to_string(job.depth) + " buffers");
+            return false;
+        }
+        for(auto handle : binding.buffers) {
+            Field *buffer = runtime->field_get(handle);
+            if(!buffer || buffer->size < job.chunk) {
+                stream_error("illegal stream buffer " + std::to_string(handle));
+                return false;
+            }
+            target.buffers.push_back(buffer);
+        }
+        target.element = static_cast<int64_t>(type_size(target.buffers[0]->type));
+        if(binding.kind == StreamFile && !binding.output) {
+            // 按顺序读，内核可以加大预读；管道之类的不支持，忽略失败
+            posix_fadvise(static_cast<int>(binding.source), 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+    return true;
+}
+
+// 读入一块，返回所有输入中最短的元素个数，出错的话返回 -1
+static int64_t read_inputs(const StreamJob &job, std::vector<StreamTarget> &targets, uint32_t slot, int64_t begin, int64_t count)
+{
+    for(size_t b = 0; b < job.bindings.size() && count > 0; b += 1) {
+        const StreamBinding &binding = job.bindings[b];
+        StreamTarget &target = targets[b];
+        int64_t got = count;
+        if(binding.kind == StreamField) {
+            // 输出到 field 的话，field 的长度同样限制这一块
+            got = std::max<int64_t>(target.field->size - begin, 0);
+        } else if(binding.output) {
+            continue;
+        } else if(binding.kind == StreamFile) {
+            int64_t bytes = read_all(
+                static_cast<int>(binding.source),
+                target.buffers[slot]->data,
+                count * target.element,
+                binding.position + begin * target.element
+            );
+            if(bytes < 0) {
+                stream_error(std::string("stream read failed: ") + strerror(errno));
+                return -1;
+            }
+            got = bytes / target.element;
+        } else {
+            got = binding.callback(begin, count, target.buffers[slot]->data);
+            if(got < 0) {
+                stream_error("stream input callback failed at " + std::to_string(begin));
+                return -1;
+            }
+        }
+        count = std::min(count, got);
+    }
+    return count;
+}
+
+// 一块执行完之后写出，失败的话返回 false
+static bool write_outputs(const StreamJob &job, std::vector<StreamTarget> &targets, const StreamChunk &chunk)
+{
+    for(size_t b = 0; b < job.bindings.size(); b += 1) {
+        const StreamBinding &binding = job.bindings[b];
+        StreamTarget &target = targets[b];
+        if(!binding.output || binding.kind == StreamField) {
+            continue;
+        }
+        Byte *data = target.buffers[chunk.slot]->data;
+        if(binding.kind == StreamFile) {
+            int64_t bytes = chunk.count * target.element;
+            if(write_all(static_cast<int>(binding.source), data, bytes, binding.position + chunk.begin * target.element) != bytes) {
+                stream_error(std::string("stream write failed: ") + strerror(errno));
+                return false;
+            }
+        } else if(binding.callback(chunk.begin, chunk.count, data) < 0) {
+            stream_error("stream output callback failed at " + std::to_string(chunk.begin));
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t stream_run(Runtime *runtime, const StreamJob &job)
+{
+    if(job.chunk <= 0 || job.depth == 0 || !job.entry) {
+        stream_error("illegal stream chunk " + std::to_string(job.chunk) + " depth " + std::to_string(job.depth));
+        return -1;
+    }
+    std::vector<StreamTarget> targets;
+    if(!resolve_targets(runtime, job, targets)) {
+        return -1;
+    }
+    int64_t page_size = std::max<int64_t>(sysconf(_SC_PAGESIZE), 1);
+
+    // 每个槽一份 context，槽中的块写出之后才会被下一块使用
+    std::vector< std::vector<Byte> > contexts(job.depth, std::vector<Byte>(job.context, job.context + job.context_size));
+    std::deque<StreamChunk> flight;
+    bool ok = true;
+    bool ended = false;
+    int64_t begin = 0;
+    for(int64_t index = 0; ok && !ended; index += 1) {
+        // 所有的槽都在使用，等最早的一块执行完，写出之后空出它的槽
+        if(flight.size() == job.depth) {
+            runtime->wait(flight.front().launch_id);
+            ok = write_outputs(job, targets, flight.front());
+            flight.pop_front();
+            if(!ok) {
+                break;
+            }
+        }
+        uint32_t slot = static_cast<uint32_t>(index % job.depth);
+        int64_t count = job.total >= 0 ? std::min(job.chunk, job.total - begin) : job.chunk;
+        if(count <= 0) {
+            break;
+        }
+        // 前面的块还在执行，这里读入的同时 worker 在计算
+        int64_t got = read_inputs(job, targets, slot, begin, count);
+        if(got < 0) {
+            ok = false;
+            break;
+        }
+        ended = got < count;
+        if(got == 0) {
+            break;
+        }
+
+        std::vector<int64_t> reads = job.reads;
+        std::vector<int64_t> writes = job.writes;
+        for(size_t b = 0; b < job.bindings.size(); b += 1) {
+            const StreamBinding &binding = job.bindings[b];
+            StreamTarget &target = targets[b];
+            Byte *data = target.field ? target.field->data + begin * target.element : target.buffers[slot]->data;
+            memcpy(contexts[slot].data() + binding.offset, &data, sizeof(Byte *));
+            int64_t handle = target.field ? target.field->handle : target.buffers[slot]->handle;
+            (binding.output ? writes : reads).push_back(field_resource(handle));
+        }
+        int64_t launch_id = runtime->launch(job.entry, contexts[slot].data(), got, reads, writes, job.signature);
+        flight.push_back(StreamChunk{slot, begin, got, launch_id});
+        begin += got;
+
+        // 文件映射的输入 field 没有读入这一步，提前让内核异步预读下一块
+        for(size_t b = 0; b < job.bindings.size(); b += 1) {
+            StreamTarget &target = targets[b];
+            if(job.bindings[b].output || !target.field || !target.field->mapping || begin >= target.field->size) {
+                continue;
+            }
+            int64_t next = std::min(job.chunk, target.field->size - begin);
+            uintptr_t first = reinterpret_cast<uintptr_t>(target.field->data + begin * target.element);
+            uintptr_t last = first + static_cast<uintptr_t>(next * target.element);
+            first = first / page_size * page_size;
+            madvise(reinterpret_cast<void *>(first), last - first, MADV_WILLNEED);
+        }
+    }
+
+    // 出错的话也要等所有发射完成，context 和缓冲区在这之后才能释放
+    while(!flight.empty()) {
+        runtime->wait(flight.front().launch_id);
+        ok = ok && write_outputs(job, targets, flight.front());
+        flight.pop_front();
+    }
+    return ok ? begin : -1;
+}
+
+}
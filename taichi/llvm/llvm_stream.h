@@ -0,0 +1,56 @@
+// 流式执行：输入比内存大（或者来自文件、管道）的时候，按固定大小的块执行同一个 kernel
+// 调用者的线程就是 I/O 线程：worker 计算第 N 块的时候，它写回第 N - 1 块的结果、读入第 N + 1 块
+// 每个绑定有 depth 个块大小的缓冲区（默认双缓冲），内存的上限是 depth * chunk * 所有缓冲的元素大小之和
+
+#ifndef LLVM_STREAM_H
+#define LLVM_STREAM_H
+
+#include <cstdint>
+#include <vector>
+
+#include "llvm_runtime.h"
+
+namespace llvm_taichi
+{
+    // 读入 / 写出 [begin, begin + count) 这一段元素，data 是块的缓冲区
+    // 输入返回实际读入的元素个数（少于 count 表示输入结束），输出返回小于 0 表示出错
+    typedef int64_t (*StreamCallback)(int64_t begin, int64_t count, void *data);
+
+    // 数据的来源 / 去处
+    // sync with python（taichi.core.stream）
+    enum StreamKind {
+        StreamFile = 0, // 文件描述符，pread / pwrite，不需要可以 seek 的话用回调
+        StreamField = 1, // 一个 field（比如文件映射的 field），kernel 直接访问 field 中的这一段，不需要缓冲
+        StreamCall = 2 // 回调
+    };
+
+    // kernel 的一个 field 参数，每一块换成不同的内存
+    struct StreamBinding {
+        uint32_t offset; // field 指针在 context 中的偏移
+        bool output; // 输出在执行之后写出，否则是输入，在执行之前读入
+        StreamKind kind;
+        int64_t source = -1; // StreamFile：文件描述符；StreamField：field 的 handle
+        int64_t position = 0; // StreamFile：第 0 个元素在文件中的偏移（字节）
+        StreamCallback callback = nullptr;
+        std::vector<int64_t> buffers; // StreamFile / StreamCall：depth 个缓冲区的 field handle
+    };
+
+    struct StreamJob {
+        KernelEntry entry;
+        const Byte *context; // 其他参数不变，每一块拷贝一份再替换绑定的指针
+        size_t context_size;
+        std::string signature; // 用于 autotuner，每一块是一次发射
+        int64_t total; // 元素总数，小于 0 表示一直执行到输入结束
+        int64_t chunk; // 每块的元素个数，也就是缓冲区的大小
+        uint32_t depth; // 同时在执行或者等待写出的块数，至少为 2 才能重叠 I/O 和计算
+        std::vector<StreamBinding> bindings;
+        // 其他参数中的 field 等资源，和普通的发射一样建立依赖
+        std::vector<int64_t> reads;
+        std::vector<int64_t> writes;
+    };
+
+    // 执行到结束才返回，返回处理的元素个数，出错的话返回 -1（已经发射的块仍然会等待完成）
+    int64_t stream_run(Runtime *runtime, const StreamJob &job);
+}
+
+#endif
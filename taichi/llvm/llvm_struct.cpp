@@ -0,0 +1,132 @@
+#include <algorithm>
+
+#include "llvm_struct.h"
+#include "../tool/print.h"
+
+namespace llvm_taichi
+{
+
+StructTable taichi_struct_table;
+
+DataType StructTable::add(const std::string &name, const std::vector< std::pair<Symbol, DataType> > &members)
+{
+    if(members.empty()) {
+        std::string _m = "struct " + name + " has no member";
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return DataType::Void;
+    }
+    StructLayout layout;
+    layout.name = name;
+    for(auto &member : members) {
+        // 成员只能是标量或者存储类型，不支持嵌套的结构体
+        if(member.second == DataType::Void || member.second > DataType::BFloat16) {
+            std::string _m = "member " + taichi_symbols.name(member.first) + " of struct " + name + " has unsupported type";
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+            return DataType::Void;
+        }
+        for(auto &other : layout.members) {
+            if(other.name == member.first) {
+                std::string _m = "duplicate member " + taichi_symbols.name(member.first) + " in struct " + name;
+                Out::Log(pType::ERROR, "%s", _m.c_str());
+                return DataType::Void;
+            }
+        }
+        // 和 C 一样，每个成员按自己的大小对齐，整个结构体按最大的成员对齐
+        uint32_t size = type_size(member.second);
+        uint32_t offset = (layout.size + size - 1) / size * size;
+        layout.members.push_back(StructMember{member.first, member.second, offset});
+        layout.size = offset + size;
+        layout.align = std::max(layout.align, size);
+    }
+    layout.size = (layout.size + layout.align - 1) / layout.align * layout.align;
+
+    for(size_t i = 0; i < layouts.size(); i += 1) {
+        if(layouts[i].name != name) {
+            continue;
+        }
+        bool same = layouts[i].members.size() == layout.members.size();
+        for(size_t j = 0; same && j < layout.members.size(); j += 1) {
+            same = layouts[i].members[j].name == layout.members[j].name
+                && layouts[i].members[j].type == layout.members[j].type;
+        }
+        if(!same) {
+            std::string _m = "struct " + name + " is already registered with different members";
+            Out::Log(pType::ERROR, "%s", _m.c_str());
+            return DataType::Void;
+        }
+        return static_cast<DataType>(StructTypeBase + i);
+    }
+    if(layouts.size() >= MaxStructTypes) {
+        std::string _m = "too many struct types (at most " + std::to_string(MaxStructTypes) + ")";
+        Out::Log(pType::ERROR, "%s", _m.c_str());
+        return DataType::Void;
+    }
+    layouts.push_back(std::move(layout));
+    return static_cast<DataType>(StructTypeBase + layouts.size() - 1);
+}
+
+const StructLayout *StructTable::get(DataType type) const
+{
+    if(!is_struct_type(type)) {
+        return nullptr;
+    }
+    size_t index = type - StructTypeBase;
+    return index < layouts.size() ? &layouts[index] : nullptr;
+}
+
+llvm::StructType *StructTable::llvm_type(DataType type, llvm::LLVMContext *context)
+{
+    StructLayout *layout = const_cast<StructLayout *>(get(type));
+    if(!layout) {
+        return nullptr;
+    }
+    if(!layout->llvm_type) {
+        // 成员都是自然对齐的，LLVM 的默认布局（非 packed）和 C 一致
+        std::vector<llvm::Type *> elements;
+        for(auto &member : layout->members) {
+            elements.push_back(to_llvm_type(member.type, context));
+        }
+        layout->llvm_type = llvm::StructType::create(*context, elements, "taichi.struct." + layout->name);
+    }
+    return layout->llvm_type;
+}
+
+int32_t StructTable::member_index(DataType type, Symbol member_name) const
+{
+    const StructLayout *layout = get(type);
+    if(!layout) {
+        return -1;
+    }
+    for(size_t i = 0; i < layout->members.size(); i += 1) {
+        if(layout->members[i].name == member_name) {
+            return static_cast<int32_t>(i);
+        }
+    }
+    return -1;
+}
+
+void StructTable::reset_llvm_types()
+{
+    for(auto &layout : layouts) {
+        layout.llvm_type = nullptr;
+    }
+}
+
+const char *struct_name(DataType type)
+{
+    const StructLayout *layout = taichi_struct_table.get(type);
+    return layout ? layout->name.c_str() : "taichi_default_data_type";
+}
+
+uint32_t struct_size(DataType type)
+{
+    const StructLayout *layout = taichi_struct_table.get(type);
+    return layout ? layout->size : 0;
+}
+
+llvm::Type *struct_llvm_type(DataType type, llvm::LLVMContext *context)
+{
+    return taichi_struct_table.llvm_type(type, context);
+}
+
+}
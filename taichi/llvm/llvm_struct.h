@@ -0,0 +1,57 @@
+// 用户定义的结构体类型（ti.types.struct）
+// 结构体注册之后是一个 DataType（StructTypeBase + 序号），可以作为 func 的参数、返回值以及 field 的元素类型
+// 内存布局和 C 的 struct 一样：成员按注册的顺序排列，每个成员按自己的大小对齐，Python 端可以用 ctypes.Structure 直接读写
+// func 的结构体参数按指针传递，返回结构体的 func 把结果写入调用者给出的内存（sret）
+// 中间层的 IR 中，结构体变量是 StructAlloca，成员的读写是 MemberPtr 之后的 FieldLoad / FieldStore
+
+#ifndef LLVM_STRUCT_H
+#define LLVM_STRUCT_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "llvm_manager.h"
+
+namespace llvm_taichi
+{
+    // 最多可以注册的结构体类型
+    const uint32_t MaxStructTypes = 0x80 - StructTypeBase;
+
+    struct StructMember {
+        Symbol name;
+        DataType type; // 标量类型或者存储类型，不能是结构体
+        uint32_t offset;
+    };
+
+    struct StructLayout {
+        std::string name;
+        std::vector<StructMember> members;
+        uint32_t size = 0;
+        uint32_t align = 1;
+        llvm::StructType *llvm_type = nullptr; // 第一次使用的时候在 context 中创建
+    };
+
+    class StructTable {
+    protected:
+        std::deque<StructLayout> layouts; // 追加不会移动已有的元素，名字的指针一直有效
+
+    public:
+        // 注册一个结构体类型，返回它的 DataType
+        // 同名同成员的类型返回已有的类型；同名不同成员、成员不合法或者类型太多的话返回 Void
+        DataType add(const std::string &name, const std::vector< std::pair<Symbol, DataType> > &members);
+        // 不是注册过的结构体的话返回 nullptr
+        const StructLayout *get(DataType type) const;
+        llvm::StructType *llvm_type(DataType type, llvm::LLVMContext *context);
+        // 成员的序号，没有这个成员的话返回 -1
+        int32_t member_index(DataType type, Symbol member_name) const;
+        // context 释放之前调用，之后使用的时候重新创建 LLVM 类型
+        void reset_llvm_types();
+    };
+
+    // 和构建接口一样需要持有 llvm_mutex
+    extern StructTable taichi_struct_table;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#include "llvm_symbols.h"
+
+namespace llvm_taichi
+{
+
+SymbolTable taichi_symbols;
+
+SymbolTable::SymbolTable()
+{
+    intern(std::string_view());
+}
+
+Symbol SymbolTable::intern(std::string_view name)
+{
+    auto it = ids.find(name);
+    if(it != ids.end()) {
+        return it->second;
+    }
+    Symbol symbol = static_cast<Symbol>(names.size());
+    names.emplace_back(name);
+    ids.emplace(std::string_view(names.back()), symbol);
+    return symbol;
+}
+
+}
@@ -0,0 +1,51 @@
+// 标识符的驻留（interning）
+// 变量名、field 名、函数名在进入 C 端的时候转换为整数 Symbol，之后的查找和比较都只用整数
+// 同一个名字总是得到同一个 Symbol，Symbol 在 lib 的整个生命周期内有效
+
+#ifndef LLVM_SYMBOLS_H
+#define LLVM_SYMBOLS_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace llvm_taichi
+{
+    typedef uint32_t Symbol;
+
+    // 空字符串，也表示「没有名字」（比如调用语句的返回值没有被使用）
+    const Symbol NoSymbol = 0;
+
+    class SymbolTable {
+    protected:
+        // key 指向 names 中的字符串，deque 追加元素不会移动已有的元素
+        std::unordered_map<std::string_view, Symbol> ids;
+        std::deque<std::string> names;
+
+    public:
+        SymbolTable();
+
+        Symbol intern(std::string_view name);
+        inline Symbol intern(const uint8_t *name) {
+            return intern(std::string_view(reinterpret_cast<const char *>(name)));
+        }
+        // 只查找不驻留，没有这个名字的话返回 NoSymbol
+        inline Symbol lookup(const uint8_t *name) const {
+            auto it = ids.find(std::string_view(reinterpret_cast<const char *>(name)));
+            return it == ids.end() ? NoSymbol : it->second;
+        }
+        inline const std::string &name(Symbol symbol) const {
+            return names[symbol];
+        }
+        inline size_t size() const {
+            return names.size();
+        }
+    };
+
+    // 全局的符号表，和构建接口一样需要持有 llvm_mutex
+    extern SymbolTable taichi_symbols;
+}
+
+#endif
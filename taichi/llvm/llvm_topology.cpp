@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "llvm_topology.h"
+
+namespace llvm_taichi
+{
+
+// 解析 cpulist 的格式，比如 "0-3,8-11"
+static std::vector<int32_t> parse_cpu_list(const std::string &text)
+{
+    std::vector<int32_t> res;
+    std::stringstream stream(text);
+    std::string part;
+    while(std::getline(stream, part, ',')) {
+        if(part.empty() || part[0] < '0' || part[0] > '9') {
+            continue;
+        }
+        char *rest = nullptr;
+        long first = std::strtol(part.c_str(), &rest, 10);
+        long last = first;
+        if(rest && *rest == '-') {
+            last = std::strtol(rest + 1, nullptr, 10);
+        }
+        for(long cpu = first; cpu <= last; cpu += 1) {
+            res.push_back(static_cast<int32_t>(cpu));
+        }
+    }
+    return res;
+}
+
+Topology Topology::detect()
+{
+    Topology res;
+    std::vector<int32_t> allowed;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int32_t cpu = 0; cpu < CPU_SETSIZE; cpu += 1) {
+            if(CPU_ISSET(cpu, &set)) {
+                allowed.push_back(cpu);
+            }
+        }
+    }
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if(dir) {
+        while(dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if(name.size() <= 4 || name.compare(0, 4, "node") != 0 || name[4] < '0' || name[4] > '9') {
+                continue;
+            }
+            std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+            std::string text;
+            if(!file || !std::getline(file, text)) {
+                continue;
+            }
+            NumaNode node;
+            node.id = static_cast<int32_t>(std::strtol(name.c_str() + 4, nullptr, 10));
+            for(auto cpu : parse_cpu_list(text)) {
+                if(allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+            if(!node.cpus.empty()) { // 没有可以使用的 CPU 的节点（比如只有内存的节点）不需要
+                res.nodes.push_back(std::move(node));
+            }
+        }
+        closedir(dir);
+    }
+#endif
+    if(res.nodes.empty()) {
+        NumaNode node;
+        node.id = 0;
+        node.cpus = allowed;
+        if(node.cpus.empty()) {
+            for(uint32_t cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu += 1) {
+                node.cpus.push_back(static_cast<int32_t>(cpu));
+            }
+        }
+        res.nodes.push_back(std::move(node));
+    }
+    std::sort(res.nodes.begin(), res.nodes.end(), [](const NumaNode &a, const NumaNode &b) {
+        return a.id < b.id;
+    });
+    return res;
+}
+
+size_t Topology::cpu_number() const
+{
+    size_t res = 0;
+    for(auto &node : nodes) {
+        res += node.cpus.size();
+    }
+    return res;
+}
+
+int32_t Topology::node_of(int32_t cpu) const
+{
+    for(auto &node : nodes) {
+        if(std::find(node.cpus.begin(), node.cpus.end(), cpu) != node.cpus.end()) {
+            return node.id;
+        }
+    }
+    return -1;
+}
+
+std::vector<int32_t> Topology::worker_cpus(uint32_t worker_number) const
+{
+    // 所有的 CPU 按节点排成一列，worker i 使用第 i * total / worker_number 个
+    // 这样每个节点分到的 worker 数量和它的 CPU 数量成比例，并且同一个节点的 worker 是连续的
+    std::vector<int32_t> all;
+    for(auto &node : nodes) {
+        all.insert(all.end(), node.cpus.begin(), node.cpus.end());
+    }
+    std::vector<int32_t> res;
+    for(uint32_t i = 0; i < worker_number; i += 1) {
+        res.push_back(all.empty() ? -1 : all[static_cast<size_t>(i) * all.size() / worker_number]);
+    }
+    return res;
+}
+
+std::string Topology::report_text() const
+{
+    std::string res;
+    for(auto &node : nodes) {
+        res += "node\t" + std::to_string(node.id) + "\t";
+        for(size_t i = 0; i < node.cpus.size(); i += 1) {
+            res += (i ? "," : "") + std::to_string(node.cpus[i]);
+        }
+        res += "\n";
+    }
+    return res;
+}
+
+bool pin_thread(std::thread &thread, int32_t cpu)
+{
+#ifdef __linux__
+    if(cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void)thread;
+    (void)cpu;
+    return false;
+#endif
+}
+
+}
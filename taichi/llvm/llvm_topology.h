@@ -0,0 +1,52 @@
+// 机器的拓扑：NUMA 节点以及每个节点上的 CPU
+// runtime 根据拓扑把 worker 绑定到 CPU 上，worker 按节点的顺序排列
+// 这样静态切分的迭代空间中，相邻的段落在同一个节点上，first-touch 的内存也在这个节点上
+
+#ifndef LLVM_TOPOLOGY_H
+#define LLVM_TOPOLOGY_H
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace llvm_taichi
+{
+    // worker 和内存的放置策略，按位组合
+    // sync with python（taichi.tool.placements）
+    enum Placement {
+        PlacementNone = 0,
+        PlacementPin = 1, // worker 绑定到 CPU 上，静态调度的第 i 段固定由 worker i 执行
+        PlacementFirstTouch = 2 // field 的内存由之后处理它的 worker 初始化（first-touch），页分配在 worker 所在的节点上
+    };
+
+    struct NumaNode {
+        int32_t id;
+        std::vector<int32_t> cpus; // 这个节点上当前进程可以使用的 CPU
+    };
+
+    class Topology {
+    public:
+        std::vector<NumaNode> nodes;
+
+    public:
+        // 从 /sys/devices/system/node 读取，读不到的话（或者不是 Linux）所有 CPU 属于节点 0
+        // 只保留 sched_getaffinity 允许使用的 CPU（比如容器限制了 CPU）
+        static Topology detect();
+
+        // 所有可以使用的 CPU 的数量
+        size_t cpu_number() const;
+        // CPU 所在的节点，找不到的话返回 -1
+        int32_t node_of(int32_t cpu) const;
+        // 每个 worker 对应的 CPU：按节点的顺序排列，worker 均匀地分布在所有 CPU 上
+        // worker 比 CPU 多的话，多个 worker 共用一个 CPU
+        std::vector<int32_t> worker_cpus(uint32_t worker_number) const;
+        // 每行一个节点：node id cpu,cpu,...，用 tab 分割
+        std::string report_text() const;
+    };
+
+    // 把线程绑定到一个 CPU 上，失败（或者不支持）的话返回 false
+    bool pin_thread(std::thread &thread, int32_t cpu);
+}
+
+#endif
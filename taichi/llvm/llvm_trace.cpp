@@ -0,0 +1,267 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+#include "llvm_trace.h"
+
+namespace llvm_taichi
+{
+
+// 缓冲区按块分配，写满了就接上新的一块，已经写入的事件不会移动
+// count 是这一块已经发布的事件数：先写事件，再用 release 增加 count，读的一方用 acquire 读 count
+struct TraceBlock {
+    static const size_t Capacity = 4096;
+    TraceEvent events[Capacity];
+    std::atomic<size_t> count{0};
+    std::atomic<TraceBlock *> next{nullptr};
+};
+
+// 一个线程的缓冲区
+// 只有 tail 由写的线程修改；head、skip 只在持有 trace_mutex 的时候由读的一方修改
+struct TraceBuffer {
+    int32_t tid;
+    std::string thread_name;
+    TraceBlock *head;
+    size_t skip = 0; // head 中开启之前的事件
+    std::atomic<TraceBlock *> tail;
+};
+
+static std::atomic<bool> trace_enabled{false};
+static std::atomic<int64_t> trace_epoch{0}; // 开启的时刻，steady_clock 的纳秒
+static std::mutex trace_mutex; // 保护 trace_buffers、trace_strings，以及每个缓冲区的 head / skip / thread_name
+static std::vector< std::unique_ptr<TraceBuffer> > trace_buffers;
+static std::unordered_set<std::string> trace_strings;
+static thread_local TraceBuffer *local_buffer = nullptr;
+
+static int64_t steady_nanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+static TraceBuffer *thread_buffer()
+{
+    if(!local_buffer) {
+        auto buffer = std::make_unique<TraceBuffer>();
+        TraceBlock *block = new TraceBlock();
+        buffer->head = block;
+        buffer->tail.store(block, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        buffer->tid = static_cast<int32_t>(trace_buffers.size()) + 1;
+        buffer->thread_name = "thread " + std::to_string(buffer->tid);
+        local_buffer = buffer.get();
+        trace_buffers.push_back(std::move(buffer));
+    }
+    return local_buffer;
+}
+
+bool Tracer::enabled()
+{
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+
+void Tracer::set_enabled(bool enabled)
+{
+    if(enabled) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        // 丢弃之前的事件：释放写的线程已经离开的块，当前的块跳过已有的事件
+        for(auto &buffer : trace_buffers) {
+            TraceBlock *tail = buffer->tail.load(std::memory_order_acquire);
+            while(buffer->head != tail) {
+                TraceBlock *next = buffer->head->next.load(std::memory_order_acquire);
+                delete buffer->head;
+                buffer->head = next;
+            }
+            buffer->skip = tail->count.load(std::memory_order_acquire);
+        }
+        trace_epoch.store(steady_nanoseconds(), std::memory_order_relaxed);
+    }
+    trace_enabled.store(enabled, std::memory_order_release);
+}
+
+int64_t Tracer::now()
+{
+    return steady_nanoseconds() - trace_epoch.load(std::memory_order_relaxed);
+}
+
+void Tracer::record(const TraceEvent &event)
+{
+    if(!enabled()) {
+        return;
+    }
+    TraceBuffer *buffer = thread_buffer();
+    TraceBlock *block = buffer->tail.load(std::memory_order_relaxed);
+    size_t index = block->count.load(std::memory_order_relaxed);
+    if(index == TraceBlock::Capacity) {
+        TraceBlock *next = new TraceBlock();
+        block->next.store(next, std::memory_order_release);
+        buffer->tail.store(next, std::memory_order_release);
+        block = next;
+        index = 0;
+    }
+    block->events[index] = event;
+    block->count.store(index + 1, std::memory_order_release);
+}
+
+void Tracer::name_thread(const std::string &name)
+{
+    TraceBuffer *buffer = thread_buffer();
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    buffer->thread_name = name;
+}
+
+const char *Tracer::intern(const std::string &text)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    return trace_strings.insert(text).first->c_str();
+}
+
+// JSON 字符串，转义引号、反斜杠和控制字符
+static void append_string(std::string &out, const char *text)
+{
+    out += '"';
+    for(const char *c = text; *c; c += 1) {
+        if(*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        } else if(static_cast<unsigned char>(*c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(*c));
+            out += escaped;
+        } else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+// Chrome trace 的时间单位是微秒，可以有小数
+static void append_microseconds(std::string &out, int64_t nanoseconds)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.3f", static_cast<double>(nanoseconds) / 1000.0);
+    out += text;
+}
+
+static void append_event(std::string &out, const TraceEvent &event, int32_t pid, int32_t tid)
+{
+    out += "{\"cat\":";
+    append_string(out, event.category);
+    out += ",\"name\":";
+    // 发射的异步区间以 kernel 签名命名，其他事件的 detail 放在参数中
+    bool named_by_detail = event.detail && (event.phase == 'b' || event.phase == 'e');
+    append_string(out, named_by_detail ? event.detail : event.name);
+    out += ",\"ph\":\"";
+    out += event.phase;
+    out += "\",\"ts\":";
+    append_microseconds(out, event.begin);
+    if(event.phase == 'X') {
+        out += ",\"dur\":";
+        append_microseconds(out, event.duration);
+    }
+    if(event.phase == 'i') {
+        out += ",\"s\":\"t\"";
+    }
+    out += ",\"pid\":" + std::to_string(pid) + ",\"tid\":" + std::to_string(tid);
+    if(event.id >= 0) {
+        out += ",\"id\":" + std::to_string(event.id);
+    }
+    out += ",\"args\":{";
+    bool first = true;
+    auto argument = [&out, &first](const char *name) {
+        out += first ? "" : ",";
+        append_string(out, name);
+        out += ':';
+        first = false;
+    };
+    if(event.detail && !named_by_detail) {
+        argument("detail");
+        append_string(out, event.detail);
+    }
+    if(event.id >= 0) {
+        argument("id");
+        out += std::to_string(event.id);
+    }
+    if(event.arg0_name) {
+        argument(event.arg0_name);
+        out += std::to_string(event.arg0);
+    }
+    if(event.arg1_name) {
+        argument(event.arg1_name);
+        out += std::to_string(event.arg1);
+    }
+    out += "}}";
+}
+
+std::string Tracer::export_json(int64_t *events)
+{
+    int32_t pid = static_cast<int32_t>(getpid());
+    int64_t count = 0;
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    for(auto &buffer : trace_buffers) {
+        if(&buffer != &trace_buffers.front()) {
+            out += ',';
+        }
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid);
+        out += ",\"tid\":" + std::to_string(buffer->tid) + ",\"args\":{\"name\":";
+        append_string(out, buffer->thread_name.c_str());
+        out += "}}";
+        size_t skip = buffer->skip;
+        for(TraceBlock *block = buffer->head; block; block = block->next.load(std::memory_order_acquire)) {
+            size_t published = block->count.load(std::memory_order_acquire);
+            for(size_t i = skip; i < published; i += 1) {
+                out += ',';
+                append_event(out, block->events[i], pid, buffer->tid);
+                count += 1;
+            }
+            skip = 0;
+        }
+    }
+    out += "]}";
+    if(events) {
+        *events = count;
+    }
+    return out;
+}
+
+TraceScope::TraceScope(
+    const char *category,
+    const char *name,
+    const char *detail,
+    int64_t id,
+    const char *arg0_name,
+    int64_t arg0,
+    const char *arg1_name,
+    int64_t arg1
+)
+{
+    active = Tracer::enabled();
+    if(active) {
+        event = TraceEvent{category, name, detail, 'X', Tracer::now(), 0, id, arg0_name, arg0, arg1_name, arg1};
+    }
+}
+
+TraceScope::~TraceScope()
+{
+    if(active) {
+        event.duration = Tracer::now() - event.begin;
+        Tracer::record(event);
+    }
+}
+
+void trace_mark(const char *category, const char *name, char phase, const char *detail, int64_t id)
+{
+    if(Tracer::enabled()) {
+        Tracer::record(TraceEvent{category, name, detail, phase, Tracer::now(), 0, id, nullptr, 0, nullptr, 0});
+    }
+}
+
+}
@@ -0,0 +1,68 @@
+// 时间线追踪：记录编译的各个阶段、kernel 的发射、worker 执行的每一段以及同步等待
+// 导出为 Chrome trace 的 JSON，可以在 Perfetto（ui.perfetto.dev）或者 chrome://tracing 中查看
+// 默认关闭，关闭的时候每个记录点只有一次 atomic 的读
+// 每个线程有自己的缓冲区，只有这个线程写入，不需要加锁；导出的时候按已经发布的数量读取
+
+#ifndef LLVM_TRACE_H
+#define LLVM_TRACE_H
+
+#include <cstdint>
+#include <string>
+
+namespace llvm_taichi
+{
+    struct TraceEvent {
+        const char *category; // 静态字符串：compile、launch、worker、sync
+        const char *name; // 静态字符串
+        const char *detail; // Tracer::intern 得到的字符串（函数名、kernel 签名），可以为 nullptr
+        char phase; // 'X' 一段时间，'b' / 'e' 异步区间的开始和结束（按 id 配对），'i' 一个时刻
+        int64_t begin; // 纳秒，相对于追踪开始的时刻
+        int64_t duration;
+        int64_t id; // 比如 launch id，小于 0 表示没有
+        // 两个附加的参数，名字是静态字符串，为 nullptr 的话不导出
+        const char *arg0_name;
+        int64_t arg0;
+        const char *arg1_name;
+        int64_t arg1;
+    };
+
+    namespace Tracer
+    {
+        bool enabled();
+        // 开启的时候丢弃之前的事件，时间从这一刻开始算
+        void set_enabled(bool enabled);
+        int64_t now();
+        // 追加到当前线程的缓冲区，没有开启的话什么都不做
+        void record(const TraceEvent &event);
+        // 在 trace 中显示的线程名（比如 worker 0），每个线程开始的时候调用一次
+        void name_thread(const std::string &name);
+        // 返回一个一直有效的相同内容的字符串，相同的内容只保存一份
+        const char *intern(const std::string &text);
+        // 导出所有线程的事件，events 是导出的事件数
+        std::string export_json(int64_t *events);
+    }
+
+    // 记录一段 'X' 事件：构造的时候开始，析构的时候结束
+    class TraceScope {
+    public:
+        TraceEvent event;
+        bool active;
+
+        TraceScope(
+            const char *category,
+            const char *name,
+            const char *detail = nullptr,
+            int64_t id = -1,
+            const char *arg0_name = nullptr,
+            int64_t arg0 = 0,
+            const char *arg1_name = nullptr,
+            int64_t arg1 = 0
+        );
+        ~TraceScope();
+    };
+
+    // 一个时刻或者异步区间的一端
+    void trace_mark(const char *category, const char *name, char phase, const char *detail = nullptr, int64_t id = -1);
+}
+
+#endif
@@ -12,6 +12,12 @@ __all__ = [
     "log_set_level",
     "log_get_level",
     "cfg",
+    "profiler_integrations",
+    "schedules",
+    "placements",
+    "map_advices",
+    "fast_math_flags",
+    "field_hint_flags",
     "cfg_get",
     "cfg_set"
 ]
@@ -19,7 +25,7 @@ __all__ = [
 import ctypes
 from taichi.tool.log import log_debug, log_message, log_warning, log_error, log_time
 from taichi.tool.log import log_levels, log_set_level, log_get_level
-from taichi.tool.config import cfg, cfg_get, cfg_set
+from taichi.tool.config import cfg, cfg_get, cfg_set, profiler_integrations, schedules, placements, map_advices, fast_math_flags, field_hint_flags
 
 # python 字节转换为 C 可用的字节指针
 def BP(bytes: bytes):
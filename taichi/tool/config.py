@@ -17,6 +17,67 @@ _cfg = dict()
 class cfg(enum.Enum): # 继承这个类
     bytes_order = "bytes_order"
     bytes_order_c = "bytes_order_c"
+    kernel_fusion = "kernel_fusion"
+    scatter_privatization = "scatter_privatization"
+    fast_math = "fast_math"
+    loop_interchange = "loop_interchange"
+    prefetch_distance = "prefetch_distance"
+
+# 性能分析工具的集成，可以组合使用，比如 perf | gdb
+# sync with cpp（llvm_taichi::ProfilerIntegration）
+class profiler_integrations(enum.IntFlag):
+    none = 0
+    perf = 1 # perf map（/tmp/perf-<pid>.map）以及 jitdump
+    gdb = 2 # GDB 的 JIT 接口
+
+# kernel 发射的调度策略
+# auto 的话由 autotuner 按 kernel 签名和迭代次数选择，选择会保存下来，之后的运行直接使用
+# sync with cpp（llvm_taichi::SchedulePolicy）
+class schedules(enum.IntEnum):
+    static = 0 # 静态连续切分，每个线程一段
+    dynamic = 1 # 每次领取固定大小的一块
+    guided = 2 # 每次领取剩余迭代的一部分，块越来越小
+    stealing = 3 # 先静态切分，做完了就从别的线程偷
+    auto = 4
+
+# worker 和内存的放置策略，可以组合使用，numa 就是 pin | first_touch
+# sync with cpp（llvm_taichi::Placement）
+class placements(enum.IntFlag):
+    none = 0
+    pin = 1 # worker 绑定到 CPU 上（按 NUMA 节点排列），静态调度的每一段固定由同一个 worker 执行
+    first_touch = 2 # field 的内存由之后处理它的 worker 初始化，页分配在 worker 所在的节点上
+    numa = 3
+
+# 文件映射的 field 的访问建议（madvise），可以组合使用，只影响预读和回收
+# sync with cpp（llvm_taichi::MapFlag）
+class map_advices(enum.IntFlag):
+    none = 0
+    sequential = 4 # 顺序访问，加大预读，读过的页尽早回收
+    willneed = 8 # 马上要用，现在就开始异步预读
+    random = 16 # 随机访问，不需要预读
+
+# 浮点数的语义，可以组合使用，比如 nnan | reassoc
+# strict 是严格的 IEEE 语义；contract 只允许 a * b + c 合并为 FMA；fast 是全部
+# 浮点数的归约（res = res + x）需要 reassoc 才能向量化，结果和严格的顺序有舍入上的差异
+# sync with cpp（llvm_taichi::FastMathFlag）
+class fast_math_flags(enum.IntFlag):
+    strict = 0
+    nnan = 1 # 假设没有 NaN
+    ninf = 2 # 假设没有无穷大
+    nsz = 4 # 不区分 +0 和 -0
+    arcp = 8 # 除法可以换成乘倒数
+    contract = 16 # 乘加合并为 FMA
+    afn = 32 # 数学函数可以使用近似的实现
+    reassoc = 64 # 可以重新结合
+    fast = 127
+
+# field 参数的访问提示，见 Field.hint
+# sync with cpp（llvm_taichi::FieldHint）
+class field_hint_flags(enum.IntFlag):
+    none = 0
+    streaming = 1 # 写入使用 non-temporal store
+    prefetch = 2 # 预取以 loop index 为下标的读取和 gather
+    prefetch_gather = 4 # 只预取 gather（x[index[i]]）
 
 def cfg_set(key: cfg, value):
     _cfg[key.value] = value
@@ -27,6 +88,21 @@ def cfg_get(key: cfg):
 # 获取系统默认的大小端设定
 cfg_set(cfg.bytes_order, sys.byteorder)
 
+# 默认开启 kernel 融合
+cfg_set(cfg.kernel_fusion, True)
+
+# 默认不使用私有化的 scatter
+cfg_set(cfg.scatter_privatization, False)
+
+# 默认严格的浮点数语义
+cfg_set(cfg.fast_math, fast_math_flags.strict)
+
+# 默认开启循环交换（外层循环太短的时候把内层循环作为并行的循环）
+cfg_set(cfg.loop_interchange, True)
+
+# 默认不自动预取
+cfg_set(cfg.prefetch_distance, 0)
+
 if cfg_get(cfg.bytes_order) == "big":
     cfg_set(cfg.bytes_order_c, ">")
 else:
@@ -8,7 +8,17 @@ __all__ = [
     "Int32",
     "Int64",
     "Float32",
-    "Float64"
+    "Float64",
+    "Int8",
+    "Int16",
+    "UInt8",
+    "UInt16",
+    "UInt32",
+    "Float16",
+    "BFloat16",
+    "template",
+    "types",
+    "dataclass"
 ]
 
 class BaseType:
@@ -35,6 +45,50 @@ class Float64(BaseType):
         super().__init__()
         self._type = "Float64"
 
+# 存储类型：只能作为 field 的元素类型，元素更小，带宽和内存都省一半以上
+# kernel 中读出来之后是计算类型（见 compute_type），写入的时候再转换回来（整数截断，浮点数就近舍入）
+class Int8(BaseType):
+    def __init__(self):
+        super().__init__()
+        self._type = "Int8"
+
+class Int16(BaseType):
+    def __init__(self):
+        super().__init__()
+        self._type = "Int16"
+
+class UInt8(BaseType):
+    def __init__(self):
+        super().__init__()
+        self._type = "UInt8"
+
+class UInt16(BaseType):
+    def __init__(self):
+        super().__init__()
+        self._type = "UInt16"
+
+class UInt32(BaseType):
+    def __init__(self):
+        super().__init__()
+        self._type = "UInt32"
+
+# IEEE 754 半精度，最大 65504
+class Float16(BaseType):
+    def __init__(self):
+        super().__init__()
+        self._type = "Float16"
+
+# Float32 的高 16 位，范围和 Float32 一样，精度只有 8 位
+class BFloat16(BaseType):
+    def __init__(self):
+        super().__init__()
+        self._type = "BFloat16"
+
+# 泛型：func 的参数标注为 ti.template（或者不标注类型）的话，按调用处的参数类型实例化
+# 返回值标注为 ti.template（或者不标注）的话，是所有泛型参数的类型运算之后的类型（见 calc_type）
+class template:
+    pass
+
 # 基础类型 可以用作 func 的参数和返回值
 basic_types = [
     Int32.__name__,
@@ -43,22 +97,99 @@ basic_types = [
     Float64.__name__
 ]
 
+# 存储类型 -> 计算类型
+# sync with cpp（llvm_taichi::compute_type）
+compute_types = {
+    Int8.__name__: Int32.__name__,
+    Int16.__name__: Int32.__name__,
+    UInt8.__name__: Int32.__name__,
+    UInt16.__name__: Int32.__name__,
+    UInt32.__name__: Int64.__name__,
+    Float16.__name__: Float32.__name__,
+    BFloat16.__name__: Float32.__name__
+}
+
+def compute_type(type: str) -> str:
+    return compute_types.get(type, type)
+
+# 二元运算的结果类型：有 8 字节的就是 8 字节，有浮点数就是浮点数
+# sync with cpp（llvm_taichi::calc_type）
+def calc_type(a: str, b: str) -> str:
+    a, b = compute_type(a), compute_type(b)
+    wide = Int64.__name__ in (a, b) or Float64.__name__ in (a, b)
+    floating = any(i in (Float32.__name__, Float64.__name__) for i in (a, b))
+    if floating:
+        return Float64.__name__ if wide else Float32.__name__
+    return Int64.__name__ if wide else Int32.__name__
+
 # sync with cpp
 type_id = {
     Int32.__name__: 1,
     Int64.__name__: 2,
     Float32.__name__: 3,
-    Float64.__name__: 4
+    Float64.__name__: 4,
+    Int8.__name__: 5,
+    Int16.__name__: 6,
+    UInt8.__name__: 7,
+    UInt16.__name__: 8,
+    UInt32.__name__: 9,
+    Float16.__name__: 10,
+    BFloat16.__name__: 11
 }
 
+# type_id -> 类型名，0（Void）不在其中
+type_name = {v: k for k, v in type_id.items()}
+
+# field 内存中元素的 ctypes 类型，半精度的浮点数是它的位（见 to_storage / from_storage）
 type_to_ctypes = {
     Int32.__name__: ctypes.c_int32,
     Int64.__name__: ctypes.c_int64,
     Float32.__name__: ctypes.c_float,
-    Float64.__name__: ctypes.c_double
+    Float64.__name__: ctypes.c_double,
+    Int8.__name__: ctypes.c_int8,
+    Int16.__name__: ctypes.c_int16,
+    UInt8.__name__: ctypes.c_uint8,
+    UInt16.__name__: ctypes.c_uint16,
+    UInt32.__name__: ctypes.c_uint32,
+    Float16.__name__: ctypes.c_uint16,
+    BFloat16.__name__: ctypes.c_uint16
+}
+
+# 整数存储类型的 (位数, 是否有符号)
+_int_storage = {
+    Int8.__name__: (8, True),
+    Int16.__name__: (16, True),
+    UInt8.__name__: (8, False),
+    UInt16.__name__: (16, False),
+    UInt32.__name__: (32, False)
 }
 
+# Float32 的舍入，struct 按 C 的 float 转换（就近舍入）
+def _round_float32(value: float) -> float:
+    return struct.unpack("<f", struct.pack("<f", value))[0] if abs(value) <= 3.4028234663852886e38 else value * float("inf")
+
+# 半精度的位，和 C 端的 float_to_half / float_to_bfloat16 一致（先舍入到 Float32）
+def _float16_bits(value: float) -> int:
+    value = _round_float32(value)
+    try:
+        return struct.unpack("<H", struct.pack("<e", value))[0]
+    except OverflowError: # 超出范围就是 inf
+        return 0xFC00 if value < 0 else 0x7C00
+
+def _bfloat16_bits(value: float) -> int:
+    bits = struct.unpack("<I", struct.pack("<f", _round_float32(value)))[0]
+    if value != value: # NaN 保持为 quiet NaN
+        return (bits >> 16) | 0x40
+    return ((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16) & 0xFFFF
+
+def _float16_value(bits: int) -> float:
+    return struct.unpack("<e", struct.pack("<H", bits))[0]
+
+def _bfloat16_value(bits: int) -> float:
+    return struct.unpack("<f", struct.pack("<I", bits << 16))[0]
+
 # 把一个 value 转换为对应的类型（其实是 python 的内置类型）
+# 存储类型的结果是存储之后再读出来的值：整数按位数回绕，浮点数舍入
 def cast(value, type: str):
     if (
         type == Int32.__name__
@@ -70,6 +201,115 @@ def cast(value, type: str):
         or type == Float64.__name__
     ):
         return float(value)
+    elif type in _int_storage:
+        bits, signed = _int_storage[type]
+        value = int(value) & ((1 << bits) - 1)
+        return value - (1 << bits) if signed and value >> (bits - 1) else value
+    elif type == Float16.__name__:
+        return _float16_value(_float16_bits(float(value)))
+    elif type == BFloat16.__name__:
+        return _bfloat16_value(_bfloat16_bits(float(value)))
+    elif type in struct_types:
+        return struct_types[type].of(value)
+
+# field 内存中的值（type_to_ctypes）和 Python 值之间的转换，只有半精度的浮点数需要转换
+def to_storage(value, type: str):
+    if type == Float16.__name__:
+        return _float16_bits(float(value))
+    elif type == BFloat16.__name__:
+        return _bfloat16_bits(float(value))
+    return cast(value, type)
+
+def from_storage(value, type: str):
+    if type == Float16.__name__:
+        return _float16_value(value)
+    elif type == BFloat16.__name__:
+        return _bfloat16_value(value)
+    return value
+
+# ===== 结构体类型 =====
+# ti.types.struct(pos=ti.Float32, vel=ti.Float32) 或者 @ti.dataclass 定义一个结构体类型
+# 结构体类型是一个 ctypes.Structure，内存布局和 C 端一致（见 llvm_struct），可以作为 func 的参数、返回值以及 field 的元素类型
+# func 中结构体按指针传递，Python 端调用的时候传入结构体的实例（或者成员的 tuple / dict），返回一个新的实例
+# 成员可以是基础类型或者存储类型，存储类型的成员在实例中是存储的值（半精度浮点数是它的位）
+
+# 结构体的 type_id 从这里开始
+# sync with cpp（llvm_taichi::StructTypeBase）
+struct_type_base = 0x40
+
+# 结构体的类型名 -> 结构体类型
+struct_types = dict()
+
+class StructType(ctypes.Structure):
+    _taichi_members = [] # [(成员名, 类型名)]
+
+    # 把成员的 tuple / dict 转换为这个结构体的实例
+    @classmethod
+    def of(cls, value):
+        if isinstance(value, cls):
+            return value
+        if isinstance(value, dict):
+            return cls(**{k: to_storage(v, dict(cls._taichi_members)[k]) for k, v in value.items()})
+        return cls(*[to_storage(v, t) for v, (_, t) in zip(value, cls._taichi_members)])
+
+    def __repr__(self):
+        members = ", ".join([f"{k}={getattr(self, k)}" for k, _ in self._taichi_members])
+        return f"{type(self).__name__}({members})"
+
+_struct_counter = 0
+
+# 定义并在 C 端注册一个结构体类型，members 是 [(成员名, 类型)]，失败的话返回 None
+def _define_struct(name: str, members: list):
+    import taichi.llvm # taichi.llvm 会加载 C lib，这里再导入
+    members = [(k, v if isinstance(v, str) else v.__name__) for k, v in members]
+    for k, v in members:
+        if v not in type_to_ctypes or v in struct_types:
+            log_error(f"member {k} of struct {name} must be a basic or storage type, not {v}")
+            return None
+    name_b = name.encode(encoding="ascii")
+    members_name_b = "".join([k + "," for k, _ in members]).encode(encoding="ascii")
+    members_type_b = bytes([type_id[v] for _, v in members])
+    struct_id = taichi.llvm.c_struct_register(
+        BP(name_b),
+        ctypes.c_uint8(len(members)),
+        BP(members_name_b),
+        BP(members_type_b)
+    )
+    if struct_id == 0:
+        log_error(f"can not define struct {name}")
+        return None
+    # 同名同成员的话是已经定义过的类型
+    if name in struct_types:
+        return struct_types[name]
+    cls = type(name, (StructType,), {
+        "_fields_": [(k, type_to_ctypes[v]) for k, v in members],
+        "_taichi_members": members
+    })
+    struct_types[name] = cls
+    type_id[name] = struct_id
+    type_name[struct_id] = name
+    type_to_ctypes[name] = cls
+    return cls
+
+# 成员使用关键字参数给出，类型名自动生成
+def _struct(**members):
+    global _struct_counter
+    _struct_counter += 1
+    return _define_struct(f"struct{_struct_counter}", list(members.items()))
+
+# 模仿 taichi 的 ti.dataclass：类的类型标注就是成员，类名是结构体的类型名
+def dataclass(cls):
+    return _define_struct(cls.__name__, list(cls.__dict__.get("__annotations__", dict()).items()))
+
+# 模仿 taichi 的 ti.types
+class types:
+    struct = staticmethod(_struct)
+
+# 需要 to_storage / from_storage 的类型
+bits_types = [
+    Float16.__name__,
+    BFloat16.__name__
+]
 
 def to_bytes(value, type: str) -> bytes:
     if type == Int32.__name__:
@@ -0,0 +1,57 @@
+# 调度的自动调优（schedule=ti.schedules.auto）的回归测试
+# 先 make，然后在仓库的根目录运行 python3 tests/test_autotune.py
+
+import os
+import sys
+import tempfile
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import taichi as ti
+
+# 迭代的开销随 i 变化（负载不均衡）
+@ti.kernel
+def imbalanced(x):
+    for i in range(len(x)):
+        acc = 0.0
+        for j in range(i):
+            acc = acc + 1.0
+        x[i] = x[i] + acc
+
+@ti.kernel
+def fill(y):
+    for i in range(len(y)):
+        y[i] = i + 1.0
+
+# 7 个候选每个测量 3 次（sync with cpp：Autotuner::candidates、SamplesPerCandidate）
+launches_to_converge = 7 * 3
+
+def main():
+    cache = os.path.join(tempfile.mkdtemp(), "schedules.tsv")
+    ti.init(log_level=ti.log_levels.warning, thread_number=4, kernel_fusion=True,
+            schedule=ti.schedules.auto, schedule_cache=cache)
+    x = ti.field(ti.Float64, 1024)
+    y = ti.field(ti.Float64, 1024)
+
+    # 连续的发射每 8 次融合为一次，融合组的签名测量 21 次
+    for _ in range(launches_to_converge * 8):
+        imbalanced(x)
+    ti.sync()
+    # 每次发射之后 sync，没有融合
+    for _ in range(launches_to_converge):
+        fill(y)
+        ti.sync()
+    assert x[1023] == launches_to_converge * 8 * 1023, x[1023]
+    assert y[1023] == 1024.0
+
+    signatures = [i["signature"] for i in ti.get_schedules()]
+    fused = "+".join(["imbalanced"] * 8) + "("
+    assert any(i.startswith(fused) for i in signatures), signatures
+    assert any(i.startswith("fill(") for i in signatures), signatures
+    with open(cache) as file:
+        saved = [line.split("\t")[0] for line in file]
+    assert sorted(saved) == sorted(signatures), (saved, signatures)
+
+    ti.log_message("autotune tests passed")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+// C++ 宿主的类型化接口（llvm_compiled.h）的测试
+// 使用 C 接口构建函数（和 Python 端一样），然后通过 compiled<...> 调用
+// 先 make，然后在仓库的根目录 make test
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "llvm_compiled.h"
+#include "llvm_export.h"
+
+using namespace llvm_taichi;
+
+// LLVM 的编译选项中可能有 NDEBUG，不能使用 assert
+#define check(condition) do { \
+    if(!(condition)) { \
+        std::printf("check failed at line %d: %s\n", __LINE__, #condition); \
+        std::exit(1); \
+    } \
+} while(0)
+
+struct Pair {
+    double x;
+    double y;
+};
+
+template<> struct llvm_taichi::NativeStruct<Pair> {
+    static constexpr const char *name = "Pair";
+};
+
+// 值的格式见 taichi.lang._value_node_to_bytes：变量是 0 0 名字，常量是 1 类型 字节
+static std::string variable(const char *name) {
+    return std::string("\0\0", 2) + name;
+}
+
+static std::string constant(double value) {
+    std::string res("\1", 1);
+    res += (char)DataType::Float64;
+    res.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    return res;
+}
+
+static uint8_t *B(const std::string &text) {
+    return (uint8_t *)text.c_str();
+}
+
+static uint8_t *B(const char *text) {
+    return (uint8_t *)text;
+}
+
+// ret = a op b
+static uint32_t binary(const char *name, DataType type, uint8_t operation) {
+    uint8_t types[] = {(uint8_t)type, (uint8_t)type};
+    uint32_t function = function_begin(B(name), 2, types, B("a,b,"), (uint8_t)type);
+    check(function);
+    assignment_statement_operation(function, B("c"), B(variable("a")), operation, B(variable("b")));
+    return_statement(function, B("c"));
+    check(function_finish(function));
+    return function;
+}
+
+int main() {
+    init_lib(0, 0, 0, 0);
+    set_log_level(3);
+
+    // 标量：签名不一致的话不能绑定
+    uint32_t add = binary("add", DataType::Int64, 1);
+    compiled<int64_t(int64_t, int64_t)> by_name("add");
+    compiled<int64_t(int64_t, int64_t)> by_function(taichi_func_table.get(add));
+    check(by_name && by_function);
+    check(by_name(2, 3) == 5 && by_function(2, 3) == 5);
+    check(!compiled<double(int64_t, int64_t)>("add"));
+    check(!compiled<int64_t(int64_t)>("add"));
+    check(!compiled<int64_t(int64_t, int64_t)>("missing"));
+
+    // 重新定义：按名字绑定的句柄使用新的版本，按 Function 绑定的句柄仍然可以调用旧的代码
+    function_remove(add);
+    function_release(add);
+    binary("add", DataType::Int64, 3);
+    check(by_name(2, 3) == 6);
+    check(by_function(2, 3) == 5);
+    // 删除之后继续使用原来的函数
+    function_release(function_handle(B("add")));
+    check(by_name(2, 4) == 8);
+
+    // 存储类型的 field：v = x[i]
+    uint8_t field_types[] = {(uint8_t)(DataType::Int8 | FieldArgumentFlag), (uint8_t)DataType::Int64};
+    uint32_t load = function_begin(B("load"), 2, field_types, B("x,i,"), (uint8_t)DataType::Int64);
+    load_statement(load, B("v"), B("x"), B(variable("i")));
+    return_statement(load, B("v"));
+    check(function_finish(load));
+    int8_t values[] = {3, -4, 5};
+    compiled<int64_t(int8_t *, int64_t)> load_int8("load");
+    check(load_int8 && load_int8(values, 1) == -4);
+    check(!compiled<int64_t(uint8_t *, int64_t)>("load"));
+    check(!compiled<int64_t(int8_t, int64_t)>("load"));
+
+    // 结构体：参数按指针传递，返回值写入调用者的内存
+    uint8_t member_types[] = {(uint8_t)DataType::Float64, (uint8_t)DataType::Float64};
+    DataType pair = (DataType)struct_register(B("Pair"), 2, B("x,y,"), member_types);
+    check(is_struct_type(pair));
+
+    uint8_t sum_types[] = {(uint8_t)pair};
+    uint32_t sum = function_begin(B("sum"), 1, sum_types, B("p,"), (uint8_t)DataType::Float64);
+    member_load_statement(sum, B("a"), B("p"), nullptr, B("x"));
+    member_load_statement(sum, B("b"), B("p"), nullptr, B("y"));
+    assignment_statement_operation(sum, B("c"), B(variable("a")), 1, B(variable("b")));
+    return_statement(sum, B("c"));
+    check(function_finish(sum));
+
+    uint8_t make_types[] = {(uint8_t)DataType::Float64};
+    uint32_t make = function_begin(B("make"), 1, make_types, B("v,"), (uint8_t)pair);
+    struct_statement(make, B("s"), (uint8_t)pair);
+    member_store_statement(make, B("s"), nullptr, B("x"), B(variable("v")));
+    assignment_statement_operation(make, B("w"), B(variable("v")), 3, B(constant(2.0)));
+    member_store_statement(make, B("s"), nullptr, B("y"), B(variable("w")));
+    return_statement(make, B("s"));
+    check(function_finish(make));
+
+    compiled<double(Pair)> sum_pair("sum");
+    compiled<Pair(double)> make_pair("make");
+    check(sum_pair && make_pair);
+    check(sum_pair(Pair{1.5, 2.0}) == 3.5);
+    Pair made = make_pair(1.5);
+    check(made.x == 1.5 && made.y == 3.0);
+    check(!compiled<double(double)>("sum"));
+
+    // 缺少 return 的函数构建失败
+    uint32_t broken = function_begin(B("broken"), 1, make_types, B("a,"), (uint8_t)DataType::Float64);
+    check(!function_finish(broken));
+    function_release(broken);
+
+    std::printf("compiled tests passed\n");
+    return 0;
+}
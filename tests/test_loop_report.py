@@ -0,0 +1,105 @@
+# 循环依赖分析（ti.get_loop_report）的回归测试
+# 先 make，然后在仓库的根目录运行 python3 tests/test_loop_report.py
+
+import os
+import sys
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import taichi as ti
+# 不交换循环，报告中 [0] 总是外层的循环
+ti.init(log_level=ti.log_levels.warning, kernel_fusion=False, loop_interchange=False, thread_number=4)
+
+# 系数不同的 GCD 测试：2 * i 是偶数，4 * i + 1 是奇数，不会访问同一个元素
+@ti.kernel
+def gcd_independent(a, n):
+    for i in range(n):
+        a[2 * i] = a[4 * i + 1]
+
+# 2 * i1 == 4 * i2 + 2 有整数解
+@ti.kernel
+def gcd_dependent(a, n):
+    for i in range(n):
+        a[2 * i] = a[4 * i + 2]
+
+# 每一行写自己的 n 个元素，外层循环的迭代之间没有依赖
+@ti.kernel
+def rows_shift(c, m, n):
+    for i in range(m):
+        for j in range(1, n):
+            c[i * n + j] = c[i * n + j - 1] + 1.0
+
+# field 上的非原子归约，多个线程的读写有竞争，结果不确定，只检查报告
+@ti.kernel
+def field_sum(a, s, n):
+    for i in range(n):
+        s[0] = s[0] + a[i]
+
+# 局部变量的归约
+@ti.kernel
+def row_sum(c, b, m, n):
+    for i in range(m):
+        acc = 0.0
+        for j in range(n):
+            acc = acc + c[i * n + j]
+        b[i] = acc
+
+# 局部变量的值传到下一次迭代，但不是归约
+@ti.kernel
+def row_carried(c, d, m, n):
+    for i in range(m):
+        prev = 0.0
+        for j in range(n):
+            d[i * n + j] = prev
+            prev = c[i * n + j]
+
+# 没有内层循环保证 n 至少是 1，n 为 0 的时候所有迭代访问 x[0]（有竞争，只检查报告）
+@ti.kernel
+def invariant_stride(x, m, n, v):
+    for i in range(m):
+        x[i * n] = x[i * n] + v
+
+def report(target, *args) -> list:
+    target(*args)
+    ti.sync()
+    return ti.get_loop_report(target)
+
+def main():
+    m, n = 16, 8
+    a = ti.field(ti.Float64, 4 * m + 4)
+    s = ti.field(ti.Float64, 1)
+    b = ti.field(ti.Float64, m)
+    c = ti.field(ti.Float64, m * n)
+    d = ti.field(ti.Float64, m * n)
+    a.fill(1.0)
+
+    r = report(gcd_independent, a, m)
+    assert r[0]["independent"] and not r[0]["dependences"], r
+    r = report(gcd_dependent, a, m)
+    assert not r[0]["parallel"] and r[0]["dependences"], r
+
+    r = report(rows_shift, c, m, n)
+    assert r[0]["independent"], r
+    assert not r[1]["parallel"] and r[1]["dependences"], r
+    assert c[n - 1] == n - 1 and c[m * n - 1] == n - 1
+
+    r = report(field_sum, a, s, m)
+    assert not r[0]["parallel"] and r[0]["reductions"], r
+
+    r = report(row_sum, c, b, m, n)
+    assert r[0]["independent"], r
+    assert r[1]["parallel"] and not r[1]["independent"] and r[1]["reductions"], r
+
+    r = report(row_carried, c, d, m, n)
+    assert r[0]["independent"], r
+    assert r[1]["parallel"] and not r[1]["independent"] and not r[1]["reductions"], r
+    assert any("carried" in i[2] for i in r[1]["dependences"]), r
+    assert d[n - 1] == c[n - 2]
+
+    x = ti.field(ti.Float64, m)
+    r = report(invariant_stride, x, m, 0, 1.0)
+    assert not r[0]["parallel"] and r[0]["dependences"], r
+
+    ti.log_message("loop report tests passed")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,56 @@
+# 文件映射的 field（ti.mmap_field）的回归测试
+# 先 make，然后在仓库的根目录运行 python3 tests/test_mmap.py
+
+import os
+import sys
+import struct
+import tempfile
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import taichi as ti
+
+@ti.kernel
+def scale(src, dst):
+    for i in range(len(src)):
+        dst[i] = src[i] * 2.0
+
+@ti.kernel
+def overwrite(x):
+    for i in range(len(x)):
+        x[i] = 0.0
+
+def main():
+    # 写只读的 field 会记录错误
+    ti.init(log_level=ti.log_levels.warning, thread_number=4)
+    n = 1000
+    path = os.path.join(tempfile.mkdtemp(), "data.bin")
+    with open(path, "wb") as file:
+        file.write(struct.pack(f"{n}d", *range(n)))
+    os.chmod(path, 0o444) # 只读的文件也可以映射
+
+    src = ti.mmap_field(path, ti.Float64, mode="r")
+    assert src.read_only and len(src) == n, len(src)
+    dst = ti.field(ti.Float64, n)
+    scale(src, dst)
+    ti.sync()
+    assert dst.to_list() == [2.0 * i for i in range(n)]
+
+    # kernel 和 Python 端的写入都被拒绝，文件不变
+    overwrite(src)
+    src[0] = 5.0
+    src.fill(1.0)
+    ti.sync()
+    assert src[1] == 1.0 and src[n - 1] == n - 1.0, src[1]
+
+    # 其他的映射可以写
+    dst_path = os.path.join(os.path.dirname(path), "out.bin")
+    out = ti.mmap_field(dst_path, ti.Float64, n, mode="w+")
+    scale(src, out)
+    out.flush()
+    with open(dst_path, "rb") as file:
+        assert struct.unpack(f"{n}d", file.read()) == tuple(2.0 * i for i in range(n))
+
+    ti.log_message("mmap tests passed")
+
+if __name__ == "__main__":
+    main()
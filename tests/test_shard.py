@@ -0,0 +1,36 @@
+# 多进程执行（ti.shard_group）的回归测试
+# 先 make，然后在仓库的根目录运行 python3 tests/test_shard.py
+
+import os
+import sys
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import taichi as ti
+
+# main-loop 比线程数短，单进程执行的时候会交换循环，分段的时候必须按 main-loop 分
+@ti.kernel
+def fill_rows(x, m, n):
+    for i in range(m):
+        for j in range(n):
+            x[i * n + j] = i * n + j + 1
+
+@ti.kernel
+def fill(x):
+    for i in range(len(x)):
+        x[i] = i + 1
+
+def main():
+    ti.init(log_level=ti.log_levels.warning, thread_number=4)
+    m, n = 2, 5000
+    x = ti.shared_field(ti.Int64, m * n)
+    y = ti.shared_field(ti.Int64, 10007)
+    with ti.shard_group(2, log_level=ti.log_levels.warning, thread_number=4) as group:
+        assert group.launch(fill_rows, x, m, n)
+        assert group.launch(fill, y)
+    assert x.to_list() == list(range(1, m * n + 1))
+    assert y.to_list() == list(range(1, len(y) + 1))
+
+    ti.log_message("shard tests passed")
+
+if __name__ == "__main__":
+    main()